@@ -0,0 +1,292 @@
+/******************************************************************************
+
+PROGRAM:  admission-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements admission control for the Tier 1 server.  See
+          admission-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+
+#include "admission-tools.h"
+#include "async-tools.h"
+
+/******************************************************************************
+
+Creates the admission table in shared memory.  The adaptive limit starts at
+'max_limit' and is only lowered once Tier 2 shows signs of overload.  A
+'hard_limit' of 0 means twice 'max_limit', leaving room for the children that
+only tell clients to come back later; it is never above ADMISSION_CHILDREN, the
+number of children the parent can keep track of.  At most 'max_watchers'
+clients may watch for changes at once.  A 'rate' of 0 turns off the
+per-address limit.
+
+*******************************************************************************/
+struct admission* create_admission(int max_limit, int hard_limit, int max_watchers, double rate,
+				   double burst) {
+  struct admission*   admission;
+  pthread_mutexattr_t mutex_attr;
+
+  admission = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (admission == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map admission table: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(admission, 0, sizeof(struct admission));
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&admission->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  admission->max_limit = max_limit < ADMISSION_MIN_LIMIT ? ADMISSION_MIN_LIMIT : max_limit;
+  admission->limit = admission->max_limit;
+  admission->hard_limit = hard_limit > 0 ? hard_limit : 2 * admission->max_limit;
+  if (admission->hard_limit > ADMISSION_CHILDREN)
+    admission->hard_limit = ADMISSION_CHILDREN;
+  admission->max_watchers = max_watchers;
+  admission->rate = rate;
+  admission->burst = burst < 1 ? 1 : burst;
+
+  return admission;
+}
+
+static void lock_admission(struct admission* admission) {
+  if (pthread_mutex_lock(&admission->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&admission->lock);
+}
+
+static double seconds_since(struct timespec* then, struct timespec* now) {
+  return (now->tv_sec - then->tv_sec) + (now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/******************************************************************************
+
+Takes a token from the bucket of 'addr', refilled at 'rate' tokens a second up
+to 'burst'.  Buckets are found by hashing the address; an address landing on a
+bucket held by another one simply takes it over with a full bucket, so the
+table never fills up, at the cost of forgetting about rarely seen clients.
+Returns 0 if the client is within its rate, otherwise the number of
+milliseconds until it will be.
+
+*******************************************************************************/
+static long take_token(struct admission* admission, in_addr_t addr) {
+  struct rate_bucket* bucket;
+  struct timespec     now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bucket = &admission->buckets[(addr * 2654435761u) % RATE_BUCKETS];
+
+  if (bucket->addr != addr || bucket->last.tv_sec == 0) {
+    bucket->addr = addr;
+    bucket->tokens = admission->burst;
+  } else {
+    bucket->tokens += admission->rate * seconds_since(&bucket->last, &now);
+    if (bucket->tokens > admission->burst)
+      bucket->tokens = admission->burst;
+  }
+  bucket->last = now;
+
+  if (bucket->tokens < 1)
+    return (long)((1 - bucket->tokens) / admission->rate * 1000) + 1;
+
+  bucket->tokens -= 1;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Decides, in the parent, whether a new client is served.  Returns ADMIT, or the
+reason it is not, with the suggested wait before retrying in 'retry_ms'.  Every
+result but REJECT_DROP means a child will be forked, and reserves the entry
+returned in 'client' for it: pass it to track_client() once the child is
+forked, or to finish_client() if the fork failed.
+
+*******************************************************************************/
+int admit_client(struct admission* admission, in_addr_t addr, long* retry_ms, int* client) {
+  long children = admission->children;
+  long wait;
+
+  *retry_ms = 0;
+
+  if (children >= admission->hard_limit) {
+    __sync_fetch_and_add(&admission->dropped, 1);
+    return REJECT_DROP;
+  }
+
+  // There are fewer children than entries, so a free one is always found
+  while (admission->clients[admission->next_client].pid != 0)
+    admission->next_client = (admission->next_client + 1) % ADMISSION_CHILDREN;
+  *client = admission->next_client;
+  admission->clients[*client].pid = -1;
+  admission->clients[*client].admitted = 0;
+  admission->clients[*client].watching = 0;
+  __sync_fetch_and_add(&admission->children, 1);
+
+  if (admission->rate > 0 && (wait = take_token(admission, addr)) > 0) {
+    __sync_fetch_and_add(&admission->limited, 1);
+    *retry_ms = wait < MIN_RETRY_AFTER ? MIN_RETRY_AFTER : wait;
+    return REJECT_RATE;
+  }
+
+  if (admission->in_flight >= (long)admission->limit) {
+    __sync_fetch_and_add(&admission->shed, 1);
+    // About the time one query in progress takes to finish
+    *retry_ms = (long)(admission->mean_us / 1000);
+    if (*retry_ms < MIN_RETRY_AFTER)
+      *retry_ms = MIN_RETRY_AFTER;
+    return REJECT_BUSY;
+  }
+
+  __sync_fetch_and_add(&admission->in_flight, 1);
+  __sync_fetch_and_add(&admission->admitted, 1);
+  admission->clients[*client].admitted = 1;
+
+  return ADMIT;
+}
+
+// Records the child forked for the entry 'client' of admit_client()
+void track_client(struct admission* admission, int client, pid_t pid) {
+  admission->clients[client].pid = pid;
+}
+
+// Gives back whatever the entry 'client' still holds, and frees it
+void finish_client(struct admission* admission, int client) {
+  if (__sync_lock_test_and_set(&admission->clients[client].admitted, 0))
+    __sync_fetch_and_sub(&admission->in_flight, 1);
+  if (admission->clients[client].watching)
+    __sync_fetch_and_sub(&admission->watchers, 1);
+  else
+    __sync_fetch_and_sub(&admission->children, 1);
+  admission->clients[client].pid = 0;
+}
+
+/******************************************************************************
+
+Called by the parent for every child it reaps, however the child ended: exit,
+a signal such as SIGPIPE, or a crash.  Gives back the slots of the child, if
+it was forked for a client.
+
+*******************************************************************************/
+void reap_client(struct admission* admission, pid_t pid) {
+  int i;
+
+  for (i = 0; i < ADMISSION_CHILDREN; i++)
+    if (admission->clients[i].pid == pid) {
+      finish_client(admission, i);
+      return;
+    }
+}
+
+// A client that keeps its connection after its query finished, e.g., to watch
+// for changes, no longer counts as a query in progress, only as a child
+void release_query_slot(struct admission* admission, int client) {
+  if (__sync_lock_test_and_set(&admission->clients[client].admitted, 0))
+    __sync_fetch_and_sub(&admission->in_flight, 1);
+}
+
+/******************************************************************************
+
+Called by a child whose client is about to watch its search for changes.  The
+child gives back its query slot and its place among the children, and counts
+as a watcher instead.  Returns 0, or -1 if there are already 'max_watchers'
+watchers, in which case the client can not watch.
+
+*******************************************************************************/
+int start_watching(struct admission* admission, int client) {
+  release_query_slot(admission, client);
+  if (__sync_add_and_fetch(&admission->watchers, 1) > admission->max_watchers) {
+    __sync_fetch_and_sub(&admission->watchers, 1);
+    return -1;
+  }
+  admission->clients[client].watching = 1;
+  __sync_fetch_and_sub(&admission->children, 1);
+
+  return 0;
+}
+
+/******************************************************************************
+
+Adjusts the concurrency limit after a query to Tier 2 took 'latency_us'.  The
+baseline follows the fastest recent queries: it drops straight to a faster one
+and creeps up slowly otherwise, so it tracks an unloaded Tier 2.  A failed query
+or one slower than ADMISSION_TOLERANCE times the baseline cuts the limit by
+ADMISSION_BACKOFF, at most once per baseline interval so that one burst of slow
+queries counts once.  Any other query adds 1/limit, i.e., the limit grows by
+about one for every full limit of queries that went well, and only while the
+limit is actually being used.
+
+*******************************************************************************/
+void record_latency(struct admission* admission, long latency_us, int failed) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lock_admission(admission);
+
+  if (!failed) {
+    if (admission->baseline_us == 0 || latency_us < admission->baseline_us)
+      admission->baseline_us = latency_us;
+    else
+      admission->baseline_us += (latency_us - admission->baseline_us) * 0.01;
+    if (admission->mean_us == 0)
+      admission->mean_us = latency_us;
+    else
+      admission->mean_us += (latency_us - admission->mean_us) * 0.1;
+  }
+
+  if (failed || latency_us > ADMISSION_TOLERANCE * admission->baseline_us) {
+    if (seconds_since(&admission->last_backoff, &now) * 1e6 > admission->baseline_us) {
+      admission->limit *= ADMISSION_BACKOFF;
+      if (admission->limit < ADMISSION_MIN_LIMIT)
+	admission->limit = ADMISSION_MIN_LIMIT;
+      admission->last_backoff = now;
+    }
+  } else if (admission->in_flight >= admission->limit / 2) {
+    admission->limit += 1 / admission->limit;
+    if (admission->limit > admission->max_limit)
+      admission->limit = admission->max_limit;
+  }
+
+  pthread_mutex_unlock(&admission->lock);
+}
+
+/******************************************************************************
+
+Runs in a child for a client that was not admitted: completes the handshake
+and reads the query, so the client is sure to see the answer, then tells it to
+come back in 'retry_ms' milliseconds.  Everything is bounded by REJECT_TIMEOUT
+so a slow client cannot hold on to the child.
+
+*******************************************************************************/
+void reject_client(SSL* ssl, int sockfd, long retry_ms) {
+  char buffer[256];
+
+  set_blocking(sockfd, REJECT_TIMEOUT);
+  if (SSL_accept(ssl) <= 0)
+    return;
+  SSL_read(ssl, buffer, sizeof(buffer));
+
+  snprintf(buffer, sizeof(buffer), "BUSY %ld", retry_ms);
+  SSL_write(ssl, buffer, strlen(buffer)+1);
+}
+
+void print_admission_stats(struct admission* admission, FILE* out) {
+  fprintf(out, "Server: Admission limit=%.1f/%d in_flight=%ld children=%ld watchers=%ld "
+	  "admitted=%ld shed=%ld rate_limited=%ld dropped=%ld baseline=%.2fms\n",
+	  admission->limit, admission->max_limit, admission->in_flight, admission->children,
+	  admission->watchers, admission->admitted, admission->shed, admission->limited, admission->dropped,
+	  admission->baseline_us / 1000);
+  fflush(out);
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+
+PROGRAM:  admission-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for admission control
+          in the Tier 1 server.  Before forking a child for a new client, the
+          server decides whether to serve it at all:
+
+          - the number of queries in progress is capped by a concurrency limit
+            that adapts to Tier 2's latency.  Each query that completes in
+            reasonable time raises the limit a little (additive increase); a
+            query that takes much longer than usual, or fails, cuts it by a
+            fraction (multiplicative decrease).  Under overload the queue thus
+            stays short and Tier 2 stays fast, instead of every query timing
+            out together;
+          - every client address has a token bucket, so a single client
+            cannot take all of the capacity; and
+          - above a hard limit on the number of children, new connections are
+            closed right away.
+
+          A client that stays connected to watch its search for changes is
+          no longer counted as a query or a child, but as a watcher, with a
+          limit of its own, so idle watchers can not take up the children
+          that serve searches.
+
+          A client turned away by the first two receives a "BUSY <ms>"
+          message telling it how long to wait before trying again.  The table
+          lives in shared memory so every child can report back to it.  The
+          parent gives back a child's slots when it reaps the child, so they
+          are not lost if the child is killed or crashes.
+
+******************************************************************************/
+
+#ifndef _ADMISSIONTOOLS_H_
+#define _ADMISSIONTOOLS_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+#include <netinet/in.h>
+
+#define ADMISSION_LIMIT       64     // Default ceiling of the adaptive limit
+#define ADMISSION_MIN_LIMIT   2
+#define ADMISSION_TOLERANCE   2.0    // Slower than this many times the baseline is "slow"
+#define ADMISSION_BACKOFF     0.8    // Factor the limit is cut by
+#define CLIENT_RATE           20     // Default queries per second per address
+#define CLIENT_BURST          40     // Default bucket size
+#define RATE_BUCKETS          1024
+#define REJECT_TIMEOUT        1000   // Milliseconds a rejected client is given
+#define MIN_RETRY_AFTER       100
+
+#define ADMIT                 0
+#define REJECT_BUSY           1      // Concurrency limit reached
+#define REJECT_RATE           2      // Client over its rate
+#define REJECT_DROP           3      // Hard limit reached, no answer at all
+#define ADMISSION_CHILDREN    4096   // Most children tracked at once
+#define ADMISSION_WATCHERS    256    // Default limit on watching clients
+
+struct rate_bucket {
+  in_addr_t       addr;
+  double          tokens;
+  struct timespec last;
+};
+
+// The slots a child holds, for the parent to give back once it exits
+struct admitted_child {
+  pid_t pid;                           // 0 if free, -1 until forked
+  int   admitted;                      // Still holds a query slot
+  int   watching;                      // Counted as a watcher, not a child
+};
+
+struct admission {
+  pthread_mutex_t    lock;             // Guards 'limit' and the latency history
+  double             limit;
+  int                max_limit;
+  int                hard_limit;
+  double             baseline_us;      // Typical latency of an unloaded Tier 2
+  double             mean_us;          // Recent latency, for retry hints
+  struct timespec    last_backoff;
+  long               in_flight;        // Admitted queries not finished yet
+  long               children;         // Admitted and rejecting children
+  long               watchers;         // Children watching for changes
+  int                max_watchers;
+  long               admitted;
+  long               shed;
+  long               limited;
+  long               dropped;
+  double             rate;
+  double             burst;
+  int                next_client;      // Where to look for a free entry
+  struct rate_bucket buckets[RATE_BUCKETS];   // Only used by the parent
+  struct admitted_child clients[ADMISSION_CHILDREN];
+};
+
+struct admission* create_admission(int max_limit, int hard_limit, int max_watchers, double rate,
+				   double burst);
+
+int admit_client(struct admission* admission, in_addr_t addr, long* retry_ms, int* client);
+
+void track_client(struct admission* admission, int client, pid_t pid);
+
+void finish_client(struct admission* admission, int client);
+
+void reap_client(struct admission* admission, pid_t pid);
+
+void release_query_slot(struct admission* admission, int client);
+
+int start_watching(struct admission* admission, int client);
+
+void record_latency(struct admission* admission, long latency_us, int failed);
+
+void reject_client(SSL* ssl, int sockfd, long retry_ms);
+
+void print_admission_stats(struct admission* admission, FILE* out);
+
+#endif
@@ -0,0 +1,299 @@
+/******************************************************************************
+
+PROGRAM:  async-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the overlapped connection setup of the Tier 1
+          server.  See async-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "async-tools.h"
+#include "client-tools.h"
+#include "local-tools.h"
+
+static void set_nonblocking(int sockfd) {
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+}
+
+/******************************************************************************
+
+Switches a socket back to blocking mode once its setup is finished.  A non-zero
+'timeout_ms' then bounds every read and write, as try_client_socket() does.
+
+*******************************************************************************/
+void set_blocking(int sockfd, int timeout_ms) {
+  struct timeval timeout;
+
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+  if (timeout_ms > 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+}
+
+// Turns the outcome of a non-blocking SSL call into the poll() events it waits
+// for, or 0 if it failed for good
+static int ssl_wait_events(SSL* ssl, int result) {
+  switch (SSL_get_error(ssl, result)) {
+  case SSL_ERROR_WANT_READ:
+    return POLLIN;
+  case SSL_ERROR_WANT_WRITE:
+    return POLLOUT;
+  default:
+    return 0;
+  }
+}
+
+static void fail_upstream(struct upstream* upstream) {
+  if (upstream->backend != NULL)
+    fprintf(stderr, "Server: Could not establish SSL session to '%s' on port %u\n",
+	    upstream->backend->host, upstream->backend->port);
+  if (upstream->ssl != NULL)
+    SSL_free(upstream->ssl);
+  if (upstream->sockfd >= 0)
+    close(upstream->sockfd);
+  if (upstream->backend != NULL)
+    release_backend(upstream->backend, 0, 1);
+  upstream->ssl = NULL;
+  upstream->sockfd = -1;
+  upstream->backend = NULL;
+  upstream->state = UPSTREAM_FAILED;
+}
+
+/******************************************************************************
+
+Picks a backend of the shard with acquire_backend() and starts a non-blocking
+connect() to it.  The connection then moves through UPSTREAM_CONNECTING and
+UPSTREAM_HANDSHAKING as run_pipeline() advances it, and ends up either
+UPSTREAM_READY, with the backend still acquired, or UPSTREAM_FAILED, with the
+backend released and charged with an error.  Host names are still resolved
+with the blocking gethostbyname(), which is normally answered from a cache.
+
+*******************************************************************************/
+void start_upstream(struct backend_pool* pool, int shard, struct upstream* upstream) {
+  struct sockaddr_in dest_addr;
+  struct hostent*    host;
+
+  memset(upstream, 0, sizeof(struct upstream));
+  upstream->shard = shard;
+  upstream->sockfd = -1;
+  clock_gettime(CLOCK_MONOTONIC, &upstream->started);
+
+  upstream->backend = acquire_backend(pool);
+  if (upstream->backend == NULL) {
+    upstream->state = UPSTREAM_FAILED;
+    return;
+  }
+
+  // A Unix domain socket connects at once or not at all, so there is nothing
+  // to gain from waiting for it in the loop
+  if (is_unix_endpoint(upstream->backend->host)) {
+    upstream->sockfd = try_unix_socket(upstream->backend->host, 0);
+    if (upstream->sockfd < 0) {
+      fail_upstream(upstream);
+      return;
+    }
+    set_nonblocking(upstream->sockfd);
+    upstream->state = UPSTREAM_CONNECTING;
+    upstream->events = POLLOUT;
+    return;
+  }
+
+  host = gethostbyname(upstream->backend->host);
+  upstream->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (host == NULL || upstream->sockfd < 0) {
+    fail_upstream(upstream);
+    return;
+  }
+  set_nonblocking(upstream->sockfd);
+
+  dest_addr.sin_family = AF_INET;
+  dest_addr.sin_port = htons(upstream->backend->port);
+  dest_addr.sin_addr.s_addr = *(long*)(host->h_addr);
+  memset(&(dest_addr.sin_zero), '\0', 8);
+
+  upstream->state = UPSTREAM_CONNECTING;
+  upstream->events = POLLOUT;
+  if (connect(upstream->sockfd, (struct sockaddr*)&dest_addr, sizeof(struct sockaddr)) < 0 &&
+      errno != EINPROGRESS)
+    fail_upstream(upstream);
+}
+
+/******************************************************************************
+
+Gives up on a connection that turned out not to be needed, e.g., because the
+query was answered from a coalesced flight.  Its backend is released without
+being charged with a request or an error.
+
+*******************************************************************************/
+void abandon_upstream(struct upstream* upstream) {
+  if (upstream->state == UPSTREAM_FAILED)
+    return;
+  if (upstream->ssl != NULL)
+    SSL_free(upstream->ssl);
+  close(upstream->sockfd);
+  cancel_backend(upstream->backend);
+  upstream->state = UPSTREAM_FAILED;
+}
+
+// Advances a connection as far as it can go without blocking
+static void step_upstream(struct upstream* upstream) {
+  socklen_t len = sizeof(int);
+  int       error = 0;
+  int       result;
+
+  if (upstream->state == UPSTREAM_CONNECTING) {
+    if (getsockopt(upstream->sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+      fail_upstream(upstream);
+      return;
+    }
+    upstream->ssl = create_backend_ssl(upstream->backend, upstream->sockfd);
+    upstream->state = UPSTREAM_HANDSHAKING;
+  }
+
+  if (upstream->state == UPSTREAM_HANDSHAKING) {
+    result = peer_connect(upstream->ssl);
+    if (result == 1)
+      upstream->state = UPSTREAM_READY;
+    else if ((upstream->events = ssl_wait_events(upstream->ssl, result)) == 0)
+      fail_upstream(upstream);
+  }
+}
+
+/******************************************************************************
+
+Prepares the client's side for run_pipeline(): its TLS handshake, and then the
+reading of one message into 'buffer', which is left NUL terminated.
+
+*******************************************************************************/
+void start_client_session(struct client_session* client, SSL* ssl, int sockfd,
+			  char* buffer, size_t size) {
+  memset(client, 0, sizeof(struct client_session));
+  client->ssl = ssl;
+  client->sockfd = sockfd;
+  client->buffer = buffer;
+  client->size = size;
+  client->state = CLIENT_HANDSHAKING;
+  client->events = POLLIN;
+  memset(buffer, 0, size);
+  set_nonblocking(sockfd);
+}
+
+static void step_client(struct client_session* client) {
+  int result;
+
+  if (client->state == CLIENT_HANDSHAKING) {
+    result = SSL_accept(client->ssl);
+    if (result == 1)
+      client->state = CLIENT_READING;
+    else if ((client->events = ssl_wait_events(client->ssl, result)) == 0) {
+      fprintf(stderr, "Server: Could not establish secure connection:\n");
+      ERR_print_errors_fp(stderr);
+      client->state = CLIENT_FAILED;
+      return;
+    }
+  }
+
+  if (client->state == CLIENT_READING) {
+    result = SSL_read(client->ssl, client->buffer, client->size - 1);
+    if (result > 0)
+      client->state = CLIENT_READY;
+    else if ((client->events = ssl_wait_events(client->ssl, result)) == 0)
+      client->state = CLIENT_FAILED;
+  }
+}
+
+static int upstream_done(struct upstream* upstream) {
+  return upstream->state == UPSTREAM_READY || upstream->state == UPSTREAM_FAILED;
+}
+
+static int client_done(struct client_session* client) {
+  return client == NULL || client->state == CLIENT_READY || client->state == CLIENT_FAILED;
+}
+
+/******************************************************************************
+
+Advances the client session and the upstream connections together, for at most
+'timeout_ms' milliseconds, or for as long as it takes if 'timeout_ms' is 0.  With a client session the wait ends as soon as the
+client's message has been read (or the client failed), and the upstream
+connections are left where they are, so the caller can look at the message
+before deciding whether it needs them.  Without one, the wait ends once every
+upstream connection is finished; the ones still unfinished at the timeout are
+failed, and the ready ones are made blocking again with 'timeout_ms' as their
+read and write timeout.  Returns the number of upstream connections ready.
+
+*******************************************************************************/
+int run_pipeline(struct client_session* client, struct upstream* upstreams, int count,
+		 int timeout_ms) {
+  struct pollfd   fds[MAX_UPSTREAMS + 1];
+  struct timespec start;
+  long            remaining;
+  int             nfds;
+  int             ready = 0;
+  int             i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1) {
+    nfds = 0;
+    if (!client_done(client)) {
+      fds[nfds].fd = client->sockfd;
+      fds[nfds++].events = client->events;
+    }
+    for (i = 0; i < count; i++)
+      if (!upstream_done(&upstreams[i])) {
+	fds[nfds].fd = upstreams[i].sockfd;
+	fds[nfds++].events = upstreams[i].events;
+      }
+    if (nfds == 0 || (client != NULL && client_done(client)))
+      break;
+
+    remaining = timeout_ms > 0 ? timeout_ms - elapsed_us(&start) / 1000 : -1;
+    if ((timeout_ms > 0 && remaining <= 0) ||
+	(poll(fds, nfds, remaining) < 0 && errno != EINTR))
+      break;
+
+    // Stepping a connection that is not ready yet just asks for the same
+    // events again, so each one is simply stepped after every wakeup
+    if (!client_done(client))
+      step_client(client);
+    for (i = 0; i < count; i++)
+      if (!upstream_done(&upstreams[i]))
+	step_upstream(&upstreams[i]);
+  }
+
+  if (client != NULL) {
+    if (!client_done(client))
+      client->state = CLIENT_FAILED;
+    set_blocking(client->sockfd, 0);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (client == NULL && !upstream_done(&upstreams[i]))
+      fail_upstream(&upstreams[i]);
+    if (upstreams[i].state == UPSTREAM_READY) {
+      if (client == NULL)
+	set_blocking(upstreams[i].sockfd, timeout_ms);
+      ready++;
+    }
+  }
+
+  return ready;
+}
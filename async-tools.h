@@ -0,0 +1,74 @@
+/******************************************************************************
+
+PROGRAM:  async-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures that let the Tier 1
+          server run its connection setup steps at the same time rather than
+          one after the other.  The client's TLS handshake and query, and the
+          TCP connections and TLS handshakes to Tier 2 servers, are each kept
+          as a small state machine over a non-blocking socket.  A single
+          poll() loop advances whichever of them can make progress, so the
+          Tier 2 connection is being set up while the client is still
+          handshaking and sending its query.
+
+          Once the loop is done the sockets are made blocking again, so the
+          rest of the server can keep using plain SSL_read() and SSL_write().
+
+******************************************************************************/
+
+#ifndef _ASYNCTOOLS_H_
+#define _ASYNCTOOLS_H_
+
+#include <time.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+
+#include "backend-tools.h"
+
+#define MAX_UPSTREAMS        16     // Most connections run_pipeline() can drive
+
+#define UPSTREAM_FAILED      0
+#define UPSTREAM_CONNECTING  1
+#define UPSTREAM_HANDSHAKING 2
+#define UPSTREAM_READY       3
+
+#define CLIENT_FAILED        0
+#define CLIENT_HANDSHAKING   1
+#define CLIENT_READING       2
+#define CLIENT_READY         3
+
+// A connection being set up to a Tier 2 server of one shard
+struct upstream {
+  int             state;
+  int             shard;
+  int             events;      // poll() events the next step waits for
+  struct backend* backend;
+  SSL*            ssl;
+  int             sockfd;
+  struct timespec started;
+};
+
+// The client's side: TLS handshake, then reading its one query message
+struct client_session {
+  int             state;
+  int             events;
+  SSL*            ssl;
+  int             sockfd;
+  char*           buffer;
+  size_t          size;
+};
+
+void start_upstream(struct backend_pool* pool, int shard, struct upstream* upstream);
+
+void abandon_upstream(struct upstream* upstream);
+
+void start_client_session(struct client_session* client, SSL* ssl, int sockfd,
+			  char* buffer, size_t size);
+
+int run_pipeline(struct client_session* client, struct upstream* upstreams, int count,
+		 int timeout_ms);
+
+void set_blocking(int sockfd, int timeout_ms);
+
+#endif
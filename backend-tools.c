@@ -0,0 +1,355 @@
+/******************************************************************************
+
+PROGRAM:  backend-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements load balancing over several Tier 2 servers for
+          the Tier 1 server.  See backend-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "backend-tools.h"
+#include "local-tools.h"
+#include "tls-tools.h"
+
+/******************************************************************************
+
+The Tier 1 server forks a new process for every client, so the backend table
+cannot simply be a global variable: each child would only update its own copy.
+Instead it is placed in an anonymous shared memory mapping created before the
+first fork().  Counters are updated with the GCC atomic builtins, which work on
+shared memory between processes just as they do between threads.
+
+*******************************************************************************/
+struct backend_pool* create_backend_pool(int policy) {
+  struct backend_pool* pool;
+
+  pool = mmap(NULL, sizeof(struct backend_pool), PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map backend table: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  memset(pool, 0, sizeof(struct backend_pool));
+  pool->policy = policy;
+
+  return pool;
+}
+
+/******************************************************************************
+
+Adds a backend given as "host" or "host:port".  When no port is given the
+default port is used.  A backend given as "unix:<path>" is reached through
+that Unix domain socket, and has no port.  Returns the index of the new
+backend, or -1 if the table is full.
+
+*******************************************************************************/
+int add_backend(struct backend_pool* pool, char* spec, unsigned int default_port) {
+  struct backend* backend;
+  char*           colon;
+  size_t          len;
+
+  if (pool->count == MAX_BACKENDS) {
+    fprintf(stderr, "Server: Too many backends (at most %d)\n", MAX_BACKENDS);
+    return -1;
+  }
+
+  backend = &pool->backends[pool->count];
+  colon = is_unix_endpoint(spec) ? NULL : strchr(spec, ':');
+  len = colon ? (size_t)(colon - spec) : strlen(spec);
+  if (len >= MAX_HOSTNAME_LENGTH)
+    len = MAX_HOSTNAME_LENGTH - 1;
+  memcpy(backend->host, spec, len);
+  backend->host[len] = '\0';
+  backend->port = colon ? (unsigned int) atoi(colon + 1) : default_port;
+  if (is_unix_endpoint(spec))
+    backend->port = 0;
+
+  // Backends start out healthy; the health checker ejects them if needed
+  backend->healthy = 1;
+
+  return pool->count++;
+}
+
+/******************************************************************************
+
+Picks a backend for the next request and counts it as outstanding.  Only
+healthy backends are considered.  If every backend has been ejected we fail
+open and consider all of them, since refusing every query is never better than
+trying a backend that may have recovered since the last probe.
+
+With BALANCE_LEAST_REQUESTS the backend with the fewest outstanding requests
+wins, scanning from a rotating start index so that ties are spread evenly.
+With BALANCE_TWO_CHOICES two distinct backends are chosen at random and the one
+with fewer outstanding requests wins; this avoids every child piling onto the
+same "least loaded" backend between counter updates.
+
+*******************************************************************************/
+struct backend* acquire_backend(struct backend_pool* pool) {
+  static pid_t    seeded = 0;
+  struct backend* candidates[MAX_BACKENDS];
+  struct backend* best;
+  struct backend* other;
+  unsigned int    start;
+  int             count = 0;
+  int             i;
+
+  // Every child inherits the parent's random state, so reseed once per process
+  // or all of them would make the same "random" choices
+  if (seeded != getpid()) {
+    seeded = getpid();
+    srand(seeded ^ time(NULL));
+  }
+
+  for (i = 0; i < pool->count; i++)
+    if (pool->backends[i].healthy)
+      candidates[count++] = &pool->backends[i];
+
+  if (count == 0)
+    for (i = 0; i < pool->count; i++)
+      candidates[count++] = &pool->backends[i];
+
+  if (count == 0)
+    return NULL;
+
+  if (pool->policy == BALANCE_TWO_CHOICES && count > 1) {
+    i = rand() % count;
+    best = candidates[i];
+    other = candidates[(i + 1 + rand() % (count - 1)) % count];
+    if (other->outstanding < best->outstanding)
+      best = other;
+  } else {
+    start = __sync_fetch_and_add(&pool->next, 1);
+    best = candidates[start % count];
+    for (i = 1; i < count; i++) {
+      other = candidates[(start + i) % count];
+      if (other->outstanding < best->outstanding)
+	best = other;
+    }
+  }
+
+  __sync_fetch_and_add(&best->outstanding, 1);
+
+  return best;
+}
+
+/******************************************************************************
+
+Marks a request acquired with acquire_backend() as finished and records its
+latency, or counts it as an error.
+
+*******************************************************************************/
+void release_backend(struct backend* backend, long latency_us, int failed) {
+  long max;
+
+  __sync_fetch_and_sub(&backend->outstanding, 1);
+  if (failed) {
+    __sync_fetch_and_add(&backend->errors, 1);
+    return;
+  }
+
+  __sync_fetch_and_add(&backend->requests, 1);
+  __sync_fetch_and_add(&backend->latency_us, latency_us);
+  max = backend->max_latency_us;
+  while (latency_us > max &&
+	 !__sync_bool_compare_and_swap(&backend->max_latency_us, max, latency_us))
+    max = backend->max_latency_us;
+}
+
+/******************************************************************************
+
+Gives back a backend acquired with acquire_backend() that ended up not being
+used, without counting a request or an error against it.
+
+*******************************************************************************/
+void cancel_backend(struct backend* backend) {
+  __sync_fetch_and_sub(&backend->outstanding, 1);
+}
+
+// Makes the sessions with the backends of the pool reached through Unix
+// sockets skip TLS, which those Tier 2 servers must have been told to do too
+void set_plain_local(struct backend_pool* pool) {
+  int i;
+
+  for (i = 0; i < pool->count; i++)
+    pool->backends[i].plain = is_unix_endpoint(pool->backends[i].host);
+}
+
+// The session object for a connection to 'backend', to be started with
+// peer_connect()
+SSL* create_backend_ssl(struct backend* backend, int sockfd) {
+  SSL* ssl;
+
+  if (backend->plain)
+    return create_plain_socket(sockfd);
+
+  ssl = create_client_ssl_socket(sockfd);
+  if (tls_profile == TLS_PROFILE_FAST)
+    use_session_slot(ssl, &backend->session);
+
+  return ssl;
+}
+
+/******************************************************************************
+
+Establishes an SSL/TLS session with a backend chosen by acquire_backend().  If
+the TCP connection or the handshake fails, the backend is charged with an error
+and the next choice is tried, so a single dead Tier 2 server does not fail the
+client's query.  On success the chosen backend and the socket descriptor are
+returned through 'chosen' and 'sockfd'; the caller must release the backend.
+A non-zero 'timeout_ms' bounds connect() and every later read and write.
+
+*******************************************************************************/
+SSL* connect_backend(struct backend_pool* pool, struct backend** chosen, int* sockfd,
+		     int timeout_ms) {
+  struct backend* backend;
+  SSL*            ssl;
+  int             sd;
+  int             attempt;
+
+  for (attempt = 0; attempt < pool->count; attempt++) {
+    backend = acquire_backend(pool);
+    if (backend == NULL)
+      break;
+
+    sd = try_client_socket(backend->host, backend->port, timeout_ms);
+    if (sd >= 0) {
+      ssl = create_backend_ssl(backend, sd);
+      if (peer_connect(ssl) == 1) {
+	*chosen = backend;
+	*sockfd = sd;
+	return ssl;
+      }
+      fprintf(stderr, "Server: Could not establish SSL session to '%s' on port %u\n",
+	      backend->host, backend->port);
+      SSL_free(ssl);
+      close(sd);
+    }
+    release_backend(backend, 0, 1);
+  }
+
+  return NULL;
+}
+
+/******************************************************************************
+
+A probe opens a TLS session to the backend and sends it a PING.  The Tier 2
+server answers PONG once it has a working MySQL connection, so a backend whose
+database is down is ejected as well, not just one whose process is gone.
+
+*******************************************************************************/
+static int probe_backend(struct backend* backend) {
+  char buffer[16];
+  SSL* ssl;
+  int  sd;
+  int  ok = 0;
+
+  sd = try_client_socket(backend->host, backend->port, HEALTH_TIMEOUT);
+  if (sd < 0)
+    return 0;
+
+  ssl = create_backend_ssl(backend, sd);
+  if (peer_connect(ssl) == 1 && peer_write(ssl, "PING", 5) > 0) {
+    bzero(buffer, sizeof(buffer));
+    if (peer_read(ssl, buffer, sizeof(buffer) - 1) > 0 && strcmp(buffer, "PONG") == 0)
+      ok = 1;
+  }
+
+  SSL_free(ssl);
+  close(sd);
+
+  return ok;
+}
+
+/******************************************************************************
+
+Forks a process that probes every backend each 'interval' seconds.  A backend
+is ejected after HEALTH_FAILURES consecutive failed probes and reinstated after
+HEALTH_SUCCESSES consecutive good ones, so a single lost probe does not make a
+backend flap in and out of rotation.  The checker exits when the Tier 1 server
+that started it goes away.
+
+*******************************************************************************/
+pid_t start_health_checker(struct backend_pool* pool, int interval) {
+  struct backend* backend;
+  pid_t           pid;
+  pid_t           parent = getpid();
+  int             i;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid != 0)
+    return pid;
+
+  signal(SIGPIPE, SIG_IGN);
+  while (getppid() == parent) {
+    for (i = 0; i < pool->count; i++) {
+      backend = &pool->backends[i];
+      if (probe_backend(backend)) {
+	backend->failures = 0;
+	backend->successes++;
+	if (!backend->healthy && backend->successes >= HEALTH_SUCCESSES) {
+	  backend->healthy = 1;
+	  fprintf(stdout, "Server: Backend %s:%u reinstated\n", backend->host, backend->port);
+	}
+      } else {
+	backend->successes = 0;
+	backend->failures++;
+	if (backend->healthy && backend->failures >= HEALTH_FAILURES) {
+	  backend->healthy = 0;
+	  fprintf(stdout, "Server: Backend %s:%u ejected\n", backend->host, backend->port);
+	}
+      }
+    }
+    sleep(interval);
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+
+Writes one line of statistics per backend: health, outstanding and completed
+requests, errors, and mean/maximum latency in milliseconds.
+
+*******************************************************************************/
+void print_backend_stats(struct backend_pool* pool, FILE* out) {
+  struct backend* backend;
+  double          mean;
+  int             i;
+
+  for (i = 0; i < pool->count; i++) {
+    backend = &pool->backends[i];
+    mean = backend->requests ? backend->latency_us / 1000.0 / backend->requests : 0.0;
+    fprintf(out, "Server: Backend %s:%u %s outstanding=%ld requests=%ld errors=%ld "
+	    "latency_mean=%.2fms latency_max=%.2fms\n", backend->host, backend->port,
+	    backend->healthy ? "up" : "down", backend->outstanding, backend->requests,
+	    backend->errors, mean, backend->max_latency_us / 1000.0);
+  }
+  fflush(out);
+}
+
+/******************************************************************************
+
+Returns the number of microseconds since 'start' on the monotonic clock.
+
+*******************************************************************************/
+long elapsed_us(struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
@@ -0,0 +1,83 @@
+/******************************************************************************
+
+PROGRAM:  backend-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures that allow the Tier 1
+          server to spread queries over several Tier 2 servers.  Each backend
+          keeps a count of outstanding requests, and a query is routed either
+          to the backend with the least outstanding requests or to the better
+          of two randomly chosen backends ("power of two choices").  A health
+          checker process probes every backend periodically, ejecting the ones
+          that fail and reinstating them once they answer again.
+
+          The backend table lives in shared memory so that the counters are
+          seen by every forked child of the Tier 1 server.
+
+******************************************************************************/
+
+#ifndef _BACKENDTOOLS_H_
+#define _BACKENDTOOLS_H_
+
+#include <time.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#include "client-tools.h"
+#include "tls-tools.h"
+
+#define MAX_BACKENDS           16
+#define BALANCE_LEAST_REQUESTS 0
+#define BALANCE_TWO_CHOICES    1
+#define HEALTH_INTERVAL        2     // Seconds between health check rounds
+#define HEALTH_TIMEOUT         1000  // Milliseconds allowed for one probe
+#define HEALTH_FAILURES        2     // Consecutive failures before ejection
+#define HEALTH_SUCCESSES       2     // Consecutive successes to reinstate
+
+struct backend {
+  char                host[MAX_HOSTNAME_LENGTH]; // Or "unix:<path>" (see local-tools.h)
+  unsigned int        port;
+  int                 plain;          // A Unix socket session without TLS
+  int                 healthy;
+  int                 failures;       // Consecutive failed probes
+  int                 successes;      // Consecutive successful probes
+  long                outstanding;    // Requests currently in flight
+  long                requests;       // Completed requests
+  long                errors;         // Failed requests (connect, handshake, reply)
+  long                latency_us;     // Sum of request latencies, microseconds
+  long                max_latency_us;
+  struct session_slot session;        // Last ticket, with the fast TLS profile
+};
+
+struct backend_pool {
+  int            policy;
+  int            count;
+  unsigned int   next;         // Rotating tie breaker
+  struct backend backends[MAX_BACKENDS];
+};
+
+struct backend_pool* create_backend_pool(int policy);
+
+int add_backend(struct backend_pool* pool, char* spec, unsigned int default_port);
+
+struct backend* acquire_backend(struct backend_pool* pool);
+
+void release_backend(struct backend* backend, long latency_us, int failed);
+
+void cancel_backend(struct backend* backend);
+
+void set_plain_local(struct backend_pool* pool);
+
+SSL* create_backend_ssl(struct backend* backend, int sockfd);
+
+SSL* connect_backend(struct backend_pool* pool, struct backend** chosen, int* sockfd,
+		     int timeout_ms);
+
+pid_t start_health_checker(struct backend_pool* pool, int interval);
+
+void print_backend_stats(struct backend_pool* pool, FILE* out);
+
+long elapsed_us(struct timespec* start);
+
+#endif
@@ -0,0 +1,156 @@
+/******************************************************************************
+
+PROGRAM:  batch-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements batching of concurrent queries in the Tier 1
+          server.  See batch-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "batch-tools.h"
+
+// Created before the server forks, like the flight table (see coalesce-tools.c)
+struct batch_table* create_batch_table() {
+  struct batch_table* table;
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t  cond_attr;
+
+  table = mmap(NULL, sizeof(struct batch_table), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map batch table: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(table, 0, sizeof(struct batch_table));
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&table->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&table->changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  return table;
+}
+
+static void lock_table(struct batch_table* table) {
+  if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&table->lock);
+}
+
+static void unlock_table(struct batch_table* table) {
+  pthread_mutex_unlock(&table->lock);
+}
+
+/******************************************************************************
+
+Adds 'query' to the open batch for 'shard', or opens one if there is none.
+'flight' is the index of the caller's flight, through which its result will
+arrive, and 'deadline_ms' the time its client gave it.  '*sender' is set to 1
+if the caller opened the batch and must send it, 0 if it joined one, in which
+case '*sender_pid' says which process will.  If the query is too long or every
+batch is busy NULL is returned and the caller sends its query on its own.
+
+A batch whose sender died before closing it would take queries forever, so
+such a batch is freed instead of joined.
+
+*******************************************************************************/
+struct batch* join_batch(struct batch_table* table, int shard, char* query, long deadline_ms,
+			 int flight, int* sender, pid_t* sender_pid) {
+  struct batch* batch;
+  struct batch* free_batch = NULL;
+  int           i;
+
+  if (strlen(query) >= BATCH_QUERY_SIZE)
+    return NULL;
+
+  lock_table(table);
+  for (i = 0; i < MAX_BATCHES; i++) {
+    batch = &table->batches[i];
+    if (batch->state == BATCH_OPEN && kill(batch->sender, 0) < 0 && errno == ESRCH)
+      batch->state = BATCH_FREE;
+    if (batch->state == BATCH_OPEN && batch->shard == shard && batch->count < BATCH_MAX) {
+      batch->flights[batch->count] = flight;
+      batch->deadlines[batch->count] = deadline_ms;
+      strcpy(batch->queries[batch->count], query);
+      batch->count++;
+      if (batch->count == BATCH_MAX)
+	pthread_cond_broadcast(&table->changed);
+      *sender = 0;
+      *sender_pid = batch->sender;
+      unlock_table(table);
+      return batch;
+    }
+    if (free_batch == NULL && batch->state == BATCH_FREE)
+      free_batch = batch;
+  }
+
+  if (free_batch != NULL) {
+    free_batch->state = BATCH_OPEN;
+    free_batch->shard = shard;
+    free_batch->sender = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &free_batch->opened);
+    free_batch->flights[0] = flight;
+    free_batch->deadlines[0] = deadline_ms;
+    strcpy(free_batch->queries[0], query);
+    free_batch->count = 1;
+    *sender = 1;
+    *sender_pid = free_batch->sender;
+  }
+  unlock_table(table);
+
+  return free_batch;
+}
+
+/******************************************************************************
+
+Called by the sender of a batch: waits until 'window_us' microseconds after it
+was opened, or until it is full, then stops it taking queries and copies it to
+'taken' to be sent.  The slot is free again as soon as this returns.
+
+*******************************************************************************/
+void close_batch(struct batch_table* table, struct batch* batch, long window_us,
+		 struct batch* taken) {
+  struct timespec deadline = batch->opened;
+
+  deadline.tv_sec += window_us / 1000000;
+  deadline.tv_nsec += (window_us % 1000000) * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  lock_table(table);
+  while (batch->count < BATCH_MAX &&
+	 pthread_cond_timedwait(&table->changed, &table->lock, &deadline) != ETIMEDOUT)
+    ;
+  memcpy(taken, batch, sizeof(struct batch));
+  batch->state = BATCH_FREE;
+  table->requests++;
+  table->queries += taken->count;
+  if (taken->count > table->largest)
+    table->largest = taken->count;
+  unlock_table(table);
+}
+
+void print_batch_stats(struct batch_table* table, FILE* out) {
+  fprintf(out, "Server: Batching requests=%ld queries=%ld largest=%d\n",
+	  table->requests, table->queries, table->largest);
+  fflush(out);
+}
@@ -0,0 +1,85 @@
+/******************************************************************************
+
+PROGRAM:  batch-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures that let the Tier 1
+          server send the different queries arriving within a short window to
+          a Tier 2 server as one request ("batching").  Each query would
+          otherwise cost a connection, a TLS handshake and a forked process
+          on Tier 2 of its own, which for small queries is most of the work.
+
+          The first child with a query for a shard opens a batch for it and
+          becomes its sender; children whose queries arrive for the same
+          shard before the window is over add theirs to it and wait.  The
+          sender then asks Tier 2
+
+            BATCH <count>
+            <deadline ms> <query>
+            ...
+
+          (one line per query, a deadline of 0 meaning none) and is sent the
+          result rows of each query in turn, every result ending with
+
+            RESULT <id> DONE|NO RESULTS|TIMEOUT|FAILED
+
+          where <id> is the query's line, counting from 0, and the whole
+          answer with "DONE".  The rows of each query are handed to the child
+          that asked through that query's flight (see coalesce-tools.h), so
+          the other children wait, and fall back to asking Tier 2 themselves,
+          just as clients of a coalesced query do.
+
+          Batches live in shared memory, protected by a process-shared mutex
+          and condition variable, like the flight table.
+
+******************************************************************************/
+
+#ifndef _BATCHTOOLS_H_
+#define _BATCHTOOLS_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define BATCH_PREFIX          "BATCH "
+#define BATCH_RESULT_PREFIX   "RESULT "
+#define BATCH_MAX             16       // Most queries in one batch
+#define BATCH_QUERY_SIZE      256
+#define BATCH_REQUEST_SIZE    8192     // Largest batch request, all queries included
+#define MAX_BATCHES           16       // Batches open at once
+
+#define BATCH_FREE            0
+#define BATCH_OPEN            1        // Accepting queries until its window ends
+
+struct batch {
+  int             state;
+  int             shard;
+  pid_t           sender;
+  struct timespec opened;
+  int             count;
+  int             flights[BATCH_MAX];     // Flight of each query, by index in the flight table
+  long            deadlines[BATCH_MAX];   // Milliseconds each query's client gave, 0 if none
+  char            queries[BATCH_MAX][BATCH_QUERY_SIZE];
+};
+
+struct batch_table {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  long            requests;               // Batches sent to Tier 2
+  long            queries;                // Queries they carried
+  int             largest;
+  struct batch    batches[MAX_BATCHES];
+};
+
+struct batch_table* create_batch_table();
+
+struct batch* join_batch(struct batch_table* table, int shard, char* query, long deadline_ms,
+			 int flight, int* sender, pid_t* sender_pid);
+
+void close_batch(struct batch_table* table, struct batch* batch, long window_us,
+		 struct batch* taken);
+
+void print_batch_stats(struct batch_table* table, FILE* out);
+
+#endif
@@ -17,6 +17,7 @@ SYNOPSIS: This header file provides function signatures that allow applications
 #include <resolv.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -29,6 +30,8 @@ SYNOPSIS: This header file provides function signatures that allow applications
 #include <openssl/x509_vfy.h>
 
 #include "client-tools.h"
+#include "local-tools.h"
+#include "tls-tools.h"
 
 #define DEFAULT_PORT        4433
 #define DEFAULT_HOST        "localhost"
@@ -55,18 +58,28 @@ allocated to the SSL object and close the socket descriptor.
 /******************************************************************************
 
 This function does the basic necessary housekeeping to establish a secure TCP
-connection to the server specified by 'hostname'.
+connection to the server specified by 'hostname'.  Unlike the function below it
+does not terminate the program when the remote host cannot be reached; instead
+it returns -1 so that callers talking to several servers (e.g., the Tier 1
+server with multiple Tier 2 backends) can try another one.  If 'timeout_ms' is
+non-zero it bounds the time spent in connect(), SSL_read() and SSL_write() on
+the returned socket.  A 'hostname' of the form "unix:<path>" connects to a Unix
+domain socket instead, and 'port' is ignored (see local-tools.h).
 
 *******************************************************************************/
-int create_client_socket(char* hostname, unsigned int port) {
+int try_client_socket(char* hostname, unsigned int port, int timeout_ms) {
   int                sockfd;
   struct hostent*    host;
   struct sockaddr_in dest_addr;
+  struct timeval     timeout;
+
+  if (is_unix_endpoint(hostname))
+    return try_unix_socket(hostname, timeout_ms);
   
   host = gethostbyname(hostname);
   if (host == NULL) {
     fprintf(stderr, "Client: Cannot resolve hostname %s\n",  hostname);
-    exit(EXIT_FAILURE);
+    return -1;
   }
   
   // Create a socket (endpoint) for network communication.  The socket()
@@ -78,7 +91,16 @@ int create_client_socket(char* hostname, unsigned int port) {
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
-    exit(EXIT_FAILURE);
+    return -1;
+  }
+
+  // On Linux the send timeout also applies to connect(), so a dead host costs
+  // at most 'timeout_ms' instead of the kernel's SYN retry schedule
+  if (timeout_ms > 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
   }
   
   // First we set up a network socket. An IP socket address is a combination
@@ -99,12 +121,29 @@ int create_client_socket(char* hostname, unsigned int port) {
   if (connect(sockfd, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr)) <0) {
     fprintf(stderr, "Client: Cannot connect to host %s [%s] on port %d: %s\n",
 	    hostname, inet_ntoa(dest_addr.sin_addr), port, strerror(errno));
-    exit(EXIT_FAILURE);
+    close(sockfd);
+    return -1;
   }
   
   return sockfd;
 }
 
+/******************************************************************************
+
+Same as try_client_socket(), but there is nothing sensible the caller can do
+without the connection, so any failure terminates the program.
+
+*******************************************************************************/
+int create_client_socket(char* hostname, unsigned int port) {
+  int sockfd;
+
+  sockfd = try_client_socket(hostname, port, 0);
+  if (sockfd < 0)
+    exit(EXIT_FAILURE);
+  
+  return sockfd;
+}
+
 // This function should  only be called once the TCP connection is established,
 // i.e., after create_socket()
 SSL* create_client_ssl_socket(int sockfd) {
@@ -121,6 +160,14 @@ SSL* create_client_ssl_socket(int sockfd) {
     exit(EXIT_FAILURE);
   }
 
+  // The fast profile shares one context, which resumes sessions (see
+  // tls-tools.h)
+  if (tls_profile == TLS_PROFILE_FAST) {
+    ssl = SSL_new(fast_client_context());
+    SSL_set_fd(ssl, sockfd);
+    return ssl;
+  }
+
   // Use the SSL/TLS method for clients
   method = SSLv23_client_method();
 
@@ -22,6 +22,8 @@ SYNOPSIS: This header file provides function signatures that allow applications
 #define DEFAULT_HOST        "localhost"
 #define MAX_HOSTNAME_LENGTH 256
 
+int try_client_socket(char* hostname, unsigned int port, int timeout_ms);
+
 int create_client_socket(char* hostname, unsigned int port);
 
 SSL* create_client_ssl_socket(int sockfd);
@@ -0,0 +1,163 @@
+/******************************************************************************
+
+PROGRAM:  coalesce-test.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program checks that the slots of the flight table (see
+          coalesce-tools.h) are given back when the processes in a flight are
+          killed instead of leaving it:
+
+          coalesce-test
+
+          For each way a Tier 1 child can die while in a flight (a follower
+          killed while the flight runs, a leader killed before or after it
+          finishes the flight), the flight is left behind in the table and the
+          rest of the table is filled with flights this process leads.  The
+          abandoned slot must then be handed out again, and any follower of a
+          killed leader must be told to query Tier 2 itself.  It prints each
+          check as it passes and stops at the first that does not.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "coalesce-tools.h"
+
+#define ROW_SIZE  256
+
+// Reports the check that did not pass and stops
+static void fail(const char* what) {
+  fprintf(stderr, "Coalesce: FAILED: %s\n", what);
+  exit(EXIT_FAILURE);
+}
+
+/******************************************************************************
+
+Forks a child that joins the flight for 'key', finishes it if it leads it and
+'finish' is set, and then waits to be killed without leaving it.  Returns the
+child's pid once it is in the flight.
+
+*******************************************************************************/
+static pid_t start_child(struct flight_table* table, char* key, int finish) {
+  struct flight* flight;
+  pid_t          pid;
+  int            fds[2];
+  int            leader;
+  char           ready;
+
+  if (pipe(fds) < 0 || (pid = fork()) < 0)
+    fail("unable to start a child");
+
+  if (pid == 0) {
+    close(fds[0]);
+    if ((flight = join_flight(table, key, &leader)) == NULL)
+      _exit(EXIT_FAILURE);
+    if (leader && finish)
+      finish_flight(table, flight, "DONE", 0);
+    write(fds[1], "x", 1);
+    while (1)
+      pause();
+  }
+
+  close(fds[1]);
+  if (read(fds[0], &ready, 1) != 1)
+    fail("the child could not join the flight");
+  close(fds[0]);
+
+  return pid;
+}
+
+// Returns the slot of the flight for 'key', whoever leads it
+static struct flight* find_flight(struct flight_table* table, char* key) {
+  int i;
+
+  for (i = 0; i < MAX_FLIGHTS; i++)
+    if (table->flights[i].waiters > 0 && strcmp(table->flights[i].key, key) == 0)
+      return &table->flights[i];
+
+  return NULL;
+}
+
+static void kill_child(pid_t pid) {
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+/******************************************************************************
+
+Fills every free slot with a flight this process leads and checks that the
+abandoned 'slot' was one of them, then finishes and leaves them all again.
+
+*******************************************************************************/
+static void check_reused(struct flight_table* table, struct flight* slot, const char* what) {
+  struct flight* taken[MAX_FLIGHTS + 1];
+  char           key[FLIGHT_KEY_SIZE];
+  int            reused = 0;
+  int            count;
+  int            leader;
+  int            i;
+
+  for (count = 0; count <= MAX_FLIGHTS; count++) {
+    snprintf(key, sizeof(key), "filler %d", count);
+    if ((taken[count] = join_flight(table, key, &leader)) == NULL)
+      break;
+    if (!leader)
+      fail("a filler flight was joined instead of led");
+    reused |= taken[count] == slot;
+  }
+
+  for (i = 0; i < count; i++) {
+    finish_flight(table, taken[i], "DONE", 0);
+    leave_flight(table, taken[i], 0);
+  }
+
+  if (!reused)
+    fail(what);
+  printf("Coalesce: %s\n", what);
+}
+
+int main(int argc, char** argv) {
+  struct flight_table* table = create_flight_table();
+  struct flight*       flight;
+  char                 row[ROW_SIZE];
+  size_t               offset = 0;
+  pid_t                pid;
+  int                  leader;
+
+  // A follower killed while the leader is still running
+  if ((flight = join_flight(table, "follower killed", &leader)) == NULL || !leader)
+    fail("unable to lead a flight");
+  pid = start_child(table, "follower killed", 0);
+  kill_child(pid);
+  finish_flight(table, flight, "DONE", 0);
+  leave_flight(table, flight, 0);
+  check_reused(table, flight, "The slot of a killed follower is reused");
+
+  // A leader killed after finishing, before it left
+  pid = start_child(table, "leader killed when done", 1);
+  if ((flight = find_flight(table, "leader killed when done")) == NULL ||
+      flight->state != FLIGHT_DONE)
+    fail("the child did not finish its flight");
+  kill_child(pid);
+  check_reused(table, flight, "The slot of a leader killed after it finished is reused");
+
+  // A leader killed while running, with a follower waiting for its rows
+  pid = start_child(table, "leader killed", 0);
+  if ((flight = join_flight(table, "leader killed", &leader)) == NULL || leader)
+    fail("unable to follow a flight");
+  kill_child(pid);
+  if (next_flight_row(table, flight, &offset, row, sizeof(row), 5000) != FLIGHT_FALLBACK)
+    fail("the follower of a killed leader did not fall back");
+  printf("Coalesce: The follower of a killed leader falls back\n");
+  leave_flight(table, flight, 1);
+  check_reused(table, flight, "The slot of a leader killed while running is reused");
+
+  printf("Coalesce: All checks passed\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/******************************************************************************
+
+PROGRAM:  coalesce-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements coalescing of identical concurrent queries in
+          the Tier 1 server.  See coalesce-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "coalesce-tools.h"
+
+/******************************************************************************
+
+The table is created in anonymous shared memory before the server forks, and
+its mutex and condition variable are marked PTHREAD_PROCESS_SHARED so that they
+work between the forked children.  The mutex is also robust: if a child dies
+while holding it, the next process to lock it is told so (EOWNERDEAD) and can
+mark it consistent again instead of deadlocking the whole server.
+
+*******************************************************************************/
+struct flight_table* create_flight_table() {
+  struct flight_table* table;
+  pthread_mutexattr_t  mutex_attr;
+  pthread_condattr_t   cond_attr;
+
+  table = mmap(NULL, sizeof(struct flight_table), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map flight table: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(table, 0, sizeof(struct flight_table));
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&table->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&table->changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  return table;
+}
+
+static void lock_table(struct flight_table* table) {
+  if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&table->lock);
+}
+
+static void unlock_table(struct flight_table* table) {
+  pthread_mutex_unlock(&table->lock);
+}
+
+static int is_dead(pid_t pid) {
+  return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+// Removes 'pid' from the processes still reading 'flight'
+static void remove_waiter(struct flight* flight, pid_t pid) {
+  int i;
+
+  for (i = 0; i < flight->waiters; i++)
+    if (flight->waiter_pids[i] == pid) {
+      flight->waiter_pids[i] = flight->waiter_pids[--flight->waiters];
+      return;
+    }
+}
+
+/******************************************************************************
+
+Fails a running flight whose leader was killed, as it would otherwise never
+finish, and drops the waiters that were killed before they left it, whether it
+is still running or not.  Returns 1 if that leaves the slot free.  Must be
+called with the table locked.
+
+*******************************************************************************/
+static int reap_dead_waiters(struct flight* flight) {
+  int i;
+
+  if (flight->state == FLIGHT_RUNNING && is_dead(flight->leader)) {
+    flight->failed = 1;
+    flight->state = FLIGHT_DONE;
+  }
+
+  for (i = 0; i < flight->waiters; )
+    if (is_dead(flight->waiter_pids[i]))
+      flight->waiter_pids[i] = flight->waiter_pids[--flight->waiters];
+    else
+      i++;
+
+  return flight->waiters == 0 && flight->state != FLIGHT_RUNNING;
+}
+
+/******************************************************************************
+
+Looks for a running flight with the same key.  If there is one, the caller
+joins it as a follower and '*leader' is set to 0.  Otherwise the caller starts
+a new flight in a free slot and becomes its leader.  Only running flights are
+joined: a finished flight is never replayed to a later query, so coalescing
+can not return stale results.  If every slot is busy, or the flight already
+has FLIGHT_WAITERS waiters, NULL is returned and the caller simply queries
+Tier 2 on its own.
+
+*******************************************************************************/
+struct flight* join_flight(struct flight_table* table, char* key, int* leader) {
+  struct flight* flight;
+  struct flight* free_flight = NULL;
+  int            i;
+
+  if (strlen(key) >= FLIGHT_KEY_SIZE)
+    return NULL;
+
+  lock_table(table);
+  for (i = 0; i < MAX_FLIGHTS; i++) {
+    flight = &table->flights[i];
+    if (flight->state == FLIGHT_RUNNING && strcmp(flight->key, key) == 0) {
+      if (flight->waiters == FLIGHT_WAITERS) {
+	unlock_table(table);
+	return NULL;
+      }
+      flight->waiter_pids[flight->waiters++] = getpid();
+      table->coalesced++;
+      unlock_table(table);
+      *leader = 0;
+      return flight;
+    }
+    if (free_flight == NULL && flight->waiters == 0 && flight->state != FLIGHT_RUNNING)
+      free_flight = flight;
+  }
+
+  // Only when the table is full is it worth checking for abandoned flights
+  for (i = 0; free_flight == NULL && i < MAX_FLIGHTS; i++)
+    if (reap_dead_waiters(&table->flights[i]))
+      free_flight = &table->flights[i];
+
+  if (free_flight != NULL) {
+    free_flight->state = FLIGHT_RUNNING;
+    free_flight->waiters = 1;
+    free_flight->overflowed = 0;
+    free_flight->failed = 0;
+    free_flight->leader = getpid();
+    free_flight->waiter_pids[0] = getpid();
+    free_flight->length = 0;
+    free_flight->terminator[0] = '\0';
+    strcpy(free_flight->key, key);
+    table->leaders++;
+    *leader = 1;
+  }
+  unlock_table(table);
+
+  return free_flight;
+}
+
+/******************************************************************************
+
+Called by the leader for each row received from Tier 2.  Rows that no longer
+fit are dropped and the flight is marked as overflowed; followers that reach
+the end of the stored rows then fall back to querying Tier 2 themselves.
+
+*******************************************************************************/
+void publish_flight_row(struct flight_table* table, struct flight* flight, char* row, size_t len) {
+  lock_table(table);
+  if (!flight->overflowed && flight->length + len + 1 <= FLIGHT_DATA_SIZE) {
+    memcpy(flight->data + flight->length, row, len);
+    flight->data[flight->length + len] = '\0';
+    flight->length += len + 1;
+  } else
+    flight->overflowed = 1;
+  pthread_cond_broadcast(&table->changed);
+  unlock_table(table);
+}
+
+// Makes another process, e.g., the sender of a batch (see batch-tools.h), the
+// one whose death fails the flight
+void hand_over_flight(struct flight_table* table, struct flight* flight, pid_t leader) {
+  lock_table(table);
+  flight->leader = leader;
+  unlock_table(table);
+}
+
+/******************************************************************************
+
+Called by the leader once Tier 2 has sent its final message.  Followers
+waiting for more rows are woken up and see the terminator.
+
+*******************************************************************************/
+void finish_flight(struct flight_table* table, struct flight* flight, char* terminator, int failed) {
+  lock_table(table);
+  strncpy(flight->terminator, terminator, FLIGHT_TERM_SIZE - 1);
+  flight->failed = failed;
+  flight->state = FLIGHT_DONE;
+  pthread_cond_broadcast(&table->changed);
+  unlock_table(table);
+}
+
+// Returns 1 if 'a' is before 'b'
+static int earlier(struct timespec* a, struct timespec* b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/******************************************************************************
+
+Copies the next row after '*offset' into 'row' for a follower, waiting for the
+leader if it has not arrived yet, but no longer than the 'timeout_ms' the
+follower has left, if that is not negative.  Returns FLIGHT_ROW for a result
+row, FLIGHT_END with the terminator in 'row' once the result is complete,
+FLIGHT_TIMEOUT once the follower's time is up, or FLIGHT_FALLBACK if the
+leader overflowed, failed or died, in which case the follower has to ask Tier
+2 itself and skip the rows it already forwarded.
+
+*******************************************************************************/
+int next_flight_row(struct flight_table* table, struct flight* flight, size_t* offset,
+		    char* row, size_t size, long timeout_ms) {
+  struct timespec deadline;
+  struct timespec end;
+  struct timespec now;
+  size_t          len;
+  int             result;
+
+  // The leader's deadline may be later than the follower's, or not be set
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (timeout_ms > 0) {
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += timeout_ms % 1000 * 1000000;
+    if (end.tv_nsec >= 1000000000) {
+      end.tv_sec++;
+      end.tv_nsec -= 1000000000;
+    }
+  }
+
+  lock_table(table);
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timeout_ms >= 0 && !earlier(&now, &end)) {
+      result = FLIGHT_TIMEOUT;
+      break;
+    }
+    if (*offset < flight->length) {
+      len = strlen(flight->data + *offset);
+      strncpy(row, flight->data + *offset, size - 1);
+      row[size - 1] = '\0';
+      *offset += len + 1;
+      result = FLIGHT_ROW;
+      break;
+    }
+    if (flight->state == FLIGHT_DONE) {
+      if (flight->overflowed || flight->failed)
+	result = FLIGHT_FALLBACK;
+      else {
+	strncpy(row, flight->terminator, size - 1);
+	row[size - 1] = '\0';
+	result = FLIGHT_END;
+      }
+      break;
+    }
+
+    // Wake up every second to make sure the leader is still alive; if it was
+    // killed the flight would otherwise never finish
+    deadline = now;
+    deadline.tv_sec += 1;
+    if (timeout_ms >= 0 && earlier(&end, &deadline))
+      deadline = end;
+    if (pthread_cond_timedwait(&table->changed, &table->lock, &deadline) == ETIMEDOUT)
+      reap_dead_waiters(flight);
+  }
+  unlock_table(table);
+
+  return result;
+}
+
+/******************************************************************************
+
+Drops the caller's interest in a flight.  The slot becomes reusable once the
+leader has finished and every follower has read the whole result, or was
+killed before it did (see reap_dead_waiters()).
+
+*******************************************************************************/
+void leave_flight(struct flight_table* table, struct flight* flight, int fell_back) {
+  lock_table(table);
+  remove_waiter(flight, getpid());
+  if (fell_back)
+    table->fallbacks++;
+  unlock_table(table);
+}
+
+/******************************************************************************
+
+Stops running flights whose key 'affected' says was touched by a change to the
+data from being joined, so later queries are sent to Tier 2 and see the
+change.  Clients that already joined still get the flight's result, which was
+correct when they asked.  An 'affected' of NULL means every flight was.
+Returns the number of flights invalidated.
+
+*******************************************************************************/
+int invalidate_flights(struct flight_table* table, int (*affected)(char* key, void* context),
+		       void* context) {
+  struct flight* flight;
+  int            count = 0;
+  int            i;
+
+  lock_table(table);
+  for (i = 0; i < MAX_FLIGHTS; i++) {
+    flight = &table->flights[i];
+    if (flight->state == FLIGHT_RUNNING && flight->key[0] != '\0' &&
+	(affected == NULL || affected(flight->key, context))) {
+      flight->key[0] = '\0';
+      count++;
+    }
+  }
+  table->invalidated += count;
+  unlock_table(table);
+
+  return count;
+}
+
+void print_flight_stats(struct flight_table* table, FILE* out) {
+  fprintf(out, "Server: Coalescing leaders=%ld coalesced=%ld fallbacks=%ld invalidated=%ld\n",
+	  table->leaders, table->coalesced, table->fallbacks, table->invalidated);
+  fflush(out);
+}
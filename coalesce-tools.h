@@ -0,0 +1,84 @@
+/******************************************************************************
+
+PROGRAM:  coalesce-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures that let the Tier 1
+          server coalesce identical concurrent queries ("single flight").  The
+          first child to send a given query to a Tier 2 server becomes the
+          leader of a flight; children receiving the same query while it is
+          still running become followers and replay the leader's result rows
+          instead of sending their own request.
+
+          Flights live in shared memory and are protected by a process-shared
+          mutex and condition variable, since every client is served by its
+          own forked process.
+
+******************************************************************************/
+
+#ifndef _COALESCETOOLS_H_
+#define _COALESCETOOLS_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define MAX_FLIGHTS       64
+#define FLIGHT_KEY_SIZE   256
+#define FLIGHT_DATA_SIZE  65536   // Result bytes kept per flight
+#define FLIGHT_TERM_SIZE  16
+#define FLIGHT_WAITERS    128     // Leader plus followers at most per flight
+
+#define FLIGHT_FREE       0
+#define FLIGHT_RUNNING    1
+#define FLIGHT_DONE       2
+
+#define FLIGHT_ROW        1       // next_flight_row() results
+#define FLIGHT_END        0
+#define FLIGHT_FALLBACK  -1
+#define FLIGHT_TIMEOUT   -2
+
+struct flight {
+  int    state;
+  int    waiters;                      // Leader plus followers still reading
+  int    overflowed;                   // Result did not fit in 'data'
+  int    failed;                       // Leader could not get a result
+  pid_t  leader;
+  pid_t  waiter_pids[FLIGHT_WAITERS];  // Processes that have not left yet
+  char   key[FLIGHT_KEY_SIZE];
+  char   terminator[FLIGHT_TERM_SIZE]; // "DONE" or "NO RESULTS"
+  size_t length;
+  char   data[FLIGHT_DATA_SIZE];       // Rows, each terminated by a NUL
+};
+
+struct flight_table {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  long            leaders;             // Queries actually sent to Tier 2
+  long            coalesced;           // Queries answered from a flight
+  long            fallbacks;           // Followers that had to query anyway
+  long            invalidated;         // Flights closed to joiners by a data change
+  struct flight   flights[MAX_FLIGHTS];
+};
+
+struct flight_table* create_flight_table();
+
+struct flight* join_flight(struct flight_table* table, char* key, int* leader);
+
+void publish_flight_row(struct flight_table* table, struct flight* flight, char* row, size_t len);
+
+void hand_over_flight(struct flight_table* table, struct flight* flight, pid_t leader);
+
+void finish_flight(struct flight_table* table, struct flight* flight, char* terminator, int failed);
+
+int next_flight_row(struct flight_table* table, struct flight* flight, size_t* offset,
+		    char* row, size_t size, long timeout_ms);
+
+void leave_flight(struct flight_table* table, struct flight* flight, int fell_back);
+
+int invalidate_flights(struct flight_table* table, int (*affected)(char* key, void* context),
+		       void* context);
+
+void print_flight_stats(struct flight_table* table, FILE* out);
+
+#endif
@@ -0,0 +1,437 @@
+/******************************************************************************
+
+PROGRAM:  facet-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the showtime counts kept by the Tier 2 server
+          and added up by the Tier 1 server.  See facet-tools.h for an
+          overview.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "facet-tools.h"
+
+static char* column_names[] = { "name", "location", "date" };
+
+// The conditions of a query on each counted column.  A column without one has
+// a count of -1; otherwise 'values' holds the values it accepts, sorted without
+// regard to case, or, for a LIKE condition, the single prefix they start with.
+struct facet_filter {
+  int    count[FACET_COLUMNS];
+  int    prefix[FACET_COLUMNS];
+  char** values[FACET_COLUMNS];
+};
+
+struct facet_index* create_facet_index() {
+  struct facet_index* index;
+
+  index = calloc(1, sizeof(struct facet_index));
+  if (index == NULL) {
+    fprintf(stderr, "Facets: Unable to allocate index\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return index;
+}
+
+void free_facet_index(struct facet_index* index) {
+  int column;
+  int i;
+
+  if (index == NULL)
+    return;
+  for (i = 0; i < index->count; i++)
+    for (column = 0; column < FACET_COLUMNS; column++)
+      free(index->groups[i].values[column]);
+  free(index->groups);
+  free(index->slots);
+  free(index);
+}
+
+static uint32_t hash_group(char** values) {
+  uint32_t hash = 2166136261u;
+  char*    p;
+  int      column;
+
+  for (column = 0; column < FACET_COLUMNS; column++) {
+    for (p = values[column]; *p != '\0'; p++)
+      hash = (hash ^ (unsigned char)*p) * 16777619u;
+    // Keeps ("ab", "c") and ("a", "bc") apart
+    hash = (hash ^ '\t') * 16777619u;
+  }
+
+  return hash;
+}
+
+static int same_group(struct facet_group* group, char** values) {
+  int column;
+
+  for (column = 0; column < FACET_COLUMNS; column++)
+    if (strcmp(group->values[column], values[column]) != 0)
+      return 0;
+
+  return 1;
+}
+
+// Makes the hash table 'slot_count' slots, a power of two, and puts every group back in it
+static void rehash(struct facet_index* index, int slot_count) {
+  int slot;
+  int i;
+
+  free(index->slots);
+  index->slot_count = slot_count;
+  index->slots = malloc(slot_count * sizeof(int));
+  if (index->slots == NULL) {
+    fprintf(stderr, "Facets: Unable to grow index\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(index->slots, -1, slot_count * sizeof(int));
+
+  for (i = 0; i < index->count; i++) {
+    slot = hash_group(index->groups[i].values) & (slot_count - 1);
+    while (index->slots[slot] >= 0)
+      slot = (slot + 1) & (slot_count - 1);
+    index->slots[slot] = i;
+  }
+}
+
+/******************************************************************************
+
+Adds 'showtimes', which is negative for showtimes removed, to the count of the
+group given by 'values' (its name, location and date), adding the group if it
+is new.  A group is never taken out again, as the same showtimes often come
+back, e.g., when a data file is rewritten; one whose count is 0 is simply
+skipped.  The hash table is kept at most half full.
+
+*******************************************************************************/
+void add_facet_count(struct facet_index* index, char** values, long showtimes) {
+  struct facet_group* group;
+  int                 slot;
+  int                 column;
+
+  if (2 * (index->count + 1) > index->slot_count)
+    rehash(index, index->slot_count ? index->slot_count * 2 : 1024);
+
+  slot = hash_group(values) & (index->slot_count - 1);
+  while (index->slots[slot] >= 0) {
+    group = &index->groups[index->slots[slot]];
+    if (same_group(group, values)) {
+      group->showtimes += showtimes;
+      return;
+    }
+    slot = (slot + 1) & (index->slot_count - 1);
+  }
+
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? index->capacity * 2 : 512;
+    index->groups = realloc(index->groups, index->capacity * sizeof(struct facet_group));
+  }
+  if (index->groups == NULL) {
+    fprintf(stderr, "Facets: Unable to grow index\n");
+    exit(EXIT_FAILURE);
+  }
+  group = &index->groups[index->count];
+  for (column = 0; column < FACET_COLUMNS; column++)
+    if ((group->values[column] = strdup(values[column])) == NULL) {
+      fprintf(stderr, "Facets: Unable to grow index\n");
+      exit(EXIT_FAILURE);
+    }
+  group->showtimes = showtimes;
+  index->slots[slot] = index->count++;
+}
+
+/******************************************************************************
+
+Reads a grouping such as "name,date" into FACET_ flags.  "total" is 0, a
+single count.  Returns -1 if any column named is not one counted by.
+
+*******************************************************************************/
+int parse_grouping(char* text) {
+  size_t len;
+  int    grouping = 0;
+  int    column;
+
+  if (strcmp(text, "total") == 0)
+    return 0;
+
+  while (1) {
+    len = strcspn(text, ",");
+    for (column = 0; column < FACET_COLUMNS; column++)
+      if (strlen(column_names[column]) == len && strncmp(text, column_names[column], len) == 0)
+	break;
+    if (column == FACET_COLUMNS)
+      return -1;
+    grouping |= 1 << column;
+    if (text[len] == '\0')
+      return grouping;
+    text += len + 1;
+  }
+}
+
+static int skip(char** query, char* word) {
+  if (strncasecmp(*query, word, strlen(word)) != 0)
+    return -1;
+  *query += strlen(word);
+
+  return 0;
+}
+
+// Reads the quoted SQL string at '*query', undoing doubled quotes, and moves past it
+static int read_quoted(char** query, char* text, size_t size) {
+  char*  p = *query;
+  size_t len = 0;
+
+  if (*p++ != '\'')
+    return -1;
+  while (*p != '\0') {
+    if (*p == '\'' && p[1] != '\'')
+      break;
+    if (*p == '\'')
+      p++;
+    if (len + 1 >= size)
+      return -1;
+    text[len++] = *p++;
+  }
+  if (*p != '\'')
+    return -1;
+  text[len] = '\0';
+  *query = p + 1;
+
+  return 0;
+}
+
+static int compare_values(const void* a, const void* b) {
+  return strcasecmp(*(char**)a, *(char**)b);
+}
+
+static void free_filter(struct facet_filter* filter) {
+  int column;
+  int i;
+
+  for (column = 0; column < FACET_COLUMNS; column++) {
+    for (i = 0; i < filter->count[column]; i++)
+      free(filter->values[column][i]);
+    free(filter->values[column]);
+  }
+}
+
+/******************************************************************************
+
+Parses the WHERE clause of a query of the form the Tier 1 server builds, after
+the Tier 2 server has replaced title and distance searches with lists, i.e.,
+conditions of the forms
+
+  <column> = '<value>'
+  <column> IN ('<value>', ...)
+  <column> LIKE '<prefix>%'
+
+on the name, location and date.  Returns 0, or -1 if the query has any other
+condition, e.g., on the time, which the counts can not tell apart.  Either
+way, the filter must be freed with free_filter().
+
+*******************************************************************************/
+static int parse_filter(char* query, struct facet_filter* filter) {
+  char   text[FACET_ROW_SIZE];
+  char** values;
+  size_t len;
+  int    column;
+  int    prefix;
+  int    list;
+
+  for (column = 0; column < FACET_COLUMNS; column++) {
+    filter->count[column] = -1;
+    filter->prefix[column] = 0;
+    filter->values[column] = NULL;
+  }
+
+  if (skip(&query, "SELECT * FROM movie_times") < 0)
+    return -1;
+  if (skip(&query, " WHERE ") == 0)
+    do {
+      for (column = 0; column < FACET_COLUMNS; column++)
+	if (strncasecmp(query, column_names[column], strlen(column_names[column])) == 0 &&
+	    query[strlen(column_names[column])] == ' ')
+	  break;
+      if (column == FACET_COLUMNS || filter->count[column] >= 0)
+	return -1;
+      query += strlen(column_names[column]);
+
+      prefix = list = 0;
+      if (skip(&query, " = ") == 0)
+	;
+      else if (skip(&query, " IN (") == 0)
+	list = 1;
+      else if (skip(&query, " LIKE ") == 0)
+	prefix = 1;
+      else
+	return -1;
+
+      filter->count[column] = 0;
+      filter->prefix[column] = prefix;
+      do {
+	skip(&query, " ");
+	if (read_quoted(&query, text, sizeof(text)) < 0)
+	  return -1;
+	if (prefix) {
+	  // Only a single trailing wildcard, i.e., a prefix, can be told apart
+	  len = strlen(text);
+	  if (len == 0 || strchr(text, '%') != &text[len - 1] || strpbrk(text, "_\\") != NULL)
+	    return -1;
+	  text[len - 1] = '\0';
+	}
+	values = realloc(filter->values[column], (filter->count[column] + 1) * sizeof(char*));
+	if (values == NULL || (values[filter->count[column]] = strdup(text)) == NULL) {
+	  fprintf(stderr, "Facets: Unable to allocate filter\n");
+	  exit(EXIT_FAILURE);
+	}
+	filter->values[column] = values;
+	filter->count[column]++;
+      } while (list && skip(&query, ",") == 0);
+      if (list && skip(&query, ")") < 0)
+	return -1;
+
+      qsort(filter->values[column], filter->count[column], sizeof(char*), compare_values);
+    } while (skip(&query, " AND ") == 0);
+
+  if (*query != '\0' && skip(&query, " ORDER BY name, location, date, time") < 0)
+    return -1;
+
+  return *query == '\0' ? 0 : -1;
+}
+
+static int filter_accepts(struct facet_filter* filter, struct facet_group* group) {
+  char* value;
+  int   column;
+
+  for (column = 0; column < FACET_COLUMNS; column++) {
+    if (filter->count[column] < 0)
+      continue;
+    value = group->values[column];
+    if (filter->prefix[column]) {
+      if (strncasecmp(value, filter->values[column][0], strlen(filter->values[column][0])) != 0)
+	return 0;
+    } else if (bsearch(&value, filter->values[column], filter->count[column], sizeof(char*),
+		       compare_values) == NULL)
+      return 0;
+  }
+
+  return 1;
+}
+
+/******************************************************************************
+
+Adds the showtimes of every group in 'index' that 'query' matches to 'counts',
+by the columns in 'grouping', the other columns being left empty.  Returns the
+number of groups matched, or -1 if the query has a condition the groups can
+not answer, in which case the caller must count the showtimes themselves.
+
+*******************************************************************************/
+int count_facets(struct facet_index* index, char* query, int grouping,
+		 struct facet_index* counts) {
+  struct facet_filter filter;
+  struct facet_group* group;
+  char*               values[FACET_COLUMNS];
+  int                 matched = 0;
+  int                 column;
+  int                 i;
+
+  if (parse_filter(query, &filter) < 0) {
+    free_filter(&filter);
+    return -1;
+  }
+
+  for (i = 0; i < index->count; i++) {
+    group = &index->groups[i];
+    if (group->showtimes == 0 || !filter_accepts(&filter, group))
+      continue;
+    for (column = 0; column < FACET_COLUMNS; column++)
+      values[column] = grouping & (1 << column) ? group->values[column] : "";
+    add_facet_count(counts, values, group->showtimes);
+    matched++;
+  }
+
+  free_filter(&filter);
+
+  return matched;
+}
+
+// Orders groups by name, location and date, without regard to case as MySQL does
+static int compare_groups(const void* a, const void* b) {
+  struct facet_group* group_a = *(struct facet_group**)a;
+  struct facet_group* group_b = *(struct facet_group**)b;
+  int                 result;
+  int                 column;
+
+  for (column = 0; column < FACET_COLUMNS; column++)
+    if ((result = strcasecmp(group_a->values[column], group_b->values[column])) != 0)
+      return result;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Returns the groups of 'index' with showtimes in (name, location, date) order,
+as an array ending with NULL, which the caller must free.
+
+*******************************************************************************/
+struct facet_group** sort_facets(struct facet_index* index) {
+  struct facet_group** sorted;
+  int                  count = 0;
+  int                  i;
+
+  sorted = malloc((index->count + 1) * sizeof(struct facet_group*));
+  if (sorted == NULL) {
+    fprintf(stderr, "Facets: Unable to sort counts\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < index->count; i++)
+    if (index->groups[i].showtimes > 0)
+      sorted[count++] = &index->groups[i];
+  qsort(sorted, count, sizeof(struct facet_group*), compare_groups);
+  sorted[count] = NULL;
+
+  return sorted;
+}
+
+void format_facet_row(char* row, size_t size, struct facet_group* group) {
+  snprintf(row, size, COUNT_PREFIX "%ld\t%s\t%s\t%s", group->showtimes,
+	   group->values[0], group->values[1], group->values[2]);
+}
+
+/******************************************************************************
+
+Takes apart a count row as format_facet_row() writes it into its count and
+the values of its group.  Returns 0, or -1 if 'row' is not a count row.
+
+*******************************************************************************/
+int parse_facet_row(char* row, char values[][FACET_ROW_SIZE], long* showtimes) {
+  char*  end;
+  size_t len;
+  int    column;
+
+  if (strncmp(row, COUNT_PREFIX, strlen(COUNT_PREFIX)) != 0)
+    return -1;
+  *showtimes = strtol(row + strlen(COUNT_PREFIX), &end, 10);
+  if (end == row + strlen(COUNT_PREFIX))
+    return -1;
+
+  for (column = 0; column < FACET_COLUMNS; column++) {
+    if (*end++ != '\t')
+      return -1;
+    len = strcspn(end, "\t");
+    if (len >= FACET_ROW_SIZE)
+      return -1;
+    memcpy(values[column], end, len);
+    values[column][len] = '\0';
+    end += len;
+  }
+
+  return *end == '\0' ? 0 : -1;
+}
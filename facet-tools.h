@@ -0,0 +1,75 @@
+/******************************************************************************
+
+PROGRAM:  facet-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for counting
+          showtimes without listing them, e.g., to show "12 showtimes of this
+          movie in Denver tomorrow" next to a filter.  The Tier 2 server keeps
+          a facet index: the number of showtimes of every (name, location,
+          date), built when the data is loaded and updated by every showtime
+          added or removed afterwards.  A count is then worked out from these
+          totals, of which there are far fewer than showtimes, instead of
+          from the showtimes themselves.
+
+          A count is asked for as
+
+            COUNT <grouping> <query>
+
+          where <query> is a search as the Tier 1 server builds it and
+          <grouping> says which of name, location and date to count by, as a
+          comma list such as "name,date", or "total" for a single count.  The
+          answer is one message per group,
+
+            COUNT <showtimes>\t<name>\t<location>\t<date>
+
+          with the columns not counted by left empty, followed by "DONE" or
+          "NO RESULTS".  Locations are split over shards, so the Tier 1 server
+          adds up the counts of the same group from different shards before
+          passing them on.
+
+******************************************************************************/
+
+#ifndef _FACETTOOLS_H_
+#define _FACETTOOLS_H_
+
+#include <stddef.h>
+
+#define COUNT_PREFIX      "COUNT "
+#define FACET_COLUMNS     3        // Name, location and date; times are not counted by
+#define FACET_NAME        1        // Groupings are flags, as in "name,date"
+#define FACET_LOCATION    2
+#define FACET_DATE        4
+#define FACET_ROW_SIZE    256
+
+struct facet_group {
+  char* values[FACET_COLUMNS];
+  long  showtimes;                 // Groups whose showtimes all went keep a count of 0
+};
+
+struct facet_index {
+  int                 count;
+  int                 capacity;
+  struct facet_group* groups;
+  int*                slots;       // Hash table of indexes into 'groups', -1 if free
+  int                 slot_count;
+};
+
+struct facet_index* create_facet_index();
+
+void free_facet_index(struct facet_index* index);
+
+void add_facet_count(struct facet_index* index, char** values, long showtimes);
+
+int parse_grouping(char* text);
+
+int count_facets(struct facet_index* index, char* query, int grouping,
+		 struct facet_index* counts);
+
+struct facet_group** sort_facets(struct facet_index* index);
+
+void format_facet_row(char* row, size_t size, struct facet_group* group);
+
+int parse_facet_row(char* row, char values[][FACET_ROW_SIZE], long* showtimes);
+
+#endif
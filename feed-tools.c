@@ -0,0 +1,405 @@
+/******************************************************************************
+
+PROGRAM:  feed-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the showtime change feed.  See feed-tools.h for
+          an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+
+#include "feed-tools.h"
+#include "local-tools.h"
+
+static char* column_names[] = { "name", "location", "date", "time" };
+static char* row_labels[] = { "Name: ", " Location: ", " Date: ", " Time: " };
+
+/******************************************************************************
+
+Creates an empty change log in shared memory, starting at 'version'.  Like the
+flight table of the Tier 1 server, it is guarded by a robust, process-shared
+mutex, and a condition variable wakes the processes waiting for changes.
+
+*******************************************************************************/
+struct change_log* create_change_log(long version) {
+  struct change_log*  log;
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t  cond_attr;
+
+  log = mmap(NULL, sizeof(struct change_log), PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (log == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map change log: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(log, 0, sizeof(struct change_log));
+  log->first_version = version;
+  log->version = version;
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&log->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&log->changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  return log;
+}
+
+static void lock_log(struct change_log* log) {
+  if (pthread_mutex_lock(&log->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&log->lock);
+}
+
+/******************************************************************************
+
+Publishes 'count' changes as one new version: 'version', or the next one if
+'version' is 0.  Readers see either all of them or none.  Returns the version.
+
+*******************************************************************************/
+long publish_changes(struct change_log* log, struct change* changes, int count, long version) {
+  int i;
+
+  lock_log(log);
+  log->version = version > 0 ? version : log->version + 1;
+  for (i = 0; i < count; i++) {
+    changes[i].version = log->version;
+    log->changes[log->count++ % FEED_LOG_SIZE] = changes[i];
+  }
+  version = log->version;
+  pthread_cond_broadcast(&log->changed);
+  pthread_mutex_unlock(&log->lock);
+
+  return version;
+}
+
+/******************************************************************************
+
+Returns the position in the log of the first change made after version
+'since', or of the next change to be published if 'since' is 0, and sets
+'*version' to the version reached just before that position.  Returns -1 if
+the changes after 'since' are no longer, or were never, in the log.
+
+*******************************************************************************/
+long feed_position(struct change_log* log, long since, long* version) {
+  long oldest;
+  long position;
+
+  lock_log(log);
+  oldest = log->count > FEED_LOG_SIZE ? log->count - FEED_LOG_SIZE : 0;
+  *version = log->version;
+  if (since == 0 || since == log->version)
+    position = log->count;
+  else if (since > log->version || since < log->first_version ||
+	   (oldest > 0 && since < log->changes[oldest % FEED_LOG_SIZE].version))
+    position = -1;
+  else {
+    for (position = oldest; position < log->count &&
+	   log->changes[position % FEED_LOG_SIZE].version <= since; position++)
+      ;
+    *version = since;
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  return position;
+}
+
+// The version the log had reached just before 'position'; the log must be locked
+static long version_at(struct change_log* log, long position) {
+  if (position == 0 || position <= log->count - FEED_LOG_SIZE)
+    return position == log->count ? log->version : log->first_version;
+
+  return log->changes[(position - 1) % FEED_LOG_SIZE].version;
+}
+
+/******************************************************************************
+
+Copies the change at '*position' into 'change' and moves past it, waiting up to
+'timeout_ms' milliseconds for one to be published.  Returns 1 with a change,
+or 0 if none arrived in time, in which case 'change->version' is the version
+every change read so far belongs to.  A reader that fell so far behind that
+its next change was overwritten gets a CHANGE_RESYNC change and continues from
+the newest one.
+
+*******************************************************************************/
+int next_change(struct change_log* log, long* position, struct change* change, int timeout_ms) {
+  struct timespec deadline;
+  int             result = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  lock_log(log);
+  while (1) {
+    if (*position < log->count - FEED_LOG_SIZE) {
+      change->op = CHANGE_RESYNC;
+      change->version = log->version;
+      change->row[0] = '\0';
+      *position = log->count;
+      result = 1;
+      break;
+    }
+    if (*position < log->count) {
+      *change = log->changes[(*position)++ % FEED_LOG_SIZE];
+      result = 1;
+      break;
+    }
+    if (timeout_ms <= 0 ||
+	pthread_cond_timedwait(&log->changed, &log->lock, &deadline) == ETIMEDOUT) {
+      change->version = version_at(log, *position);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  return result;
+}
+
+void format_change(struct change* change, char* message, size_t size) {
+  if (change->op == CHANGE_RESYNC)
+    snprintf(message, size, "RESYNC %ld", change->version);
+  else
+    snprintf(message, size, "CHANGE %ld %s %s", change->version,
+	     change->op == CHANGE_ADD ? "ADD" : "REMOVE", change->row);
+}
+
+/******************************************************************************
+
+Reads a message of the change feed into 'change'.  Returns FEED_CHANGE,
+FEED_VERSION or FEED_RESYNC, with 'change->version' set, or -1 if the message
+is none of those.
+
+*******************************************************************************/
+int parse_feed_message(char* message, struct change* change) {
+  char* rest;
+
+  if (strncmp(message, "VERSION ", 8) == 0) {
+    change->version = atol(message + 8);
+    return FEED_VERSION;
+  }
+  if (strncmp(message, "RESYNC ", 7) == 0) {
+    change->version = atol(message + 7);
+    change->op = CHANGE_RESYNC;
+    change->row[0] = '\0';
+    return FEED_RESYNC;
+  }
+  if (strncmp(message, "CHANGE ", 7) != 0)
+    return -1;
+
+  change->version = strtol(message + 7, &rest, 10);
+  if (strncmp(rest, " ADD ", 5) == 0) {
+    change->op = CHANGE_ADD;
+    rest += 5;
+  } else if (strncmp(rest, " REMOVE ", 8) == 0) {
+    change->op = CHANGE_REMOVE;
+    rest += 8;
+  } else
+    return -1;
+  strncpy(change->row, rest, FEED_ROW_SIZE - 1);
+  change->row[FEED_ROW_SIZE - 1] = '\0';
+
+  return FEED_CHANGE;
+}
+
+/******************************************************************************
+
+Runs in the child serving a SUBSCRIBE request: sends every change after
+'since' and then each new one as it is published, each version followed by a
+VERSION message, until the subscriber goes away.
+
+*******************************************************************************/
+void serve_subscription(struct change_log* log, SSL* ssl, long since) {
+  struct change change;
+  char          message[FEED_ROW_SIZE + 32];
+  long          position;
+  long          version;
+  long          pending = 0;    // Version whose changes were sent but not closed
+  int           result;
+
+  // A subscriber that left is only noticed when writing to it fails
+  signal(SIGPIPE, SIG_IGN);
+
+  // The subscriber first learns which version it is at
+  position = feed_position(log, since, &version);
+  if (position < 0) {
+    position = feed_position(log, 0, &version);
+    snprintf(message, sizeof(message), "RESYNC %ld", version);
+  } else
+    snprintf(message, sizeof(message), "VERSION %ld", version);
+  if (peer_write(ssl, message, strlen(message)+1) <= 0)
+    return;
+
+  while (1) {
+    // Once the changes of a version are all sent, the version is closed right
+    // away; otherwise the feed waits for more
+    result = next_change(log, &position, &change, pending ? 0 : FEED_HEARTBEAT);
+    if (result == 0 || change.op == CHANGE_RESYNC ||
+	(pending && change.version != pending)) {
+      snprintf(message, sizeof(message), "VERSION %ld", pending ? pending : change.version);
+      if (peer_write(ssl, message, strlen(message)+1) <= 0)
+	return;
+      pending = 0;
+    }
+    if (result == 0)
+      continue;
+
+    format_change(&change, message, sizeof(message));
+    if (peer_write(ssl, message, strlen(message)+1) <= 0)
+      return;
+    pending = change.op == CHANGE_RESYNC ? 0 : change.version;
+  }
+}
+
+/******************************************************************************
+
+Splits a result row, "Name: ... Location: ... Date: ... Time: ... \n", into
+its four values.  Returns 0, or -1 if the row is not formatted that way.
+
+*******************************************************************************/
+int row_values(char* row, char values[][FEED_VALUE_SIZE]) {
+  char*  start = row;
+  char*  end;
+  size_t len;
+  int    i;
+
+  for (i = 0; i < 4; i++) {
+    if (strncmp(start, row_labels[i], strlen(row_labels[i])) != 0)
+      return -1;
+    start += strlen(row_labels[i]);
+    end = i < 3 ? strstr(start, row_labels[i + 1]) : start + strcspn(start, "\n");
+    if (end == NULL)
+      return -1;
+    // The last value is followed by a space before the newline
+    len = end - start;
+    if (i == 3 && len > 0 && start[len - 1] == ' ')
+      len--;
+    if (len >= FEED_VALUE_SIZE)
+      len = FEED_VALUE_SIZE - 1;
+    memcpy(values[i], start, len);
+    values[i][len] = '\0';
+    start = end;
+  }
+
+  return 0;
+}
+
+// Reads the quoted value at '*text' into 'value' and moves past it
+static int read_value(char** text, char* value) {
+  char*  p = *text;
+  size_t len = 0;
+
+  if (*p++ != '\'')
+    return -1;
+  while (*p != '\0' && !(*p == '\'' && p[1] != '\'')) {
+    if (*p == '\'')
+      p++;
+    if (len < FEED_VALUE_SIZE - 1)
+      value[len++] = *p;
+    p++;
+  }
+  if (*p != '\'')
+    return -1;
+  value[len] = '\0';
+  *text = p + 1;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Decides whether a result row matches a query as built by the Tier 1 server,
+comparing without regard to case as MySQL does.  Conditions of the forms
+"<column> = '...'", "<column> LIKE '<prefix>%'" and "<column> IN ('...', ...)"
+are understood.  Returns 1 if the row matches, 0 if it does not, or -1 if the
+query has another kind of condition (e.g., a search by distance or by similar
+titles) and can not be decided from the row alone.
+
+*******************************************************************************/
+int match_filter(char* query, char* row) {
+  char  values[4][FEED_VALUE_SIZE];
+  char  value[FEED_VALUE_SIZE];
+  char* p;
+  int   column;
+  int   matched;
+  int   prefix;
+  int   list;
+  int   result = 1;
+
+  if (strncmp(query, "SELECT * FROM movie_times", 25) != 0 || row_values(row, values) < 0)
+    return -1;
+  p = query + 25;
+  if (strncmp(p, " WHERE ", 7) != 0)
+    return 1;
+  p += 7;
+
+  while (1) {
+    for (column = 0; column < 4; column++)
+      if (strncmp(p, column_names[column], strlen(column_names[column])) == 0 &&
+	  p[strlen(column_names[column])] == ' ')
+	break;
+    if (column == 4)
+      return -1;
+    p += strlen(column_names[column]);
+
+    prefix = list = 0;
+    if (strncmp(p, " = ", 3) == 0)
+      p += 3;
+    else if (strncmp(p, " LIKE ", 6) == 0) {
+      p += 6;
+      prefix = 1;
+    } else if (strncmp(p, " IN (", 5) == 0) {
+      p += 5;
+      list = 1;
+    } else
+      return -1;
+
+    matched = 0;
+    do {
+      if (read_value(&p, value) < 0)
+	return -1;
+      if (prefix) {
+	if (strlen(value) == 0 || strchr(value, '%') != value + strlen(value) - 1 ||
+	    strchr(value, '_') != NULL)
+	  return -1;
+	matched |= strncasecmp(values[column], value, strlen(value) - 1) == 0;
+      } else
+	matched |= strcasecmp(values[column], value) == 0;
+    } while (list && strncmp(p, ", ", 2) == 0 && (p += 2));
+    if (list && *p++ != ')')
+      return -1;
+
+    // Every condition is checked, so an unsupported one is never missed
+    if (!matched)
+      result = 0;
+    if (strncmp(p, " AND ", 5) != 0)
+      break;
+    p += 5;
+  }
+
+  return result;
+}
+
+// True if every condition of the query can be decided by match_filter()
+int filter_supported(char* query) {
+  return match_filter(query, "Name:  Location:  Date:  Time:  \n") >= 0;
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+
+PROGRAM:  feed-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for the showtime
+          change feed.  Every time the Tier 2 server applies a change to its
+          data (see reload-tools.h) it publishes the showtimes added and
+          removed under the new data version.  A subscriber sends
+
+            SUBSCRIBE <version>
+
+          and is sent every change made after that version, then each new
+          change as it is published, over the same session:
+
+            CHANGE <version> ADD Name: ... Location: ... Date: ... Time: ...
+            CHANGE <version> REMOVE Name: ... Location: ... Date: ... Time: ...
+            VERSION <version>       all changes up to this version were sent
+            RESYNC <version>        changes were missed; start over from here
+
+          A showtime moved to another time is sent as a REMOVE and an ADD
+          under the same version.  An idle feed sends VERSION every
+          FEED_HEARTBEAT milliseconds so both ends notice a lost connection.
+          Subscribing from version 0 starts from the current version.
+
+          Published changes are kept in a ring in shared memory, the change
+          log, so the process serving each subscriber can read them; a
+          subscriber that falls more than FEED_LOG_SIZE changes behind is told
+          to RESYNC.  The Tier 1 server keeps a change log of its own, fed by
+          its subscriptions to Tier 2.
+
+******************************************************************************/
+
+#ifndef _FEEDTOOLS_H_
+#define _FEEDTOOLS_H_
+
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#define FEED_LOG_SIZE     4096
+#define FEED_ROW_SIZE     256
+#define FEED_VALUE_SIZE   64
+#define FEED_HEARTBEAT    5000    // Milliseconds between VERSION messages on an idle feed
+#define FEED_RETRY        1000    // Milliseconds before a lost subscription is retried
+
+#define CHANGE_REMOVE     0
+#define CHANGE_ADD        1
+#define CHANGE_RESYNC     2
+
+#define FEED_CHANGE       0       // parse_feed_message() results
+#define FEED_VERSION      1
+#define FEED_RESYNC       2
+
+struct change {
+  long version;
+  int  op;
+  char row[FEED_ROW_SIZE];        // Formatted as Tier 2 sends result rows
+};
+
+struct change_log {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  long            first_version;  // Version the log was created at
+  long            version;        // Latest published version
+  long            count;          // Changes ever published
+  struct change   changes[FEED_LOG_SIZE];   // Change i is at i % FEED_LOG_SIZE
+};
+
+struct change_log* create_change_log(long version);
+
+long publish_changes(struct change_log* log, struct change* changes, int count, long version);
+
+long feed_position(struct change_log* log, long since, long* version);
+
+int next_change(struct change_log* log, long* position, struct change* change, int timeout_ms);
+
+void format_change(struct change* change, char* message, size_t size);
+
+int parse_feed_message(char* message, struct change* change);
+
+void serve_subscription(struct change_log* log, SSL* ssl, long since);
+
+int row_values(char* row, char values[][FEED_VALUE_SIZE]);
+
+int match_filter(char* query, char* row);
+
+int filter_supported(char* query);
+
+#endif
@@ -0,0 +1,258 @@
+/******************************************************************************
+
+PROGRAM:  geo-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the in-memory spatial index of theater
+          locations kept by the Tier 2 server.  See geo-tools.h for an
+          overview.
+
+******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geo-tools.h"
+
+#define GRID_ROWS ((int)(180 / GEO_CELL_DEGREES))
+#define GRID_COLS ((int)(360 / GEO_CELL_DEGREES))
+#define KM_PER_DEGREE (EARTH_RADIUS_KM * M_PI / 180)
+
+struct geo_index* create_geo_index() {
+  struct geo_index* index;
+
+  index = calloc(1, sizeof(struct geo_index));
+  if (index == NULL) {
+    fprintf(stderr, "Server: Unable to allocate spatial index\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return index;
+}
+
+static int grid_row(double latitude) {
+  int row = (int)floor((latitude + 90) / GEO_CELL_DEGREES);
+
+  return row < 0 ? 0 : row >= GRID_ROWS ? GRID_ROWS - 1 : row;
+}
+
+// Longitudes wrap around, so columns do as well
+static int grid_col(double longitude) {
+  int col = (int)floor((longitude + 180) / GEO_CELL_DEGREES) % GRID_COLS;
+
+  return col < 0 ? col + GRID_COLS : col;
+}
+
+void add_theater(struct geo_index* index, char* location, double latitude, double longitude) {
+  struct theater* theater;
+
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? index->capacity * 2 : 64;
+    index->theaters = realloc(index->theaters, index->capacity * sizeof(struct theater));
+    if (index->theaters == NULL) {
+      fprintf(stderr, "Server: Unable to grow spatial index\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  theater = &index->theaters[index->count++];
+  strncpy(theater->location, location, MAX_GEO_LOCATION - 1);
+  theater->location[MAX_GEO_LOCATION - 1] = '\0';
+  theater->latitude = latitude;
+  theater->longitude = longitude;
+  theater->cell = (long)grid_row(latitude) * GRID_COLS + grid_col(longitude);
+}
+
+static int compare_cells(const void* a, const void* b) {
+  long cell_a = ((struct theater*)a)->cell;
+  long cell_b = ((struct theater*)b)->cell;
+
+  return cell_a < cell_b ? -1 : cell_a > cell_b;
+}
+
+void build_geo_index(struct geo_index* index) {
+  qsort(index->theaters, index->count, sizeof(struct theater), compare_cells);
+  fprintf(stdout, "Server: Indexed %d theater locations\n", index->count);
+}
+
+void free_geo_index(struct geo_index* index) {
+  free(index->theaters);
+  free(index);
+}
+
+/******************************************************************************
+
+Returns the great circle distance between two points in kilometers, using the
+haversine formula.
+
+*******************************************************************************/
+double distance_km(double latitude1, double longitude1, double latitude2, double longitude2) {
+  double dlat = (latitude2 - latitude1) * M_PI / 180;
+  double dlon = (longitude2 - longitude1) * M_PI / 180;
+  double a;
+
+  a = sin(dlat / 2) * sin(dlat / 2) + cos(latitude1 * M_PI / 180) *
+    cos(latitude2 * M_PI / 180) * sin(dlon / 2) * sin(dlon / 2);
+
+  return 2 * EARTH_RADIUS_KM * atan2(sqrt(a), sqrt(1 - a));
+}
+
+/******************************************************************************
+
+A search keeps its best matches in increasing order of distance.  'limit' is the
+largest number of matches to keep, and 'radius' the largest distance accepted.
+'found' counts every theater within the radius, kept or not.
+
+*******************************************************************************/
+struct geo_search {
+  double latitude;
+  double longitude;
+  double radius;
+  int    limit;
+  int    count;
+  int    found;
+  int    visited;
+  int*   matches;
+  double distances[MAX_GEO_MATCHES];
+};
+
+// Offers every theater of one grid cell to the search
+static void search_cell(struct geo_index* index, struct geo_search* search, int row, int col) {
+  long   cell = (long)row * GRID_COLS + col;
+  int    low = 0;
+  int    high = index->count;
+  int    middle;
+  int    i;
+  int    j;
+  double distance;
+
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (index->theaters[middle].cell < cell)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (i = low; i < index->count && index->theaters[i].cell == cell; i++) {
+    search->visited++;
+    distance = distance_km(search->latitude, search->longitude,
+			   index->theaters[i].latitude, index->theaters[i].longitude);
+    if (distance > search->radius)
+      continue;
+    search->found++;
+    for (j = search->count; j > 0 && search->distances[j - 1] > distance; j--)
+      if (j < search->limit) {
+	search->matches[j] = search->matches[j - 1];
+	search->distances[j] = search->distances[j - 1];
+      }
+    if (j < search->limit) {
+      search->matches[j] = i;
+      search->distances[j] = distance;
+      if (search->count < search->limit)
+	search->count++;
+    }
+  }
+}
+
+static void start_search(struct geo_search* search, double latitude, double longitude,
+			 double radius, int limit, int* matches) {
+  memset(search, 0, sizeof(struct geo_search));
+  search->latitude = latitude;
+  search->longitude = longitude;
+  search->radius = radius;
+  search->limit = limit > MAX_GEO_MATCHES ? MAX_GEO_MATCHES : limit;
+  search->matches = matches;
+}
+
+/******************************************************************************
+
+Stores in 'matches' up to 'max' theaters at most 'km' kilometers away, nearest
+first, and returns how many theaters are that close, which is more than 'max'
+if the farthest were left out.  Only the grid cells overlapping the circle's
+bounding box are searched.
+
+*******************************************************************************/
+int theaters_within(struct geo_index* index, double latitude, double longitude, double km,
+		    int max, int* matches) {
+  struct geo_search search;
+  double            dlat = km / KM_PER_DEGREE;
+  double            dlon;
+  double            widest;
+  int               row;
+  int               col;
+  int               cols;
+  int               first_col;
+
+  start_search(&search, latitude, longitude, km, max, matches);
+
+  // The box is widest, in degrees of longitude, at the latitude nearest a pole
+  widest = fabs(latitude) + dlat;
+  dlon = widest >= 89.9 ? 180 : dlat / cos(widest * M_PI / 180);
+  cols = dlon >= 180 ? GRID_COLS : (int)(2 * dlon / GEO_CELL_DEGREES) + 2;
+  if (cols > GRID_COLS)
+    cols = GRID_COLS;
+  first_col = grid_col(longitude - (cols == GRID_COLS ? 180 : dlon));
+
+  for (row = grid_row(latitude - dlat); row <= grid_row(latitude + dlat); row++)
+    for (col = 0; col < cols; col++)
+      search_cell(index, &search, row, (first_col + col) % GRID_COLS);
+
+  return search.found;
+}
+
+/******************************************************************************
+
+Stores in 'matches' the 'k' theaters nearest to the given point, nearest first,
+and returns how many were found.  Rings of cells at growing distance from the
+point's cell are searched until k theaters were found and every theater beyond
+the last ring is known to be farther away than the k-th, or until every
+theater has been seen.
+
+*******************************************************************************/
+int nearest_theaters(struct geo_index* index, double latitude, double longitude, int k,
+		     int* matches) {
+  struct geo_search search;
+  double            bound;
+  double            widest;
+  int               center_row = grid_row(latitude);
+  int               center_col = grid_col(longitude);
+  int               ring;
+  int               row;
+  int               col;
+  int               step;
+
+  start_search(&search, latitude, longitude, HUGE_VAL, k, matches);
+  if (search.limit <= 0)
+    return 0;
+
+  for (ring = 0; ring <= GRID_COLS / 2 && search.visited < index->count; ring++) {
+    for (row = center_row - ring; row <= center_row + ring; row++) {
+      if (row < 0 || row >= GRID_ROWS)
+	continue;
+      // Rows on the edge of the ring are searched fully, the others only at
+      // their two ends
+      step = (row == center_row - ring || row == center_row + ring) ? 1 : 2 * ring;
+      for (col = center_col - ring; col <= center_col + ring; col += step) {
+	// The widest ring meets itself on the far side of the globe
+	if (2 * ring == GRID_COLS && col == center_col + ring)
+	  break;
+	search_cell(index, &search, row, ((col % GRID_COLS) + GRID_COLS) % GRID_COLS);
+      }
+    }
+
+    // Anything outside this ring is at least 'ring' whole cells away, either
+    // north/south or east/west, where cells narrow with latitude
+    if (search.count == search.limit) {
+      widest = fabs(latitude) + (ring + 1) * GEO_CELL_DEGREES;
+      bound = ring * GEO_CELL_DEGREES * KM_PER_DEGREE *
+	(widest >= 90 ? 0 : cos(widest * M_PI / 180));
+      if (bound >= search.distances[search.count - 1])
+	break;
+    }
+  }
+
+  return search.count;
+}
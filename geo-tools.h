@@ -0,0 +1,56 @@
+/******************************************************************************
+
+PROGRAM:  geo-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for the in-memory
+          spatial index of theater locations kept by the Tier 2 server.  The
+          globe is divided into a grid of GEO_CELL_DEGREES by GEO_CELL_DEGREES
+          cells, and the theaters are kept sorted by the cell they fall in, so
+          all the theaters of a cell are found with one binary search.
+
+          Radius queries only visit the cells overlapping the circle's
+          bounding box.  Nearest neighbor queries visit rings of cells around
+          the starting point, moving outwards until no unvisited cell can hold
+          a theater closer than the k-th best one found so far.
+
+******************************************************************************/
+
+#ifndef _GEOTOOLS_H_
+#define _GEOTOOLS_H_
+
+#define GEO_CELL_DEGREES    0.5      // About 55 km north to south
+#define MAX_GEO_LOCATION    64
+#define MAX_GEO_MATCHES     64
+#define EARTH_RADIUS_KM     6371.0
+
+struct theater {
+  char   location[MAX_GEO_LOCATION];  // As stored in movie_times, "city,state"
+  double latitude;
+  double longitude;
+  long   cell;
+};
+
+struct geo_index {
+  int             count;
+  int             capacity;
+  struct theater* theaters;           // Sorted by 'cell' once built
+};
+
+struct geo_index* create_geo_index();
+
+void add_theater(struct geo_index* index, char* location, double latitude, double longitude);
+
+void build_geo_index(struct geo_index* index);
+
+void free_geo_index(struct geo_index* index);
+
+double distance_km(double latitude1, double longitude1, double latitude2, double longitude2);
+
+int theaters_within(struct geo_index* index, double latitude, double longitude, double km,
+		    int max, int* matches);
+
+int nearest_theaters(struct geo_index* index, double latitude, double longitude, int k,
+		     int* matches);
+
+#endif
@@ -0,0 +1,207 @@
+/******************************************************************************
+
+PROGRAM:  ingest-tool.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program writes showtimes to a Tier 2 server (see
+          ingest-tools.h).  The showtimes are read from a file, or the
+          standard input, one per line with the name, location, date and time
+          separated by tabs:
+
+          ingest-tool -k <key file> [-b <showtimes per batch>] <server>[:<port>] [<file>]
+
+          A server on the same host may also be given as unix:<path>, the
+          Unix domain socket it was started with (see local-tools.h).  Up to INGEST_PIPELINE batches are sent before waiting for the first
+          one to be acknowledged, so the server is never left idle waiting for
+          the next batch.  When done, the tool reports how many showtimes were
+          acknowledged and how fast.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <openssl/ssl.h>
+
+#include "client-tools.h"
+#include "ingest-tools.h"
+#include "local-tools.h"
+
+#define DEFAULT_BATCH     500
+#define INGEST_PIPELINE   4      // Batches sent but not acknowledged yet
+
+struct ingest_session {
+  SSL*  ssl;
+  long  first_lines[INGEST_PIPELINE];   // Input line each batch started at
+  long  sent;
+  long  answered;
+  long  acknowledged;
+  int   rejected;
+  int   failed;
+};
+
+/******************************************************************************
+
+Reads the answer to the oldest batch not answered yet.  Returns 0, or -1 if
+the connection was lost.
+
+*******************************************************************************/
+int read_answer(struct ingest_session* session) {
+  char answer[64];
+  int  nbytes;
+
+  nbytes = SSL_read(session->ssl, answer, sizeof(answer) - 1);
+  if (nbytes <= 0) {
+    fprintf(stderr, "Ingest: Lost the connection to the server\n");
+    return -1;
+  }
+  answer[nbytes] = '\0';
+
+  if (strncmp(answer, "ACK ", 4) == 0)
+    session->acknowledged += atol(answer + 4);
+  else if (strncmp(answer, "REJECTED ", 9) == 0) {
+    fprintf(stderr, "Ingest: Batch rejected, input line %ld is malformed\n",
+	    session->first_lines[session->answered % INGEST_PIPELINE] + atol(answer + 9) - 1);
+    session->rejected++;
+  } else {
+    fprintf(stderr, "Ingest: Batch starting at input line %ld was not committed\n",
+	    session->first_lines[session->answered % INGEST_PIPELINE]);
+    session->failed++;
+  }
+  session->answered++;
+
+  return 0;
+}
+
+int send_batch(struct ingest_session* session, char* batch, size_t len, long first_line) {
+  if (session->sent - session->answered == INGEST_PIPELINE && read_answer(session) < 0)
+    return -1;
+  session->first_lines[session->sent % INGEST_PIPELINE] = first_line;
+  if (SSL_write(session->ssl, batch, len + 1) <= 0) {
+    fprintf(stderr, "Ingest: Lost the connection to the server\n");
+    return -1;
+  }
+  session->sent++;
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  struct ingest_session session;
+  struct timespec       start;
+  struct timespec       end;
+  char                  key[INGEST_KEY_SIZE];
+  char                  remote_host[MAX_HOSTNAME_LENGTH];
+  char                  batch[INGEST_MESSAGE_SIZE];
+  char                  line[INGEST_MESSAGE_SIZE];
+  char                  answer[64];
+  char*                 key_file = NULL;
+  char*                 colon;
+  unsigned int          port = DEFAULT_PORT;
+  FILE*                 input = stdin;
+  double                seconds;
+  size_t                len = 0;
+  size_t                line_len;
+  long                  line_number = 0;
+  long                  first_line = 1;
+  int                   batch_rows = DEFAULT_BATCH;
+  int                   rows = 0;
+  int                   sockfd;
+  int                   opt;
+
+  while ((opt = getopt(argc, argv, "b:k:")) != -1) {
+    switch (opt) {
+    case 'b':
+      batch_rows = atoi(optarg);
+      break;
+    case 'k':
+      key_file = optarg;
+      break;
+    default:
+      key_file = NULL;
+      optind = argc + 1;
+      break;
+    }
+  }
+
+  if (key_file == NULL || batch_rows <= 0 || batch_rows > INGEST_BATCH_ROWS ||
+      argc - optind < 1 || argc - optind > 2) {
+    fprintf(stderr, "Usage: ingest-tool -k <key file> [-b <showtimes per batch>] <server>[:<port>] [<file>]\n");
+    return EXIT_FAILURE;
+  }
+  if (read_ingest_key(key_file, key, sizeof(key)) < 0)
+    return EXIT_FAILURE;
+  if (argc - optind == 2 && (input = fopen(argv[optind + 1], "r")) == NULL) {
+    perror(argv[optind + 1]);
+    return EXIT_FAILURE;
+  }
+
+  strncpy(remote_host, argv[optind], MAX_HOSTNAME_LENGTH - 1);
+  remote_host[MAX_HOSTNAME_LENGTH - 1] = '\0';
+  if (!is_unix_endpoint(remote_host) && (colon = strchr(remote_host, ':')) != NULL) {
+    *colon = '\0';
+    port = atoi(colon + 1);
+  }
+
+  memset(&session, 0, sizeof(session));
+  sockfd = create_client_socket(remote_host, port);
+  session.ssl = create_client_ssl_socket(sockfd);
+  if (SSL_connect(session.ssl) != 1) {
+    fprintf(stderr, "Ingest: Could not establish SSL session to '%s' on port %u\n", remote_host, port);
+    return EXIT_FAILURE;
+  }
+
+  snprintf(batch, sizeof(batch), "%s%s", INGEST_PREFIX, key);
+  SSL_write(session.ssl, batch, strlen(batch)+1);
+  bzero(answer, sizeof(answer));
+  if (SSL_read(session.ssl, answer, sizeof(answer) - 1) <= 0 || strcmp(answer, "READY") != 0) {
+    fprintf(stderr, "Ingest: The server refused to ingest (%s)\n", answer[0] ? answer : "no answer");
+    return EXIT_FAILURE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (fgets(line, sizeof(line), input) != NULL) {
+    line_number++;
+    line_len = strlen(line);
+    if (line_len > 0 && line[line_len - 1] != '\n' && !feof(input)) {
+      fprintf(stderr, "Ingest: Input line %ld is too long\n", line_number);
+      return EXIT_FAILURE;
+    }
+
+    // A batch ends when it has enough showtimes or the line would not fit
+    if (rows == batch_rows || len + line_len + 2 > sizeof(batch)) {
+      if (send_batch(&session, batch, len, first_line) < 0)
+	return EXIT_FAILURE;
+      len = 0;
+      rows = 0;
+      first_line = line_number;
+    }
+    memcpy(batch + len, line, line_len);
+    len += line_len;
+    if (line[line_len - 1] != '\n')
+      batch[len++] = '\n';
+    batch[len] = '\0';
+    rows++;
+  }
+  if (rows > 0 && send_batch(&session, batch, len, first_line) < 0)
+    return EXIT_FAILURE;
+  while (session.answered < session.sent)
+    if (read_answer(&session) < 0)
+      return EXIT_FAILURE;
+  SSL_write(session.ssl, "END", 4);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Ingest: %ld showtimes acknowledged in %ld batches, %.2f s (%.0f showtimes/s); "
+	 "%d batches rejected, %d failed\n", session.acknowledged, session.sent, seconds,
+	 seconds > 0 ? session.acknowledged / seconds : 0, session.rejected, session.failed);
+
+  SSL_free(session.ssl);
+  close(sockfd);
+  if (input != stdin)
+    fclose(input);
+
+  return session.rejected || session.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
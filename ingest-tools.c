@@ -0,0 +1,349 @@
+/******************************************************************************
+
+PROGRAM:  ingest-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the ingest queue shared by the Tier 2 server
+          and the children serving writers.  See ingest-tools.h for an
+          overview.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+
+#include "ingest-tools.h"
+#include "server-tools.h"
+#include "local-tools.h"
+
+static void lock_queue(struct ingest_queue* queue) {
+  if (pthread_mutex_lock(&queue->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&queue->lock);
+}
+
+static double elapsed_ms(struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/******************************************************************************
+
+Creates the queue in anonymous shared memory before the server forks, with a
+process-shared, robust mutex as for the flight table (see coalesce-tools.c).
+Both ends of the wakeup pipe are non-blocking: a child never waits for the
+parent to read, and one byte pending is as good as many.
+
+*******************************************************************************/
+struct ingest_queue* create_ingest_queue() {
+  struct ingest_queue* queue;
+  pthread_mutexattr_t  mutex_attr;
+  pthread_condattr_t   cond_attr;
+
+  queue = mmap(NULL, sizeof(struct ingest_queue), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (queue == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map ingest queue: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(queue, 0, sizeof(struct ingest_queue));
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&queue->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queue->changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (pipe(queue->wakeup) < 0) {
+    fprintf(stderr, "Server: Unable to create ingest pipe: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fcntl(queue->wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl(queue->wakeup[1], F_SETFL, O_NONBLOCK);
+
+  queue->group = 1;
+  clock_gettime(CLOCK_MONOTONIC, &queue->started);
+
+  return queue;
+}
+
+/******************************************************************************
+
+Reads the ingest key from the first line of 'file'.  Returns 0, or -1 if the
+file can not be read or the key is empty.
+
+*******************************************************************************/
+int read_ingest_key(char* file, char* key, size_t size) {
+  FILE* fptr;
+
+  if ((fptr = fopen(file, "r")) == NULL) {
+    fprintf(stderr, "Server: Unable to read ingest key '%s': %s\n", file, strerror(errno));
+    return -1;
+  }
+  if (fgets(key, size, fptr) == NULL)
+    key[0] = '\0';
+  fclose(fptr);
+
+  key[strcspn(key, "\r\n")] = '\0';
+  if (key[0] == '\0') {
+    fprintf(stderr, "Server: Ingest key '%s' is empty\n", file);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Compares in constant time, so the key can not be guessed a byte at a time
+int check_ingest_key(char* expected, char* given) {
+  size_t len = strlen(expected);
+
+  return strlen(given) == len && CRYPTO_memcmp(expected, given, len) == 0;
+}
+
+/******************************************************************************
+
+Splits a batch into showtimes, one per line with the four values separated by
+tabs.  Blank lines are skipped.  Returns the number of showtimes, or -1 if a
+line is malformed, i.e., does not have exactly four values, has an empty or
+overlong value or a control character, or there are more than 'max' of them;
+'line' is then set to the line at fault, counting from 1.
+
+*******************************************************************************/
+int parse_showtimes(char* message, struct showtime* showtimes, int max, int* line) {
+  char*  p = message;
+  char*  q;
+  char*  end;
+  char*  stop;
+  char*  value;
+  size_t len;
+  int    count = 0;
+  int    column;
+
+  for (*line = 1; *p != '\0'; (*line)++, p = *end ? end + 1 : end) {
+    end = p + strcspn(p, "\n");
+    stop = end > p && end[-1] == '\r' ? end - 1 : end;
+    if (stop == p)
+      continue;
+    if (count == max)
+      return -1;
+
+    q = p;
+    for (column = 0; column < SNAPSHOT_COLUMNS; column++) {
+      for (value = q; q < stop && *q != '\t'; q++)
+	if ((unsigned char)*q < ' ')
+	  return -1;
+      len = q - value;
+      if (len == 0 || len >= INGEST_VALUE_SIZE)
+	return -1;
+      memcpy(showtimes[count].values[column], value, len);
+      showtimes[count].values[column][len] = '\0';
+      if (column < SNAPSHOT_COLUMNS - 1 && q++ == stop)
+	return -1;
+    }
+    if (q != stop)
+      return -1;
+
+    count++;
+  }
+
+  return count;
+}
+
+/******************************************************************************
+
+Adds a batch to the queue, waiting for the parent to empty it if it is full,
+and wakes the parent.  Returns the commit group the batch belongs to, or -1 if
+the parent took more than REQUEST_TIMEOUT milliseconds to make room.
+
+*******************************************************************************/
+long queue_showtimes(struct ingest_queue* queue, struct showtime* showtimes, int count) {
+  struct timespec deadline;
+  long            group;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += REQUEST_TIMEOUT / 1000;
+
+  lock_queue(queue);
+  while (queue->count + count > INGEST_QUEUE_SIZE)
+    if (pthread_cond_timedwait(&queue->changed, &queue->lock, &deadline) == ETIMEDOUT) {
+      pthread_mutex_unlock(&queue->lock);
+      return -1;
+    }
+  memcpy(&queue->showtimes[queue->count], showtimes, count * sizeof(struct showtime));
+  queue->count += count;
+  queue->batches++;
+  queue->received += count;
+  group = queue->group;
+  pthread_mutex_unlock(&queue->lock);
+
+  if (write(queue->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+    fprintf(stderr, "Server: Unable to wake the ingest committer: %s\n", strerror(errno));
+
+  return group;
+}
+
+/******************************************************************************
+
+Waits for the commit of 'group'.  Returns 0 once it is committed, or -1 if it
+failed or did not finish within REQUEST_TIMEOUT milliseconds.
+
+*******************************************************************************/
+int wait_for_group(struct ingest_queue* queue, long group) {
+  struct timespec deadline;
+  int             result;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += REQUEST_TIMEOUT / 1000;
+
+  lock_queue(queue);
+  while (queue->committed < group)
+    if (pthread_cond_timedwait(&queue->changed, &queue->lock, &deadline) == ETIMEDOUT) {
+      pthread_mutex_unlock(&queue->lock);
+      return -1;
+    }
+  result = queue->failed[group % INGEST_GROUPS] ? -1 : 0;
+  pthread_mutex_unlock(&queue->lock);
+
+  return result;
+}
+
+// Empties the wakeup pipe and returns the number of showtimes queued
+int ingest_pending(struct ingest_queue* queue) {
+  char buffer[256];
+  int  count;
+
+  while (read(queue->wakeup[0], buffer, sizeof(buffer)) > 0)
+    ;
+
+  lock_queue(queue);
+  count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+
+  return count;
+}
+
+/******************************************************************************
+
+Run by the parent to start a commit: copies every queued showtime into
+'showtimes', which must hold INGEST_QUEUE_SIZE of them, and closes the group
+they belong to.  Batches queued from then on join the next group, so writers
+are never held up by the commit in progress.  Returns the number of showtimes.
+
+*******************************************************************************/
+int take_showtimes(struct ingest_queue* queue, struct showtime* showtimes, long* group) {
+  int count;
+
+  lock_queue(queue);
+  count = queue->count;
+  memcpy(showtimes, queue->showtimes, count * sizeof(struct showtime));
+  queue->count = 0;
+  *group = queue->group++;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+
+  return count;
+}
+
+// Records the outcome of a commit and wakes the writers waiting for it
+void finish_group(struct ingest_queue* queue, long group, int failed, int inserted,
+		  int duplicates, double elapsed_ms) {
+  lock_queue(queue);
+  queue->failed[group % INGEST_GROUPS] = failed;
+  queue->committed = group;
+  queue->commits++;
+  if (failed)
+    queue->failures++;
+  else {
+    queue->inserted += inserted;
+    queue->duplicates += duplicates;
+  }
+  queue->commit_ms += elapsed_ms;
+  if (elapsed_ms > queue->max_commit_ms)
+    queue->max_commit_ms = elapsed_ms;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void record_ack(struct ingest_queue* queue, double elapsed_ms, int rejected) {
+  lock_queue(queue);
+  queue->acks++;
+  queue->ack_ms += elapsed_ms;
+  if (elapsed_ms > queue->max_ack_ms)
+    queue->max_ack_ms = elapsed_ms;
+  if (rejected)
+    queue->rejected++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/******************************************************************************
+
+Runs in the child serving a writer once its key was accepted: answers each
+batch as the durability requires, until the writer sends END or goes away.
+
+*******************************************************************************/
+void serve_ingest(struct ingest_queue* queue, SSL* ssl, int durability) {
+  static struct showtime showtimes[INGEST_BATCH_ROWS];
+  struct timespec        start;
+  char                   message[INGEST_MESSAGE_SIZE + 1];
+  char                   reply[64];
+  long                   group;
+  int                    nbytes;
+  int                    count;
+  int                    line;
+
+  peer_write(ssl, "READY", 6);
+
+  while ((nbytes = peer_read(ssl, message, sizeof(message) - 1)) > 0) {
+    message[nbytes] = '\0';
+    if (strcmp(message, "END") == 0)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    count = parse_showtimes(message, showtimes, INGEST_BATCH_ROWS, &line);
+    if (count < 0)
+      snprintf(reply, sizeof(reply), "REJECTED %d", line);
+    else if (count > 0 &&
+	     ((group = queue_showtimes(queue, showtimes, count)) < 0 ||
+	      (durability == DURABLE_COMMIT && wait_for_group(queue, group) < 0)))
+      strcpy(reply, "FAILED");
+    else
+      snprintf(reply, sizeof(reply), "ACK %d", count);
+
+    record_ack(queue, elapsed_ms(&start), count < 0);
+    if (peer_write(ssl, reply, strlen(reply)+1) <= 0)
+      break;
+  }
+}
+
+void print_ingest_stats(struct ingest_queue* queue, FILE* out) {
+  double seconds;
+
+  lock_queue(queue);
+  seconds = elapsed_ms(&queue->started) / 1000;
+  fprintf(out, "Server: Ingest batches=%ld showtimes=%ld inserted=%ld duplicates=%ld "
+	  "rejected=%ld queued=%d rate=%.1f/s\n",
+	  queue->batches, queue->received, queue->inserted, queue->duplicates,
+	  queue->rejected, queue->count, seconds > 0 ? queue->received / seconds : 0);
+  fprintf(out, "Server: Ingest commits=%ld failed=%ld showtimes/commit=%.1f "
+	  "commit=%.2fms avg %.2fms max ack=%.2fms avg %.2fms max\n",
+	  queue->commits, queue->failures,
+	  queue->commits ? (double)(queue->inserted + queue->duplicates) / queue->commits : 0,
+	  queue->commits ? queue->commit_ms / queue->commits : 0, queue->max_commit_ms,
+	  queue->acks ? queue->ack_ms / queue->acks : 0, queue->max_ack_ms);
+  pthread_mutex_unlock(&queue->lock);
+  fflush(out);
+}
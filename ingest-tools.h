@@ -0,0 +1,105 @@
+/******************************************************************************
+
+PROGRAM:  ingest-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for writing showtimes
+          to the Tier 2 server.  A writer authenticates with the shared ingest
+          key, then sends batches of showtimes over the same session:
+
+            INGEST <key>            answered READY, DENIED or UNSUPPORTED
+            <name>\t<location>\t<date>\t<time>\n...
+                                    one batch, answered ACK <count>,
+                                    REJECTED <line> or FAILED
+            END
+
+          Each showtime is an upsert: one already in movie_times is left as
+          it is, as the unique index on all four columns requires.  A batch
+          is applied entirely or not at all, and must fit in one TLS record.
+
+          The children serving writers do not write to MySQL themselves.
+          They add their batches to a queue in shared memory and wake the
+          parent, which waits up to a commit window for more to arrive and
+          then inserts everything queued in a single transaction (group
+          commit), so concurrent writers share one commit, and its flush to
+          disk, instead of paying for one each.  Depending on the durability
+          chosen, a batch is acknowledged once its group is committed, or as
+          soon as it is queued, which is faster but loses the batch if the
+          server or MySQL fails before the commit.
+
+******************************************************************************/
+
+#ifndef _INGESTTOOLS_H_
+#define _INGESTTOOLS_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#include "snapshot-tools.h"
+
+#define INGEST_PREFIX        "INGEST "
+#define INGEST_MESSAGE_SIZE  16384   // Largest batch, the most a TLS record holds
+#define INGEST_BATCH_ROWS    2048    // Most showtimes a batch can hold
+#define INGEST_QUEUE_SIZE    8192    // Showtimes waiting for the next commit
+#define INGEST_VALUE_SIZE    31      // The columns are VARCHAR(30)
+#define INGEST_KEY_SIZE      256
+#define INGEST_WINDOW        10      // Default milliseconds a commit waits for more batches
+#define INGEST_GROUPS        1024    // Outcomes of recent commits kept for their writers
+
+#define DURABLE_COMMIT       0       // Acknowledge batches once committed
+#define DURABLE_QUEUE        1       // Acknowledge batches once queued
+
+struct showtime {
+  char values[SNAPSHOT_COLUMNS][INGEST_VALUE_SIZE];   // In COLUMN_* order
+};
+
+struct ingest_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  int             wakeup[2];        // Pipe the children wake the parent with
+  long            group;            // Commit group being filled
+  long            committed;        // Last group whose commit finished
+  char            failed[INGEST_GROUPS];      // Outcome of group g at g % INGEST_GROUPS
+  struct timespec started;
+  long            batches;
+  long            received;
+  long            inserted;
+  long            duplicates;
+  long            rejected;
+  long            commits;
+  long            failures;
+  double          commit_ms;        // Total and worst time spent committing
+  double          max_commit_ms;
+  long            acks;
+  double          ack_ms;           // Total and worst time from batch to answer
+  double          max_ack_ms;
+  int             count;
+  struct showtime showtimes[INGEST_QUEUE_SIZE];
+};
+
+struct ingest_queue* create_ingest_queue();
+
+int read_ingest_key(char* file, char* key, size_t size);
+
+int check_ingest_key(char* expected, char* given);
+
+int parse_showtimes(char* message, struct showtime* showtimes, int max, int* line);
+
+long queue_showtimes(struct ingest_queue* queue, struct showtime* showtimes, int count);
+
+int wait_for_group(struct ingest_queue* queue, long group);
+
+int ingest_pending(struct ingest_queue* queue);
+
+int take_showtimes(struct ingest_queue* queue, struct showtime* showtimes, long* group);
+
+void finish_group(struct ingest_queue* queue, long group, int failed, int inserted,
+		  int duplicates, double elapsed_ms);
+
+void serve_ingest(struct ingest_queue* queue, SSL* ssl, int durability);
+
+void print_ingest_stats(struct ingest_queue* queue, FILE* out);
+
+#endif
@@ -0,0 +1,257 @@
+/******************************************************************************
+
+PROGRAM:  local-bench.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program measures what a request from a Tier 1 server to a
+          Tier 2 server on the same host costs over each transport (see
+          local-tools.h), for the showtimes of a snapshot (see
+          snapshot-tool.c):
+
+          local-bench [-n <requests>] [-q <query>] <snapshot>
+
+          For each of TCP over the loopback interface with TLS, a Unix domain
+          socket with TLS and a Unix domain socket without TLS, a child
+          process serves the requests the way the Tier 2 server does, one
+          connection and TLS handshake (if any) per request, sending compact
+          result batches.  The parent connects and reads the results the way
+          the Tier 1 server does.  The mean latency of a request and the
+          processor time each side spent on it are printed for each.  The
+          server needs cert.pem and key.pem, so run it where the servers run.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+#include "client-tools.h"
+#include "server-tools.h"
+#include "local-tools.h"
+#include "result-tools.h"
+#include "snapshot-tools.h"
+
+#define DEFAULT_REQUESTS 200
+#define DEFAULT_QUERY    "SELECT * FROM movie_times WHERE date = 'Oct 12' AND time = '1:00 pm' ORDER BY name, location, date, time"
+#define ROW_SIZE         2048
+#define NAME_SIZE        108
+
+#define TRANSPORT_TCP    0
+#define TRANSPORT_UNIX   1
+
+struct bench_transport {
+  char* name;
+  int   kind;
+  int   plain;
+};
+
+struct bench_transport transports[] = {
+  { "tcp loopback, TLS", TRANSPORT_TCP,  0 },
+  { "unix socket, TLS",  TRANSPORT_UNIX, 0 },
+  { "unix socket, none", TRANSPORT_UNIX, 1 },
+};
+
+double cpu_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+double wall_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+void send_row(void* context, char** values) {
+  send_result_row((struct result_encoder*)context, values);
+}
+
+// Answers 'requests' requests on 'listener', then reports the processor time
+// spent through 'report', as the child end of a run
+void serve_requests(struct snapshot* snapshot, struct bench_transport* transport, int listener,
+		    int requests, int report) {
+  struct result_encoder* encoder = malloc(sizeof(struct result_encoder));
+  char                   query[ROW_SIZE];
+  double                 start = cpu_ms();
+  double                 spent;
+  SSL*                   ssl;
+  int                    client;
+  int                    i;
+
+  for (i = 0; i < requests; i++) {
+    if ((client = accept(listener, NULL, NULL)) < 0 ||
+	(transport->kind == TRANSPORT_UNIX && check_peer(client) < 0)) {
+      fprintf(stderr, "Bench: Unable to accept a connection: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    ssl = transport->plain ? create_plain_socket(client) : create_ssl_socket(client);
+    if (encoder == NULL || peer_accept(ssl) <= 0) {
+      fprintf(stderr, "Bench: Could not accept the SSL session\n");
+      exit(EXIT_FAILURE);
+    }
+
+    bzero(query, sizeof(query));
+    peer_read(ssl, query, sizeof(query) - 1);
+    start_results(encoder, ssl, ENCODING_COMPACT);
+    query_snapshot(snapshot, query, send_row, encoder);
+    send_result_text(encoder, "DONE");
+    finish_results(encoder);
+
+    SSL_free(ssl);
+    close(client);
+  }
+
+  spent = cpu_ms() - start;
+  write(report, &spent, sizeof(spent));
+  exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+
+Sends 'requests' requests over one transport and prints the mean latency and
+processor time of the client and server per request.  Returns -1 if a request
+failed.
+
+*******************************************************************************/
+int run_transport(struct snapshot* snapshot, char* query, struct bench_transport* transport,
+		  int requests) {
+  static struct result_decoder decoder;
+  struct sockaddr_in addr;
+  socklen_t          len = sizeof(addr);
+  char               name[NAME_SIZE];
+  char               row[ROW_SIZE];
+  double             server_ms = 0;
+  double             client_ms;
+  double             latency_ms;
+  double             start;
+  long               rows = 0;
+  SSL*               ssl;
+  int                listener;
+  int                sockfd;
+  int                report[2];
+  int                nbytes;
+  int                i;
+  pid_t              pid;
+
+  // Port 0 lets the system pick a free port, read back with getsockname()
+  if (transport->kind == TRANSPORT_UNIX) {
+    snprintf(name, sizeof(name), "%s/tmp/local-bench-%d.sock", UNIX_PREFIX, (int)getpid());
+    listener = create_unix_socket(name);
+  } else {
+    listener = create_socket(0);
+    getsockname(listener, (struct sockaddr*)&addr, &len);
+    snprintf(name, sizeof(name), "localhost");
+  }
+
+  if (pipe(report) < 0) {
+    fprintf(stderr, "Bench: Unable to create a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  fflush(stdout);
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Bench: Unable to fork: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pid == 0) {
+    close(report[0]);
+    serve_requests(snapshot, transport, listener, requests, report[1]);
+  }
+  close(report[1]);
+  close(listener);
+
+  start = wall_ms();
+  client_ms = cpu_ms();
+  for (i = 0; i < requests; i++) {
+    if ((sockfd = try_client_socket(name, ntohs(addr.sin_port), 0)) < 0)
+      return -1;
+    ssl = transport->plain ? create_plain_socket(sockfd) : create_client_ssl_socket(sockfd);
+    if (peer_connect(ssl) != 1 || peer_write(ssl, query, strlen(query)+1) <= 0) {
+      fprintf(stderr, "Bench: Could not send the request over %s\n", transport->name);
+      return -1;
+    }
+
+    rows = 0;
+    start_result_decoder(&decoder);
+    while ((nbytes = read_result(&decoder, ssl, row, sizeof(row))) > 0 && strcmp(row, "DONE") != 0)
+      rows++;
+    finish_result_decoder(&decoder);
+    if (nbytes <= 0) {
+      fprintf(stderr, "Bench: The result was not received over %s\n", transport->name);
+      return -1;
+    }
+
+    SSL_free(ssl);
+    close(sockfd);
+  }
+  latency_ms = wall_ms() - start;
+  client_ms = cpu_ms() - client_ms;
+
+  if (read(report[0], &server_ms, sizeof(server_ms)) != sizeof(server_ms)) {
+    fprintf(stderr, "Bench: The server over %s failed\n", transport->name);
+    return -1;
+  }
+  close(report[0]);
+  waitpid(pid, NULL, 0);
+  if (transport->kind == TRANSPORT_UNIX)
+    unlink(name + strlen(UNIX_PREFIX));
+
+  printf("%-18s %6ld %12.3f %12.3f %12.3f\n", transport->name, rows, latency_ms / requests,
+	 client_ms / requests, server_ms / requests);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  struct snapshot* snapshot;
+  char*            query = DEFAULT_QUERY;
+  int              requests = DEFAULT_REQUESTS;
+  int              opt;
+  int              i;
+
+  while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+    switch (opt) {
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 1 || requests <= 0) {
+    fprintf(stderr, "Usage: local-bench [-n <requests>] [-q <query>] <snapshot>\n");
+    return EXIT_FAILURE;
+  }
+  if ((snapshot = open_snapshot(argv[optind])) == NULL)
+    return EXIT_FAILURE;
+
+  signal(SIGPIPE, SIG_IGN);
+  init_openssl();
+
+  printf("%-18s %6s %12s %12s %12s\n", "transport", "rows", "latency ms", "client ms",
+	 "server ms");
+  for (i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+    if (run_transport(snapshot, query, &transports[i], requests) < 0)
+      return EXIT_FAILURE;
+
+  close_snapshot(snapshot);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,328 @@
+/******************************************************************************
+
+PROGRAM:  local-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements Unix domain socket connections between servers
+          on the same host, and sessions on them without TLS.  See
+          local-tools.h for an overview.
+
+******************************************************************************/
+
+#define _GNU_SOURCE               // For struct ucred
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+#include "local-tools.h"
+#include "tls-tools.h"
+
+// What is kept with the SSL object of a plain session
+struct plain_session {
+  uint32_t remaining;             // Bytes of the current message not read yet
+};
+
+static SSL_CTX* plain_ctx = NULL;
+static int      plain_index = -1;
+
+int is_unix_endpoint(char* name) {
+  return strncmp(name, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0;
+}
+
+// Fills in the address of the socket named "unix:<path>" or just "<path>", or
+// returns -1 if the path is too long for one
+static int unix_address(char* name, struct sockaddr_un* addr) {
+  if (is_unix_endpoint(name))
+    name += strlen(UNIX_PREFIX);
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(name) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Unix socket path too long: %s\n", name);
+    return -1;
+  }
+  strcpy(addr->sun_path, name);
+
+  return 0;
+}
+
+/******************************************************************************
+
+Creates a Unix domain socket at the path 'name' and listens on it, as
+create_socket() does for a TCP port.  A socket left behind by a server that
+did not exit cleanly is removed first.  The socket is only accessible to its
+owner; check_peer() still checks every connection, since root, or a server
+started with another umask, could reach it anyway.
+
+*******************************************************************************/
+int create_unix_socket(char* name) {
+  struct sockaddr_un addr;
+  struct stat        info;
+  int                s;
+
+  if (unix_address(name, &addr) < 0)
+    exit(EXIT_FAILURE);
+
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) {
+    fprintf(stderr, "Server: Unable to create socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (lstat(addr.sun_path, &info) == 0 && S_ISSOCK(info.st_mode))
+    unlink(addr.sun_path);
+  if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Server: Unable to bind to %s: %s\n", addr.sun_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  chmod(addr.sun_path, S_IRUSR | S_IWUSR);
+
+  // Every child of a Tier 1 server may connect at once, and a client of a
+  // full Unix socket backlog is refused rather than retried like TCP's
+  if (listen(s, SOMAXCONN) < 0) {
+    fprintf(stderr, "Server: Unable to listen: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stdout, "Server: Listening on Unix socket %s\n", addr.sun_path);
+
+  return s;
+}
+
+/******************************************************************************
+
+Connects to the Unix domain socket 'name' and checks that the server is run by
+the same user, or root.  A non-zero 'timeout_ms' bounds every later read and
+write, as in try_client_socket().  Returns the socket descriptor, or -1.
+
+*******************************************************************************/
+int try_unix_socket(char* name, int timeout_ms) {
+  struct sockaddr_un addr;
+  struct timeval     timeout;
+  int                sockfd;
+
+  if (unix_address(name, &addr) < 0)
+    return -1;
+
+  sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    fprintf(stderr, "Client: Unable to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (timeout_ms > 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Client: Cannot connect to %s: %s\n", addr.sun_path, strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+  if (check_peer(sockfd) < 0) {
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+/******************************************************************************
+
+Returns 0 if the process on the other end of the Unix domain socket 'sockfd'
+runs as the same user as this one, or as root, and -1 otherwise.  The kernel
+records who connected or listened, so unlike an address this can not be
+forged.
+
+*******************************************************************************/
+int check_peer(int sockfd) {
+  uid_t        uid;
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t    len = sizeof(cred);
+
+  if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    fprintf(stderr, "Unable to read the peer credentials: %s\n", strerror(errno));
+    return -1;
+  }
+  uid = cred.uid;
+#else
+  gid_t        gid;
+
+  if (getpeereid(sockfd, &uid, &gid) < 0) {
+    fprintf(stderr, "Unable to read the peer credentials: %s\n", strerror(errno));
+    return -1;
+  }
+#endif
+
+  if (uid != geteuid() && uid != 0) {
+    fprintf(stderr, "Refused a Unix socket peer running as user %u\n", (unsigned int)uid);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_plain_session(void* parent, void* session, CRYPTO_EX_DATA* data, int index,
+			       long argl, void* argp) {
+  free(session);
+}
+
+/******************************************************************************
+
+Creates an SSL object for a session without TLS on the connected socket
+'sockfd'.  It never handshakes or encrypts anything; it only carries the
+socket, and the state of the message being read, to the peer_ functions.  All
+plain sessions share one context, with no certificate or key to load.
+
+*******************************************************************************/
+SSL* create_plain_socket(int sockfd) {
+  struct plain_session* session;
+  SSL*                  ssl;
+
+  if (plain_ctx == NULL) {
+    plain_ctx = SSL_CTX_new(SSLv23_method());
+    plain_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_plain_session);
+    if (plain_ctx == NULL || plain_index < 0) {
+      fprintf(stderr, "Unable to create the plain session context\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  session = calloc(1, sizeof(struct plain_session));
+  ssl = SSL_new(plain_ctx);
+  if (session == NULL || ssl == NULL) {
+    fprintf(stderr, "Unable to allocate a plain session\n");
+    exit(EXIT_FAILURE);
+  }
+  SSL_set_fd(ssl, sockfd);
+  SSL_set_ex_data(ssl, plain_index, session);
+
+  return ssl;
+}
+
+static struct plain_session* plain_session(SSL* ssl) {
+  return plain_index < 0 ? NULL : SSL_get_ex_data(ssl, plain_index);
+}
+
+int is_plain(SSL* ssl) {
+  return plain_session(ssl) != NULL;
+}
+
+// Completes the TLS handshake of a client, if there is one to do and it is not
+// put off to send the first message as early data (see tls-tools.h)
+int peer_connect(SSL* ssl) {
+  return is_plain(ssl) || defer_handshake(ssl) ? 1 : SSL_connect(ssl);
+}
+
+// Completes the TLS handshake of a server, if there is one to do, or reads the
+// early data sent with it
+int peer_accept(SSL* ssl) {
+  return is_plain(ssl) ? 1 : accept_early(ssl);
+}
+
+// Reads exactly 'size' bytes; returns 'size', 0 at the end of the stream or -1
+static int read_fully(int sockfd, unsigned char* buffer, int size) {
+  int done = 0;
+  int nbytes;
+
+  while (done < size) {
+    nbytes = read(sockfd, buffer + done, size - done);
+    if (nbytes < 0 && errno == EINTR)
+      continue;
+    if (nbytes <= 0)
+      return done == 0 ? nbytes : -1;
+    done += nbytes;
+  }
+
+  return done;
+}
+
+/******************************************************************************
+
+Reads at most 'size' bytes of the next message, as SSL_read() reads at most
+'size' bytes of the next TLS record: a message longer than that is returned
+over several reads, but one read never returns parts of two messages.
+Returns the number of bytes read, 0 if the peer closed the connection, or -1
+with errno set.
+
+*******************************************************************************/
+int peer_read(SSL* ssl, void* buffer, int size) {
+  struct plain_session* session = plain_session(ssl);
+  uint32_t              length;
+  int                   sockfd;
+  int                   nbytes;
+
+  if (session == NULL)
+    return (nbytes = read_early(ssl, buffer, size)) != 0 ? nbytes : SSL_read(ssl, buffer, size);
+
+  sockfd = SSL_get_fd(ssl);
+  while (session->remaining == 0) {
+    if ((nbytes = read_fully(sockfd, (unsigned char*)&length, sizeof(length))) <= 0)
+      return nbytes;
+    session->remaining = ntohl(length);
+  }
+
+  if ((uint32_t)size > session->remaining)
+    size = session->remaining;
+  if ((nbytes = read_fully(sockfd, buffer, size)) <= 0)
+    return -1;
+  session->remaining -= nbytes;
+
+  return nbytes;
+}
+
+/******************************************************************************
+
+Sends 'size' bytes as one message, with its length in front, in a single
+system call unless the socket buffer fills up.  Returns 'size', or -1 with
+errno set.
+
+*******************************************************************************/
+int peer_write(SSL* ssl, const void* buffer, int size) {
+  struct iovec parts[2];
+  uint32_t     length = htonl(size);
+  ssize_t      nbytes;
+  int          sockfd;
+  int          part = 0;
+
+  if (!is_plain(ssl))
+    return (nbytes = write_early(ssl, buffer, size)) != 0 ? nbytes : SSL_write(ssl, buffer, size);
+
+  sockfd = SSL_get_fd(ssl);
+  parts[0].iov_base = &length;
+  parts[0].iov_len = sizeof(length);
+  parts[1].iov_base = (void*)buffer;
+  parts[1].iov_len = size;
+
+  while (part < 2) {
+    nbytes = writev(sockfd, parts + part, 2 - part);
+    if (nbytes < 0 && errno == EINTR)
+      continue;
+    if (nbytes < 0)
+      return -1;
+    // Skip what was written, which may end part way through either part
+    while (part < 2 && (size_t)nbytes >= parts[part].iov_len)
+      nbytes -= parts[part++].iov_len;
+    if (part < 2) {
+      parts[part].iov_base = (char*)parts[part].iov_base + nbytes;
+      parts[part].iov_len -= nbytes;
+    }
+  }
+
+  return size;
+}
@@ -0,0 +1,55 @@
+/******************************************************************************
+
+PROGRAM:  local-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for connecting a
+          Tier 1 server to a Tier 2 server on the same host over a Unix domain
+          socket instead of TCP.  Wherever a server name is expected, e.g.,
+          "-s unix:/run/movies/tier2.sock", a name starting with "unix:" is
+          taken as the path of such a socket.  Both ends check who is on the
+          other end with the kernel's peer credentials (SO_PEERCRED), and
+          only talk to processes of the same user, or root.
+
+          Since nothing but the kernel lies between the two, TLS may also be
+          left out of that hop.  The session is then still an SSL object, so
+          the rest of the code does not change, but is read and written with
+          peer_read() and peer_write(), which send each message as a 4-byte
+          length in network byte order followed by the message, in the clear,
+          instead of as a TLS record.  A reader is given messages one at a
+          time, exactly as SSL_read() would give TLS records, and on a TLS
+          session the peer_ functions simply call their SSL_ counterparts.
+          Both ends must agree on whether the hop is plain.  With the fast
+          TLS profile they also send and receive 0-RTT early data (see
+          tls-tools.h).
+
+******************************************************************************/
+
+#ifndef _LOCALTOOLS_H_
+#define _LOCALTOOLS_H_
+
+#include <openssl/ssl.h>
+
+#define UNIX_PREFIX       "unix:"
+
+int is_unix_endpoint(char* name);
+
+int create_unix_socket(char* name);
+
+int try_unix_socket(char* name, int timeout_ms);
+
+int check_peer(int sockfd);
+
+SSL* create_plain_socket(int sockfd);
+
+int is_plain(SSL* ssl);
+
+int peer_connect(SSL* ssl);
+
+int peer_accept(SSL* ssl);
+
+int peer_read(SSL* ssl, void* buffer, int size);
+
+int peer_write(SSL* ssl, const void* buffer, int size);
+
+#endif
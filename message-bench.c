@@ -0,0 +1,238 @@
+/******************************************************************************
+
+PROGRAM:  message-bench.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program measures the parsing of search messages and the
+          writing of result rows (see message-tools.h) against the strtok()
+          and strcat() code they replaced:
+
+          message-bench [-n <iterations>]
+
+          Each is run over a typical search, one with every field as long as
+          fits, a typical showtime and a long one, and the mean nanoseconds
+          per call and memory allocations per call are printed.  It is linked
+          with malloc() wrapped, so every allocation made by this program's
+          own code is counted.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message-tools.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define BUFFER_SIZE        256
+
+void* __real_malloc(size_t size);
+
+static long allocations = 0;
+
+// Counts every malloc() of this program, with -Wl,--wrap=malloc
+void* __wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+static volatile size_t sink;
+
+double wall_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// build_query() as it was, with strtok() and strcat(), for comparison
+int legacy_build_query(char* message, char* query, char* location) {
+  char  delim[] = "/";
+  char  fields[4][BUFFER_SIZE];
+  char  where[BUFFER_SIZE] = " WHERE ";
+  char* blank[] = { "name = ''", "location = ''", "date = ''", "time = ''" };
+  char* ptr;
+  int   count = 0;
+  int   where_count = 0;
+  int   i;
+
+  for (i = 0; i < 4; i++)
+    strcpy(fields[i], blank[i]);
+
+  ptr = strtok(message, delim);
+  while (ptr != NULL && count < 4) {
+    strncpy(fields[count], ptr, BUFFER_SIZE - 1);
+    fields[count][BUFFER_SIZE - 1] = '\0';
+    ptr = strtok(NULL, delim);
+    count = count + 1;
+  }
+
+  for (i = 0; i < 4; i++) {
+    if (strcmp(fields[i], blank[i]) == 0)
+      continue;
+    if (strlen(where) + strlen(fields[i]) + 5 >= BUFFER_SIZE - 64)
+      break;
+    if (where_count >= 1)
+      strcat(where, " AND ");
+    strcat(where, fields[i]);
+    where_count = where_count + 1;
+  }
+
+  strcpy(query, "SELECT * FROM movie_times");
+  if (where_count != 0)
+    strcat(query, where);
+  strcat(query, " ORDER BY name, location, date, time");
+
+  location[0] = '\0';
+  if (strcmp(fields[1], blank[1]) != 0 && strncmp(fields[1], "location = '", 12) == 0) {
+    strcpy(location, strchr(fields[1], '\'') + 1);
+    if (strchr(location, '\'') != NULL)
+      *strchr(location, '\'') = '\0';
+  }
+
+  return location[0] != '\0';
+}
+
+// The Tier 2 server's text row as it was, with strcat(), for comparison
+size_t legacy_format_row(char* reply, char** row) {
+  bzero(reply, BUFFER_SIZE);
+  strcat(reply, "Name: ");
+  strcat(reply, row[0]);
+  strcat(reply, " ");
+  strcat(reply, "Location: ");
+  strcat(reply, row[1]);
+  strcat(reply, " ");
+  strcat(reply, "Date: ");
+  strcat(reply, row[2]);
+  strcat(reply, " ");
+  strcat(reply, "Time: ");
+  strcat(reply, row[3]);
+  strcat(reply, " ");
+  strcat(reply, "\n");
+
+  return strlen(reply);
+}
+
+// Prints the mean time and allocations of 'iterations' calls since 'start'
+void report(char* name, char* input, double start, long allocated, long iterations) {
+  printf("%-22s %-8s %10.1f %10.2f\n", name, input, (wall_ns() - start) / iterations,
+	 (double)(allocations - allocated) / iterations);
+}
+
+/******************************************************************************
+
+Times both parsers on 'message'.  strtok() writes into the message, so the old
+parser is given a fresh copy every time, as the Tier 1 server's buffer was.
+Returns -1 if the two build different queries.
+
+*******************************************************************************/
+int bench_parse(char* input, char* message, long iterations) {
+  char   copy[BUFFER_SIZE];
+  char   query[BUFFER_SIZE];
+  char   expected[BUFFER_SIZE];
+  char   location[BUFFER_SIZE];
+  double start;
+  long   allocated;
+  long   i;
+
+  strcpy(copy, message);
+  legacy_build_query(copy, expected, location);
+  build_query(message, query, sizeof(query), location, sizeof(location));
+  if (strcmp(query, expected) != 0) {
+    fprintf(stderr, "Bench: The parsers disagree on %s:\n%s\n%s\n", input, expected, query);
+    return -1;
+  }
+
+  allocated = allocations;
+  start = wall_ns();
+  for (i = 0; i < iterations; i++) {
+    strcpy(copy, message);
+    sink += legacy_build_query(copy, query, location);
+  }
+  report("parse, strtok/strcat", input, start, allocated, iterations);
+
+  allocated = allocations;
+  start = wall_ns();
+  for (i = 0; i < iterations; i++)
+    sink += build_query(message, query, sizeof(query), location, sizeof(location));
+  report("parse, single pass", input, start, allocated, iterations);
+
+  return 0;
+}
+
+// Times both row writers on 'values'; returns -1 if they write different rows
+int bench_row(char* input, char** values, long iterations) {
+  unsigned long lengths[SEARCH_FIELDS];
+  char          row[BUFFER_SIZE];
+  char          expected[BUFFER_SIZE];
+  double        start;
+  long          allocated;
+  long          i;
+
+  for (i = 0; i < SEARCH_FIELDS; i++)
+    lengths[i] = strlen(values[i]);
+
+  legacy_format_row(expected, values);
+  format_row(row, sizeof(row), values, lengths);
+  if (strcmp(row, expected) != 0) {
+    fprintf(stderr, "Bench: The row writers disagree on %s:\n%s%s", input, expected, row);
+    return -1;
+  }
+
+  allocated = allocations;
+  start = wall_ns();
+  for (i = 0; i < iterations; i++)
+    sink += legacy_format_row(row, values);
+  report("row, strcat", input, start, allocated, iterations);
+
+  allocated = allocations;
+  start = wall_ns();
+  for (i = 0; i < iterations; i++)
+    sink += format_row(row, sizeof(row), values, lengths);
+  report("row, single pass", input, start, allocated, iterations);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  char  typical[] = "name = 'Dune'/location = 'Phoenix,AZ'/date = 'Oct 12'/time = '7:00 pm'";
+  char  longest[BUFFER_SIZE];
+  char* showtime[] = { "Dune", "Phoenix,AZ", "Oct 12", "7:00 pm" };
+  char* long_showtime[] = { "Harry Potter and the Deathly Hallows: Part 2 (Extended Edition)",
+			    "Colorado Springs,CO", "Oct 12", "11:45 pm" };
+  long  iterations = DEFAULT_ITERATIONS;
+  int   opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 0 || iterations <= 0) {
+    fprintf(stderr, "Usage: message-bench [-n <iterations>]\n");
+    return EXIT_FAILURE;
+  }
+
+  // A search whose conditions only just fit in the query
+  snprintf(longest, sizeof(longest), "name = '%.40s'/location = '%.40s'/date = '%s'/time = '%s'",
+	   "The Lord of the Rings: The Return of the King Extended", "Colorado Springs,CO",
+	   "Oct 12", "11:45 pm");
+
+  printf("%-22s %-8s %10s %10s\n", "function", "input", "ns/op", "allocs/op");
+  if (bench_parse("typical", typical, iterations) < 0 ||
+      bench_parse("long", longest, iterations) < 0 ||
+      bench_row("typical", showtime, iterations) < 0 ||
+      bench_row("long", long_showtime, iterations) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,263 @@
+/******************************************************************************
+
+PROGRAM:  message-fuzz.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program checks the parsing of search messages and the writing
+          of result rows (see message-tools.h) on random input:
+
+          message-fuzz [-n <inputs>] [-s <seed>]
+
+          Every input is a random message, made mostly of the pieces real
+          searches are made of, and random buffer sizes.  It is split with
+          split_fields(), built into a query with build_query() and its
+          fields written as a row with format_row(), each into a buffer with
+          guard bytes after it.  The program stops at the first input a
+          function wrote past its buffer on, left without a NUL, or answered
+          wrongly for, and prints it with the seed to run it again.  Built
+          with -DLIBFUZZER and -fsanitize=fuzzer, the same checks run as a
+          libFuzzer target instead.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message-tools.h"
+
+#define DEFAULT_INPUTS  1000000
+#define MAX_MESSAGE     600
+#define MAX_BUFFER      300
+#define GUARD_SIZE      64
+#define GUARD_BYTE      0x5a
+
+static const char* pieces[] = {
+  "name = '", "location = '", "date = '", "time = '", "name LIKE '", "name SOUNDS LIKE '",
+  "location NEAR '", "location NEAREST '", "'", "/", "%", " ", "Dune", "Phoenix,AZ",
+  "Oct 12", "7:00 pm", "33.4,-112.0,25", "name = ''", "location = ''",
+};
+
+static const char* input;
+
+// Reports what 'input' broke and stops, so it can be run again
+static void fail(const char* what) {
+  fprintf(stderr, "Fuzz: %s on \"%s\"\n", what, input);
+  abort();
+}
+
+// Fills 'buffer' and its guard bytes with the guard pattern
+static void guard(char* buffer, size_t size) {
+  memset(buffer, GUARD_BYTE, size + GUARD_SIZE);
+}
+
+// Fails unless every byte after the first 'size' of 'buffer' is untouched
+static void check_guard(char* buffer, size_t size, const char* what) {
+  size_t i;
+
+  for (i = size; i < size + GUARD_SIZE; i++)
+    if ((unsigned char)buffer[i] != GUARD_BYTE)
+      fail(what);
+}
+
+// Fails unless 'text' is NUL terminated within its 'size' bytes
+static void check_string(char* text, size_t size, const char* what) {
+  if (size == 0 || memchr(text, '\0', size) == NULL)
+    fail(what);
+}
+
+/******************************************************************************
+
+Splits 'message' into at most 'max' fields and checks that the fields lie in
+the message in order, one delimiter apart, and cover all of it.
+
+*******************************************************************************/
+static void check_split(const char* message, int max) {
+  struct span fields[SEARCH_FIELDS + 2];
+  const char* next = message;
+  int         count = split_fields(message, '/', fields, max);
+  int         i;
+
+  if (count < 1 || count > max)
+    fail("split_fields() returned a wrong count");
+  for (i = 0; i < count; i++) {
+    if (fields[i].start != next || memchr(fields[i].start, '\0', fields[i].len) != NULL)
+      fail("split_fields() returned a field outside the message");
+    if (i < count - 1 && (memchr(fields[i].start, '/', fields[i].len) != NULL ||
+			  fields[i].start[fields[i].len] != '/'))
+      fail("split_fields() did not split at a delimiter");
+    next = fields[i].start + fields[i].len + 1;
+  }
+  if (fields[count - 1].start[fields[count - 1].len] != '\0')
+    fail("split_fields() left part of the message out");
+  if (count < max && memchr(fields[count - 1].start, '/', fields[count - 1].len) != NULL)
+    fail("split_fields() stopped before the last delimiter");
+}
+
+/******************************************************************************
+
+Builds the query for 'message' into 'size' bytes, and its location into
+'location_size', and checks the buffers and what was built.
+
+*******************************************************************************/
+static void check_query(const char* message, size_t size, size_t location_size) {
+  char query[MAX_BUFFER + GUARD_SIZE];
+  char location[MAX_BUFFER + GUARD_SIZE];
+  int  result;
+
+  guard(query, size);
+  guard(location, location_size);
+  result = build_query(message, query, size, location, location_size);
+  check_guard(query, size, "build_query() wrote past the query");
+  check_guard(location, location_size, "build_query() wrote past the location");
+  if (result < 0)
+    return;
+
+  check_string(query, size, "build_query() left the query without a NUL");
+  check_string(location, location_size, "build_query() left the location without a NUL");
+  if (strncmp(query, SEARCH_SELECT, strlen(SEARCH_SELECT)) != 0 ||
+      strlen(query) < strlen(SEARCH_ORDER) ||
+      strcmp(query + strlen(query) - strlen(SEARCH_ORDER), SEARCH_ORDER) != 0)
+    fail("build_query() built a query without its SELECT or ORDER BY");
+  if (result != (location[0] != '\0'))
+    fail("build_query() returned a wrong location flag");
+}
+
+/******************************************************************************
+
+Writes the fields of 'message' as a row into 'size' bytes, with the values
+whose bit is set in 'missing' left NULL, and checks that the row is the start
+of the whole row and as long as the length returned.
+
+*******************************************************************************/
+static void check_row(const char* message, size_t size, int missing, int counted) {
+  struct span   fields[SEARCH_FIELDS];
+  char          text[SEARCH_FIELDS][MAX_MESSAGE + 1];
+  char*         values[SEARCH_FIELDS];
+  unsigned long lengths[SEARCH_FIELDS];
+  char          row[MAX_BUFFER + GUARD_SIZE];
+  char          expected[MAX_MESSAGE + 64];
+  size_t        len;
+  int           count = split_fields(message, '/', fields, SEARCH_FIELDS);
+  int           i;
+
+  for (i = 0; i < SEARCH_FIELDS; i++) {
+    text[i][0] = '\0';
+    if (i < count) {
+      memcpy(text[i], fields[i].start, fields[i].len);
+      text[i][fields[i].len] = '\0';
+    }
+    values[i] = missing & (1 << i) ? NULL : text[i];
+    lengths[i] = values[i] == NULL ? 0 : strlen(text[i]);
+  }
+  snprintf(expected, sizeof(expected), "Name: %s Location: %s Date: %s Time: %s \n",
+	   values[0] ? values[0] : "", values[1] ? values[1] : "",
+	   values[2] ? values[2] : "", values[3] ? values[3] : "");
+
+  guard(row, size);
+  len = format_row(row, size, values, counted ? lengths : NULL);
+  check_guard(row, size, "format_row() wrote past the row");
+  if (size == 0) {
+    if (len != 0)
+      fail("format_row() wrote into an empty buffer");
+    return;
+  }
+  check_string(row, size, "format_row() left the row without a NUL");
+  if (len != strlen(row) || len >= size || strncmp(row, expected, len) != 0 ||
+      (len < strlen(expected) && len != size - 1))
+    fail("format_row() wrote a wrong row");
+}
+
+/******************************************************************************
+
+Runs every check on one input: its first four bytes pick the buffer sizes and
+which values are missing, and the rest, up to any NUL, is the message.
+
+*******************************************************************************/
+int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size) {
+  char message[MAX_MESSAGE + 1];
+  int  max;
+
+  if (size < 4)
+    return 0;
+  size = size - 4 > MAX_MESSAGE ? MAX_MESSAGE : size - 4;
+  memcpy(message, data + 4, size);
+  message[size] = '\0';
+  input = message;
+
+  for (max = 1; max <= SEARCH_FIELDS + 2; max++)
+    check_split(message, max);
+  check_query(message, data[0] % (MAX_BUFFER + 1), data[1] % (MAX_BUFFER + 1));
+  check_row(message, data[2] % (MAX_BUFFER + 1), data[3] & 0xf, data[3] & 0x10);
+
+  return 0;
+}
+
+#ifndef LIBFUZZER
+
+// Writes a random input for LLVMFuzzerTestOneInput() into 'data'
+static size_t random_input(unsigned char* data) {
+  size_t len = 4;
+  size_t want = rand() % MAX_MESSAGE;
+  size_t piece;
+  int    i;
+
+  // Sizes near the ones the servers use are tried most often
+  for (i = 0; i < 3; i++)
+    data[i] = rand() % 4 == 0 ? rand() : MAX_BUFFER - 44 - rand() % 8;
+  data[3] = rand();
+
+  while (len < want + 4) {
+    if (rand() % 4 == 0) {
+      data[len++] = 1 + rand() % 255;
+      continue;
+    }
+    piece = rand() % (sizeof(pieces) / sizeof(pieces[0]));
+    if (len + strlen(pieces[piece]) > MAX_MESSAGE + 4)
+      break;
+    memcpy(data + len, pieces[piece], strlen(pieces[piece]));
+    len += strlen(pieces[piece]);
+  }
+
+  return len;
+}
+
+int main(int argc, char** argv) {
+  unsigned char data[MAX_MESSAGE + 4];
+  unsigned int  seed = time(NULL);
+  long          inputs = DEFAULT_INPUTS;
+  long          i;
+  int           opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      inputs = atol(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 0 || inputs <= 0) {
+    fprintf(stderr, "Usage: message-fuzz [-n <inputs>] [-s <seed>]\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("Fuzz: Checking %ld inputs with seed %u\n", inputs, seed);
+  fflush(stdout);
+  srand(seed);
+  for (i = 0; i < inputs; i++)
+    LLVMFuzzerTestOneInput(data, random_input(data));
+  printf("Fuzz: All %ld inputs passed\n", inputs);
+
+  return EXIT_SUCCESS;
+}
+
+#endif
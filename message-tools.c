@@ -0,0 +1,171 @@
+/******************************************************************************
+
+PROGRAM:  message-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the parsing of search messages and the
+          writing of result rows.  See message-tools.h for an overview.
+
+******************************************************************************/
+
+#include <string.h>
+
+#include "message-tools.h"
+
+static const char* row_labels[] = { "Name: ", " Location: ", " Date: ", " Time: " };
+
+/******************************************************************************
+
+Splits 'text' at every 'delim' into at most 'max' fields, the last of which
+holds the rest of the text.  Empty fields are kept, so every field stays at
+its position.  Returns the number of fields.
+
+*******************************************************************************/
+int split_fields(const char* text, char delim, struct span* fields, int max) {
+  const char* end;
+  int         count = 0;
+
+  while (count < max) {
+    end = count < max - 1 ? strchr(text, delim) : NULL;
+    fields[count].start = text;
+    if (end == NULL) {
+      fields[count++].len = strlen(text);
+      break;
+    }
+    fields[count++].len = end - text;
+    text = end + 1;
+  }
+
+  return count;
+}
+
+// Starts an empty string in the 'size' bytes at 'data'
+void start_text(struct text_buffer* out, char* data, size_t size) {
+  out->data = data;
+  out->size = size;
+  out->len = 0;
+  if (size > 0)
+    data[0] = '\0';
+}
+
+/******************************************************************************
+
+Appends the 'len' bytes at 'text'.  Returns 0, or -1 if only the part that
+fits, leaving room for the NUL, was appended.
+
+*******************************************************************************/
+int append_text(struct text_buffer* out, const char* text, size_t len) {
+  size_t room = out->size > out->len ? out->size - out->len - 1 : 0;
+  int    result = 0;
+
+  if (len > room) {
+    len = room;
+    result = -1;
+  }
+  memcpy(out->data + out->len, text, len);
+  out->len += len;
+  if (out->size > 0)
+    out->data[out->len] = '\0';
+
+  return result;
+}
+
+// Takes the string back to its first 'len' bytes
+void cut_text(struct text_buffer* out, size_t len) {
+  if (len < out->len) {
+    out->len = len;
+    out->data[len] = '\0';
+  }
+}
+
+/******************************************************************************
+
+Writes the showtime 'values', name, location, date and time, into the 'size'
+bytes at 'out' as the text row "Name: ... Location: ... Date: ... Time: ... \n".
+'lengths' gives the length of every value, as mysql_fetch_lengths() does, or is
+NULL if they must be counted.  A missing (NULL) value is written as empty.  A
+row longer than the buffer is cut short.  Returns the length written.
+
+*******************************************************************************/
+size_t format_row(char* out, size_t size, char** values, unsigned long* lengths) {
+  struct text_buffer text;
+  size_t             len;
+  int                i;
+
+  start_text(&text, out, size);
+  for (i = 0; i < SEARCH_FIELDS; i++) {
+    len = values[i] == NULL ? 0 : lengths != NULL ? lengths[i] : strlen(values[i]);
+    append_text(&text, row_labels[i], strlen(row_labels[i]));
+    if (len > 0)
+      append_text(&text, values[i], len);
+  }
+  append_text(&text, " \n", 2);
+
+  return text.len;
+}
+
+// Returns 1 if 'field' holds exactly the string 'text'
+static int span_equals(struct span* field, const char* text) {
+  return strlen(text) == field->len && memcmp(field->start, text, field->len) == 0;
+}
+
+/******************************************************************************
+
+Builds the SQL query for a search message from the client, which has the form
+
+  name = '...'/location = '...'/date = '...'/time = '...'
+
+with empty values for the fields the user left blank.  The name may also be
+given as "name LIKE '<prefix>%'" or "name SOUNDS LIKE '<text>'", and the
+location as "location NEAR '<lat>,<lon>,<km>'" or "location NEAREST
+'<lat>,<lon>,<k>'"; the Tier 2 server resolves those from its indexes.  The
+query is written into the 'size' bytes at 'query', always leaving room for the
+ORDER BY.  If the search names a location, its value is copied to 'location'
+and 1 is returned, otherwise 0.  Returns -1 if a condition or the location does
+not fit, as a query with a condition left out would match the wrong rows, or
+if not even the query without conditions, or an empty location, fits.
+
+*******************************************************************************/
+int build_query(const char* message, char* query, size_t size, char* location,
+		size_t location_size) {
+  static const char* blank[] = { "name = ''", "location = ''", "date = ''", "time = ''" };
+  struct text_buffer out;
+  struct span        fields[SEARCH_FIELDS];
+  struct span        value;
+  int                count = split_fields(message, '/', fields, SEARCH_FIELDS);
+  int                where_count = 0;
+  int                i;
+
+  if (size <= strlen(SEARCH_SELECT) + strlen(SEARCH_ORDER) || location_size == 0)
+    return -1;
+
+  // The conditions may only use what the ORDER BY leaves
+  start_text(&out, query, size - strlen(SEARCH_ORDER));
+  append_text(&out, SEARCH_SELECT, strlen(SEARCH_SELECT));
+  for (i = 0; i < count; i++) {
+    if (fields[i].len == 0 || span_equals(&fields[i], blank[i]))
+      continue;
+    if (append_text(&out, where_count == 0 ? " WHERE " : " AND ", where_count == 0 ? 7 : 5) < 0 ||
+	append_text(&out, fields[i].start, fields[i].len) < 0)
+      return -1;
+    where_count++;
+  }
+
+  // Shards are merged by this order, so every shard must sort its rows
+  out.size = size;
+  append_text(&out, SEARCH_ORDER, strlen(SEARCH_ORDER));
+
+  // A query for a single location only needs that location's shard, while a
+  // search by distance ("location NEAR ...") may need any of them
+  start_text(&out, location, location_size);
+  if (count > 1 && fields[1].len > 12 && strncmp(fields[1].start, "location = '", 12) == 0) {
+    value.start = fields[1].start + 12;
+    value.len = fields[1].len - 12;
+    if (memchr(value.start, '\'', value.len) != NULL)
+      value.len = (const char*)memchr(value.start, '\'', value.len) - value.start;
+    if (append_text(&out, value.start, value.len) < 0)
+      return -1;
+  }
+
+  return location[0] != '\0';
+}
@@ -0,0 +1,53 @@
+/******************************************************************************
+
+PROGRAM:  message-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for parsing search
+          messages and writing result rows, which both happen for every
+          request and every showtime.  A message is split in one pass into
+          spans, pointers into the message with their lengths, rather than
+          copied field by field, and text is written through a text_buffer,
+          which keeps the length written so far and never writes past the
+          end of its buffer.  Appending is then a bounds check and a
+          memcpy(), not a strcat() that first searches for the end of
+          everything written before it.  Nothing here allocates memory.
+
+******************************************************************************/
+
+#ifndef _MESSAGETOOLS_H_
+#define _MESSAGETOOLS_H_
+
+#include <stddef.h>
+
+#define SEARCH_FIELDS     4
+#define SEARCH_SELECT     "SELECT * FROM movie_times"
+#define SEARCH_ORDER      " ORDER BY name, location, date, time"
+
+// Part of a larger string, not NUL terminated
+struct span {
+  const char* start;
+  size_t      len;
+};
+
+// A string being written into a buffer of 'size' bytes, always NUL terminated
+struct text_buffer {
+  char*  data;
+  size_t size;
+  size_t len;
+};
+
+int split_fields(const char* text, char delim, struct span* fields, int max);
+
+void start_text(struct text_buffer* out, char* data, size_t size);
+
+int append_text(struct text_buffer* out, const char* text, size_t len);
+
+void cut_text(struct text_buffer* out, size_t len);
+
+size_t format_row(char* out, size_t size, char** values, unsigned long* lengths);
+
+int build_query(const char* message, char* query, size_t size, char* location,
+		size_t location_size);
+
+#endif
@@ -0,0 +1,305 @@
+/******************************************************************************
+
+PROGRAM:  reload-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements reloading the showtime data of the Tier 2
+          server.  See reload-tools.h for an overview.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "reload-tools.h"
+
+// Rows are compared exactly, so that any edit shows up as a change
+static int compare_rows(const void* a, const void* b) {
+  char** row_a = (char**)a;
+  char** row_b = (char**)b;
+  int    result;
+  int    i;
+
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+    if ((result = strcmp(row_a[i], row_b[i])) != 0)
+      return result;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Turns what a snapshot builder collected into a dataset, taking over its
+strings: the rows and theaters are sorted, and repeated ones are dropped, as
+the unique index on movie_times and the theaters' primary key would.
+
+*******************************************************************************/
+static struct dataset* builder_dataset(struct snapshot_builder* builder) {
+  struct dataset* dataset;
+  char**          row;
+  char*           location;
+  double          latitude;
+  double          longitude;
+  int             count = 0;
+  int             i;
+  int             j;
+  int             k;
+
+  dataset = calloc(1, sizeof(struct dataset));
+  if (dataset == NULL) {
+    fprintf(stderr, "Server: Unable to allocate dataset\n");
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(builder->values, builder->row_count, SNAPSHOT_COLUMNS * sizeof(char*), compare_rows);
+  for (i = 0; i < builder->row_count; i++) {
+    row = &builder->values[i * SNAPSHOT_COLUMNS];
+    if (count > 0 && compare_rows(&builder->values[(count - 1) * SNAPSHOT_COLUMNS], row) == 0) {
+      for (j = 0; j < SNAPSHOT_COLUMNS; j++)
+	free(row[j]);
+      continue;
+    }
+    memmove(&builder->values[count++ * SNAPSHOT_COLUMNS], row, SNAPSHOT_COLUMNS * sizeof(char*));
+  }
+  dataset->row_count = count;
+  dataset->rows = builder->values;
+
+  // Insertion sort the theaters, keeping the last coordinates given for a
+  // location as a later INSERT would; there are only ever a few of them
+  count = 0;
+  for (i = 0; i < builder->theater_count; i++) {
+    location = builder->theater_locations[i];
+    latitude = builder->theater_coordinates[2 * i];
+    longitude = builder->theater_coordinates[2 * i + 1];
+    for (j = 0; j < count && strcmp(builder->theater_locations[j], location) < 0; j++)
+      ;
+    if (j < count && strcmp(builder->theater_locations[j], location) == 0)
+      free(location);
+    else {
+      for (k = count++; k > j; k--) {
+	builder->theater_locations[k] = builder->theater_locations[k - 1];
+	builder->theater_coordinates[2 * k] = builder->theater_coordinates[2 * k - 2];
+	builder->theater_coordinates[2 * k + 1] = builder->theater_coordinates[2 * k - 1];
+      }
+      builder->theater_locations[j] = location;
+    }
+    builder->theater_coordinates[2 * j] = latitude;
+    builder->theater_coordinates[2 * j + 1] = longitude;
+  }
+  dataset->theater_count = count;
+  dataset->theater_locations = builder->theater_locations;
+  dataset->theater_coordinates = builder->theater_coordinates;
+
+  free(builder);
+
+  return dataset;
+}
+
+/******************************************************************************
+
+Reads the showtimes and theaters of the given SQL data files.  Returns NULL if
+any of them can not be read or parsed, e.g., because it is still being written.
+
+*******************************************************************************/
+struct dataset* load_dataset(char** files, int count) {
+  struct snapshot_builder* builder;
+  int                      i;
+
+  builder = create_snapshot_builder();
+  for (i = 0; i < count; i++)
+    if (load_snapshot_sql(builder, files[i]) < 0) {
+      free_dataset(builder_dataset(builder));
+      return NULL;
+    }
+
+  return builder_dataset(builder);
+}
+
+struct dataset* snapshot_dataset(struct snapshot* snapshot) {
+  struct snapshot_builder* builder;
+  char*                    values[SNAPSHOT_COLUMNS];
+  uint32_t                 row;
+  uint32_t                 i;
+  int                      column;
+
+  builder = create_snapshot_builder();
+  for (row = 0; row < snapshot->header->row_count; row++) {
+    for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+      values[column] = snapshot_string(snapshot, snapshot->columns[column][row]);
+    add_snapshot_row(builder, values);
+  }
+  for (i = 0; i < snapshot->header->theater_count; i++)
+    add_snapshot_theater(builder, snapshot_string(snapshot, snapshot->theaters[i].location),
+			 snapshot->theaters[i].latitude, snapshot->theaters[i].longitude);
+
+  return builder_dataset(builder);
+}
+
+// Copies a dataset into a new builder, so it can be written out as a snapshot
+struct snapshot_builder* dataset_builder(struct dataset* dataset) {
+  struct snapshot_builder* builder;
+  int                      i;
+
+  builder = create_snapshot_builder();
+  for (i = 0; i < dataset->row_count; i++)
+    add_snapshot_row(builder, &dataset->rows[i * SNAPSHOT_COLUMNS]);
+  for (i = 0; i < dataset->theater_count; i++)
+    add_snapshot_theater(builder, dataset->theater_locations[i],
+			 dataset->theater_coordinates[2 * i], dataset->theater_coordinates[2 * i + 1]);
+
+  return builder;
+}
+
+void free_dataset(struct dataset* dataset) {
+  int i;
+
+  for (i = 0; i < dataset->row_count * SNAPSHOT_COLUMNS; i++)
+    free(dataset->rows[i]);
+  for (i = 0; i < dataset->theater_count; i++)
+    free(dataset->theater_locations[i]);
+  free(dataset->rows);
+  free(dataset->theater_locations);
+  free(dataset->theater_coordinates);
+  free(dataset);
+}
+
+/******************************************************************************
+
+Walks two datasets side by side and reports every showtime found in only one of
+them to 'row_changed', with 'inserted' set if it is only in 'new'.  Theaters
+are reported to 'theater_changed' the same way; one whose coordinates changed
+is reported as removed and then inserted.  Returns the number of changes.
+
+*******************************************************************************/
+int diff_datasets(struct dataset* old, struct dataset* new,
+		  void (*row_changed)(void* context, char** values, int inserted),
+		  void (*theater_changed)(void* context, char* location, double latitude,
+					  double longitude, int inserted),
+		  void* context) {
+  double* old_coordinates;
+  double* new_coordinates;
+  int     changes = 0;
+  int     result;
+  int     i = 0;
+  int     j = 0;
+
+  while (i < old->row_count || j < new->row_count) {
+    if (i == old->row_count)
+      result = 1;
+    else if (j == new->row_count)
+      result = -1;
+    else
+      result = compare_rows(&old->rows[i * SNAPSHOT_COLUMNS], &new->rows[j * SNAPSHOT_COLUMNS]);
+
+    if (result < 0) {
+      row_changed(context, &old->rows[i++ * SNAPSHOT_COLUMNS], 0);
+      changes++;
+    } else if (result > 0) {
+      row_changed(context, &new->rows[j++ * SNAPSHOT_COLUMNS], 1);
+      changes++;
+    } else {
+      i++;
+      j++;
+    }
+  }
+
+  i = 0;
+  j = 0;
+  while (i < old->theater_count || j < new->theater_count) {
+    if (i == old->theater_count)
+      result = 1;
+    else if (j == new->theater_count)
+      result = -1;
+    else
+      result = strcmp(old->theater_locations[i], new->theater_locations[j]);
+    old_coordinates = &old->theater_coordinates[2 * i];
+    new_coordinates = &new->theater_coordinates[2 * j];
+
+    if (result <= 0 && (result < 0 || old_coordinates[0] != new_coordinates[0] ||
+			old_coordinates[1] != new_coordinates[1])) {
+      theater_changed(context, old->theater_locations[i], old_coordinates[0],
+		      old_coordinates[1], 0);
+      changes++;
+    }
+    if (result >= 0 && (result > 0 || old_coordinates[0] != new_coordinates[0] ||
+			old_coordinates[1] != new_coordinates[1])) {
+      theater_changed(context, new->theater_locations[j], new_coordinates[0],
+		      new_coordinates[1], 1);
+      changes++;
+    }
+    if (result <= 0)
+      i++;
+    if (result >= 0)
+      j++;
+  }
+
+  return changes;
+}
+
+/******************************************************************************
+
+Starts watching the directories of the given files for files being written or
+renamed into place.  Returns a non-blocking inotify descriptor to poll() for
+input, or -1 if the files can not be watched.
+
+*******************************************************************************/
+int watch_files(char** files, int count) {
+  char path[PATH_MAX];
+  int  watchfd;
+  int  i;
+
+  watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watchfd < 0) {
+    fprintf(stderr, "Server: Unable to watch data files: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    strncpy(path, files[i], sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    if (inotify_add_watch(watchfd, dirname(path), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      fprintf(stderr, "Server: Unable to watch '%s': %s\n", files[i], strerror(errno));
+      close(watchfd);
+      return -1;
+    }
+  }
+
+  return watchfd;
+}
+
+/******************************************************************************
+
+Reads every pending event from 'watchfd' and returns 1 if any of them is about
+one of the given files, 0 otherwise.
+
+*******************************************************************************/
+int files_changed(int watchfd, char** files, int count) {
+  char                  buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char                  path[PATH_MAX];
+  struct inotify_event* event;
+  ssize_t               len;
+  char*                 p;
+  int                   changed = 0;
+  int                   i;
+
+  while ((len = read(watchfd, buffer, sizeof(buffer))) > 0)
+    for (p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event*)p;
+      if (event->len == 0)
+	continue;
+      for (i = 0; i < count; i++) {
+	strncpy(path, files[i], sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	if (strcmp(event->name, basename(path)) == 0)
+	  changed = 1;
+      }
+    }
+
+  return changed;
+}
@@ -0,0 +1,53 @@
+/******************************************************************************
+
+PROGRAM:  reload-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for reloading the
+          showtime data of the Tier 2 server while it runs.  The server keeps
+          the data it last loaded as a dataset: every showtime and theater,
+          sorted.  When inotify reports that one of the data files was
+          written, the files are read into a new dataset and the two are
+          compared with a single merge pass, so only the showtimes that were
+          added or removed, and the theaters that changed, need to be applied.
+
+          The directories holding the data files are watched rather than the
+          files themselves, so files replaced by renaming a new copy over them,
+          as most editors do, keep being watched.
+
+******************************************************************************/
+
+#ifndef _RELOADTOOLS_H_
+#define _RELOADTOOLS_H_
+
+#include "snapshot-tools.h"
+
+#define RELOAD_DELAY   200   // Milliseconds for the writes to a file to settle
+
+struct dataset {
+  int     row_count;
+  char**  rows;                  // SNAPSHOT_COLUMNS strings per row, sorted, distinct
+  int     theater_count;
+  char**  theater_locations;     // Sorted, distinct
+  double* theater_coordinates;   // latitude, longitude pairs
+};
+
+struct dataset* load_dataset(char** files, int count);
+
+struct dataset* snapshot_dataset(struct snapshot* snapshot);
+
+struct snapshot_builder* dataset_builder(struct dataset* dataset);
+
+void free_dataset(struct dataset* dataset);
+
+int diff_datasets(struct dataset* old, struct dataset* new,
+		  void (*row_changed)(void* context, char** values, int inserted),
+		  void (*theater_changed)(void* context, char* location, double latitude,
+					  double longitude, int inserted),
+		  void* context);
+
+int watch_files(char** files, int count);
+
+int files_changed(int watchfd, char** files, int count);
+
+#endif
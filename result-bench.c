@@ -0,0 +1,218 @@
+/******************************************************************************
+
+PROGRAM:  result-bench.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program measures what each result encoding costs, in bytes
+          sent and in processor time, for the showtimes of a snapshot (see
+          snapshot-tool.c):
+
+          result-bench [-n <runs>] [-q <query>] <snapshot>
+
+          Every showtime, or those matching the query given, is sent over a
+          real TLS session on a socket pair, from a child process encoding
+          the rows the way the Tier 2 server does to a parent process
+          reading them the way Tier 1 and the client do.  This is repeated
+          for text, compact batches and compressed batches at a few levels,
+          and the averages printed for each.  The sender needs cert.pem and
+          key.pem, so run it where the servers run.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
+
+#include "client-tools.h"
+#include "server-tools.h"
+#include "result-tools.h"
+#include "snapshot-tools.h"
+
+#define DEFAULT_RUNS    20
+#define DEFAULT_QUERY   "SELECT * FROM movie_times ORDER BY name, location, date, time"
+#define ROW_SIZE        2048
+
+struct bench_config {
+  char* name;
+  int   encoding;
+  int   level;
+};
+
+// What the sender reports back to the reader through a pipe
+struct bench_sent {
+  long   bytes;
+  double cpu_ms;
+};
+
+struct bench_config configs[] = {
+  { "text",              ENCODING_TEXT,                       0 },
+  { "compact",           ENCODING_COMPACT,                    0 },
+  { "compact,deflate 1", ENCODING_COMPACT | ENCODING_DEFLATE, 1 },
+  { "compact,deflate 6", ENCODING_COMPACT | ENCODING_DEFLATE, 6 },
+  { "compact,deflate 9", ENCODING_COMPACT | ENCODING_DEFLATE, 9 },
+};
+
+double cpu_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+void send_row(void* context, char** values) {
+  send_result_row((struct result_encoder*)context, values);
+}
+
+// Sends the result of 'query' once, as the child end of a run
+void send_result(struct snapshot* snapshot, char* query, struct bench_config* config,
+		 int sockfd, int report) {
+  struct result_encoder* encoder = malloc(sizeof(struct result_encoder));
+  struct bench_sent      sent;
+  SSL*                   ssl;
+  double                 start;
+
+  ssl = create_ssl_socket(sockfd);
+  if (encoder == NULL || SSL_accept(ssl) <= 0) {
+    fprintf(stderr, "Bench: Could not accept the SSL session\n");
+    exit(EXIT_FAILURE);
+  }
+
+  start = cpu_ms();
+  start_results(encoder, ssl, config->encoding);
+  encoder->level = config->level;
+  query_snapshot(snapshot, query, send_row, encoder);
+  send_result_text(encoder, "DONE");
+  finish_results(encoder);
+  sent.cpu_ms = cpu_ms() - start;
+  sent.bytes = encoder->bytes;
+
+  write(report, &sent, sizeof(sent));
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+
+Runs one configuration 'runs' times and prints the average bytes sent and
+processor time spent by the sender and the reader per result.  Returns the
+average bytes sent, or -1 if a run failed.
+
+*******************************************************************************/
+long run_config(struct snapshot* snapshot, char* query, struct bench_config* config, int runs,
+	       long text_bytes) {
+  static struct result_decoder decoder;
+  struct bench_sent sent;
+  char              row[ROW_SIZE];
+  SSL*              ssl;
+  double            start;
+  double            send_ms = 0;
+  double            read_ms = 0;
+  long              bytes = 0;
+  long              rows = 0;
+  int               sockets[2];
+  int               report[2];
+  int               nbytes;
+  int               run;
+  pid_t             pid;
+
+  for (run = 0; run < runs; run++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0 || pipe(report) < 0) {
+      fprintf(stderr, "Bench: Unable to create a socket pair: %s\n", strerror(errno));
+      return -1;
+    }
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+      fprintf(stderr, "Bench: Unable to fork: %s\n", strerror(errno));
+      return -1;
+    }
+    if (pid == 0) {
+      close(sockets[0]);
+      close(report[0]);
+      send_result(snapshot, query, config, sockets[1], report[1]);
+    }
+    close(sockets[1]);
+    close(report[1]);
+
+    ssl = create_client_ssl_socket(sockets[0]);
+    if (SSL_connect(ssl) != 1) {
+      fprintf(stderr, "Bench: Could not establish the SSL session\n");
+      return -1;
+    }
+    rows = 0;
+    start = cpu_ms();
+    start_result_decoder(&decoder);
+    while ((nbytes = read_result(&decoder, ssl, row, sizeof(row))) > 0 && strcmp(row, "DONE") != 0)
+      rows++;
+    finish_result_decoder(&decoder);
+    read_ms += cpu_ms() - start;
+
+    if (nbytes <= 0 || read(report[0], &sent, sizeof(sent)) != sizeof(sent)) {
+      fprintf(stderr, "Bench: The %s result was not received\n", config->name);
+      return -1;
+    }
+    send_ms += sent.cpu_ms;
+    bytes += sent.bytes;
+
+    SSL_free(ssl);
+    close(sockets[0]);
+    close(report[0]);
+    waitpid(pid, NULL, 0);
+  }
+
+  printf("%-18s %8ld %10ld %7.1f%% %10.3f %10.3f\n", config->name, rows, bytes / runs,
+	 text_bytes > 0 ? 100.0 * bytes / runs / text_bytes : 100.0, send_ms / runs, read_ms / runs);
+
+  return bytes / runs;
+}
+
+int main(int argc, char** argv) {
+  struct snapshot* snapshot;
+  char*            query = DEFAULT_QUERY;
+  long             text_bytes = 0;
+  long             bytes;
+  int              runs = DEFAULT_RUNS;
+  int              opt;
+  int              i;
+
+  while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+    switch (opt) {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 1 || runs <= 0) {
+    fprintf(stderr, "Usage: result-bench [-n <runs>] [-q <query>] <snapshot>\n");
+    return EXIT_FAILURE;
+  }
+  if ((snapshot = open_snapshot(argv[optind])) == NULL)
+    return EXIT_FAILURE;
+
+  printf("%-18s %8s %10s %8s %10s %10s\n", "encoding", "rows", "bytes", "of text",
+	 "send ms", "read ms");
+  for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    if ((bytes = run_config(snapshot, query, &configs[i], runs, text_bytes)) < 0)
+      return EXIT_FAILURE;
+    if (i == 0)
+      text_bytes = bytes;
+  }
+
+  close_snapshot(snapshot);
+
+  return EXIT_SUCCESS;
+}
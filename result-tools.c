@@ -0,0 +1,492 @@
+/******************************************************************************
+
+PROGRAM:  result-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the text and compact encodings of search
+          results.  See result-tools.h for an overview.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "result-tools.h"
+#include "local-tools.h"
+#include "message-tools.h"
+
+#define ROW_TEXT_SIZE  (4 * RESULT_MAX_VALUE + 64)
+#define ROW_CODE_SIZE  (4 * (RESULT_MAX_VALUE + 10))
+
+static char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/******************************************************************************
+
+Removes an "ENCODING <names> " prefix from a request, if there is one, and
+returns the encoding it asks for, the flags of the comma separated names.
+Names this server does not know are ignored, so they are answered in text, and
+compression is only used along with compact batches.
+
+*******************************************************************************/
+int strip_encoding(char* message) {
+  char*  name;
+  size_t len;
+  int    encoding = ENCODING_TEXT;
+
+  if (strncmp(message, ENCODING_PREFIX, strlen(ENCODING_PREFIX)) != 0)
+    return ENCODING_TEXT;
+
+  name = message + strlen(ENCODING_PREFIX);
+  while (*name != '\0' && *name != ' ') {
+    len = strcspn(name, ", ");
+    if (len == strlen("compact") && strncmp(name, "compact", len) == 0)
+      encoding |= ENCODING_COMPACT;
+    else if (len == strlen("deflate") && strncmp(name, "deflate", len) == 0)
+      encoding |= ENCODING_DEFLATE;
+    name += len;
+    if (*name == ',')
+      name++;
+  }
+  if (*name == ' ')
+    name++;
+  memmove(message, name, strlen(name) + 1);
+
+  return encoding & ENCODING_COMPACT ? encoding : ENCODING_TEXT;
+}
+
+void format_result_row(char* row, size_t size, char** values) {
+  format_row(row, size, values, NULL);
+}
+
+static int put_varint(unsigned char* out, uint32_t value) {
+  int len = 0;
+
+  while (value >= 0x80) {
+    out[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[len++] = value;
+
+  return len;
+}
+
+static int put_string(unsigned char* out, char* text, size_t len) {
+  int header = put_varint(out, len);
+
+  memcpy(out + header, text, len);
+
+  return header + len;
+}
+
+// Packs "Oct 12" as month * 32 + day + 1, or returns 0 if written otherwise
+static uint32_t pack_date(char* date) {
+  char canonical[16];
+  char month[4];
+  int  day;
+  int  i;
+
+  if (sscanf(date, "%3s %d", month, &day) != 2 || day < 1 || day > 31)
+    return 0;
+  for (i = 0; i < 12 && strcmp(months[i], month) != 0; i++)
+    ;
+  if (i == 12)
+    return 0;
+  snprintf(canonical, sizeof(canonical), "%s %d", months[i], day);
+
+  return strcmp(canonical, date) == 0 ? i * 32 + day + 1 : 0;
+}
+
+// Packs "7:00 pm" as minutes after midnight + 1, or returns 0 if written otherwise
+static uint32_t pack_time(char* time) {
+  char canonical[16];
+  char half[3];
+  int  hour;
+  int  minute;
+
+  if (sscanf(time, "%d:%d %2s", &hour, &minute, half) != 3 || hour < 1 || hour > 12 ||
+      minute < 0 || minute > 59 || (strcmp(half, "am") != 0 && strcmp(half, "pm") != 0))
+    return 0;
+  snprintf(canonical, sizeof(canonical), "%d:%02d %s", hour, minute, half);
+  if (strcmp(canonical, time) != 0)
+    return 0;
+
+  return (hour % 12) * 60 + minute + (half[0] == 'p' ? 720 : 0) + 1;
+}
+
+static void free_dictionary(struct result_dictionary* dictionary) {
+  int i;
+
+  for (i = 0; i < dictionary->count; i++)
+    free(dictionary->strings[i]);
+  free(dictionary->strings);
+  free(dictionary->slots);
+  memset(dictionary, 0, sizeof(struct result_dictionary));
+}
+
+static void add_string(struct result_dictionary* dictionary, char* text, size_t len) {
+  if (dictionary->count == dictionary->capacity) {
+    dictionary->capacity = dictionary->capacity ? dictionary->capacity * 2 : 64;
+    dictionary->strings = realloc(dictionary->strings, dictionary->capacity * sizeof(char*));
+  }
+  if (dictionary->strings == NULL || (dictionary->strings[dictionary->count] = malloc(len + 1)) == NULL) {
+    fprintf(stderr, "Unable to grow result dictionary\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(dictionary->strings[dictionary->count], text, len);
+  dictionary->strings[dictionary->count][len] = '\0';
+  dictionary->count++;
+}
+
+static uint32_t hash_string(char* text) {
+  uint32_t hash = 2166136261u;
+
+  for (; *text != '\0'; text++)
+    hash = (hash ^ (unsigned char)*text) * 16777619u;
+
+  return hash;
+}
+
+/******************************************************************************
+
+Returns the index of 'text' in an encoder's dictionary, adding it at the end if
+it is not there yet.  The hash table of indexes is kept at most half full.
+
+*******************************************************************************/
+static int find_string(struct result_dictionary* dictionary, char* text) {
+  int* old_slots = dictionary->slots;
+  int  old_count = dictionary->slot_count;
+  int  slot;
+  int  i;
+
+  if (2 * (dictionary->count + 1) > dictionary->slot_count) {
+    dictionary->slot_count = dictionary->slot_count ? dictionary->slot_count * 2 : 256;
+    dictionary->slots = malloc(dictionary->slot_count * sizeof(int));
+    if (dictionary->slots == NULL) {
+      fprintf(stderr, "Unable to grow result dictionary\n");
+      exit(EXIT_FAILURE);
+    }
+    memset(dictionary->slots, -1, dictionary->slot_count * sizeof(int));
+    for (i = 0; i < old_count; i++)
+      if (old_slots[i] >= 0) {
+	slot = hash_string(dictionary->strings[old_slots[i]]) & (dictionary->slot_count - 1);
+	while (dictionary->slots[slot] >= 0)
+	  slot = (slot + 1) & (dictionary->slot_count - 1);
+	dictionary->slots[slot] = old_slots[i];
+      }
+    free(old_slots);
+  }
+
+  slot = hash_string(text) & (dictionary->slot_count - 1);
+  while (dictionary->slots[slot] >= 0) {
+    if (strcmp(dictionary->strings[dictionary->slots[slot]], text) == 0)
+      return dictionary->slots[slot];
+    slot = (slot + 1) & (dictionary->slot_count - 1);
+  }
+  dictionary->slots[slot] = dictionary->count;
+  add_string(dictionary, text, strlen(text));
+
+  return dictionary->count - 1;
+}
+
+// Encodes a name or location, defining it first if it is new to the result
+static int encode_string(struct result_dictionary* dictionary, char* text, unsigned char* out) {
+  int count = dictionary->count;
+  int index = find_string(dictionary, text);
+  int len = put_varint(out, index);
+
+  if (index == count)
+    len += put_string(out + len, text, strlen(text));
+
+  return len;
+}
+
+void start_results(struct result_encoder* encoder, SSL* ssl, int encoding) {
+  memset(encoder, 0, offsetof(struct result_encoder, batch));
+  encoder->ssl = ssl;
+  encoder->encoding = encoding;
+  encoder->level = RESULT_DEFLATE_LEVEL;
+}
+
+/******************************************************************************
+
+Sends one showtime, given as its name, location, date and time.  In text it
+goes out right away; compact, it is added to the current batch, which is sent
+first if the row does not fit.  A value too long for a batch, or a dictionary
+that is full, makes the row go out as text.  Returns -1 if the peer is gone.
+
+*******************************************************************************/
+int send_result_row(struct result_encoder* encoder, char** values) {
+  unsigned char code[ROW_CODE_SIZE];
+  char          row[ROW_TEXT_SIZE];
+  uint32_t      packed;
+  int           len = 0;
+  int           limit = RESULT_BATCH_SIZE;
+  int           i;
+
+  for (i = 0; i < 4 && strlen(values[i]) <= RESULT_MAX_VALUE; i++)
+    ;
+  if (!(encoder->encoding & ENCODING_COMPACT) || i < 4 ||
+      encoder->names.count >= RESULT_MAX_STRINGS - 1 ||
+      encoder->locations.count >= RESULT_MAX_STRINGS - 1) {
+    format_result_row(row, sizeof(row), values);
+    return send_result_text(encoder, row);
+  }
+
+  len += encode_string(&encoder->names, values[0], code + len);
+  len += encode_string(&encoder->locations, values[1], code + len);
+  if ((packed = pack_date(values[2])) != 0)
+    len += put_varint(code + len, packed);
+  else {
+    len += put_varint(code + len, 0);
+    len += put_string(code + len, values[2], strlen(values[2]));
+  }
+  if ((packed = pack_time(values[3])) != 0)
+    len += put_varint(code + len, packed);
+  else {
+    len += put_varint(code + len, 0);
+    len += put_string(code + len, values[3], strlen(values[3]));
+  }
+
+  // A batch to be compressed is kept a little short, in case it does not
+  if (encoder->encoding & ENCODING_DEFLATE)
+    limit -= RESULT_DEFLATE_SLACK;
+  if (encoder->len + len > limit && flush_results(encoder) < 0)
+    return -1;
+  if (encoder->len == 0)
+    encoder->batch[encoder->len++] = RESULT_BATCH_MARKER;
+  memcpy(encoder->batch + encoder->len, code, len);
+  encoder->len += len;
+
+  return 0;
+}
+
+// Sends a message as is, after any rows still waiting in a batch
+int send_result_text(struct result_encoder* encoder, char* message) {
+  int len = strlen(message) + 1;
+
+  if (flush_results(encoder) < 0 || peer_write(encoder->ssl, message, len) <= 0)
+    return -1;
+  encoder->bytes += len;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Compresses the batch of 'len' bytes waiting in the encoder into its 'packed'
+buffer, as the next part of the result's deflate stream.  Returns the length
+of the compressed batch, or -1 if it could not be compressed.
+
+*******************************************************************************/
+static int deflate_batch(struct result_encoder* encoder, int len) {
+  z_stream* stream = &encoder->deflater;
+
+  // Raw deflate: the stream has no header or checksum, TLS already has one
+  if (!encoder->deflating) {
+    if (deflateInit2(stream, encoder->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      fprintf(stderr, "Unable to start compressing results\n");
+      return -1;
+    }
+    encoder->deflating = 1;
+  }
+
+  stream->next_in = encoder->batch + 1;
+  stream->avail_in = len - 1;
+  stream->next_out = encoder->packed + 1;
+  stream->avail_out = RESULT_BATCH_SIZE - 1;
+  if (deflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in > 0 || stream->avail_out == 0) {
+    fprintf(stderr, "Unable to compress a result batch\n");
+    return -1;
+  }
+  encoder->packed[0] = RESULT_DEFLATED_MARKER;
+
+  return RESULT_BATCH_SIZE - stream->avail_out;
+}
+
+int flush_results(struct result_encoder* encoder) {
+  unsigned char* data = encoder->batch;
+  int            len = encoder->len;
+
+  if (len == 0)
+    return 0;
+  encoder->len = 0;
+  if ((encoder->encoding & ENCODING_DEFLATE) && len >= RESULT_DEFLATE_MIN) {
+    if ((len = deflate_batch(encoder, len)) < 0)
+      return -1;
+    data = encoder->packed;
+  }
+  if (peer_write(encoder->ssl, data, len) <= 0)
+    return -1;
+  encoder->bytes += len;
+
+  return 0;
+}
+
+// Sends what is left and frees the dictionaries and compression stream
+void finish_results(struct result_encoder* encoder) {
+  flush_results(encoder);
+  free_dictionary(&encoder->names);
+  free_dictionary(&encoder->locations);
+  if (encoder->deflating)
+    deflateEnd(&encoder->deflater);
+  encoder->deflating = 0;
+}
+
+void start_result_decoder(struct result_decoder* decoder) {
+  memset(decoder, 0, offsetof(struct result_decoder, message));
+}
+
+void finish_result_decoder(struct result_decoder* decoder) {
+  free_dictionary(&decoder->names);
+  free_dictionary(&decoder->locations);
+  if (decoder->inflating)
+    inflateEnd(&decoder->inflater);
+  decoder->inflating = 0;
+  decoder->len = 0;
+  decoder->pos = 0;
+}
+
+static int get_varint(struct result_decoder* decoder, uint32_t* value) {
+  int shift;
+
+  *value = 0;
+  for (shift = 0; shift < 35 && decoder->pos < decoder->len; shift += 7) {
+    *value |= (uint32_t)(decoder->data[decoder->pos] & 0x7f) << shift;
+    if ((decoder->data[decoder->pos++] & 0x80) == 0)
+      return 0;
+  }
+
+  return -1;
+}
+
+static int get_string(struct result_decoder* decoder, char* value) {
+  uint32_t len;
+
+  if (get_varint(decoder, &len) < 0 || len > RESULT_MAX_VALUE ||
+      len > (uint32_t)(decoder->len - decoder->pos))
+    return -1;
+  memcpy(value, decoder->data + decoder->pos, len);
+  value[len] = '\0';
+  decoder->pos += len;
+
+  return 0;
+}
+
+static int decode_string(struct result_decoder* decoder, struct result_dictionary* dictionary,
+			 char* value) {
+  uint32_t index;
+
+  if (get_varint(decoder, &index) < 0 || index > (uint32_t)dictionary->count)
+    return -1;
+  if (index < (uint32_t)dictionary->count) {
+    strcpy(value, dictionary->strings[index]);
+    return 0;
+  }
+  if (dictionary->count == RESULT_MAX_STRINGS || get_string(decoder, value) < 0)
+    return -1;
+  add_string(dictionary, value, strlen(value));
+
+  return 0;
+}
+
+// Decodes the next row of the current batch as text.  Returns -1 if malformed.
+static int decode_row(struct result_decoder* decoder, char* row, size_t size) {
+  char     text[4][RESULT_MAX_VALUE + 1];
+  char*    values[4] = { text[0], text[1], text[2], text[3] };
+  uint32_t packed;
+
+  if (decode_string(decoder, &decoder->names, text[0]) < 0 ||
+      decode_string(decoder, &decoder->locations, text[1]) < 0 ||
+      get_varint(decoder, &packed) < 0)
+    return -1;
+  if (packed == 0) {
+    if (get_string(decoder, text[2]) < 0)
+      return -1;
+  } else if (--packed / 32 >= 12)
+    return -1;
+  else
+    snprintf(text[2], sizeof(text[2]), "%s %u", months[packed / 32], packed % 32);
+
+  if (get_varint(decoder, &packed) < 0)
+    return -1;
+  if (packed == 0) {
+    if (get_string(decoder, text[3]) < 0)
+      return -1;
+  } else if (--packed >= 24 * 60)
+    return -1;
+  else
+    snprintf(text[3], sizeof(text[3]), "%u:%02u %s", (packed / 60) % 12 ? (packed / 60) % 12 : 12,
+	     packed % 60, packed >= 720 ? "pm" : "am");
+
+  format_result_row(row, size, values);
+
+  return 0;
+}
+
+// Decompresses a batch of 'len' bytes into 'inflated'.  Returns its length, or -1.
+static int inflate_batch(struct result_decoder* decoder, int len) {
+  z_stream* stream = &decoder->inflater;
+
+  if (!decoder->inflating) {
+    if (inflateInit2(stream, -15) != Z_OK)
+      return -1;
+    decoder->inflating = 1;
+  }
+
+  stream->next_in = decoder->message + 1;
+  stream->avail_in = len - 1;
+  stream->next_out = decoder->inflated + 1;
+  stream->avail_out = RESULT_BATCH_SIZE - 1;
+  if (inflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in > 0 || stream->avail_out == 0)
+    return -1;
+  decoder->inflated[0] = RESULT_BATCH_MARKER;
+
+  return RESULT_BATCH_SIZE - stream->avail_out;
+}
+
+/******************************************************************************
+
+Reads the next message of a result into 'row', as SSL_read() would, except
+that row batches are decompressed if need be, then taken apart and their rows
+returned one at a time as the text they stand for.  Returns the length of the message, including its
+terminating NUL, or what SSL_read() returned if the read failed.  A batch that
+can not be decoded fails the read with errno set to EPROTO.
+
+*******************************************************************************/
+int read_result(struct result_decoder* decoder, SSL* ssl, char* row, size_t size) {
+  int nbytes;
+
+  while (decoder->pos >= decoder->len) {
+    nbytes = peer_read(ssl, decoder->message, RESULT_BATCH_SIZE);
+    if (nbytes <= 0)
+      return nbytes;
+    if (decoder->message[0] == RESULT_BATCH_MARKER) {
+      decoder->data = decoder->message;
+      decoder->len = nbytes;
+    } else if (decoder->message[0] == RESULT_DEFLATED_MARKER) {
+      if ((decoder->len = inflate_batch(decoder, nbytes)) < 0) {
+	decoder->len = 0;
+	errno = EPROTO;
+	return -1;
+      }
+      decoder->data = decoder->inflated;
+    } else {
+      decoder->message[nbytes] = '\0';
+      snprintf(row, size, "%s", (char*)decoder->message);
+      return strlen(row) + 1;
+    }
+    decoder->pos = 1;
+  }
+
+  if (decode_row(decoder, row, size) < 0) {
+    decoder->pos = decoder->len;
+    errno = EPROTO;
+    return -1;
+  }
+
+  return strlen(row) + 1;
+}
@@ -0,0 +1,116 @@
+/******************************************************************************
+
+PROGRAM:  result-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for encoding search
+          results.  By default every showtime is sent as its own message,
+          labelled text such as
+
+            Name: Dune Location: Phoenix,AZ Date: Oct 12 Time: 7:00 pm
+
+          so the same titles and cities are sent, and encrypted, over and over.
+          A peer that puts "ENCODING compact " before its request (after any
+          deadline) may instead be sent row batches: binary messages starting
+          with RESULT_BATCH_MARKER, each holding as many rows as fit in one
+          TLS record.  Every row is four unsigned LEB128 varints:
+
+            name, location   index into a dictionary kept for the whole result;
+                             an index one past the end is followed by the
+                             length and bytes of a new entry
+            date             month * 32 + day + 1 for dates such as "Oct 12"
+            time             minutes after midnight + 1 for times such as
+                             "7:00 pm"
+
+          A date or time written any other way is sent as 0 followed by its
+          length and bytes, so any value survives unchanged.  Everything
+          other than showtimes, e.g., title completions and the final "DONE",
+          stays text, and the reader tells the two apart by the first byte.
+          The peer that asked may always be sent text; it is only the sender
+          that chooses to use batches.
+
+          Asking for "ENCODING compact,deflate " also has batches of at least
+          RESULT_DEFLATE_MIN bytes compressed with deflate (zlib) and sent
+          starting with RESULT_DEFLATED_MARKER instead.  The batches of a
+          result are compressed as one stream, flushed after every batch, so
+          each batch can be decompressed as it arrives but may still refer
+          back to the batches before it.  Smaller batches are sent as they
+          are, since compressing them would save next to nothing.
+
+******************************************************************************/
+
+#ifndef _RESULTTOOLS_H_
+#define _RESULTTOOLS_H_
+
+#include <stddef.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+
+#define ENCODING_PREFIX        "ENCODING "
+#define ENCODING_TEXT          0
+#define ENCODING_COMPACT       1          // Encodings are flags, as in "compact,deflate"
+#define ENCODING_DEFLATE       2
+#define RESULT_BATCH_MARKER    0x01
+#define RESULT_DEFLATED_MARKER 0x02
+#define RESULT_BATCH_SIZE      16384      // Largest batch, the most a TLS record holds
+#define RESULT_MAX_VALUE       255        // Longest value a batch can carry
+#define RESULT_MAX_STRINGS     65536      // Most entries a dictionary may grow to
+#define RESULT_DEFLATE_MIN     512        // Smallest batch worth compressing
+#define RESULT_DEFLATE_SLACK   64         // Room left in a batch for deflate to grow it
+#define RESULT_DEFLATE_LEVEL   1          // Fastest; the batches are small already
+
+struct result_dictionary {
+  int    count;
+  int    capacity;
+  char** strings;
+  int*   slots;                         // Hash table of indexes, -1 if free (encoder only)
+  int    slot_count;
+};
+
+struct result_encoder {
+  SSL*                     ssl;
+  int                      encoding;
+  long                     bytes;       // Sent, including text messages
+  struct result_dictionary names;
+  struct result_dictionary locations;
+  z_stream                 deflater;
+  int                      deflating;   // Whether 'deflater' has been set up
+  int                      level;       // Of compression, RESULT_DEFLATE_LEVEL unless changed
+  int                      len;
+  unsigned char            batch[RESULT_BATCH_SIZE];
+  unsigned char            packed[RESULT_BATCH_SIZE];
+};
+
+struct result_decoder {
+  struct result_dictionary names;
+  struct result_dictionary locations;
+  z_stream                 inflater;
+  int                      inflating;   // Whether 'inflater' has been set up
+  unsigned char*           data;        // The batch being read, 'message' or 'inflated'
+  int                      len;
+  int                      pos;         // Next row in 'data', 'len' if none
+  unsigned char            message[RESULT_BATCH_SIZE + 1];
+  unsigned char            inflated[RESULT_BATCH_SIZE];
+};
+
+int strip_encoding(char* message);
+
+void format_result_row(char* row, size_t size, char** values);
+
+void start_results(struct result_encoder* encoder, SSL* ssl, int encoding);
+
+int send_result_row(struct result_encoder* encoder, char** values);
+
+int send_result_text(struct result_encoder* encoder, char* message);
+
+int flush_results(struct result_encoder* encoder);
+
+void finish_results(struct result_encoder* encoder);
+
+void start_result_decoder(struct result_decoder* decoder);
+
+int read_result(struct result_decoder* decoder, SSL* ssl, char* row, size_t size);
+
+void finish_result_decoder(struct result_decoder* decoder);
+
+#endif
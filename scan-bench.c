@@ -0,0 +1,132 @@
+/******************************************************************************
+
+PROGRAM:  scan-bench.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program measures how fast the Tier 2 server searches a
+          snapshot (see snapshot-tool.c) by date and time alone, the
+          searches that scan every row:
+
+          scan-bench [-n <runs>] [-q <query>] <snapshot>
+
+          Each query, a few typical ones unless one is given with -q, is run
+          with every scan kernel this processor supports (see scan-tools.h)
+          on a single core, and the rows scanned per second printed for
+          each.  The number of showtimes found is printed too, and must be
+          the same for every kernel.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan-tools.h"
+#include "snapshot-tools.h"
+
+#define DEFAULT_RUNS    200
+
+char* default_queries[] = {
+  "SELECT * FROM movie_times WHERE time = '7:00 pm' ORDER BY name, location, date, time",
+  "SELECT * FROM movie_times WHERE date = 'Oct 12' ORDER BY name, location, date, time",
+  "SELECT * FROM movie_times WHERE date = 'Oct 12' AND time = '1:00 pm' ORDER BY name, location, date, time",
+  NULL
+};
+
+double cpu_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+void count_row(void* context, char** values) {
+  (*(long*)context)++;
+}
+
+/******************************************************************************
+
+Runs 'query' 'runs' times with each kernel and prints the showtimes found and
+the rows scanned per second.  Returns -1 if the query can not be answered from
+the snapshot or the kernels do not agree, otherwise 0.
+
+*******************************************************************************/
+int run_query(struct snapshot* snapshot, char* query, int runs) {
+  double elapsed;
+  double start;
+  long   expected = -1;
+  long   found;
+  int    kernel;
+  int    run;
+
+  printf("%s\n", query);
+  for (kernel = 0; kernel < SCAN_KERNELS; kernel++) {
+    if (set_scan_kernel(kernel) < 0)
+      continue;
+    start = cpu_ms();
+    for (run = 0; run < runs; run++) {
+      found = 0;
+      if (query_snapshot(snapshot, query, count_row, &found) < 0) {
+	fprintf(stderr, "Bench: The query can not be answered from the snapshot\n");
+	return -1;
+      }
+    }
+    elapsed = cpu_ms() - start;
+
+    printf("  %-8s %8ld found %12.0f rows/s %10.3f ms\n", scan_kernel_name(kernel), found,
+	   elapsed > 0 ? (double)snapshot->header->row_count * runs / (elapsed / 1000) : 0,
+	   elapsed / runs);
+    if (expected >= 0 && found != expected) {
+      fprintf(stderr, "Bench: %s found %ld showtimes instead of %ld\n",
+	      scan_kernel_name(kernel), found, expected);
+      return -1;
+    }
+    expected = found;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  struct snapshot* snapshot;
+  char*            queries[] = { NULL, NULL };
+  char**           query = default_queries;
+  int              runs = DEFAULT_RUNS;
+  int              status = EXIT_SUCCESS;
+  int              opt;
+
+  while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+    switch (opt) {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'q':
+      queries[0] = optarg;
+      query = queries;
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 1 || runs <= 0) {
+    fprintf(stderr, "Usage: scan-bench [-n <runs>] [-q <query>] <snapshot>\n");
+    return EXIT_FAILURE;
+  }
+  if ((snapshot = open_snapshot(argv[optind])) == NULL)
+    return EXIT_FAILURE;
+
+  printf("%u rows, best kernel %s\n", snapshot->header->row_count,
+	 scan_kernel_name(best_scan_kernel()));
+  for (; *query != NULL && status == EXIT_SUCCESS; query++)
+    if (run_query(snapshot, *query, runs) < 0)
+      status = EXIT_FAILURE;
+
+  close_snapshot(snapshot);
+
+  return status;
+}
@@ -0,0 +1,232 @@
+/******************************************************************************
+
+PROGRAM:  scan-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the column scans of snapshot searches.  See
+          scan-tools.h for an overview.  The AVX2 and SSE4.2 versions are
+          compiled for those instruction sets function by function, so the
+          program as a whole still runs on any x86 processor.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#include "scan-tools.h"
+
+static char* kernel_names[SCAN_KERNELS] = { "scalar", "SSE4.2", "AVX2" };
+
+// Chosen by the first scan, unless set_scan_kernel() chose it before
+static int kernel = -1;
+
+// Adds the ids from 'low' to 'high' to those a condition accepts, or returns
+// -1 if it has as many ranges as it can hold
+int add_scan_range(struct scan_condition* condition, uint32_t low, uint32_t high) {
+  if (condition->count == SCAN_MAX_RANGES)
+    return -1;
+  condition->low[condition->count] = low;
+  condition->high[condition->count] = high;
+  condition->count++;
+
+  return 0;
+}
+
+// Returns, as the low 'n' bits of a word, which of the rows from 'first' on a condition accepts
+static uint64_t match_rows(struct scan_condition* condition, uint32_t first, int n) {
+  uint64_t mask = 0;
+  uint32_t id;
+  int      bit;
+  int      r;
+
+  for (bit = 0; bit < n; bit++) {
+    id = condition->column[first + bit];
+    // One unsigned comparison checks both ends of the range
+    for (r = 0; r < condition->count; r++)
+      if (id - condition->low[r] <= condition->high[r] - condition->low[r]) {
+	mask |= 1ULL << bit;
+	break;
+      }
+  }
+
+  return mask;
+}
+
+static void scan_scalar(struct scan_condition* condition, uint32_t blocks, uint64_t* selected) {
+  uint32_t block;
+
+  for (block = 0; block < blocks; block++)
+    if (selected[block] != 0)
+      selected[block] &= match_rows(condition, block * SCAN_BLOCK, SCAN_BLOCK);
+}
+
+#ifdef SCAN_X86
+
+/******************************************************************************
+
+Clears the bit of every row of the first 'blocks' blocks that a condition does
+not accept, 4 rows at a time.  An id is in a range if it is at least the low
+end and, after subtracting that, at most the width of the range; SSE has no
+unsigned comparison, so the second test is done as min(offset, width) ==
+offset.  Blocks with no rows left are skipped.
+
+*******************************************************************************/
+__attribute__((target("sse4.2")))
+static void scan_sse42(struct scan_condition* condition, uint32_t blocks, uint64_t* selected) {
+  __m128i  lows[SCAN_MAX_RANGES];
+  __m128i  widths[SCAN_MAX_RANGES];
+  __m128i  ids;
+  __m128i  offset;
+  __m128i  in;
+  uint64_t mask;
+  uint32_t block;
+  int      bit;
+  int      r;
+
+  for (r = 0; r < condition->count; r++) {
+    lows[r] = _mm_set1_epi32((int)condition->low[r]);
+    widths[r] = _mm_set1_epi32((int)(condition->high[r] - condition->low[r]));
+  }
+
+  for (block = 0; block < blocks; block++) {
+    if (selected[block] == 0)
+      continue;
+    mask = 0;
+    for (bit = 0; bit < SCAN_BLOCK; bit += 4) {
+      ids = _mm_loadu_si128((const __m128i*)(condition->column + (size_t)block * SCAN_BLOCK + bit));
+      in = _mm_setzero_si128();
+      for (r = 0; r < condition->count; r++) {
+	offset = _mm_sub_epi32(ids, lows[r]);
+	in = _mm_or_si128(in, _mm_cmpeq_epi32(_mm_min_epu32(offset, widths[r]), offset));
+      }
+      mask |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(in)) << bit;
+    }
+    selected[block] &= mask;
+  }
+}
+
+// The same as scan_sse42(), 8 rows at a time
+__attribute__((target("avx2")))
+static void scan_avx2(struct scan_condition* condition, uint32_t blocks, uint64_t* selected) {
+  __m256i  lows[SCAN_MAX_RANGES];
+  __m256i  widths[SCAN_MAX_RANGES];
+  __m256i  ids;
+  __m256i  offset;
+  __m256i  in;
+  uint64_t mask;
+  uint32_t block;
+  int      bit;
+  int      r;
+
+  for (r = 0; r < condition->count; r++) {
+    lows[r] = _mm256_set1_epi32((int)condition->low[r]);
+    widths[r] = _mm256_set1_epi32((int)(condition->high[r] - condition->low[r]));
+  }
+
+  for (block = 0; block < blocks; block++) {
+    if (selected[block] == 0)
+      continue;
+    mask = 0;
+    for (bit = 0; bit < SCAN_BLOCK; bit += 8) {
+      ids = _mm256_loadu_si256((const __m256i*)(condition->column + (size_t)block * SCAN_BLOCK + bit));
+      in = _mm256_setzero_si256();
+      for (r = 0; r < condition->count; r++) {
+	offset = _mm256_sub_epi32(ids, lows[r]);
+	in = _mm256_or_si256(in, _mm256_cmpeq_epi32(_mm256_min_epu32(offset, widths[r]), offset));
+      }
+      mask |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(in)) << bit;
+    }
+    selected[block] &= mask;
+  }
+}
+
+#endif
+
+/******************************************************************************
+
+Sets a bit in 'selected', which must have room for one bit per row rounded up
+to whole 64-bit words, for every one of the first 'rows' rows that meets all
+'count' conditions, and clears the others.  Bit i % 64 of word i / 64 stands
+for row i.  Conditions are applied one column at a time, each only to the
+blocks of rows the ones before left anything in.
+
+*******************************************************************************/
+void scan_rows(struct scan_condition* conditions, int count, uint32_t rows, uint64_t* selected) {
+  uint32_t blocks = rows / SCAN_BLOCK;
+  int      tail = rows % SCAN_BLOCK;
+  int      i;
+
+  if (kernel < 0)
+    kernel = best_scan_kernel();
+
+  memset(selected, 0xff, blocks * sizeof(uint64_t));
+  if (tail > 0)
+    selected[blocks] = (1ULL << tail) - 1;
+
+  for (i = 0; i < count; i++) {
+    switch (kernel) {
+#ifdef SCAN_X86
+    case SCAN_AVX2:
+      scan_avx2(&conditions[i], blocks, selected);
+      break;
+    case SCAN_SSE42:
+      scan_sse42(&conditions[i], blocks, selected);
+      break;
+#endif
+    default:
+      scan_scalar(&conditions[i], blocks, selected);
+      break;
+    }
+    if (tail > 0)
+      selected[blocks] &= match_rows(&conditions[i], blocks * SCAN_BLOCK, tail);
+  }
+}
+
+// Returns the first selected row from 'row' on, or 'rows' if there is none
+uint32_t next_selected(uint64_t* selected, uint32_t rows, uint32_t row) {
+  uint64_t word;
+
+  if (row >= rows)
+    return rows;
+  word = selected[row / SCAN_BLOCK] & (~0ULL << (row % SCAN_BLOCK));
+  while (word == 0) {
+    row = (row / SCAN_BLOCK + 1) * SCAN_BLOCK;
+    if (row >= rows)
+      return rows;
+    word = selected[row / SCAN_BLOCK];
+  }
+
+  return (row / SCAN_BLOCK) * SCAN_BLOCK + __builtin_ctzll(word);
+}
+
+// The fastest kernel this processor can run
+int best_scan_kernel() {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SCAN_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return SCAN_SSE42;
+#endif
+  return SCAN_SCALAR;
+}
+
+// Makes every later scan use 'new_kernel', e.g., to compare them.  Returns -1
+// if this processor can not run it.
+int set_scan_kernel(int new_kernel) {
+  if (new_kernel < 0 || new_kernel > best_scan_kernel())
+    return -1;
+  kernel = new_kernel;
+
+  return 0;
+}
+
+char* scan_kernel_name(int which) {
+  return which >= 0 && which < SCAN_KERNELS ? kernel_names[which] : "unknown";
+}
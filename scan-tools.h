@@ -0,0 +1,55 @@
+/******************************************************************************
+
+PROGRAM:  scan-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for scanning the
+          columns of a snapshot (see snapshot-tools.h) when a search has no
+          name or location to narrow the rows down, e.g., a search by date
+          or time alone.  Every column is an array of 32-bit string ids, and
+          strings are sorted, so the values a condition accepts are one or a
+          few runs of consecutive ids.  A condition is therefore given as up
+          to SCAN_MAX_RANGES ranges of ids, and a scan produces a bitmap with
+          a bit set for every row whose ids fall in a range of every
+          condition.
+
+          The scan is done with AVX2 (8 rows at a time) or SSE4.2 (4 rows at
+          a time) instructions when the processor has them, checked when the
+          first scan runs, and with plain C otherwise; all three give the
+          same bitmap.
+
+******************************************************************************/
+
+#ifndef _SCANTOOLS_H_
+#define _SCANTOOLS_H_
+
+#include <stdint.h>
+
+#define SCAN_MAX_RANGES   8        // More runs than this are left to the caller
+#define SCAN_BLOCK        64       // Rows per word of a bitmap
+
+#define SCAN_SCALAR       0
+#define SCAN_SSE42        1
+#define SCAN_AVX2         2
+#define SCAN_KERNELS      3
+
+struct scan_condition {
+  const uint32_t* column;
+  int             count;                     // Ranges; 0 accepts no row
+  uint32_t        low[SCAN_MAX_RANGES];
+  uint32_t        high[SCAN_MAX_RANGES];     // Inclusive
+};
+
+int add_scan_range(struct scan_condition* condition, uint32_t low, uint32_t high);
+
+void scan_rows(struct scan_condition* conditions, int count, uint32_t rows, uint64_t* selected);
+
+uint32_t next_selected(uint64_t* selected, uint32_t rows, uint32_t row);
+
+int best_scan_kernel();
+
+int set_scan_kernel(int kernel);
+
+char* scan_kernel_name(int kernel);
+
+#endif
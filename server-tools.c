@@ -15,13 +15,18 @@ SYNOPSIS: This header file provides function signatures that allow applications
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #include "server-tools.h"
+#include "tls-tools.h"
+
+SSL_CTX* ctx;
 
 /******************************************************************************
 
@@ -206,10 +211,15 @@ SSL* create_ssl_socket(int sockfd) {
   SSL_CTX* ssl_ctx;
   SSL*     ssl;
 
-  // Initialize and create SSL data structures and algorithms
+  // Initialize and create SSL data structures and algorithms.  The fast
+  // profile shares one context, made before the server forked
   init_openssl();
-  ssl_ctx = create_new_context();
-  configure_context(ssl_ctx);
+  if (tls_profile == TLS_PROFILE_FAST)
+    ssl_ctx = fast_server_context();
+  else {
+    ssl_ctx = create_new_context();
+    configure_context(ssl_ctx);
+  }
 
   // Create a new SSL object to bind to the socket descriptor
   ssl = SSL_new(ssl_ctx);
@@ -227,3 +237,41 @@ void cleanup_ssl(SSL* ssl) {
   SSL_free(ssl);
 }
 
+/******************************************************************************
+
+Bounds every later read from and write to the socket by 'timeout_ms', so a peer
+that stops responding turns into a failed SSL_read() or SSL_write() instead of
+a process blocked forever.
+
+*******************************************************************************/
+void set_socket_timeout(int sockfd, long timeout_ms) {
+  struct timeval timeout;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/******************************************************************************
+
+A request may start with "DEADLINE <ms> ", the number of milliseconds the
+sender will wait for the answer.  This removes that prefix from 'message' and
+returns the number of milliseconds, or 0 if there was no deadline.
+
+*******************************************************************************/
+long strip_deadline(char* message) {
+  char* rest;
+  long  deadline_ms;
+
+  if (strncmp(message, DEADLINE_PREFIX, strlen(DEADLINE_PREFIX)) != 0)
+    return 0;
+
+  deadline_ms = strtol(message + strlen(DEADLINE_PREFIX), &rest, 10);
+  if (*rest == ' ')
+    rest++;
+  memmove(message, rest, strlen(rest) + 1);
+
+  // A deadline already passed still has to be told apart from none
+  return deadline_ms > 0 ? deadline_ms : 1;
+}
@@ -21,8 +21,10 @@ SYNOPSIS: This header file provides function signatures that allow applications
 #define DEFAULT_PORT      4433
 #define CERTIFICATE_FILE  "cert.pem"
 #define KEY_FILE          "key.pem"
+#define REQUEST_TIMEOUT   10000    // Milliseconds a peer may take to send a request
+#define DEADLINE_PREFIX   "DEADLINE "
 
-SSL_CTX* ctx;
+extern SSL_CTX* ctx;
 
 void init_openssl();
 
@@ -32,4 +34,8 @@ SSL* create_ssl_socket(int sockfd);
 
 void cleanup_ssl(SSL* ssl);
 
+void set_socket_timeout(int sockfd, long timeout_ms);
+
+long strip_deadline(char* message);
+
 #endif
@@ -0,0 +1,430 @@
+/******************************************************************************
+
+PROGRAM:  shard-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements location sharding and scatter-gather queries
+          for the Tier 1 server.  See shard-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+
+#include "shard-tools.h"
+#include "local-tools.h"
+
+struct shard_map* create_shard_map() {
+  struct shard_map* map;
+
+  map = calloc(1, sizeof(struct shard_map));
+  if (map == NULL) {
+    fprintf(stderr, "Server: Unable to allocate shard map\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return map;
+}
+
+/******************************************************************************
+
+Adds a new, empty shard to the map and returns its backend pool, to which the
+caller adds the shard's Tier 2 servers.
+
+*******************************************************************************/
+struct backend_pool* add_shard(struct shard_map* map, int policy) {
+  if (map->count == MAX_SHARDS) {
+    fprintf(stderr, "Server: Too many shards (at most %d)\n", MAX_SHARDS);
+    exit(EXIT_FAILURE);
+  }
+
+  map->shards[map->count] = create_backend_pool(policy);
+
+  return map->shards[map->count++];
+}
+
+/******************************************************************************
+
+Locations are typed by people, so "Denver, CO", "denver,co" and "Denver,CO"
+must all end up on the same shard.  This copies 'location' into 'key' with the
+spaces removed and letters lowercased.
+
+*******************************************************************************/
+static void location_key(char* location, char* key) {
+  int i = 0;
+
+  for (; *location != '\0' && i < MAX_LOCATION_LENGTH - 1; location++)
+    if (!isspace((unsigned char)*location))
+      key[i++] = tolower((unsigned char)*location);
+  key[i] = '\0';
+}
+
+/******************************************************************************
+
+Reads a shard map file (see shard-tools.h for the format).  Shards must be
+listed in order starting from 0, and must be defined before any location line
+refers to them.  Returns the number of shards, and terminates the program if
+the file can not be used since the server can not route queries without it.
+
+*******************************************************************************/
+int load_shard_map(struct shard_map* map, char* filename, int policy, unsigned int default_port) {
+  struct backend_pool* pool;
+  FILE*                file;
+  char                 line[1024];
+  char*                word;
+  int                  line_number = 0;
+  int                  id;
+
+  file = fopen(filename, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Server: Cannot open shard map %s: %s\n", filename, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    word = strtok(line, " \t\r\n");
+    if (word == NULL || word[0] == '#')
+      continue;
+
+    if (strcmp(word, "shard") == 0) {
+      word = strtok(NULL, " \t\r\n");
+      if (word == NULL || atoi(word) != map->count) {
+	fprintf(stderr, "Server: %s:%d: shards must be numbered 0, 1, 2, ...\n",
+		filename, line_number);
+	exit(EXIT_FAILURE);
+      }
+      pool = add_shard(map, policy);
+      while ((word = strtok(NULL, " \t\r\n")) != NULL)
+	add_backend(pool, word, default_port);
+      if (pool->count == 0) {
+	fprintf(stderr, "Server: %s:%d: shard has no servers\n", filename, line_number);
+	exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(word, "location") == 0) {
+      // The location itself may contain spaces, so the shard id is the last word
+      word = strtok(NULL, "\r\n");
+      if (word == NULL || strrchr(word, ' ') == NULL ||
+	  map->location_count == MAX_SHARD_LOCATIONS) {
+	fprintf(stderr, "Server: %s:%d: expected 'location <city,state> <shard>'\n",
+		filename, line_number);
+	exit(EXIT_FAILURE);
+      }
+      id = atoi(strrchr(word, ' ') + 1);
+      *strrchr(word, ' ') = '\0';
+      if (id < 0 || id >= map->count) {
+	fprintf(stderr, "Server: %s:%d: unknown shard %d\n", filename, line_number, id);
+	exit(EXIT_FAILURE);
+      }
+      location_key(word, map->locations[map->location_count].location);
+      map->locations[map->location_count++].shard = id;
+    } else {
+      fprintf(stderr, "Server: %s:%d: unknown directive '%s'\n", filename, line_number, word);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fclose(file);
+
+  if (map->count == 0) {
+    fprintf(stderr, "Server: Shard map %s defines no shards\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  return map->count;
+}
+
+/******************************************************************************
+
+Returns the shard holding the rows for 'location': the one given in the map if
+the location is listed there, otherwise one chosen by a hash (FNV-1a) of the
+location so that every Tier 1 server agrees on it.
+
+*******************************************************************************/
+int shard_for_location(struct shard_map* map, char* location) {
+  char          key[MAX_LOCATION_LENGTH];
+  unsigned int  hash = 2166136261u;
+  int           i;
+
+  location_key(location, key);
+  for (i = 0; i < map->location_count; i++)
+    if (strcmp(map->locations[i].location, key) == 0)
+      return map->locations[i].shard;
+
+  for (i = 0; key[i] != '\0'; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+  return hash % map->count;
+}
+
+// Returns 1 once the first message of 'stream' can be read without waiting, and
+// 0 if all that arrived was part of it or TLS housekeeping, e.g., a ticket
+static int first_row_ready(struct shard_stream* stream) {
+  char byte;
+  int  flags;
+  int  result;
+
+  if (is_plain(stream->ssl))
+    return 1;
+
+  flags = fcntl(stream->sockfd, F_GETFL);
+  fcntl(stream->sockfd, F_SETFL, flags | O_NONBLOCK);
+  result = SSL_peek(stream->ssl, &byte, 1);
+  fcntl(stream->sockfd, F_SETFL, flags);
+
+  return result > 0 || SSL_get_error(stream->ssl, result) != SSL_ERROR_WANT_READ;
+}
+
+/******************************************************************************
+
+Reads the first message of every stream that was sent its query, in whatever
+order the shards answer.  Each shard has 'timeout_ms' from when its query was
+sent to start answering; one that does not is marked STREAM_FAILED and timed
+out, without holding up the others.
+
+*******************************************************************************/
+static void read_first_rows(struct shard_stream* streams, int count, int timeout_ms) {
+  struct pollfd   fds[MAX_SHARDS];
+  int             waiting[MAX_SHARDS];
+  int             polled[MAX_SHARDS];
+  long            left_ms;
+  int             wait_ms;
+  int             n;
+  int             i;
+
+  for (i = 0; i < count; i++)
+    waiting[i] = streams[i].state == STREAM_ROW;
+
+  while (1) {
+    n = 0;
+    wait_ms = -1;
+    for (i = 0; i < count; i++) {
+      if (!waiting[i])
+	continue;
+      // What OpenSSL already holds does not make the socket readable
+      if (SSL_has_pending(streams[i].ssl)) {
+	advance_shard_stream(&streams[i]);
+	waiting[i] = 0;
+	continue;
+      }
+      left_ms = timeout_ms - elapsed_us(&streams[i].sent) / 1000;
+      if (left_ms <= 0) {
+	fprintf(stderr, "Server: Shard %d timed out\n", streams[i].shard);
+	streams[i].timed_out = 1;
+	streams[i].state = STREAM_FAILED;
+	waiting[i] = 0;
+	continue;
+      }
+      fds[n].fd = streams[i].sockfd;
+      fds[n].events = POLLIN;
+      fds[n].revents = 0;
+      polled[n++] = i;
+      if (wait_ms < 0 || left_ms < wait_ms)
+	wait_ms = left_ms;
+    }
+    if (n == 0)
+      return;
+
+    // Should poll() itself fail, the reads fall back to their socket timeout
+    if (poll(fds, n, wait_ms) < 0 && errno != EINTR)
+      for (i = 0; i < n; i++)
+	fds[i].revents = POLLIN;
+    for (i = 0; i < n; i++)
+      if (fds[i].revents != 0 && first_row_ready(&streams[polled[i]])) {
+	advance_shard_stream(&streams[polled[i]]);
+	waiting[polled[i]] = 0;
+      }
+  }
+}
+
+/******************************************************************************
+
+Connects to one of the servers of each shard in 'shards', sends it the query,
+and reads its first message.  The TCP connections and TLS handshakes to all the
+shards are made at the same time (see async-tools.h), so a scatter query costs
+one connection setup rather than one per shard.  If 'prefetched' is a
+connection already being set up to one of these shards, it is used for that
+shard; otherwise it is abandoned.  A shard whose first choice of server could
+not be reached gets another try with connect_backend().
+
+The query goes to every shard before any answer is waited for, so the shards
+run it at the same time, and the first messages are then read as they arrive
+(see read_first_rows()).  Every read on a stream is bounded by 'timeout_ms', so
+a slow or stuck shard turns into STREAM_FAILED instead of holding up the whole
+merge.
+
+*******************************************************************************/
+void open_shard_streams(struct shard_map* map, struct shard_stream* streams, int* shards,
+			int count, char* query, int timeout_ms, struct upstream* prefetched) {
+  struct upstream upstreams[MAX_SHARDS];
+  int             i;
+
+  for (i = 0; i < count; i++) {
+    if (prefetched != NULL && prefetched->state != UPSTREAM_FAILED &&
+	prefetched->shard == shards[i]) {
+      // Its setup overlapped the client's, so only time the query itself
+      upstreams[i] = *prefetched;
+      clock_gettime(CLOCK_MONOTONIC, &upstreams[i].started);
+      prefetched = NULL;
+    } else
+      start_upstream(map->shards[shards[i]], shards[i], &upstreams[i]);
+  }
+  if (prefetched != NULL)
+    abandon_upstream(prefetched);
+
+  run_pipeline(NULL, upstreams, count, timeout_ms);
+
+  for (i = 0; i < count; i++) {
+    memset(&streams[i], 0, sizeof(struct shard_stream));
+    streams[i].shard = shards[i];
+    streams[i].started = upstreams[i].started;
+
+    if (upstreams[i].state == UPSTREAM_READY) {
+      streams[i].backend = upstreams[i].backend;
+      streams[i].ssl = upstreams[i].ssl;
+      streams[i].sockfd = upstreams[i].sockfd;
+    } else
+      streams[i].ssl = connect_backend(map->shards[shards[i]], &streams[i].backend,
+				       &streams[i].sockfd, timeout_ms);
+
+    if (streams[i].ssl == NULL) {
+      fprintf(stderr, "Server: Could not establish SSL session to any server of shard %d\n",
+	      shards[i]);
+      streams[i].state = STREAM_FAILED;
+      continue;
+    }
+
+    if (peer_write(streams[i].ssl, query, strlen(query)+1) <= 0) {
+      streams[i].state = STREAM_FAILED;
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &streams[i].sent);
+
+    streams[i].decoder = malloc(sizeof(struct result_decoder));
+    if (streams[i].decoder == NULL) {
+      fprintf(stderr, "Server: Unable to allocate result decoder\n");
+      exit(EXIT_FAILURE);
+    }
+    start_result_decoder(streams[i].decoder);
+    streams[i].state = STREAM_ROW;
+  }
+
+  read_first_rows(streams, count, timeout_ms);
+}
+
+/******************************************************************************
+
+Reads the next message of a stream into 'stream->row' and returns the new
+state of the stream.  Rows that arrived in a compact batch are returned one at
+a time, as text.
+
+*******************************************************************************/
+int advance_shard_stream(struct shard_stream* stream) {
+  int nbytes_read;
+
+  if (stream->state != STREAM_ROW)
+    return stream->state;
+
+  bzero(stream->row, ROW_SIZE);
+  nbytes_read = read_result(stream->decoder, stream->ssl, stream->row, ROW_SIZE);
+  if (nbytes_read <= 0) {
+    stream->timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+    fprintf(stderr, "Server: Shard %d failed or timed out: %s\n", stream->shard, strerror(errno));
+    stream->state = STREAM_FAILED;
+  } else if (strcmp(stream->row, "TIMEOUT") == 0) {
+    // The Tier 2 server gave up on the query once its deadline had passed
+    stream->timed_out = 1;
+    stream->state = STREAM_FAILED;
+  } else if (strcmp(stream->row, "DONE") == 0 || strcmp(stream->row, "NO RESULTS") == 0)
+    stream->state = STREAM_DONE;
+  else if (strcmp(stream->row, "PARTIAL") == 0) {
+    // The Tier 2 server could only list some of the theaters a search by
+    // distance matched
+    stream->partial = 1;
+    stream->state = STREAM_DONE;
+  } else
+    stream->rows++;
+
+  return stream->state;
+}
+
+/******************************************************************************
+
+Releases the connection held by a stream and charges the backend with the
+stream's latency, or with an error if the stream failed.
+
+*******************************************************************************/
+void close_shard_stream(struct shard_stream* stream) {
+  if (stream->backend != NULL)
+    release_backend(stream->backend, elapsed_us(&stream->started),
+		    stream->state == STREAM_FAILED);
+  if (stream->ssl != NULL) {
+    SSL_free(stream->ssl);
+    close(stream->sockfd);
+  }
+  if (stream->decoder != NULL) {
+    finish_result_decoder(stream->decoder);
+    free(stream->decoder);
+  }
+  stream->backend = NULL;
+  stream->ssl = NULL;
+  stream->decoder = NULL;
+}
+
+/******************************************************************************
+
+Copies the value following 'label' in a formatted result row, up to the space
+before the next label, into 'value'.
+
+*******************************************************************************/
+static void row_field(char* row, char* label, char* next_label, char* value, size_t size) {
+  char*  start;
+  char*  end;
+  size_t len;
+
+  value[0] = '\0';
+  start = strstr(row, label);
+  if (start == NULL)
+    return;
+  start += strlen(label);
+  end = next_label ? strstr(start, next_label) : NULL;
+  len = end ? (size_t)(end - start) : strcspn(start, "\n");
+  if (len >= size)
+    len = size - 1;
+  memcpy(value, start, len);
+  value[len] = '\0';
+}
+
+/******************************************************************************
+
+Orders two result rows formatted by the Tier 2 server
+("Name: ... Location: ... Date: ... Time: ...") by name, location, date and
+time.  The comparison ignores case, matching the collation MySQL uses for the
+ORDER BY clause on each shard, so the merged stream stays sorted.
+
+*******************************************************************************/
+int compare_rows(char* a, char* b) {
+  static char* labels[] = { "Name: ", " Location: ", " Date: ", " Time: ", NULL };
+  char         field_a[ROW_SIZE];
+  char         field_b[ROW_SIZE];
+  int          result;
+  int          i;
+
+  for (i = 0; labels[i] != NULL; i++) {
+    row_field(a, labels[i], labels[i + 1], field_a, ROW_SIZE);
+    row_field(b, labels[i], labels[i + 1], field_b, ROW_SIZE);
+    result = strcasecmp(field_a, field_b);
+    if (result != 0)
+      return result;
+  }
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+/******************************************************************************
+
+PROGRAM:  shard-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures that let the Tier 1
+          server spread the movie_times table over several shards, each
+          served by its own group of Tier 2 servers.  Rows are partitioned by
+          location using a shard map file.  A query naming a location goes to
+          that location's shard only; any other query is sent to every shard
+          at once and the sorted result streams are merged back into a single
+          stream in (name, location, date, time) order.
+
+          A shard map file contains lines of the form
+
+            shard <id> <host>[:<port>] [<host>[:<port>] ...]
+            location <city,state> <id>
+
+          Locations not listed in the map are assigned to a shard by hashing
+          the location.  Blank lines and lines starting with '#' are ignored.
+
+******************************************************************************/
+
+#ifndef _SHARDTOOLS_H_
+#define _SHARDTOOLS_H_
+
+#include <stdio.h>
+#include <openssl/ssl.h>
+
+#include "backend-tools.h"
+#include "async-tools.h"
+#include "result-tools.h"
+
+#define MAX_SHARDS          16
+#define MAX_SHARD_LOCATIONS 256
+#define MAX_LOCATION_LENGTH 64
+#define SHARD_TIMEOUT       5000   // Default milliseconds a shard may take
+#define ROW_SIZE            256
+
+#define STREAM_ROW          1      // 'row' holds the shard's next result row
+#define STREAM_DONE         0      // The shard sent its final message
+#define STREAM_FAILED      -1      // Connect, handshake or read failed/timed out
+
+struct shard_location {
+  char location[MAX_LOCATION_LENGTH];
+  int  shard;
+};
+
+struct shard_map {
+  int                   count;
+  struct backend_pool*  shards[MAX_SHARDS];
+  int                   location_count;
+  struct shard_location locations[MAX_SHARD_LOCATIONS];
+};
+
+struct shard_stream {
+  int             shard;
+  int             state;
+  struct backend* backend;
+  SSL*            ssl;
+  int             sockfd;
+  long            rows;
+  int             timed_out;     // Failed because a timeout or deadline expired
+  int             partial;       // Ended with "PARTIAL": some matches were left out
+  struct timespec started;
+  struct timespec sent;          // When the query was written
+  struct result_decoder* decoder; // Takes apart the row batches the shard sends
+  char            row[ROW_SIZE];
+};
+
+struct shard_map* create_shard_map();
+
+struct backend_pool* add_shard(struct shard_map* map, int policy);
+
+int load_shard_map(struct shard_map* map, char* filename, int policy, unsigned int default_port);
+
+int shard_for_location(struct shard_map* map, char* location);
+
+void open_shard_streams(struct shard_map* map, struct shard_stream* streams, int* shards,
+			int count, char* query, int timeout_ms, struct upstream* prefetched);
+
+int advance_shard_stream(struct shard_stream* stream);
+
+void close_shard_stream(struct shard_stream* stream);
+
+int compare_rows(char* a, char* b);
+
+#endif
@@ -0,0 +1,127 @@
+/******************************************************************************
+
+PROGRAM:  snapshot-tool.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program writes a showtime snapshot (see snapshot-tools.h) for
+          the Tier 2 server to map at startup.  The showtimes and theaters are
+          read either from SQL data files such as sqldata.txt and
+          theaterdata.txt, or from the movie_times and theaters tables of the
+          MySQL server on 'localhost':
+
+          snapshot-tool -o <snapshot> [-f <data file>]... [-m]
+
+          Without -f or -m, sqldata.txt and theaterdata.txt are read.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mysql.h>
+
+#include "snapshot-tools.h"
+
+#define DATA_FILE    "sqldata.txt"
+#define THEATER_FILE "theaterdata.txt"
+#define MAX_FILES    16
+
+/******************************************************************************
+
+Reads every showtime and theater from the movies database.  Returns 0, or -1 if
+the database can not be read.
+
+*******************************************************************************/
+int load_snapshot_mysql(struct snapshot_builder* builder) {
+  MYSQL*     connection;
+  MYSQL_RES* result;
+  MYSQL_ROW  row;
+
+  if ((connection = mysql_init(NULL)) == NULL) {
+    fprintf(stderr, "Could not initialize mysql\n");
+    return -1;
+  }
+  if (mysql_real_connect(connection, "localhost", "user", "password", "movies", 0, NULL, 0) == NULL) {
+    fprintf(stderr, "Could not connect to database: %s\n", mysql_error(connection));
+    mysql_close(connection);
+    return -1;
+  }
+
+  if (mysql_query(connection, "SELECT name, location, date, time FROM movie_times") ||
+      (result = mysql_store_result(connection)) == NULL) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    mysql_close(connection);
+    return -1;
+  }
+  while ((row = mysql_fetch_row(result)))
+    add_snapshot_row(builder, row);
+  mysql_free_result(result);
+
+  // Older databases may not have theater coordinates yet
+  if (mysql_query(connection, "SELECT location, latitude, longitude FROM theaters") ||
+      (result = mysql_store_result(connection)) == NULL)
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+  else {
+    while ((row = mysql_fetch_row(result)))
+      add_snapshot_theater(builder, row[0], atof(row[1]), atof(row[2]));
+    mysql_free_result(result);
+  }
+
+  mysql_close(connection);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  struct snapshot_builder* builder;
+  char*                    output = NULL;
+  char*                    files[MAX_FILES];
+  int                      file_count = 0;
+  int                      from_mysql = 0;
+  int                      opt;
+  int                      i;
+
+  while ((opt = getopt(argc, argv, "f:mo:")) != -1) {
+    switch (opt) {
+    case 'f':
+      if (file_count == MAX_FILES) {
+	fprintf(stderr, "Snapshot: At most %d data files can be given\n", MAX_FILES);
+	return EXIT_FAILURE;
+      }
+      files[file_count++] = optarg;
+      break;
+    case 'm':
+      from_mysql = 1;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      output = NULL;
+      optind = argc + 1;
+      break;
+    }
+  }
+
+  if (output == NULL || optind != argc) {
+    fprintf(stderr, "Usage: snapshot-tool -o <snapshot> [-f <data file>]... [-m]\n");
+    return EXIT_FAILURE;
+  }
+
+  if (file_count == 0 && !from_mysql) {
+    files[file_count++] = DATA_FILE;
+    files[file_count++] = THEATER_FILE;
+  }
+
+  builder = create_snapshot_builder();
+  for (i = 0; i < file_count; i++)
+    if (load_snapshot_sql(builder, files[i]) < 0)
+      return EXIT_FAILURE;
+  if (from_mysql && load_snapshot_mysql(builder) < 0)
+    return EXIT_FAILURE;
+
+  if (write_snapshot(builder, output) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,850 @@
+/******************************************************************************
+
+PROGRAM:  snapshot-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements reading, querying and writing showtime
+          snapshots.  See snapshot-tools.h for an overview of the format.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot-tools.h"
+#include "scan-tools.h"
+
+#define ALIGNMENT      8
+#define CHECKSUM_BASIS 14695981039346656037ULL
+
+static char* column_names[SNAPSHOT_COLUMNS] = { "name", "location", "date", "time" };
+
+// Continues the FNV-1a 'hash' of earlier data over the 'length' bytes at 'data'
+static uint64_t checksum(uint64_t hash, unsigned char* data, size_t length) {
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+// MySQL compares strings without regard to case, and so does the snapshot
+static int compare_strings(const void* a, const void* b) {
+  int result = strcasecmp(*(char**)a, *(char**)b);
+
+  return result != 0 ? result : strcmp(*(char**)a, *(char**)b);
+}
+
+/******************************************************************************
+
+Checks that the sections of the snapshot in 'data' are as long as its counts
+need and that every string id, string offset and row id in them is in range,
+so that a snapshot that passed the checksum by accident, or was written
+wrongly, can not make a reader look outside the file.  Returns 0, or -1.
+
+*******************************************************************************/
+static int check_sections(unsigned char* data) {
+  struct snapshot_header*  header = (struct snapshot_header*)data;
+  struct snapshot_section* sections = header->sections;
+  struct snapshot_theater* theaters;
+  uint64_t                 strings = header->string_count;
+  uint64_t                 rows = header->row_count;
+  uint64_t                 string_length;
+  uint32_t*                offsets;
+  uint32_t*                columns;
+  uint32_t*                starts;
+  char*                    string_data;
+  uint64_t                 i;
+
+  if (sections[SECTION_STRINGS].length < strings * sizeof(uint32_t) ||
+      sections[SECTION_ROWS].length < rows * SNAPSHOT_COLUMNS * sizeof(uint32_t) ||
+      sections[SECTION_LOCATIONS].length < (strings + 1 + rows) * sizeof(uint32_t) ||
+      sections[SECTION_THEATERS].length <
+      (uint64_t)header->theater_count * sizeof(struct snapshot_theater))
+    return -1;
+
+  // Every string must start within the characters, which must end in a NUL
+  offsets = (uint32_t*)(data + sections[SECTION_STRINGS].offset);
+  string_data = (char*)(offsets + strings);
+  string_length = sections[SECTION_STRINGS].length - strings * sizeof(uint32_t);
+  if (strings > 0 && (string_length == 0 || string_data[string_length - 1] != '\0'))
+    return -1;
+  for (i = 0; i < strings; i++)
+    if (offsets[i] >= string_length)
+      return -1;
+
+  columns = (uint32_t*)(data + sections[SECTION_ROWS].offset);
+  for (i = 0; i < rows * SNAPSHOT_COLUMNS; i++)
+    if (columns[i] >= strings)
+      return -1;
+
+  // The rows of every location must lie within the row ids, which must be rows
+  starts = (uint32_t*)(data + sections[SECTION_LOCATIONS].offset);
+  for (i = 0; i < strings; i++)
+    if (starts[i] > starts[i + 1])
+      return -1;
+  if (starts[strings] > rows)
+    return -1;
+  for (i = 0; i < rows; i++)
+    if (starts[strings + 1 + i] >= rows)
+      return -1;
+
+  theaters = (struct snapshot_theater*)(data + sections[SECTION_THEATERS].offset);
+  for (i = 0; i < header->theater_count; i++)
+    if (theaters[i].location >= strings)
+      return -1;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Maps a snapshot file read-only and checks it before use: the magic string, the
+format version, that every section lies within the file, the checksum, and
+that the sections hold what the header says (see check_sections()).  Returns
+NULL, after saying why, if the file can not be used.
+
+*******************************************************************************/
+struct snapshot* open_snapshot(char* filename) {
+  struct snapshot*        snapshot;
+  struct snapshot_header* header;
+  struct snapshot_header  zeroed;
+  struct stat             status;
+  unsigned char*          data;
+  uint64_t                sum;
+  int                     fd;
+  int                     i;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &status) < 0) {
+    fprintf(stderr, "Server: Unable to open snapshot '%s': %s\n", filename, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  if ((size_t)status.st_size < sizeof(struct snapshot_header)) {
+    fprintf(stderr, "Server: '%s' is not a snapshot\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map snapshot '%s': %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  header = (struct snapshot_header*)data;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0 ||
+      header->version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "Server: '%s' is not a version %d snapshot\n", filename, SNAPSHOT_VERSION);
+    munmap(data, status.st_size);
+    return NULL;
+  }
+  for (i = 0; i < SNAPSHOT_SECTIONS; i++)
+    if (header->sections[i].offset % ALIGNMENT != 0 ||
+	header->sections[i].offset > (uint64_t)status.st_size ||
+	header->sections[i].length > status.st_size - header->sections[i].offset) {
+      fprintf(stderr, "Server: Snapshot '%s' is truncated\n", filename);
+      munmap(data, status.st_size);
+      return NULL;
+    }
+
+  // The header is part of the checksum, with the checksum itself taken as 0
+  memcpy(&zeroed, header, sizeof(zeroed));
+  zeroed.checksum = 0;
+  sum = checksum(CHECKSUM_BASIS, (unsigned char*)&zeroed, sizeof(zeroed));
+  sum = checksum(sum, data + sizeof(zeroed), status.st_size - sizeof(zeroed));
+  if (sum != header->checksum || check_sections(data) < 0) {
+    fprintf(stderr, "Server: Snapshot '%s' is corrupt\n", filename);
+    munmap(data, status.st_size);
+    return NULL;
+  }
+
+  snapshot = calloc(1, sizeof(struct snapshot));
+  if (snapshot == NULL) {
+    fprintf(stderr, "Server: Unable to allocate snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+  snapshot->size = status.st_size;
+  snapshot->header = header;
+  snapshot->string_offsets = (uint32_t*)(data + header->sections[SECTION_STRINGS].offset);
+  snapshot->string_data = (char*)(snapshot->string_offsets + header->string_count);
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+    snapshot->columns[i] = (uint32_t*)(data + header->sections[SECTION_ROWS].offset) +
+      (size_t)i * header->row_count;
+  snapshot->location_starts = (uint32_t*)(data + header->sections[SECTION_LOCATIONS].offset);
+  snapshot->location_rows = snapshot->location_starts + header->string_count + 1;
+  snapshot->theaters = (struct snapshot_theater*)(data + header->sections[SECTION_THEATERS].offset);
+
+  fprintf(stdout, "Server: Mapped snapshot '%s' with %u showtimes and %u theaters\n",
+	  filename, header->row_count, header->theater_count);
+
+  return snapshot;
+}
+
+void close_snapshot(struct snapshot* snapshot) {
+  munmap(snapshot->header, snapshot->size);
+  free(snapshot);
+}
+
+char* snapshot_string(struct snapshot* snapshot, uint32_t id) {
+  return snapshot->string_data + snapshot->string_offsets[id];
+}
+
+/******************************************************************************
+
+Returns the first string id not sorting before 'text', comparing only the first
+'len' characters if 'len' is not 0.  Strings are sorted without regard to
+case, so the ids equal to 'text' (or starting with it) follow contiguously.
+
+*******************************************************************************/
+static uint32_t find_string(struct snapshot* snapshot, char* text, size_t len) {
+  uint32_t low = 0;
+  uint32_t high = snapshot->header->string_count;
+  uint32_t middle;
+  char*    string;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    string = snapshot_string(snapshot, middle);
+    if ((len ? strncasecmp(string, text, len) : strcasecmp(string, text)) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+// Marks in 'set' every string id equal to 'text', or starting with it
+static void mark_strings(struct snapshot* snapshot, char* set, char* text, int prefix) {
+  size_t   len = prefix ? strlen(text) : 0;
+  uint32_t id;
+  char*    string;
+
+  for (id = find_string(snapshot, text, len); id < snapshot->header->string_count; id++) {
+    string = snapshot_string(snapshot, id);
+    if ((len ? strncasecmp(string, text, len) : strcasecmp(string, text)) != 0)
+      break;
+    set[id] = 1;
+  }
+}
+
+/******************************************************************************
+
+Reads a quoted SQL string at '*query' into 'text', undoing doubled quotes, and
+moves '*query' past it.  Returns 0, or -1 if there is no quoted string there or
+it does not fit in 'size' bytes.
+
+*******************************************************************************/
+static int read_quoted(char** query, char* text, size_t size) {
+  char*  p = *query;
+  size_t len = 0;
+
+  if (*p++ != '\'')
+    return -1;
+  while (*p != '\0') {
+    if (*p == '\'' && p[1] != '\'')
+      break;
+    if (*p == '\'')
+      p++;
+    if (len + 1 >= size)
+      return -1;
+    text[len++] = *p++;
+  }
+  if (*p != '\'')
+    return -1;
+  text[len] = '\0';
+  *query = p + 1;
+
+  return 0;
+}
+
+static int skip(char** query, char* word) {
+  if (strncasecmp(*query, word, strlen(word)) != 0)
+    return -1;
+  *query += strlen(word);
+
+  return 0;
+}
+
+/******************************************************************************
+
+Parses one condition of the WHERE clause, of the form
+
+  <column> = '<value>'
+  <column> IN ('<value>', ...)
+  <column> LIKE '<prefix>%'
+
+and narrows the column's set of accepted string ids to the ones it matches.
+Returns 0, or -1 if the condition is not one of these.
+
+*******************************************************************************/
+static int parse_condition(struct snapshot* snapshot, char** query, char** accepted) {
+  char   text[256];
+  char*  matched;
+  size_t len;
+  int    column;
+  int    prefix = 0;
+  int    list = 0;
+  uint32_t id;
+
+  for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+    if (skip(query, column_names[column]) == 0 && **query == ' ')
+      break;
+  if (column == SNAPSHOT_COLUMNS)
+    return -1;
+
+  if (skip(query, " = ") == 0)
+    ;
+  else if (skip(query, " IN (") == 0)
+    list = 1;
+  else if (skip(query, " LIKE ") == 0)
+    prefix = 1;
+  else
+    return -1;
+
+  matched = calloc(snapshot->header->string_count + 1, 1);
+  if (matched == NULL)
+    return -1;
+
+  do {
+    if (read_quoted(query, text, sizeof(text)) < 0) {
+      free(matched);
+      return -1;
+    }
+    if (prefix) {
+      // Only a single trailing wildcard, i.e., a prefix, can be looked up
+      len = strlen(text);
+      if (len == 0 || strchr(text, '%') != &text[len - 1] || strpbrk(text, "_\\") != NULL) {
+	free(matched);
+	return -1;
+      }
+      text[len - 1] = '\0';
+    }
+    mark_strings(snapshot, matched, text, prefix);
+  } while (list && skip(query, ",") == 0);
+
+  if (list && skip(query, ")") < 0) {
+    free(matched);
+    return -1;
+  }
+
+  if (accepted[column] == NULL)
+    accepted[column] = matched;
+  else {
+    for (id = 0; id < snapshot->header->string_count; id++)
+      accepted[column][id] &= matched[id];
+    free(matched);
+  }
+
+  return 0;
+}
+
+/******************************************************************************
+
+Turns the string ids a column accepts into a scan condition: one range for
+every run of consecutive accepted ids.  Returns 0, or -1 if there are more
+runs than a condition holds, in which case the column is not scanned for and
+its rows are only checked one by one.
+
+*******************************************************************************/
+static int scan_condition(struct snapshot* snapshot, int column, char* accepted,
+			  struct scan_condition* condition) {
+  uint32_t strings = snapshot->header->string_count;
+  uint32_t id;
+  uint32_t start;
+
+  condition->column = snapshot->columns[column];
+  condition->count = 0;
+  for (id = 0; id < strings; id++) {
+    if (!accepted[id])
+      continue;
+    for (start = id; id + 1 < strings && accepted[id + 1]; id++)
+      ;
+    if (add_scan_range(condition, start, id) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int compare_row_ids(const void* a, const void* b) {
+  uint32_t id_a = *(uint32_t*)a;
+  uint32_t id_b = *(uint32_t*)b;
+
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+/******************************************************************************
+
+Runs a query of the form Tier 1 sends,
+
+  SELECT * FROM movie_times [WHERE <condition> [AND <condition>]...]
+  [ORDER BY name, location, date, time]
+
+calling 'handler' with the four values of every matching row, in (name,
+location, date, time) order.  Returns the number of rows found, or -1 if the
+query is not one the snapshot can answer, in which case the caller should ask
+MySQL instead.
+
+Rows for a name are contiguous, so a search by name only looks at the rows of
+the names it matches; otherwise a search by location only looks at the rows of
+its locations.  Any other search scans the columns it has conditions on, many
+rows at a time (see scan-tools.h), and only looks at the rows found.
+
+*******************************************************************************/
+int query_snapshot(struct snapshot* snapshot, char* query,
+		   void (*handler)(void* context, char** values), void* context) {
+  char*                 accepted[SNAPSHOT_COLUMNS] = { NULL, NULL, NULL, NULL };
+  char*                 values[SNAPSHOT_COLUMNS];
+  struct scan_condition conditions[SNAPSHOT_COLUMNS];
+  uint64_t*             selected = NULL;
+  uint32_t*             candidates = NULL;
+  uint32_t              rows = snapshot->header->row_count;
+  uint32_t              count = 0;
+  uint32_t              low;
+  uint32_t              high;
+  uint32_t              middle;
+  uint32_t              row;
+  uint32_t              id;
+  int                   found = 0;
+  int                   scanned = 0;
+  int                   status = 0;
+  int                   column;
+  uint32_t              i;
+
+  if (skip(&query, "SELECT * FROM movie_times") < 0)
+    return -1;
+  if (skip(&query, " WHERE ") == 0)
+    do {
+      status = parse_condition(snapshot, &query, accepted);
+    } while (status == 0 && skip(&query, " AND ") == 0);
+  if (status == 0 && *query != '\0' && skip(&query, " ORDER BY name, location, date, time") < 0)
+    status = -1;
+  if (status == 0 && *query != '\0')
+    status = -1;
+
+  if (status == 0) {
+    candidates = malloc((rows + 1) * sizeof(uint32_t));
+    if (candidates == NULL)
+      status = -1;
+  }
+
+  if (status == 0 && accepted[COLUMN_NAME] != NULL) {
+    // Binary search the name column for the rows of each accepted name
+    for (id = 0; id < snapshot->header->string_count; id++) {
+      if (!accepted[COLUMN_NAME][id])
+	continue;
+      low = 0;
+      high = rows;
+      while (low < high) {
+	middle = low + (high - low) / 2;
+	if (snapshot->columns[COLUMN_NAME][middle] < id)
+	  low = middle + 1;
+	else
+	  high = middle;
+      }
+      for (row = low; row < rows && snapshot->columns[COLUMN_NAME][row] == id; row++)
+	candidates[count++] = row;
+    }
+  } else if (status == 0 && accepted[COLUMN_LOCATION] != NULL) {
+    for (id = 0; id < snapshot->header->string_count; id++)
+      if (accepted[COLUMN_LOCATION][id])
+	for (i = snapshot->location_starts[id]; i < snapshot->location_starts[id + 1]; i++)
+	  candidates[count++] = snapshot->location_rows[i];
+    qsort(candidates, count, sizeof(uint32_t), compare_row_ids);
+  } else if (status == 0) {
+    selected = malloc((rows / SCAN_BLOCK + 1) * sizeof(uint64_t));
+    if (selected == NULL)
+      status = -1;
+    else {
+      for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+	if (accepted[column] != NULL &&
+	    scan_condition(snapshot, column, accepted[column], &conditions[scanned]) == 0)
+	  scanned++;
+      scan_rows(conditions, scanned, rows, selected);
+      for (row = next_selected(selected, rows, 0); row < rows;
+	   row = next_selected(selected, rows, row + 1))
+	candidates[count++] = row;
+    }
+  }
+
+  if (status == 0) {
+    for (i = 0; i < count; i++) {
+      row = candidates[i];
+      for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+	if (accepted[column] != NULL && !accepted[column][snapshot->columns[column][row]])
+	  break;
+      if (column < SNAPSHOT_COLUMNS)
+	continue;
+      for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+	values[column] = snapshot_string(snapshot, snapshot->columns[column][row]);
+      handler(context, values);
+      found++;
+    }
+  }
+
+  free(candidates);
+  free(selected);
+  for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+    free(accepted[column]);
+
+  return status == 0 ? found : -1;
+}
+
+struct snapshot_builder* create_snapshot_builder() {
+  struct snapshot_builder* builder;
+
+  builder = calloc(1, sizeof(struct snapshot_builder));
+  if (builder == NULL) {
+    fprintf(stderr, "Snapshot: Unable to allocate builder\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return builder;
+}
+
+static char* copy_string(char* text) {
+  char* copy = strdup(text);
+
+  if (copy == NULL) {
+    fprintf(stderr, "Snapshot: Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return copy;
+}
+
+void free_snapshot_builder(struct snapshot_builder* builder) {
+  int i;
+
+  for (i = 0; i < builder->row_count * SNAPSHOT_COLUMNS; i++)
+    free(builder->values[i]);
+  for (i = 0; i < builder->theater_count; i++)
+    free(builder->theater_locations[i]);
+  free(builder->values);
+  free(builder->theater_locations);
+  free(builder->theater_coordinates);
+  free(builder);
+}
+
+void add_snapshot_row(struct snapshot_builder* builder, char** values) {
+  int i;
+
+  if (builder->row_count == builder->row_capacity) {
+    builder->row_capacity = builder->row_capacity ? builder->row_capacity * 2 : 256;
+    builder->values = realloc(builder->values,
+			      (size_t)builder->row_capacity * SNAPSHOT_COLUMNS * sizeof(char*));
+    if (builder->values == NULL) {
+      fprintf(stderr, "Snapshot: Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+    builder->values[(size_t)builder->row_count * SNAPSHOT_COLUMNS + i] = copy_string(values[i]);
+  builder->row_count++;
+}
+
+void add_snapshot_theater(struct snapshot_builder* builder, char* location, double latitude,
+			  double longitude) {
+  if (builder->theater_count == builder->theater_capacity) {
+    builder->theater_capacity = builder->theater_capacity ? builder->theater_capacity * 2 : 64;
+    builder->theater_locations = realloc(builder->theater_locations,
+					 builder->theater_capacity * sizeof(char*));
+    builder->theater_coordinates = realloc(builder->theater_coordinates,
+					   builder->theater_capacity * 2 * sizeof(double));
+    if (builder->theater_locations == NULL || builder->theater_coordinates == NULL) {
+      fprintf(stderr, "Snapshot: Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  builder->theater_locations[builder->theater_count] = copy_string(location);
+  builder->theater_coordinates[2 * builder->theater_count] = latitude;
+  builder->theater_coordinates[2 * builder->theater_count + 1] = longitude;
+  builder->theater_count++;
+}
+
+/******************************************************************************
+
+Reads the rows of the INSERT statements in an SQL file such as sqldata.txt or
+theaterdata.txt, i.e.,
+
+  INSERT [IGNORE] INTO movie_times (...) VALUES ('..','..','..','..'),...
+  INSERT [IGNORE] INTO theaters (...) VALUES ('..', <latitude>, <longitude>),...
+
+Values may be quoted strings or plain numbers.  Returns the number of rows read,
+or -1 if the file can not be read or parsed.
+
+*******************************************************************************/
+int load_snapshot_sql(struct snapshot_builder* builder, char* filename) {
+  FILE*  file;
+  char*  sql;
+  char*  p;
+  char*  values_start;
+  char   values[SNAPSHOT_COLUMNS][256];
+  long   size;
+  int    theaters;
+  int    count;
+  int    rows = 0;
+
+  file = fopen(filename, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Snapshot: Unable to open '%s': %s\n", filename, strerror(errno));
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  sql = malloc(size + 1);
+  if (sql == NULL || fread(sql, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Snapshot: Unable to read '%s'\n", filename);
+    free(sql);
+    fclose(file);
+    return -1;
+  }
+  sql[size] = '\0';
+  fclose(file);
+
+  p = sql;
+  while ((p = strstr(p, "INSERT")) != NULL) {
+    values_start = strstr(p, "VALUES");
+    if (values_start == NULL)
+      break;
+    *values_start = '\0';
+    theaters = strstr(p, "theaters") != NULL;
+    p = values_start + strlen("VALUES");
+
+    // Each row is a parenthesized, comma separated list of values
+    while (1) {
+      p += strspn(p, " \t\r\n");
+      if (*p != '(')
+	break;
+      p++;
+      for (count = 0; ; count++) {
+	p += strspn(p, " \t\r\n");
+	if (count == SNAPSHOT_COLUMNS)
+	  goto malformed;
+	if (*p == '\'') {
+	  if (read_quoted(&p, values[count], sizeof(values[count])) < 0)
+	    goto malformed;
+	} else {
+	  size = strcspn(p, ",) \t\r\n");
+	  if (size == 0 || size >= (long)sizeof(values[count]))
+	    goto malformed;
+	  memcpy(values[count], p, size);
+	  values[count][size] = '\0';
+	  p += size;
+	}
+	p += strspn(p, " \t\r\n");
+	if (*p == ')')
+	  break;
+	if (*p++ != ',')
+	  goto malformed;
+      }
+      p++;
+
+      if (theaters && count == 2)
+	add_snapshot_theater(builder, values[0], atof(values[1]), atof(values[2]));
+      else if (!theaters && count == SNAPSHOT_COLUMNS - 1)
+	add_snapshot_row(builder, (char*[]){ values[0], values[1], values[2], values[3] });
+      else
+	goto malformed;
+      rows++;
+
+      p += strspn(p, " \t\r\n");
+      if (*p != ',')
+	break;
+      p++;
+    }
+  }
+
+  free(sql);
+  return rows;
+
+ malformed:
+  fprintf(stderr, "Snapshot: Malformed row in '%s' near \"%.20s\"\n", filename, p);
+  free(sql);
+  return -1;
+}
+
+static char** sorted_strings;
+static uint32_t* sorted_rows;
+
+static uint32_t string_id(char** strings, uint32_t count, char* text) {
+  char** found = bsearch(&text, strings, count, sizeof(char*), compare_strings);
+
+  return found - strings;
+}
+
+// Orders rows, given by position, by their string ids column after column
+static int compare_rows_by_id(const void* a, const void* b) {
+  uint32_t* row_a = &sorted_rows[*(uint32_t*)a * SNAPSHOT_COLUMNS];
+  uint32_t* row_b = &sorted_rows[*(uint32_t*)b * SNAPSHOT_COLUMNS];
+  int       i;
+
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+    if (row_a[i] != row_b[i])
+      return row_a[i] < row_b[i] ? -1 : 1;
+
+  return 0;
+}
+
+static size_t align(size_t offset) {
+  return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+/******************************************************************************
+
+Writes the rows and theaters collected so far to 'filename' as a snapshot.
+Duplicate rows are written once, as the unique index on movie_times would keep
+them.  The file is written under a temporary name and renamed into place, so a
+server mapping the old snapshot never sees a half written one.  Returns 0, or
+-1 on failure.
+
+*******************************************************************************/
+int write_snapshot(struct snapshot_builder* builder, char* filename) {
+  struct snapshot_header header;
+  struct snapshot_theater* theaters;
+  uint32_t*              order;
+  uint32_t*              columns;
+  uint32_t*              starts;
+  uint32_t*              offsets;
+  uint32_t               string_count = 0;
+  uint32_t               row_count = 0;
+  unsigned char*         data;
+  char                   temporary[4096];
+  FILE*                  file;
+  size_t                 total = builder->row_count * SNAPSHOT_COLUMNS + builder->theater_count;
+  size_t                 length = 0;
+  size_t                 offset;
+  uint32_t               i;
+  uint32_t               j;
+  int                    column;
+
+  // Every distinct string gets an id, its position in sorted order
+  sorted_strings = malloc((total + 1) * sizeof(char*));
+  if (sorted_strings == NULL)
+    return -1;
+  memcpy(sorted_strings, builder->values, builder->row_count * SNAPSHOT_COLUMNS * sizeof(char*));
+  memcpy(sorted_strings + builder->row_count * SNAPSHOT_COLUMNS, builder->theater_locations,
+	 builder->theater_count * sizeof(char*));
+  qsort(sorted_strings, total, sizeof(char*), compare_strings);
+  for (i = 0; i < total; i++)
+    if (string_count == 0 || strcmp(sorted_strings[string_count - 1], sorted_strings[i]) != 0)
+      sorted_strings[string_count++] = sorted_strings[i];
+  for (i = 0; i < string_count; i++)
+    length += strlen(sorted_strings[i]) + 1;
+
+  sorted_rows = malloc(((size_t)builder->row_count * SNAPSHOT_COLUMNS + 1) * sizeof(uint32_t));
+  order = malloc((builder->row_count + 1) * sizeof(uint32_t));
+  if (sorted_rows == NULL || order == NULL)
+    return -1;
+  for (i = 0; i < (uint32_t)builder->row_count; i++) {
+    for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+      sorted_rows[i * SNAPSHOT_COLUMNS + column] =
+	string_id(sorted_strings, string_count, builder->values[i * SNAPSHOT_COLUMNS + column]);
+    order[i] = i;
+  }
+  qsort(order, builder->row_count, sizeof(uint32_t), compare_rows_by_id);
+  for (i = 0; i < (uint32_t)builder->row_count; i++)
+    if (row_count == 0 || compare_rows_by_id(&order[row_count - 1], &order[i]) != 0)
+      order[row_count++] = order[i];
+
+  // Lay out the sections one after the other
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.row_count = row_count;
+  header.string_count = string_count;
+  header.theater_count = builder->theater_count;
+  offset = align(sizeof(header));
+  header.sections[SECTION_STRINGS].offset = offset;
+  header.sections[SECTION_STRINGS].length = string_count * sizeof(uint32_t) + length;
+  offset = align(offset + header.sections[SECTION_STRINGS].length);
+  header.sections[SECTION_ROWS].offset = offset;
+  header.sections[SECTION_ROWS].length = (size_t)row_count * SNAPSHOT_COLUMNS * sizeof(uint32_t);
+  offset = align(offset + header.sections[SECTION_ROWS].length);
+  header.sections[SECTION_LOCATIONS].offset = offset;
+  header.sections[SECTION_LOCATIONS].length = (string_count + 1 + row_count) * sizeof(uint32_t);
+  offset = align(offset + header.sections[SECTION_LOCATIONS].length);
+  header.sections[SECTION_THEATERS].offset = offset;
+  header.sections[SECTION_THEATERS].length = builder->theater_count * sizeof(struct snapshot_theater);
+  offset = align(offset + header.sections[SECTION_THEATERS].length);
+
+  data = calloc(offset, 1);
+  if (data == NULL)
+    return -1;
+
+  offsets = (uint32_t*)(data + header.sections[SECTION_STRINGS].offset);
+  length = 0;
+  for (i = 0; i < string_count; i++) {
+    offsets[i] = length;
+    strcpy((char*)(offsets + string_count) + length, sorted_strings[i]);
+    length += strlen(sorted_strings[i]) + 1;
+  }
+
+  columns = (uint32_t*)(data + header.sections[SECTION_ROWS].offset);
+  for (i = 0; i < row_count; i++)
+    for (column = 0; column < SNAPSHOT_COLUMNS; column++)
+      columns[(size_t)column * row_count + i] = sorted_rows[order[i] * SNAPSHOT_COLUMNS + column];
+
+  // Count the rows of each location, turn the counts into starting positions,
+  // then drop every row in place; rows are visited in order, so each
+  // location's rows stay sorted
+  starts = (uint32_t*)(data + header.sections[SECTION_LOCATIONS].offset);
+  for (i = 0; i < row_count; i++)
+    starts[columns[(size_t)COLUMN_LOCATION * row_count + i] + 1]++;
+  for (i = 0; i < string_count; i++)
+    starts[i + 1] += starts[i];
+  for (i = 0; i < row_count; i++) {
+    j = columns[(size_t)COLUMN_LOCATION * row_count + i];
+    starts[string_count + 1 + starts[j]++] = i;
+  }
+  for (i = string_count; i > 0; i--)
+    starts[i] = starts[i - 1];
+  starts[0] = 0;
+
+  theaters = (struct snapshot_theater*)(data + header.sections[SECTION_THEATERS].offset);
+  for (i = 0; i < (uint32_t)builder->theater_count; i++) {
+    theaters[i].location = string_id(sorted_strings, string_count, builder->theater_locations[i]);
+    theaters[i].latitude = builder->theater_coordinates[2 * i];
+    theaters[i].longitude = builder->theater_coordinates[2 * i + 1];
+  }
+
+  // The checksum covers the header too, taken while its checksum is still 0
+  memcpy(data, &header, sizeof(header));
+  header.checksum = checksum(CHECKSUM_BASIS, data, offset);
+  memcpy(data, &header, sizeof(header));
+
+  snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+  file = fopen(temporary, "wb");
+  if (file == NULL || fwrite(data, 1, offset, file) != offset || fclose(file) != 0 ||
+      rename(temporary, filename) < 0) {
+    fprintf(stderr, "Snapshot: Unable to write '%s': %s\n", filename, strerror(errno));
+    free(data);
+    return -1;
+  }
+
+  fprintf(stdout, "Snapshot: Wrote %u showtimes, %u strings and %d theaters to '%s'\n",
+	  row_count, string_count, builder->theater_count, filename);
+
+  free(data);
+  free(order);
+  free(sorted_rows);
+  free(sorted_strings);
+
+  return 0;
+}
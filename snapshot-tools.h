@@ -0,0 +1,126 @@
+/******************************************************************************
+
+PROGRAM:  snapshot-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for showtime
+          snapshots: a compact, read-only binary copy of the movie_times and
+          theaters tables that the Tier 2 server can mmap() and answer
+          queries from as soon as it starts, without MySQL.  Because the
+          mapping is shared and read-only, every child process uses the same
+          pages of the operating system's page cache.
+
+          A snapshot file is laid out as a header followed by sections, each
+          aligned to 8 bytes:
+
+          header    magic "MTSNAP", format version, counts, the offset and
+                    length of every section, and a 64-bit FNV-1a checksum of
+                    the whole file, taken with the checksum itself as 0
+          strings   every distinct string once, sorted, as a table of 32-bit
+                    offsets followed by the NUL terminated characters; rows
+                    refer to strings by their position in this table
+          rows      four columns (name, location, date, time) of 32-bit
+                    string ids, one entry per showtime, with the rows sorted
+                    by (name, location, date, time) so results come out in
+                    the order Tier 1 expects, and the rows of a name are
+                    contiguous
+          locations for each location string, the ids of its rows in
+                    increasing order: a table giving where the rows of each
+                    string start, followed by the row ids
+          theaters  location string id, latitude and longitude of every
+                    theater
+
+          All numbers are stored in the byte order of the machine that wrote
+          the snapshot.  Snapshots are written by the snapshot-tool program.
+
+******************************************************************************/
+
+#ifndef _SNAPSHOTTOOLS_H_
+#define _SNAPSHOTTOOLS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAPSHOT_MAGIC        "MTSNAP"
+#define SNAPSHOT_VERSION      2
+#define SNAPSHOT_COLUMNS      4
+
+#define SECTION_STRINGS       0
+#define SECTION_ROWS          1
+#define SECTION_LOCATIONS     2
+#define SECTION_THEATERS      3
+#define SNAPSHOT_SECTIONS     4
+
+#define COLUMN_NAME           0
+#define COLUMN_LOCATION       1
+#define COLUMN_DATE           2
+#define COLUMN_TIME           3
+
+struct snapshot_section {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct snapshot_header {
+  char                    magic[8];
+  uint32_t                version;
+  uint32_t                row_count;
+  uint32_t                string_count;
+  uint32_t                theater_count;
+  uint64_t                checksum;
+  struct snapshot_section sections[SNAPSHOT_SECTIONS];
+};
+
+struct snapshot_theater {
+  uint32_t location;
+  uint32_t padding;
+  double   latitude;
+  double   longitude;
+};
+
+// An open, mapped snapshot; every pointer points into the mapping
+struct snapshot {
+  size_t                   size;
+  struct snapshot_header*  header;
+  uint32_t*                string_offsets;
+  char*                    string_data;
+  uint32_t*                columns[SNAPSHOT_COLUMNS];
+  uint32_t*                location_starts;   // string_count + 1 entries
+  uint32_t*                location_rows;
+  struct snapshot_theater* theaters;
+};
+
+// Collects showtimes and theaters before writing them out as a snapshot
+struct snapshot_builder {
+  int     row_count;
+  int     row_capacity;
+  char**  values;              // SNAPSHOT_COLUMNS strings per row
+  int     theater_count;
+  int     theater_capacity;
+  char**  theater_locations;
+  double* theater_coordinates; // latitude, longitude pairs
+};
+
+struct snapshot* open_snapshot(char* filename);
+
+void close_snapshot(struct snapshot* snapshot);
+
+char* snapshot_string(struct snapshot* snapshot, uint32_t id);
+
+int query_snapshot(struct snapshot* snapshot, char* query,
+		   void (*handler)(void* context, char** values), void* context);
+
+struct snapshot_builder* create_snapshot_builder();
+
+void free_snapshot_builder(struct snapshot_builder* builder);
+
+void add_snapshot_row(struct snapshot_builder* builder, char** values);
+
+void add_snapshot_theater(struct snapshot_builder* builder, char* location, double latitude,
+			  double longitude);
+
+int load_snapshot_sql(struct snapshot_builder* builder, char* filename);
+
+int write_snapshot(struct snapshot_builder* builder, char* filename);
+
+#endif
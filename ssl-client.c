@@ -15,33 +15,173 @@ SYNOPSIS: This program is a small client application that establishes a secure
 
 ******************************************************************************/
 
+#include <time.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 #include <openssl/ssl.h>
 
 #include "client-tools.h"
+#include "result-tools.h"
+#include "facet-tools.h"
 
 #define BUFFER_SIZE         256
+#define FIELD_SIZE          40    // Columns are VARCHAR(30); coordinates need more
+#define MAX_SUGGESTIONS     10
+#define MAX_BUSY_RETRIES    3
+#define MAX_RETRY_WAIT      5000  // Milliseconds
+#define DEFAULT_DEADLINE    10000 // Milliseconds to wait for the results
+#define WATCH_TIMEOUT       15000 // Three missed heartbeats from a watch session
+
+// Takes apart the row batches of a compact result
+struct result_decoder decoder;
+
+// Milliseconds left until 'deadline_ms' after 'start'
+long remaining_ms(struct timespec* start, long deadline_ms) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return deadline_ms - ((now.tv_sec - start->tv_sec) * 1000 +
+			(now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+/******************************************************************************
+
+Prints the changes to a watched search as the server sends them, each showtime
+marked '+' if it was added or '-' if it was removed, until the session is lost.
+Returns 1 if the server asked for the search to be run again (RESYNC), because
+changes were missed, otherwise 0.
+
+*******************************************************************************/
+int watch_changes(SSL* ssl, int sockfd) {
+  struct timeval timeout;
+  char           buffer[BUFFER_SIZE + 32];
+  char*          row;
+  int            nbytes;
+
+  timeout.tv_sec = WATCH_TIMEOUT / 1000;
+  timeout.tv_usec = 0;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  printf("-----------------Watching for changes (Ctrl-C to stop)-----------------\n");
+  fflush(stdout);
+  while (1) {
+    bzero(buffer, sizeof(buffer));
+    nbytes = SSL_read(ssl, buffer, sizeof(buffer) - 1);
+    if (nbytes <= 0) {
+      fprintf(stderr, "Client: Lost the connection to the server\n");
+      return 0;
+    }
+
+    if (strncmp(buffer, "RESYNC ", 7) == 0) {
+      printf("Too many changes were missed, searching again\n");
+      return 1;
+    }
+    // "CHANGE <version> ADD|REMOVE <row>"; VERSION messages only keep the
+    // session alive
+    if (strncmp(buffer, "CHANGE ", 7) != 0 || (row = strchr(buffer + 7, ' ')) == NULL)
+      continue;
+    if (strncmp(row, " ADD ", 5) == 0)
+      printf("+ %s", row + 5);
+    else if (strncmp(row, " REMOVE ", 8) == 0)
+      printf("- %s", row + 8);
+    fflush(stdout);
+  }
+}
+
+// Reads one line of input into 'field', without the trailing newline
+void read_field(char* field) {
+  size_t len;
+
+  if (fgets(field, FIELD_SIZE, stdin) == NULL)
+    field[0] = 0;
+  len = strlen(field);
+  if (len > 0 && field[len-1] == '\n')
+    field[len-1] = 0;
+}
+
+// Prints a count row (see facet-tools.h) with the columns it was counted by
+void print_count(char* row) {
+  static char* labels[] = { "Name", "Location", "Date" };
+  char         values[FACET_COLUMNS][FACET_ROW_SIZE];
+  long         showtimes;
+  int          column;
+
+  if (parse_facet_row(row, values, &showtimes) < 0) {
+    printf("%s", row);
+    return;
+  }
+  printf("Showtimes: %ld", showtimes);
+  for (column = 0; column < FACET_COLUMNS; column++)
+    if (values[column][0] != '\0')
+      printf(" %s: %s", labels[column], values[column]);
+  printf("\n");
+}
 
 int main(int argc, char** argv) {
   unsigned int      port = DEFAULT_PORT;
   char              remote_host[MAX_HOSTNAME_LENGTH];
   char              buffer[BUFFER_SIZE], message[BUFFER_SIZE];
+  char              request[BUFFER_SIZE + 64];
   char*             temp_ptr;
   int               sockfd;
   SSL*              ssl;
 
   int nbytes_written, nbytes_read, len;
-  char movie[20] = "";
-  char location[20] = "";
-  char date[20] = "";
-  char time[20] = "";
+  int attempt;
+  long results = 0;
+  long retry_ms;
+  long deadline_ms = DEFAULT_DEADLINE;
+  long remaining;
+  struct timespec start;
+  int c;
+  int watch = 0;
+  char* encoding = "compact";
+  char* grouping = NULL;
+  int compress = 0;
+  int finished;
+  char movie[FIELD_SIZE] = "";
+  char location[FIELD_SIZE] = "";
+  char date[FIELD_SIZE] = "";
+  char time[FIELD_SIZE] = "";
   
-  if (argc != 2) {
-    fprintf(stderr, "Client: Usage: ssl-client <server name>:<port>\n");
+  // -t gives the number of milliseconds the user is willing to wait, -w
+  // keeps the session open to be sent changes to the results, -e text
+  // asks for results as labelled text rather than compact batches, -z
+  // asks for the batches to be compressed, and -c counts the showtimes
+  // found by the columns given instead of listing them
+  while ((c = getopt(argc, argv, "c:e:t:wz")) != -1)
+    switch (c)
+      {
+      case 'c':
+    grouping = optarg;
+    break;
+      case 'e':
+    encoding = optarg;
+    break;
+      case 't':
+    deadline_ms = atol(optarg);
+    break;
+      case 'w':
+    watch = 1;
+    break;
+      case 'z':
+    compress = 1;
+    break;
+      default:
+    argc = 0;
+      }
+
+  if (argc - optind != 1 || deadline_ms <= 0 ||
+      (strcmp(encoding, "compact") != 0 && strcmp(encoding, "text") != 0) ||
+      (grouping != NULL && (watch || parse_grouping(grouping) < 0))) {
+    fprintf(stderr, "Client: Usage: ssl-client [-t <deadline ms>] [-w] [-e <compact|text>] [-z] [-c <name,location,date|total>] <server name>:<port>\n");
     exit(EXIT_FAILURE);
   } else {
+    argv += optind - 1;
     // Search for ':' in the argument to see if port is specified
     temp_ptr = strchr(argv[1], ':');
     if (temp_ptr == NULL)    // Hostname only. Use default port
@@ -57,29 +197,6 @@ int main(int argc, char** argv) {
     }
   }
   
-  // Create the underlying TCP socket connection to the remote host
-  sockfd = create_client_socket(remote_host, port);
-  if(sockfd != 0) {
-    printf("Client: Established TCP connection to '%s' on port %u\n",
-	   remote_host, port);
-  } else {
-    fprintf(stderr, "Client: Could not establish TCP connection to %s on port %u\n", remote_host, port);
-    exit(EXIT_FAILURE);
-  }
-
-  // Now create the SSL/TLS socket over the TCP socket
-  ssl = create_client_ssl_socket(sockfd);
-
-  // Initiates an SSL session over the existing socket connection. SSL_connect()
-  // will return 1 if successful.
-  if (SSL_connect(ssl) == 1) {
-    printf("Client: Established SSL/TLS session to '%s' on port %u\n",
-	   remote_host, port);
-  } else {
-    fprintf(stderr, "Client: Could not establish SSL session to '%s' on port %u\n", remote_host, port);
-    exit(EXIT_FAILURE);
-  }
-
   //***************************************************************
   printf("Welcome to Movie Times Searcher\n");
   printf("This program uses the following information to search for movie times\n");
@@ -89,41 +206,61 @@ int main(int argc, char** argv) {
   printf("time\n");
 
   printf("Please provide any information or leave blank to search all\n");
+  printf("End a movie name with '*' to match the beginning of titles, start it with\n");
+  printf("'~' if you are unsure of the spelling, or end it with '?' to list titles\n");
+  printf("For the location, 'near <lat>,<lon>,<km>' finds theaters within a distance\n");
+  printf("and 'nearest <lat>,<lon>,<count>' finds the closest theaters\n");
 
   printf("Enter movie name: ");
-  fgets(movie, 20, stdin);
+  read_field(movie);
   len = strlen(movie);
-  if( movie[len-1] == '\n' )
+
+  bzero(message, BUFFER_SIZE);
+
+  if (len > 0 && movie[len-1] == '?') {
+    // Only list the matching titles
     movie[len-1] = 0;
+    snprintf(message, BUFFER_SIZE, "COMPLETE %d %s", MAX_SUGGESTIONS, movie);
+  } else {
+    printf("Enter location (city, state): ");
+    read_field(location);
 
-  printf("Enter location (city, state): ");
-  fgets(location, 20, stdin);
-  len = strlen(location);
-  if( location[len-1] == '\n' )
-    location[len-1] = 0;
+    printf("Enter date (month, day): ");
+    read_field(date);
 
-  printf("Enter date (month, day): ");
-  fgets(date, 20, stdin);
-  len = strlen(date);
-  if( date[len-1] == '\n' )
-    date[len-1] = 0;
+    printf("Enter time (hr:min am): ");
+    read_field(time);
 
-  printf("Enter time (hr:min am): ");
-  fgets(time, 20, stdin);
-  len = strlen(time);
-  if( time[len-1] == '\n' )
-    time[len-1] = 0;
+    printf("Searching...\n");
 
-  printf("Searching...\n");
+    if (grouping != NULL)
+      snprintf(message, BUFFER_SIZE, COUNT_PREFIX "%s ", grouping);
 
-  bzero(message, BUFFER_SIZE);
-  
-    strcat(message, "name = '");
-    strcat(message, movie);
-    strcat(message, "'/");
+    if (len > 0 && movie[len-1] == '*') {
+      movie[len-1] = 0;
+      strcat(message, "name LIKE '");
+      strcat(message, movie);
+      strcat(message, "%'/");
+    } else if (movie[0] == '~') {
+      strcat(message, "name SOUNDS LIKE '");
+      strcat(message, movie + 1);
+      strcat(message, "'/");
+    } else {
+      strcat(message, "name = '");
+      strcat(message, movie);
+      strcat(message, "'/");
+    }
   
-    strcat(message, "location = '");
-    strcat(message, location);
+    if (strncmp(location, "nearest ", 8) == 0) {
+      strcat(message, "location NEAREST '");
+      strcat(message, location + 8);
+    } else if (strncmp(location, "near ", 5) == 0) {
+      strcat(message, "location NEAR '");
+      strcat(message, location + 5);
+    } else {
+      strcat(message, "location = '");
+      strcat(message, location);
+    }
     strcat(message, "'/");
 
     strcat(message, "date = '");
@@ -133,48 +270,160 @@ int main(int argc, char** argv) {
     strcat(message, "time = '");
     strcat(message, time);
     strcat(message, "'");
-  printf("Sending message to client: \"%s\" \n", message);
-  nbytes_written = SSL_write(ssl, message, strlen(message));
+  }
+  // The server may be too busy to take the query, in which case it says how
+  // long to wait before trying again.  The query is only typed once, so it
+  // can simply be sent again over a new connection.
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (attempt = 0; ; attempt++) {
+    // Every step, from connecting to reading the last row, must fit in the
+    // time left before the deadline
+    remaining = remaining_ms(&start, deadline_ms);
+    if (remaining <= 0) {
+      fprintf(stderr, "The search did not finish within %ld ms\n", deadline_ms);
+      return EXIT_FAILURE;
+    }
 
-  bzero(message, BUFFER_SIZE);
+    // Create the underlying TCP socket connection to the remote host
+    sockfd = try_client_socket(remote_host, port, remaining);
+    if(sockfd >= 0) {
+      printf("Client: Established TCP connection to '%s' on port %u\n",
+  	   remote_host, port);
+    } else {
+      fprintf(stderr, "Client: Could not establish TCP connection to %s on port %u\n", remote_host, port);
+      exit(EXIT_FAILURE);
+    }
 
-  if (nbytes_written < 0)
-  {
-    fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
-  }
+    // Now create the SSL/TLS socket over the TCP socket
+    ssl = create_client_ssl_socket(sockfd);
 
-  //***************************************************************
+    // Initiates an SSL session over the existing socket connection. SSL_connect()
+    // will return 1 if successful.
+    if (SSL_connect(ssl) == 1) {
+      printf("Client: Established SSL/TLS session to '%s' on port %u\n",
+  	   remote_host, port);
+    } else {
+      fprintf(stderr, "Client: Could not establish SSL session to '%s' on port %u\n", remote_host, port);
+      exit(EXIT_FAILURE);
+    }
 
-  // Client reads a message sent by the server
-  printf("-----------------Results-----------------\n");
+    // The deadline travels with the query, so the servers know when to give up
+    printf("Sending message to client: \"%s\" \n", message);
+    snprintf(request, sizeof(request), "DEADLINE %ld " ENCODING_PREFIX "%s%s %s%s",
+	     remaining_ms(&start, deadline_ms), encoding, compress ? ",deflate" : "",
+	     watch ? "WATCH " : "", message);
+    nbytes_written = SSL_write(ssl, request, strlen(request));
 
-   while (1)
-  {
-    nbytes_read = SSL_read(ssl, buffer, BUFFER_SIZE);
-    if (nbytes_read < 0)
+    if (nbytes_written < 0)
     {
-      fprintf(stderr, "Server: Error reading from socket: %s\n", strerror(errno));
-      break;
+      fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
     }
 
-    if (strcmp(buffer, "NO RESULTS") == 0)
+    //***************************************************************
+
+    // Client reads a message sent by the server
+    retry_ms = 0;
+    finished = 0;
+    bzero(buffer, BUFFER_SIZE);
+    start_result_decoder(&decoder);
+    while (1)
     {
-      fprintf(stderr, "No results\n");
-      break;
+      nbytes_read = read_result(&decoder, ssl, buffer, BUFFER_SIZE);
+      if (nbytes_read <= 0)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          fprintf(stderr, "The search did not finish within %ld ms\n", deadline_ms);
+        else
+          fprintf(stderr, "Server: Error reading from socket: %s\n", strerror(errno));
+        break;
+      }
+
+      if (strncmp(buffer, "BUSY ", 5) == 0)
+      {
+        retry_ms = atol(buffer + 5);
+        break;
+      }
+
+      if (results == 0)
+        printf("-----------------Results-----------------\n");
+      results++;
+
+      if (strcmp(buffer, "NO RESULTS") == 0)
+      {
+        fprintf(stderr, "No results\n");
+        finished = 1;
+        break;
+      }
+
+      if (strcmp(buffer, "DONE") == 0)
+      {
+        finished = 1;
+        break;
+      }
+
+      if (strcmp(buffer, "UNSUPPORTED") == 0)
+      {
+        fprintf(stderr, "Searches by distance or by similar titles can not be watched\n");
+        break;
+      }
+
+      if (strcmp(buffer, "TOO LONG") == 0)
+      {
+        fprintf(stderr, "The search is too long to be run\n");
+        break;
+      }
+
+      if (strcmp(buffer, "TIMEOUT") == 0)
+      {
+        fprintf(stderr, "The search did not finish within %ld ms\n", deadline_ms);
+        break;
+      }
+
+      // Some shards of the movie database did not answer in time
+      if (strcmp(buffer, "PARTIAL") == 0)
+      {
+        fprintf(stderr, "Some theaters could not be searched; results may be incomplete\n");
+        finished = 1;
+        break;
+      }
+      if (grouping != NULL)
+        print_count(buffer);
+      else
+        printf("%s", buffer);
+      bzero(buffer, BUFFER_SIZE);
     }
+    finish_result_decoder(&decoder);
 
-    if (strcmp(buffer, "DONE") == 0)
-    {
+    // A watched search starts over if the server lost track of its changes
+    if (watch && finished && watch_changes(ssl, sockfd)) {
+      SSL_free(ssl);
+      close(sockfd);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      attempt = -1;
+      results = 0;
+      continue;
+    }
+
+    // Deallocate memory for the SSL data structures and close the socket
+    SSL_free(ssl);
+    close(sockfd);
+
+    if (retry_ms == 0)
       break;
+    if (attempt == MAX_BUSY_RETRIES) {
+      fprintf(stderr, "Client: The server is busy, please try again later\n");
+      return EXIT_FAILURE;
     }
-      printf("%s", buffer);
-    bzero(buffer, BUFFER_SIZE);
+    if (retry_ms > MAX_RETRY_WAIT)
+      retry_ms = MAX_RETRY_WAIT;
+    if (retry_ms >= remaining_ms(&start, deadline_ms)) {
+      fprintf(stderr, "Client: The server is busy, and the deadline would pass before retrying\n");
+      return EXIT_FAILURE;
+    }
+    printf("Client: The server is busy, retrying in %ld ms\n", retry_ms);
+    usleep(retry_ms * 1000);
   }
-
-  // Deallocate memory for the SSL data structures and close the socket
-  SSL_free(ssl);
-  close(sockfd);
   
   return EXIT_SUCCESS;
 }
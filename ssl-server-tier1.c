@@ -6,11 +6,25 @@ COURSE:   CS469 - Distributed Systems (Regis University)
 SYNOPSIS: This program is a small server application that receives incoming TCP
           connections from clients, then establishes an SSL/TLS encrypted
           connection to a tier 2 server.  It receives a message from the other
-          server and passes it back to the client. The secure SSL/TLS
-          connection is created using certificates generated with the
-          openssl application.  The purpose is to demonstrate how to establish
-          secure communication between a client and server using public key
-          cryptography in a multi-tier server architecture.
+          server and passes it back to the client.  Several tier 2 servers may
+          be given, in which case each query goes to the least loaded healthy
+          one (see backend-tools.h).  Identical queries from clients arriving
+          while one is already in progress share a single tier 2 request (see
+          coalesce-tools.h), and different queries arriving within a short
+          window may be sent together (see batch-tools.h).  Counts of
+          showtimes are added up over the shards (see facet-tools.h).
+          Clients beyond what tier 2 can currently handle are told to retry
+          later (see admission-tools.h).  The connection to tier 2 is set up
+          while the client's own handshake and query are still arriving (see
+          async-tools.h).  A tier 2 server on the same host may be reached
+          through a Unix domain socket, with or without TLS (see
+          local-tools.h).  With "-T fast", both hops use the fast TLS
+          profile, and requests to tier 2 resume its sessions and go out as
+          0-RTT early data (see tls-tools.h).  The secure SSL/TLS connection is created using
+          certificates generated with the openssl application.  The purpose
+          is to demonstrate how to establish secure communication between a
+          client and server using public key cryptography in a multi-tier
+          server architecture.
 
           Some of the code and descriptions can be found in "Network Security
           with OpenSSL", O'Reilly Media, 2002.
@@ -22,58 +36,620 @@ SYNOPSIS: This program is a small server application that receives incoming TCP
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #include "server-tools.h"
 #include "client-tools.h"
+#include "backend-tools.h"
+#include "coalesce-tools.h"
+#include "shard-tools.h"
+#include "async-tools.h"
+#include "admission-tools.h"
+#include "watch-tools.h"
+#include "result-tools.h"
+#include "batch-tools.h"
+#include "facet-tools.h"
+#include "tls-tools.h"
+#include "message-tools.h"
 
-#define BUFFER_SIZE 256
+#define BUFFER_SIZE  256
+#define REQUEST_SIZE (BUFFER_SIZE + 64)   // A search with the prefixes ssl-client adds
+#define QUERY_SIZE   (REQUEST_SIZE + 128) // Also its SELECT, WHERE, ANDs and ORDER BY
+
+static volatile sig_atomic_t stats_requested = 0;
+
+// Shared by every child so identical concurrent queries can be coalesced
+struct flight_table* flights;
+
+// Milliseconds each shard is given to answer a query
+int shard_timeout = SHARD_TIMEOUT;
+
+// Shared by every child so different queries arriving within 'batch_window'
+// microseconds of each other can share a Tier 2 request (0 turns this off)
+struct batch_table* batches;
+long batch_window = 0;
+
+// Shared by every child so the number of queries in progress can be bounded
+struct admission* admission;
+int client_admitted = 0;
+int admission_client;
+
+// Changes to the showtimes, as received from every shard's change feed
+struct change_log* changes;
+
+// How the child sends results to its client, as the client asked
+struct result_encoder client_results;
+
+// When the child started, and how many milliseconds the client gave it to
+// answer (0 if the client did not say)
+struct timespec request_start;
+long request_deadline = 0;
+
+// SIGCHLD only interrupts accept(), so exited children are reaped right away
+void child_exited(int signum) {
+}
+
+// SIGUSR1 asks the server to print its per-backend statistics
+void request_stats(int signum) {
+  stats_requested = 1;
+}
+
+long remaining_ms() {
+  return request_deadline - elapsed_us(&request_start) / 1000;
+}
+
+// Sends a result row, as received from Tier 2, on to the client.  Rows that
+// are not showtimes, e.g., title completions, always go as text.
+void forward_row(char* row) {
+  char  values[4][FEED_VALUE_SIZE];
+  char* pointers[4] = { values[0], values[1], values[2], values[3] };
+
+  if ((client_results.encoding & ENCODING_COMPACT) && row_values(row, values) == 0)
+    send_result_row(&client_results, pointers);
+  else
+    send_result_text(&client_results, row);
+}
+
+// Results are always asked of Tier 2 in compact batches, whatever the client
+// asked for, and compressed if the client asked for that, so both hops are
+char* backend_encoding() {
+  return client_results.encoding & ENCODING_DEFLATE ? "compact,deflate" : "compact";
+}
+
+/******************************************************************************
+
+Builds the request for a count message from the client, which has the form
+
+  COUNT <grouping> <search>
+
+with the search as for build_query() (see message-tools.h), into the 'size'
+bytes at 'query'.  Returns what build_query() returns, -1 too if the request
+does not fit, or -2 if the grouping is not one Tier 2 counts by.  The counts
+are added up and sorted here, so Tier 2 is not asked to sort anything.
+
+*******************************************************************************/
+int build_count_query(char* message, char* query, size_t size, char* location,
+		      size_t location_size) {
+  struct text_buffer out;
+  char               search[QUERY_SIZE];
+  char*              grouping = message + strlen(COUNT_PREFIX);
+  char*              rest = strchr(grouping, ' ');
+  int                found;
+
+  if (rest == NULL)
+    return -2;
+  *rest++ = '\0';
+  if (parse_grouping(grouping) < 0)
+    return -2;
+
+  if ((found = build_query(rest, search, sizeof(search), location, location_size)) < 0)
+    return -1;
+
+  // The search always ends in its ORDER BY, which is left out
+  start_text(&out, query, size);
+  if (append_text(&out, COUNT_PREFIX, strlen(COUNT_PREFIX)) < 0 ||
+      append_text(&out, grouping, strlen(grouping)) < 0 || append_text(&out, " ", 1) < 0 ||
+      append_text(&out, search, strlen(search) - strlen(SEARCH_ORDER)) < 0)
+    return -1;
+
+  return found;
+}
+
+/******************************************************************************
+
+Opens a stream for 'query' to every shard it needs: the shard of 'location'
+if one is given, otherwise all of them.  Returns the number of streams, with
+the milliseconds they may take in '*timeout'.  If the client's deadline has
+already passed, '*timeout' is 0 or less and no stream is opened.  'prefetched'
+is as for query_backend().
+
+*******************************************************************************/
+int open_query(struct shard_map* shards, char* location, char* query,
+	       struct upstream* prefetched, struct shard_stream* streams, int* timeout) {
+  char request[QUERY_SIZE + 64];
+  long remaining;
+  int  count = 0;
+  int  targets[MAX_SHARDS];
+  int  i;
+
+  *timeout = shard_timeout;
+
+  // Tier 2 is given a little less than what is left, so that its "TIMEOUT"
+  // still arrives before this server stops waiting for it
+  snprintf(request, sizeof(request), ENCODING_PREFIX "%s %s", backend_encoding(), query);
+  if (request_deadline > 0) {
+    remaining = remaining_ms();
+    if (remaining < *timeout)
+      *timeout = remaining;
+    snprintf(request, sizeof(request), DEADLINE_PREFIX "%ld " ENCODING_PREFIX "%s %s",
+	     remaining * 9 / 10, backend_encoding(), query);
+  }
+
+  if (*timeout > 0) {
+    if (location != NULL)
+      targets[count++] = shard_for_location(shards, location);
+    else
+      for (i = 0; i < shards->count; i++)
+	targets[count++] = i;
+    open_shard_streams(shards, streams, targets, count, request, *timeout, prefetched);
+  } else if (prefetched != NULL)
+    abandon_upstream(prefetched);
+
+  return count;
+}
+
+/******************************************************************************
+
+Closes the streams of a query that found 'rows' rows and leaves its final
+message in 'buffer': "DONE", "NO RESULTS", "PARTIAL" if some but not all
+shards failed or timed out, or a shard left some matches out, or "TIMEOUT".
+Returns the number of streams that failed.
+
+*******************************************************************************/
+int finish_query(struct shard_stream* streams, int count, int timeout, long rows, char* buffer) {
+  int failed = 0;
+  int timeouts = 0;
+  int partial = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (streams[i].state == STREAM_FAILED)
+      failed++;
+    if (streams[i].timed_out)
+      timeouts++;
+    if (streams[i].partial)
+      partial++;
+    close_shard_stream(&streams[i]);
+  }
+
+  if (timeout <= 0 || (failed == count && timeouts > 0)) {
+    fprintf(stderr, "Server: The query ran out of time\n");
+    strcpy(buffer, "TIMEOUT");
+  } else if (failed == 0 && partial > 0) {
+    fprintf(stderr, "Server: %d of %d shards left matches out, result is partial\n", partial, count);
+    strcpy(buffer, "PARTIAL");
+  } else if (failed == 0)
+    strcpy(buffer, rows > 0 ? "DONE" : "NO RESULTS");
+  else if (failed < count) {
+    fprintf(stderr, "Server: %d of %d shards did not answer, result is partial\n", failed, count);
+    strcpy(buffer, "PARTIAL");
+  } else
+    strcpy(buffer, "NO RESULTS");
+  fprintf(stderr, "Server: The query has been recieved successfully\n");
+
+  return failed;
+}
+
+/******************************************************************************
+
+Sends a count (see facet-tools.h) to the shards it needs and forwards the
+counts to the client.  Each shard only counts the showtimes of its own
+locations, so every shard's counts are read and those of the same group added
+up before any is sent, in (name, location, date) order.  Otherwise it works
+as query_backend(), which calls it, except that a count, which reads every
+matching showtime, is not taken as a sample of Tier 2's latency.
+
+*******************************************************************************/
+int query_counts(struct shard_map* shards, char* location, char* query,
+		 struct flight* flight, long skip, struct upstream* prefetched, char* buffer) {
+  struct shard_stream  streams[MAX_SHARDS];
+  struct facet_index*  counts = create_facet_index();
+  struct facet_group** sorted;
+  char                 values[FACET_COLUMNS][FACET_ROW_SIZE];
+  char*                pointers[FACET_COLUMNS] = { values[0], values[1], values[2] };
+  char                 row[FACET_ROW_SIZE];
+  long                 showtimes;
+  long                 rows;
+  int                  timeout;
+  int                  count;
+  int                  failed;
+  int                  i;
+
+  count = open_query(shards, location, query, prefetched, streams, &timeout);
+
+  for (i = 0; i < count; i++)
+    while (streams[i].state == STREAM_ROW) {
+      if (request_deadline > 0 && remaining_ms() <= 0) {
+	streams[i].state = STREAM_FAILED;
+	streams[i].timed_out = 1;
+	break;
+      }
+      if (parse_facet_row(streams[i].row, values, &showtimes) == 0)
+	add_facet_count(counts, pointers, showtimes);
+      advance_shard_stream(&streams[i]);
+    }
+
+  sorted = sort_facets(counts);
+  for (rows = 0; sorted[rows] != NULL; rows++) {
+    format_facet_row(row, sizeof(row), sorted[rows]);
+    if (flight != NULL)
+      publish_flight_row(flights, flight, row, strlen(row));
+    if (skip > 0)
+      skip--;
+    else
+      send_result_text(&client_results, row);
+  }
+  free(sorted);
+  free_facet_index(counts);
+
+  failed = finish_query(streams, count, timeout, rows, buffer);
+  printf("Server: Added up %ld counts from %d shards\n", rows, count);
+
+  if (flight != NULL)
+    finish_flight(flights, flight, buffer, failed == count);
+
+  return failed;
+}
+
+/******************************************************************************
+
+Sends 'query' to the Tier 2 servers of the shards it needs and forwards the
+result rows to the client.  When 'location' names a single location only that
+location's shard is asked; otherwise the query goes to every shard at once and
+the sorted streams are merged, always forwarding the smallest head row next,
+so the client still sees one stream in (name, location, date, time) order.
+
+The final message ("DONE", "NO RESULTS", or "PARTIAL" if some but not all
+shards failed or timed out, or some matches were left out) is left in 'buffer' for the caller to pass on.  If
+this process leads a coalesced flight, every row is also published to the
+flight so followers can replay it.  A follower falling back to its own query
+passes the number of rows it already forwarded in 'skip', and those are not
+sent to the client a second time.  A non-zero 'limit' caps the number of rows,
+and rows equal to the one before are dropped.  'prefetched', if not NULL, is a
+connection to Tier 2 set up while the client's query was still arriving.
+
+If the client gave a deadline, the time left is passed on to Tier 2 and bounds
+every step of the query; once it has passed the query is abandoned and the
+final message is "TIMEOUT".
+
+*******************************************************************************/
+int query_backend(struct shard_map* shards, char* location, char* query,
+		  struct flight* flight, long skip, long limit, struct upstream* prefetched,
+		  char* buffer) {
+  struct shard_stream streams[MAX_SHARDS];
+  struct shard_stream* next;
+  struct timespec     start;
+  char                last[ROW_SIZE] = "";
+  long                latency;
+  int                 timeout;
+  int                 count;
+  int                 failed;
+  long                rows = 0;
+  int                 i;
+
+  if (strncmp(query, COUNT_PREFIX, strlen(COUNT_PREFIX)) == 0)
+    return query_counts(shards, location, query, flight, skip, prefetched, buffer);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  count = open_query(shards, location, query, prefetched, streams, &timeout);
+  latency = elapsed_us(&start);
+
+  while (1) {
+    // Read timeouts bound each row, but the deadline bounds all of them
+    if (request_deadline > 0 && remaining_ms() <= 0)
+      for (i = 0; i < count; i++)
+	if (streams[i].state == STREAM_ROW) {
+	  streams[i].state = STREAM_FAILED;
+	  streams[i].timed_out = 1;
+	}
+
+    next = NULL;
+    for (i = 0; i < count; i++)
+      if (streams[i].state == STREAM_ROW &&
+	  (next == NULL || compare_rows(streams[i].row, next->row) < 0))
+	next = &streams[i];
+    if (next == NULL || (limit > 0 && rows == limit))
+      break;
+
+    // Title completions from different shards can name the same movie
+    if (strcmp(next->row, last) == 0) {
+      advance_shard_stream(next);
+      continue;
+    }
+    strcpy(last, next->row);
+
+    printf("Server: Received message from shard %d:\n%s\n", next->shard, next->row);
+    if (flight != NULL)
+      publish_flight_row(flights, flight, next->row, strlen(next->row));
+    if (skip > 0)
+      skip--;
+    else
+      forward_row(next->row);
+    rows++;
+    advance_shard_stream(next);
+  }
+
+  failed = finish_query(streams, count, timeout, rows, buffer);
+
+  if (flight != NULL)
+    finish_flight(flights, flight, buffer, failed == count);
+
+  // Tier 2's latency steers how many queries are admitted at once.  It is
+  // the time to the first rows of every shard, before any was forwarded, so
+  // a slow client does not count, and only searches are sampled, as title
+  // completions take far less time and would pull the baseline down.
+  if (count > 0 && strncmp(query, "COMPLETE ", strlen("COMPLETE ")) != 0)
+    record_latency(admission, latency, failed > 0);
+
+  return failed;
+}
+
+/******************************************************************************
+
+Sends the queries of a batch to its shard as one request (see batch-tools.h)
+and hands each result to the flight of the child that asked for it, while the
+rows of this child's own query, always the first, are also forwarded to its
+client.  Results that did not arrive, because the shard failed or could not
+answer them, fail their flights, so those children ask Tier 2 themselves.
+
+Returns 0 with the final message of this child's query in 'buffer', or -1 if
+that query needs to be sent again, in which case '*forwarded' rows have
+already been sent to the client.  'prefetched' is as for query_backend().
+
+*******************************************************************************/
+int query_batch(struct shard_map* shards, struct batch* batch, struct upstream* prefetched,
+		long* forwarded, char* buffer) {
+  struct shard_stream stream;
+  struct flight*      flight;
+  struct timespec     start;
+  char                request[BATCH_REQUEST_SIZE];
+  char*               status;
+  long                latency;
+  long                deadline = 0;
+  int                 timeout = shard_timeout;
+  int                 unbounded = 0;
+  int                 answered = -1;
+  int                 failed;
+  int                 len = 0;
+  int                 id = 0;
+  int                 n;
+  int                 i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Tier 2 may take as long as the client that gave it the most time, but
+  // is told each query's own deadline
+  for (i = 0; i < batch->count; i++)
+    if (batch->deadlines[i] <= 0)
+      unbounded = 1;
+    else if (batch->deadlines[i] > deadline)
+      deadline = batch->deadlines[i];
+  if (!unbounded) {
+    if (deadline < timeout)
+      timeout = deadline;
+    len = snprintf(request, sizeof(request), DEADLINE_PREFIX "%ld ", deadline * 9 / 10);
+  }
+  n = snprintf(request + len, sizeof(request) - len, ENCODING_PREFIX "%s " BATCH_PREFIX "%d",
+	       backend_encoding(), batch->count);
+  for (i = 0; i < batch->count && n >= 0 && n < sizeof(request) - len; i++) {
+    len += n;
+    n = snprintf(request + len, sizeof(request) - len, "\n%ld %s",
+		 batch->deadlines[i] > 0 ? batch->deadlines[i] * 9 / 10 : 0, batch->queries[i]);
+  }
+
+  // A batch that does not fit in one request is not sent, and each of its
+  // queries is sent on its own instead, as when the shard could not answer
+  if (n < 0 || n >= sizeof(request) - len) {
+    fprintf(stderr, "Server: A batch of %d queries does not fit in a request\n", batch->count);
+    for (i = 0; i < batch->count; i++)
+      finish_flight(flights, &flights->flights[batch->flights[i]], "NO RESULTS", 1);
+    if (prefetched != NULL)
+      abandon_upstream(prefetched);
+    return -1;
+  }
+
+  open_shard_streams(shards, &stream, &batch->shard, 1, request, timeout, prefetched);
+  latency = elapsed_us(&start);
+  while (stream.state == STREAM_ROW && id < batch->count) {
+    flight = &flights->flights[batch->flights[id]];
+    if (strncmp(stream.row, BATCH_RESULT_PREFIX, strlen(BATCH_RESULT_PREFIX)) != 0) {
+      publish_flight_row(flights, flight, stream.row, strlen(stream.row));
+      if (id == 0) {
+	forward_row(stream.row);
+	(*forwarded)++;
+      }
+      advance_shard_stream(&stream);
+      continue;
+    }
+
+    if (atoi(stream.row + strlen(BATCH_RESULT_PREFIX)) != id)
+      break;
+    status = strchr(stream.row + strlen(BATCH_RESULT_PREFIX), ' ');
+    status = status != NULL ? status + 1 : "FAILED";
+    failed = strcmp(status, "DONE") != 0 && strcmp(status, "NO RESULTS") != 0 &&
+      strcmp(status, "PARTIAL") != 0;
+    finish_flight(flights, flight, status, failed);
+    if (id == 0 && (!failed || strcmp(status, "TIMEOUT") == 0)) {
+      strcpy(buffer, status);
+      answered = 0;
+    }
+    id++;
+    advance_shard_stream(&stream);
+  }
+
+  for (; id < batch->count; id++)
+    finish_flight(flights, &flights->flights[batch->flights[id]], "NO RESULTS", 1);
+  failed = stream.state == STREAM_FAILED;
+  close_shard_stream(&stream);
+  printf("Server: Sent a batch of %d queries to shard %d\n", batch->count, batch->shard);
+
+  // Sampled when the shard first answered, as in query_backend()
+  record_latency(admission, latency, failed);
+
+  return answered;
+}
 
 int main(int argc, char **argv) {
   struct sockaddr_in addr;
   char               client_addr[INET_ADDRSTRLEN];
-  char               buffer[BUFFER_SIZE];
-  char               remote_server[MAX_HOSTNAME_LENGTH];
+  char               buffer[REQUEST_SIZE];
+  char*              remote_servers[MAX_BACKENDS];
+  int                remote_server_count = 0;
+  int                policy = BALANCE_LEAST_REQUESTS;
+  int                health_interval = HEALTH_INTERVAL;
+  int                plain_local = 0;
+  int                max_limit = ADMISSION_LIMIT;
+  int                hard_limit = 0;
+  int                max_watchers = ADMISSION_WATCHERS;
+  double             client_rate = CLIENT_RATE;
+  int                decision;
+  long               retry_ms;
+  int                i;
   char               c;
   unsigned int       len = sizeof(addr);
   unsigned int       sockfd;
   unsigned int       port = DEFAULT_PORT;
   unsigned int       remote_server_port = DEFAULT_PORT;
   SSL*               clientssl;
-  SSL*               server2ssl;
   int                clientsd;
-  int                server2sd;
   pid_t              pid;
+  struct shard_map*  shards;
+  char*              shard_file = NULL;
+  struct sigaction   stats_action;
 
-  // Do not create zombie processes
-  signal(SIGCHLD, SIG_IGN);
+  // Children are reaped in the accept loop, which gives back their admission
+  // slots.  A client that goes away in the middle of its results must fail
+  // the child's next write rather than kill it
+  signal(SIGPIPE, SIG_IGN);
   init_openssl();
     
   // Port can be specified on the command line. If it's not, use the default port
-  while((c = getopt(argc, argv, "o:p:s:")) != -1)
+  // The -s option may be repeated, once per tier 2 server, and each server may
+  // carry its own port as <name>:<port>.  Servers without one use the -o port,
+  // and one given as unix:<path> is reached through that Unix domain socket.
+  while((c = getopt(argc, argv, "b:c:d:i:m:no:p:r:s:t:T:w:W:")) != -1)
     switch(c)
       {
       case 'p':
     port = atoi(optarg);
     break;
       case 's':
-    strcpy(remote_server, optarg);
+    if (remote_server_count == MAX_BACKENDS) {
+      fprintf(stderr, "Server: At most %d remote servers are supported\n", MAX_BACKENDS);
+      return EXIT_FAILURE;
+    }
+    remote_servers[remote_server_count++] = optarg;
     break;
       case 'o':
     remote_server_port = atoi(optarg);
+    break;
+      case 'b':
+    if (strcmp(optarg, "p2c") == 0)
+      policy = BALANCE_TWO_CHOICES;
+    else if (strcmp(optarg, "lor") == 0)
+      policy = BALANCE_LEAST_REQUESTS;
+    else {
+      fprintf(stderr, "Server: Unknown balancing policy '%s' (use lor or p2c)\n", optarg);
+      return EXIT_FAILURE;
+    }
+    break;
+      case 'i':
+    health_interval = atoi(optarg);
+    break;
+      case 'm':
+    shard_file = optarg;
+    break;
+      case 't':
+    shard_timeout = atoi(optarg);
+    break;
+      case 'c':
+    max_limit = atoi(optarg);
+    break;
+      case 'd':
+    hard_limit = atoi(optarg);
+    break;
+      case 'r':
+    client_rate = atof(optarg);
+    break;
+      case 'w':
+    batch_window = atol(optarg);
+    break;
+      case 'W':
+    max_watchers = atoi(optarg);
+    break;
+      case 'n':
+    plain_local = 1;
+    break;
+      case 'T':
+    if ((tls_profile = parse_tls_profile(optarg)) < 0) {
+      fprintf(stderr, "Server: Unknown TLS profile '%s' (use default or fast)\n", optarg);
+      return EXIT_FAILURE;
+    }
     break;
       default:
-    fprintf(stderr, "Usage: ssl-server-tier1 -p <port> (optional) -s <remote server name/IP address> -o <remote server port>\n");
+    fprintf(stderr, "Usage: ssl-server-tier1 -p <port> (optional) -s <remote server name/IP address>[:<port>] (repeatable) -o <remote server port> -m <shard map file> (instead of -s) -b <lor|p2c> (optional) -i <health check seconds> (optional) -t <shard timeout ms> (optional) -c <max concurrent queries> (optional) -d <max connections> (optional) -r <queries per second per client, 0 for no limit> (optional) -w <batch window microseconds, 0 for no batching> (optional) -n (no TLS to unix:<path> servers) (optional) -T <default|fast> (optional) -W <max watching clients> (optional)\n");
     return EXIT_FAILURE;
       }
+
+  if ((remote_server_count == 0) == (shard_file == NULL)) {
+    fprintf(stderr, "Server: Give the remote servers either with -s or with a shard map (-m)\n");
+    return EXIT_FAILURE;
+  }
+
+  // The backend tables are shared with every child, so they must exist before
+  // the first fork(), and so must the health checkers that keep them up to
+  // date.  Without a shard map all remote servers form a single shard.
+  shards = create_shard_map();
+  if (shard_file != NULL)
+    load_shard_map(shards, shard_file, policy, remote_server_port);
+  else {
+    add_shard(shards, policy);
+    for (i = 0; i < remote_server_count; i++)
+      add_backend(shards->shards[0], remote_servers[i], remote_server_port);
+  }
+  if (plain_local)
+    for (i = 0; i < shards->count; i++)
+      set_plain_local(shards->shards[i]);
+  if (health_interval > 0)
+    for (i = 0; i < shards->count; i++)
+      start_health_checker(shards->shards[i], health_interval);
+  flights = create_flight_table();
+  batches = create_batch_table();
+  changes = create_change_log(1);
+  for (i = 0; i < shards->count; i++)
+    start_feed_subscriber(shards->shards[i], i, changes, flights);
+  admission = create_admission(max_limit, hard_limit, max_watchers, client_rate, 2 * client_rate);
+
+  // Installed without SA_RESTART so that the signal interrupts accept()
+  stats_action.sa_handler = request_stats;
+  sigemptyset(&stats_action.sa_mask);
+  stats_action.sa_flags = 0;
+  sigaction(SIGUSR1, &stats_action, NULL);
+  stats_action.sa_handler = child_exited;
+  sigaction(SIGCHLD, &stats_action, NULL);
   
   // This will create a network socket and return a socket descriptor, which is
   // and works just like a file descriptor, but for network communcations. Note
   // we have to specify which TCP/UDP port on which we are communicating as an
   // argument to our user-defined create_socket() function.
   sockfd = create_socket(port);
+
+  // The fast profile's context, and its ticket keys, are shared by all children
+  if (tls_profile == TLS_PROFILE_FAST)
+    fast_server_context();
   
   // Wait for incoming connections and handle them as the arrive
   while(true) {
@@ -81,156 +657,249 @@ int main(int argc, char **argv) {
     // we now have a connection between client and server and can communicate
     // using the socket descriptor
     clientsd = accept(sockfd, (struct sockaddr*)&addr, &len);
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+      reap_client(admission, pid);
+    if (stats_requested) {
+      stats_requested = 0;
+      for (i = 0; i < shards->count; i++) {
+        fprintf(stdout, "Server: Shard %d\n", i);
+        print_backend_stats(shards->shards[i], stdout);
+      }
+      print_flight_stats(flights, stdout);
+      print_batch_stats(batches, stdout);
+      print_admission_stats(admission, stdout);
+    }
+    if (clientsd < 0 && errno == EINTR)
+      continue;
     if (clientsd < 0) {
       fprintf(stderr, "Server: Unable to accept connection: %s\n", strerror(errno));
       return EXIT_FAILURE;
     }
     
-    // This will be a concurrent, rather than an iterative, server
+    // Past the hard limit the connection is closed without a word, which costs
+    // far less than a child telling the client to come back later
+    decision = admit_client(admission, addr.sin_addr.s_addr, &retry_ms, &admission_client);
+    if (decision == REJECT_DROP) {
+      close(clientsd);
+      continue;
+    }
+
+    // This will be a concurrent, rather than an iterative, server.  Flush
+    // first so that buffered output is not duplicated in the child.
+    fflush(stdout);
     pid = fork();
+    if (pid > 0)
+      track_client(admission, admission_client, pid);
+    else if (pid < 0) {
+      fprintf(stderr, "Server: Unable to fork: %s\n", strerror(errno));
+      finish_client(admission, admission_client);
+    }
     
     if (pid == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &request_start);
+      client_admitted = decision == ADMIT;
+
       // Display the IPv4 network address of the connected client
       inet_ntop(AF_INET, (struct in_addr*)&addr.sin_addr, client_addr, INET_ADDRSTRLEN);
       fprintf(stdout, "Server: Established TCP connection with client (%s) on port %u\n", client_addr, port);
       
       // Create a new SSL object to bind to the socket descriptor
       clientssl = create_ssl_socket(clientsd);
-      
-      // SSL_accept() executes the SSL/TLS handshake. Because network sockets
-      // are blocking by default, this function will block as well until the
-      // handshake is complete.
-      if (SSL_accept(clientssl) <= 0) {
-    fprintf(stderr, "Server: Could not establish secure connection:\n");
-    ERR_print_errors_fp(stderr);
-      }
-      else
-    fprintf(stdout, "Server: Established SSL/TLS connection with client (%s)\n", client_addr);
-
-      // This is where the server establishes a connection with another server
-      server2sd = create_client_socket(remote_server, remote_server_port);
-      server2ssl = create_client_ssl_socket(server2sd);
-      if (SSL_connect(server2ssl) == 1) {
-    printf("Server: Established SSL/TLS session to '%s' on port %u\n",
-           "localhost", remote_server_port);
-      } else {
-    fprintf(stderr, "Server: Could not establish SSL session to '%s' on port %u\n", remote_server, remote_server_port);
-    exit(EXIT_FAILURE);
+
+      if (!client_admitted) {
+            fprintf(stdout, "Server: Too busy for client (%s), retry in %ld ms\n", client_addr, retry_ms);
+            reject_client(clientssl, clientsd, retry_ms);
+            SSL_free(clientssl);
+            close(clientsd);
+            exit(EXIT_SUCCESS);
       }
-      
-      //**************************************************************************
-      char delim[] = "/";
-      char eq[] = "=";
-      char movie[20], location[20], date[20], time[20], type[20];
-      int count = 1;
-      char query[BUFFER_SIZE] = "SELECT * FROM movie_times";
-      char where[BUFFER_SIZE] = " WHERE ";
-      int where_count = 0;
-      int nbytes_read;
-      bzero(buffer, BUFFER_SIZE);
-      SSL_read(clientssl, buffer, BUFFER_SIZE);
 
-        
-      printf("Message from client: %s\n", buffer);
+      // With a single shard the query can only go to that shard, so the
+      // connection to it is started right away and set up while the client's
+      // TLS handshake and query are still arriving, rather than after them.
+      // With several shards the target depends on the query, and those
+      // connections are made once it is known (see open_shard_streams()).
+      struct client_session session;
+      struct upstream upstream;
+      struct upstream* prefetched = NULL;
 
-      char *ptr = strtok(buffer, delim);
+      if (shards->count == 1) {
+            start_upstream(shards->shards[0], 0, &upstream);
+            prefetched = &upstream;
+      }
+      start_client_session(&session, clientssl, clientsd, buffer, REQUEST_SIZE);
+      run_pipeline(&session, prefetched, prefetched != NULL, REQUEST_TIMEOUT);
+      set_socket_timeout(clientsd, REQUEST_TIMEOUT);
 
-      while(ptr != NULL){
-            if (count == 1) {
-                  strcpy(movie, ptr);
-            }
+      if (session.state != CLIENT_READY) {
+            fprintf(stderr, "Server: No query received from client (%s)\n", client_addr);
+            if (prefetched != NULL)
+                  abandon_upstream(prefetched);
+            SSL_free(clientssl);
+            close(clientsd);
+            exit(EXIT_FAILURE);
+      }
+      fprintf(stdout, "Server: Established SSL/TLS connection with client (%s)\n", client_addr);
 
-            if (count == 2) {
-                  strcpy(location, ptr);
-            }
+      //**************************************************************************
+      char query[QUERY_SIZE];
+      char location[REQUEST_SIZE];
+      struct flight* flight;
+      struct batch* batch = NULL;
+      struct batch taken;
+      pid_t sender_pid;
+      int sender = 0;
+      size_t offset = 0;
+      long forwarded = 0;
+      long limit = 0;
+      int leader = 0;
+      int status;
+      int watch = 0;
+      long watch_position = 0;
+      long watch_version;
+      char* location_value = NULL;
+      char* reply;
 
-            if (count == 3) {
-                  strcpy(date, ptr);
-            }
+      printf("Message from client: %s\n", buffer);
 
-            if (count == 4) {
-                  strcpy(time, ptr);
-            }
-            ptr = strtok(NULL, delim);
-            count = count + 1;
-      }
+      // The deadline and encoding are not part of the query, so that queries
+      // differing only in them are still coalesced
+      request_deadline = strip_deadline(buffer);
+      start_results(&client_results, clientssl, strip_encoding(buffer));
 
-      bzero(buffer, BUFFER_SIZE);
-      
-      if (strcmp(movie, "name = ''") != 0) {
-            strcat(where, movie);
-            where_count = where_count + 1;
+      // A watching client is sent the changes made after its search started,
+      // so none can fall between its results and its first change
+      if (strncmp(buffer, WATCH_PREFIX, strlen(WATCH_PREFIX)) == 0) {
+            memmove(buffer, buffer + strlen(WATCH_PREFIX), strlen(buffer + strlen(WATCH_PREFIX)) + 1);
+            watch = 1;
+            watch_position = feed_position(changes, 0, &watch_version);
       }
 
-      if (strcmp(location, "location = ''") != 0) {
-            if (where_count >= 1) {
-                  strcat(where, " AND ");
-            }
-            strcat(where, location);
-            where_count = where_count + 1;
-      }
+      if (strncmp(buffer, "COMPLETE ", strlen("COMPLETE ")) == 0) {
+            // Title completions are passed to every shard as they are, and at
+            // most the requested number of titles is returned
+            strcpy(query, buffer);
+            limit = atoi(buffer + strlen("COMPLETE "));
+            status = 0;
+      } else if (strncmp(buffer, COUNT_PREFIX, strlen(COUNT_PREFIX)) == 0)
+            status = build_count_query(buffer, query, sizeof(query), location, sizeof(location));
+      else
+            status = build_query(buffer, query, sizeof(query), location, sizeof(location));
 
-      if (strcmp(date, "date = ''") != 0) {
-            if (where_count >= 1) {
-                  strcat(where, " AND ");
-            }
-            strcat(where, date);
-            where_count = where_count + 1;
+      // A search that does not fit in a query is refused, not run with some
+      // of its conditions left out
+      if (status < 0) {
+            reply = status == -1 ? "TOO LONG" : "UNSUPPORTED";
+            SSL_write(clientssl, reply, strlen(reply)+1);
+            if (prefetched != NULL)
+                  abandon_upstream(prefetched);
+            SSL_free(clientssl);
+            close(clientsd);
+            exit(EXIT_SUCCESS);
       }
+      if (status)
+            location_value = location;
 
-      if (strcmp(time, "time = ''") != 0) {
-            if (where_count >= 1) {
-                  strcat(where, " AND ");
-            }
-            strcat(where, time);
-            where_count = where_count + 1;
-      }
-      
-      if (where_count != 0) {
-            strcat(query, where);
-      }
+      bzero(buffer, BUFFER_SIZE);
 
       printf("Server: Sending query to database:\n%s\n", query);
-      SSL_write(server2ssl, query, strlen(query)+1);
-      bzero(buffer, BUFFER_SIZE);
+
+      // Only searches whose matches can be told from a row alone can be
+      // watched; a search by distance or by similar titles can not
+      if (watch && !filter_supported(query)) {
+            SSL_write(clientssl, "UNSUPPORTED", strlen("UNSUPPORTED")+1);
+            if (prefetched != NULL)
+                  abandon_upstream(prefetched);
+            SSL_free(clientssl);
+            close(clientsd);
+            exit(EXIT_SUCCESS);
+      }
 
       //**************************************************************************
 
-      // Receive response back from other server that it will pass to the client
-      while (1) {
-            nbytes_read = SSL_read(server2ssl, buffer, BUFFER_SIZE);
-            if (nbytes_read < 0) {
-                  fprintf(stderr, "Server: Error reading from socket: %s\n", strerror(errno));
-                  break;
-            }
+      // If the same query is already running for another client, replay that
+      // result instead of sending it to Tier 2 again
+      flight = join_flight(flights, query, &leader);
 
-            if (strcmp(buffer, "NO RESULTS") == 0)
-            {
-                  fprintf(stderr, "Server: No results\n");
-                  break;
-            }
+      // A query no other client is running may still share a Tier 2 request
+      // with other queries for the same shard arriving about the same time.
+      // Its result then arrives through its flight, as if it had joined one.
+      // Counts are always sent on their own, as Tier 2 does not batch them.
+      if (flight != NULL && leader && batch_window > 0 && limit == 0 &&
+          strncmp(query, "COMPLETE ", strlen("COMPLETE ")) != 0 &&
+          strncmp(query, COUNT_PREFIX, strlen(COUNT_PREFIX)) != 0 &&
+          (location_value != NULL || shards->count == 1))
+            batch = join_batch(batches, location_value ? shard_for_location(shards, location_value) : 0,
+                               query, request_deadline > 0 ? remaining_ms() : 0,
+                               flight - flights->flights, &sender, &sender_pid);
+      if (batch != NULL && !sender) {
+            printf("Server: Added query to a batch for client (%s)\n", client_addr);
+            hand_over_flight(flights, flight, sender_pid);
+            leader = 0;
+      }
 
-            if (strcmp(buffer, "DONE") == 0)
-            {
-                  fprintf(stderr, "Server: The query has been recieved successfully\n");
-                  break;
+      if (flight != NULL && !leader) {
+            printf("Server: Joined in-flight query for client (%s)\n", client_addr);
+            if (prefetched != NULL)
+                  abandon_upstream(prefetched);
+            // A follower keeps to its own deadline, however long the leader takes
+            while ((status = next_flight_row(flights, flight, &offset, buffer, BUFFER_SIZE,
+                                             request_deadline > 0 ? remaining_ms() : -1)) == FLIGHT_ROW) {
+                  forward_row(buffer);
+                  forwarded++;
             }
-            printf("Server: Received message from database:\n%s\n", buffer);
-            SSL_write(clientssl, buffer, strlen(buffer)+1);
-            bzero(buffer, BUFFER_SIZE);
+            leave_flight(flights, flight, status == FLIGHT_FALLBACK);
+            if (status == FLIGHT_TIMEOUT) {
+                  fprintf(stderr, "Server: The query ran out of time\n");
+                  strcpy(buffer, "TIMEOUT");
+            } else if (status == FLIGHT_FALLBACK)
+                  query_backend(shards, location_value, query, NULL, forwarded, limit, NULL,
+                                buffer);
+      } else if (batch != NULL) {
+            // Alone in its batch, the query goes to Tier 2 as usual
+            close_batch(batches, batch, batch_window, &taken);
+            if (taken.count == 1)
+                  query_backend(shards, location_value, query, flight, 0, limit, prefetched,
+                                buffer);
+            else if (query_batch(shards, &taken, prefetched, &forwarded, buffer) < 0)
+                  query_backend(shards, location_value, query, NULL, forwarded, limit, NULL,
+                                buffer);
+            leave_flight(flights, flight, 0);
+      } else {
+            query_backend(shards, location_value, query, flight, 0, limit, prefetched,
+                          buffer);
+            if (flight != NULL)
+                  leave_flight(flights, flight, 0);
       }
-      
+
       printf("Server: Sending result to client (%s)\n", client_addr);
 
-      // Server sends the message to the client
-      SSL_write(clientssl, buffer, strlen(buffer)+1);
+      // Server sends the message to the client, after any rows still waiting
+      // to fill a batch
+      send_result_text(&client_results, buffer);
+      finish_results(&client_results);
+      printf("Server: Sent %ld bytes of results to client (%s)\n", client_results.bytes,
+             client_addr);
+
+      if (watch && strcmp(buffer, "TIMEOUT") != 0) {
+            client_admitted = 0;
+            if (start_watching(admission, admission_client) < 0)
+                  printf("Server: Too many watchers, client (%s) can not watch\n", client_addr);
+            else {
+                  printf("Server: Client (%s) is watching for changes\n", client_addr);
+                  fflush(stdout);
+                  serve_watch(changes, clientssl, query, watch_position);
+            }
+      }
       
       // Terminate the SSL session, close the TCP connection, and clean up
       fprintf(stdout, "Server: Terminating SSL session and TCP connection with client (%s)\n", client_addr);
       
       SSL_free(clientssl);
       close(clientsd);
+      exit(EXIT_SUCCESS);
     } // Child process code ends here. Parent just resumes listening
+    close(clientsd);
   }
   
   // Tear down and clean up server data structures before terminating
@@ -6,7 +6,28 @@ COURSE:   CS469 - Distributed Systems (Regis University)
 SYNOPSIS: This program is a small server application that receives incoming TCP
           connections from clients and simply exchanges messages.  It uses a
           secure SSL/TLS connection using certificates generated with the
-          openssl application.  The purpose is to demonstrate how to establish
+          openssl application.  Movie titles are also kept in an in-memory
+          index (see title-tools.h) that serves title completion requests and
+          prefix or fuzzy title searches without scanning the table, and the
+          theater coordinates in a spatial index (see geo-tools.h) that
+          serves searches for theaters near a given point.  Given a snapshot
+          file (see snapshot-tools.h), the server maps it at startup instead
+          of loading MySQL, and answers searches from it, only asking MySQL
+          for the ones the snapshot can not answer.  While it runs, the
+          server watches the data files and applies just the showtimes added
+          to or removed from them (see reload-tools.h); each change makes a
+          new data version, published to subscribers as a change feed (see
+          feed-tools.h).  Writers holding the ingest key can also send
+          batches of showtimes, which are committed to MySQL in groups (see
+          ingest-tools.h).  The Tier 1 server may send several searches as
+          one batch, answered in a single session (see batch-tools.h), and
+          ask for showtimes to be counted rather than listed, which is
+          answered from counts kept up to date as the data changes (see
+          facet-tools.h).  A Tier 1 server on the same host may connect
+          through a Unix domain socket instead of TCP, optionally without
+          TLS (see local-tools.h).  With "-T fast", sessions use the fast TLS
+          profile, which resumes sessions and accepts requests sent as 0-RTT
+          early data (see tls-tools.h).  The purpose is to demonstrate how to establish
           secure communication between a client and server using public key
           cryptography.
  
@@ -19,7 +40,11 @@ SYNOPSIS: This program is a small server application that receives incoming TCP
           This will create two files: a private key contained in the file
           'key.pem' and a certificate containing a public key in the file
           'cert.pem'.  Your server will require both in order to operate
-          properly.  The client requires neither.
+          properly.  The client requires neither.  The fast TLS profile
+          needs an ECDSA certificate and key instead:
+
+          openssl req -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes
+          -keyout ec-key.pem -x509 -days 365 -out ec-cert.pem
 
           Some of the code and descriptions can be found in "Network Security
           with OpenSSL", O'Reilly Media, 2002.
@@ -29,6 +54,7 @@ SYNOPSIS: This program is a small server application that receives incoming TCP
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
@@ -36,54 +62,1221 @@ SYNOPSIS: This program is a small server application that receives incoming TCP
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 
 #include "server-tools.h"
+#include "title-tools.h"
+#include "geo-tools.h"
+#include "snapshot-tools.h"
+#include "reload-tools.h"
+#include "feed-tools.h"
+#include "ingest-tools.h"
+#include "result-tools.h"
+#include "batch-tools.h"
+#include "facet-tools.h"
+#include "local-tools.h"
+#include "tls-tools.h"
+#include "message-tools.h"
 
 #define BUFFER_SIZE 256
-#define BUF_SIZE 2048
+#define REQUEST_SIZE BATCH_REQUEST_SIZE   // Room for a batch of queries
+#define QUERY_SIZE  8192
+#define DATA_FILE   "sqldata.txt"
+#define THEATER_FILE "theaterdata.txt"
+
+// Built at startup and inherited by every child.  A reload builds new ones
+// and swaps them in; children already running keep the ones they were forked
+// with, so a reload never disturbs a query in progress.
+struct title_index* titles;
+struct geo_index*   theaters;
+struct facet_index* facets;            // Kept up to date rather than rebuilt
+struct snapshot*    snapshot;
+char*               snapshot_file;
+struct dataset*     dataset;           // What the data files held when last loaded
+long                data_version;
+struct change_log*  feed;              // Shared with the children serving subscribers
+
+char* data_files[] = { DATA_FILE, THEATER_FILE };
+
+// Batches from writers wait in the ingest queue until the parent commits them
+// on its own connection to MySQL.  Ingest is off without a key.
+struct ingest_queue* ingest;
+char                 ingest_key[INGEST_KEY_SIZE];
+int                  durability = DURABLE_COMMIT;
+int                  commit_window = INGEST_WINDOW;
+MYSQL*               ingest_connection;
+
+// How the child sends its result, as its client asked
+struct result_encoder results;
+
+static volatile sig_atomic_t stats_requested = 0;
+
+// SIGUSR1 asks the server to print its ingest statistics
+void request_stats(int signum) {
+  stats_requested = 1;
+}
+
+/******************************************************************************
+
+Connects to the MySQL server on 'localhost' and selects the movies database,
+creating it if needed.  Returns NULL if the database can not be used.  A
+non-zero 'timeout_ms' bounds every read from and write to the MySQL server,
+rounded up to whole seconds as MySQL requires.
+
+*******************************************************************************/
+MYSQL* connect_database(long timeout_ms) {
+  MYSQL*       connection;
+  unsigned int timeout = (timeout_ms + 999) / 1000;
+
+  // Initialize the MySQL connection object
+  if ((connection = mysql_init(NULL)) == NULL) {
+    fprintf(stderr, "Could not initialize mysql: %s\n", mysql_error(connection));
+    return NULL;
+  }
+
+  if (timeout > 0) {
+    mysql_options(connection, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(connection, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(connection, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+  }
+
+  // Connect to mysql on 'localhost' and provide login credentials
+  if (mysql_real_connect(connection, "localhost", "user", "password",
+			 NULL, 0, NULL, 0) == NULL) {
+    fprintf(stderr, "Could not connect to MySQL database: %s\n",
+	    mysql_error(connection));
+    mysql_close(connection);
+    return NULL;
+  }
+
+  // create database
+  if (mysql_query(connection, "CREATE DATABASE IF NOT EXISTS movies") ||
+      mysql_query(connection, "USE movies")) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    mysql_close(connection);
+    return NULL;
+  }
+
+  return connection;
+}
+
+/******************************************************************************
+
+Runs the SQL statement contained in 'filename'.  Returns 0, or -1 on failure.
+
+*******************************************************************************/
+int run_sql_file(MYSQL* connection, char* filename) {
+  FILE* fptr;
+  char* buf;
+  long  size;
+
+  fptr = fopen(filename, "r");
+  if (fptr == NULL) {
+    fprintf(stderr, "File operations error: %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  fseek(fptr, 0, SEEK_END);
+  size = ftell(fptr);
+  rewind(fptr);
+  buf = calloc(size + 1, 1);
+  if (buf == NULL || fread(buf, 1, size, fptr) != (size_t)size) {
+    fprintf(stderr, "File operations error: could not read %s\n", filename);
+    fclose(fptr);
+    free(buf);
+    return -1;
+  }
+  fclose(fptr);
+
+  if (mysql_query(connection, buf)) {
+    fprintf(stderr, "MySQL query failed***: %s\n", mysql_error(connection));
+    fprintf(stderr, "MySQL query failed***: %s\n", buf);
+    free(buf);
+    return -1;
+  }
+  free(buf);
+
+  return 0;
+}
+
+/******************************************************************************
+
+Creates the movie_times and theaters tables if needed and populates them from
+the data files.
+This used to happen for every request; it only needs to happen once when the
+server starts.
+
+*******************************************************************************/
+int load_database(MYSQL* connection) {
+  if (mysql_query(connection, "CREATE TABLE IF NOT EXISTS movie_times(name VARCHAR(30) NOT NULL, location VARCHAR(30) NOT NULL, date VARCHAR(30) NOT NULL, time VARCHAR(30) NOT NULL )")) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return -1;
+  }
+  if (mysql_query(connection, "ALTER TABLE movie_times ADD UNIQUE INDEX(name, location, date, time)")) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return -1;
+  }
+
+  if (mysql_query(connection, "CREATE TABLE IF NOT EXISTS theaters(location VARCHAR(30) NOT NULL PRIMARY KEY, latitude DOUBLE NOT NULL, longitude DOUBLE NOT NULL)")) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return -1;
+  }
+
+  //read files to populate database
+  if (run_sql_file(connection, DATA_FILE) < 0 || run_sql_file(connection, THEATER_FILE) < 0)
+    return -1;
+
+  return 0;
+}
+
+/******************************************************************************
+
+Builds the title index from the distinct names in movie_times, along with the
+number of showtimes of each, which is used to rank matches.
+
+*******************************************************************************/
+struct title_index* load_title_index(MYSQL* connection) {
+  struct title_index* index;
+  MYSQL_RES*          result;
+  MYSQL_ROW           row;
+
+  index = create_title_index();
+  if (mysql_query(connection, "SELECT name, COUNT(*) FROM movie_times GROUP BY name") ||
+      (result = mysql_store_result(connection)) == NULL) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return index;
+  }
+  while ((row = mysql_fetch_row(result)))
+    add_title(index, row[0], atol(row[1]));
+  mysql_free_result(result);
+  build_title_index(index);
+
+  return index;
+}
+
+/******************************************************************************
+
+Builds the spatial index from the coordinates of every theater.
+
+*******************************************************************************/
+struct geo_index* load_geo_index(MYSQL* connection) {
+  struct geo_index* index;
+  MYSQL_RES*        result;
+  MYSQL_ROW         row;
+
+  index = create_geo_index();
+  if (mysql_query(connection, "SELECT location, latitude, longitude FROM theaters") ||
+      (result = mysql_store_result(connection)) == NULL) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return index;
+  }
+  while ((row = mysql_fetch_row(result)))
+    add_theater(index, row[0], atof(row[1]), atof(row[2]));
+  mysql_free_result(result);
+  build_geo_index(index);
+
+  return index;
+}
+
+/******************************************************************************
+
+Builds the facet index from the number of showtimes of every name, location
+and date.  From then on it is kept up to date by the changes published to the
+change feed (see count_changes()).
+
+*******************************************************************************/
+struct facet_index* load_facet_index(MYSQL* connection) {
+  struct facet_index* index;
+  MYSQL_RES*          result;
+  MYSQL_ROW           row;
+
+  index = create_facet_index();
+  if (mysql_query(connection, "SELECT name, location, date, COUNT(*) FROM movie_times "
+		  "GROUP BY name, location, date") ||
+      (result = mysql_store_result(connection)) == NULL) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
+    return index;
+  }
+  while ((row = mysql_fetch_row(result)))
+    add_facet_count(index, row, atol(row[3]));
+  mysql_free_result(result);
+
+  return index;
+}
+
+/******************************************************************************
+
+Builds the title index from a snapshot.  Its rows are sorted by name, so each
+title's showtimes form one run of rows.
 
+*******************************************************************************/
+struct title_index* snapshot_title_index(struct snapshot* snapshot) {
+  struct title_index* index;
+  uint32_t*           names = snapshot->columns[COLUMN_NAME];
+  uint32_t            rows = snapshot->header->row_count;
+  uint32_t            start;
+  uint32_t            end;
 
+  index = create_title_index();
+  for (start = 0; start < rows; start = end) {
+    for (end = start + 1; end < rows && names[end] == names[start]; end++)
+      ;
+    add_title(index, snapshot_string(snapshot, names[start]), end - start);
+  }
+  build_title_index(index);
+
+  return index;
+}
+
+struct geo_index* snapshot_geo_index(struct snapshot* snapshot) {
+  struct geo_index* index;
+  uint32_t          i;
+
+  index = create_geo_index();
+  for (i = 0; i < snapshot->header->theater_count; i++)
+    add_theater(index, snapshot_string(snapshot, snapshot->theaters[i].location),
+		snapshot->theaters[i].latitude, snapshot->theaters[i].longitude);
+  build_geo_index(index);
+
+  return index;
+}
+
+struct facet_index* snapshot_facet_index(struct snapshot* snapshot) {
+  struct facet_index* index;
+  char*               values[FACET_COLUMNS];
+  uint32_t            row;
+  int                 column;
+
+  index = create_facet_index();
+  for (row = 0; row < snapshot->header->row_count; row++) {
+    for (column = 0; column < FACET_COLUMNS; column++)
+      values[column] = snapshot_string(snapshot, snapshot->columns[column][row]);
+    add_facet_count(index, values, 1);
+  }
+
+  return index;
+}
+
+// Sends one row found in the snapshot, encoded as rows from MySQL are
+void send_snapshot_row(void* context, char** values) {
+  send_result_row((struct result_encoder*)context, values);
+}
+
+/******************************************************************************
+
+Appends 'text' to 'out' as a quoted SQL string, doubling any single quotes.
+Returns 0, or -1 if it does not fit in 'size' bytes.
+
+*******************************************************************************/
+int append_quoted(char* out, size_t size, char* text) {
+  size_t len = strlen(out);
+
+  if (len + 1 >= size)
+    return -1;
+  out[len++] = '\'';
+  for (; *text != '\0'; text++) {
+    if (len + 3 >= size)
+      return -1;
+    if (*text == '\'')
+      out[len++] = '\'';
+    out[len++] = *text;
+  }
+  out[len++] = '\'';
+  out[len] = '\0';
+
+  return 0;
+}
+
+/******************************************************************************
+
+Looks for the predicate starting with 'form' (e.g., "name LIKE '") in 'query'.
+If it is there, its quoted value is copied into 'text', and 'start'/'end' are
+set to the first character of the predicate and the character just past it.
+Returns 1 if the predicate was found, 0 otherwise.
+
+*******************************************************************************/
+int find_predicate(char* query, char* form, char* text, size_t size, char** start, char** end) {
+  size_t len;
+
+  *start = strstr(query, form);
+  if (*start == NULL)
+    return 0;
+  *end = strchr(*start + strlen(form), '\'');
+  if (*end == NULL)
+    return 0;
+  len = *end - *start - strlen(form);
+  if (len >= size)
+    return 0;
+  memcpy(text, *start + strlen(form), len);
+  text[len] = '\0';
+  (*end)++;
+
+  return 1;
+}
+
+/******************************************************************************
+
+Copies 'query' to 'out', replacing the text between 'start' and 'end' with
+"<column> IN (<values>)".  An empty list matches nothing.  Returns 0, or -1 if
+the result does not fit in 'size' bytes.
+
+*******************************************************************************/
+int substitute_list(char* query, char* start, char* end, char* column, char** values,
+		    int count, char* out, size_t size) {
+  int i;
+
+  if ((size_t)(start - query) + strlen(column) + 6 >= size)
+    return -1;
+  memcpy(out, query, start - query);
+  out[start - query] = '\0';
+  strcat(out, column);
+  strcat(out, " IN (");
+  if (count == 0 && append_quoted(out, size, "") < 0)
+    return -1;
+  for (i = 0; i < count; i++) {
+    if (i > 0 && strlen(out) + 2 >= size)
+      return -1;
+    if (i > 0)
+      strcat(out, ",");
+    if (append_quoted(out, size, values[i]) < 0)
+      return -1;
+  }
+  if (strlen(out) + strlen(end) + 2 > size)
+    return -1;
+  strcat(out, ")");
+  strcat(out, end);
+
+  return 0;
+}
+
+/******************************************************************************
+
+The Tier 1 server asks for title prefix searches as "name LIKE '<prefix>%'"
+and for typo tolerant searches as "name SOUNDS LIKE '<text>'".  Either would
+make MySQL compare every name in the table, so the predicate is replaced by
+"name IN (...)" listing the matching titles from the title index, which MySQL
+answers from the (name, ...) unique index.  A prefix with more matches than
+fit in the list is left to MySQL, which can still use the index for it.
+
+Searches by distance arrive as "location NEAR '<lat>,<lon>,<km>'" for every
+theater within a radius, or "location NEAREST '<lat>,<lon>,<k>'" for the k
+nearest theaters.  MySQL has no notion of either, so they are always replaced
+by "location IN (...)" from the spatial index.  At most MAX_GEO_MATCHES
+theaters, the nearest, are listed, and fewer if the list would not fit in the
+query.  Returns 1 if some theaters the search asked for were left out, so the
+answer can say its result is partial, otherwise 0.
+
+*******************************************************************************/
+int expand_filters(char* query, char* expanded, size_t size) {
+  char*  values[MAX_GEO_MATCHES];
+  int    matches[MAX_GEO_MATCHES];
+  char   work[QUERY_SIZE];
+  char   text[MAX_TITLE_LENGTH];
+  char*  start;
+  char*  end;
+  double latitude;
+  double longitude;
+  double amount;
+  size_t len;
+  int    count = -1;
+  int    cut = 0;
+  int    i;
+
+  strncpy(expanded, query, size - 1);
+  expanded[size - 1] = '\0';
+
+  if (find_predicate(query, "name LIKE '", text, sizeof(text), &start, &end)) {
+    // Only a plain prefix, i.e., a single trailing wildcard, can be looked up
+    len = strlen(text);
+    if (len > 0 && strchr(text, '%') == &text[len - 1] && strpbrk(text, "_\\") == NULL) {
+      text[len - 1] = '\0';
+      count = prefix_titles(titles, text, MAX_TITLE_MATCHES, matches);
+      if (count == MAX_TITLE_MATCHES)
+	count = -1;
+    }
+  } else if (find_predicate(query, "name SOUNDS LIKE '", text, sizeof(text), &start, &end))
+    count = fuzzy_titles(titles, text, MAX_TITLE_MATCHES, matches);
+
+  if (count >= 0) {
+    for (i = 0; i < count; i++)
+      values[i] = titles->titles[matches[i]].name;
+    if (substitute_list(query, start, end, "name", values, count, work, QUERY_SIZE) == 0)
+      strcpy(expanded, work);
+  }
+
+  strcpy(work, expanded);
+  count = -1;
+  if (find_predicate(work, "location NEAR '", text, sizeof(text), &start, &end)) {
+    if (sscanf(text, "%lf,%lf,%lf", &latitude, &longitude, &amount) == 3)
+      count = theaters_within(theaters, latitude, longitude, amount, MAX_GEO_MATCHES, matches);
+    else
+      count = 0;
+    if (count > MAX_GEO_MATCHES) {
+      count = MAX_GEO_MATCHES;
+      cut = 1;
+    }
+  } else if (find_predicate(work, "location NEAREST '", text, sizeof(text), &start, &end)) {
+    if (sscanf(text, "%lf,%lf,%lf", &latitude, &longitude, &amount) == 3)
+      count = nearest_theaters(theaters, latitude, longitude, (int)amount, matches);
+    else
+      count = 0;
+    cut = count == MAX_GEO_MATCHES && amount > MAX_GEO_MATCHES;
+  }
+
+  if (count >= 0) {
+    for (i = 0; i < count; i++)
+      values[i] = theaters->theaters[matches[i]].location;
+    // Unlike a title search, MySQL can not answer this one if it does not
+    // fit, so the farthest theaters are left out until it does
+    while (substitute_list(work, start, end, "location", values, count, expanded, size) < 0 &&
+	   count > 0) {
+      count--;
+      cut = 1;
+    }
+  }
+
+  return cut;
+}
+
+/******************************************************************************
+
+Answers "COMPLETE <k> <text>" with up to k movie titles: those starting with
+the text, then, if there are fewer than k, those similar to it.  Titles are
+sent in name order, one per message, followed by "DONE" or "NO RESULTS".  No
+database access is needed.
+
+*******************************************************************************/
+void answer_completion(SSL* ssl, char* request) {
+  int   matches[2 * MAX_TITLE_MATCHES];
+  int   fuzzy[MAX_TITLE_MATCHES];
+  char  reply[BUFFER_SIZE];
+  char* text;
+  int   k;
+  int   count;
+  int   fuzzy_count;
+  int   i;
+  int   j;
+
+  k = atoi(request + strlen("COMPLETE "));
+  if (k <= 0 || k > MAX_TITLE_MATCHES)
+    k = MAX_TITLE_MATCHES;
+  text = strchr(request + strlen("COMPLETE "), ' ');
+  text = text ? text + 1 : "";
+
+  count = prefix_titles(titles, text, k, matches);
+  if (count < k) {
+    fuzzy_count = fuzzy_titles(titles, text, k, fuzzy);
+    for (i = 0; i < fuzzy_count && count < k; i++) {
+      for (j = 0; j < count && matches[j] != fuzzy[i]; j++)
+	;
+      if (j == count)
+	matches[count++] = fuzzy[i];
+    }
+  }
+
+  // Positions in the index are in name order
+  for (i = 1; i < count; i++)
+    for (j = i; j > 0 && matches[j - 1] > matches[j]; j--) {
+      k = matches[j];
+      matches[j] = matches[j - 1];
+      matches[j - 1] = k;
+    }
+
+  for (i = 0; i < count; i++) {
+    snprintf(reply, BUFFER_SIZE, "Name: %s \n", titles->titles[matches[i]].name);
+    peer_write(ssl, reply, strlen(reply)+1);
+  }
+  strcpy(reply, count ? "DONE" : "NO RESULTS");
+  peer_write(ssl, reply, strlen(reply)+1);
+}
+
+struct change_batch {
+  int            count;
+  int            capacity;
+  struct change* changes;
+};
+
+// Collects a showtime change for the change feed
+void feed_row_change(void* context, char** values, int inserted) {
+  struct change_batch* batch = context;
+
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+    batch->changes = realloc(batch->changes, batch->capacity * sizeof(struct change));
+    if (batch->changes == NULL) {
+      fprintf(stderr, "Server: Unable to grow change batch\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  batch->changes[batch->count].op = inserted ? CHANGE_ADD : CHANGE_REMOVE;
+  format_result_row(batch->changes[batch->count].row, FEED_ROW_SIZE, values);
+  batch->count++;
+}
+
+struct data_change {
+  MYSQL*              connection;
+  struct change_batch batch;
+  int                 inserted;
+  int                 removed;
+  int                 theaters;
+  int                 failed;
+};
+
+/******************************************************************************
+
+Inserts one showtime unless movie_times already has it.  Returns 1 if it was
+inserted, 0 if it was already there, or -1 if the statement failed.
+
+*******************************************************************************/
+int insert_showtime(MYSQL* connection, char** values) {
+  char statement[QUERY_SIZE];
+  int  failed = 0;
+  int  i;
+
+  strcpy(statement, "INSERT IGNORE INTO movie_times (name, location, date, time) VALUES (");
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++) {
+    failed |= append_quoted(statement, QUERY_SIZE, values[i]);
+    strncat(statement, i < SNAPSHOT_COLUMNS - 1 ? ", " : ")", QUERY_SIZE - strlen(statement) - 1);
+  }
+  if (failed || mysql_query(connection, statement))
+    return -1;
+
+  return mysql_affected_rows(connection) > 0 ? 1 : 0;
+}
+
+/******************************************************************************
+
+Applies one added or removed showtime to MySQL, within the reload transaction,
+and collects it for the change feed if it changed movie_times: a showtime
+already inserted by an ingest, or already deleted, is left out.  When serving
+from a snapshot, which is rewritten from the data files, every change counts.
+
+*******************************************************************************/
+void apply_row_change(void* context, char** values, int inserted) {
+  struct data_change* change = context;
+  char                statement[QUERY_SIZE];
+  int                 failed = 0;
+  int                 result = 1;
+
+  if (change->failed)
+    return;
+
+  if (inserted) {
+    if (change->connection != NULL &&
+	(result = insert_showtime(change->connection, values)) < 0) {
+      fprintf(stderr, "MySQL query failed: %s\n", mysql_error(change->connection));
+      change->failed = 1;
+      return;
+    }
+    if (result > 0) {
+      feed_row_change(&change->batch, values, 1);
+      change->inserted++;
+    }
+    return;
+  }
+
+  strcpy(statement, "DELETE FROM movie_times WHERE name = ");
+  failed |= append_quoted(statement, QUERY_SIZE, values[COLUMN_NAME]);
+  strcat(statement, " AND location = ");
+  failed |= append_quoted(statement, QUERY_SIZE, values[COLUMN_LOCATION]);
+  strcat(statement, " AND date = ");
+  failed |= append_quoted(statement, QUERY_SIZE, values[COLUMN_DATE]);
+  strcat(statement, " AND time = ");
+  failed |= append_quoted(statement, QUERY_SIZE, values[COLUMN_TIME]);
+
+  if (change->connection != NULL) {
+    if (failed || mysql_query(change->connection, statement)) {
+      fprintf(stderr, "MySQL query failed: %s\n", mysql_error(change->connection));
+      change->failed = 1;
+      return;
+    }
+    result = mysql_affected_rows(change->connection) > 0;
+  }
+  if (result > 0) {
+    feed_row_change(&change->batch, values, 0);
+    change->removed++;
+  }
+}
+
+void apply_theater_change(void* context, char* location, double latitude, double longitude,
+			  int inserted) {
+  struct data_change* change = context;
+  char                statement[QUERY_SIZE];
+  char                coordinates[64];
+  int                 failed;
+
+  if (inserted) {
+    strcpy(statement, "INSERT INTO theaters (location, latitude, longitude) VALUES (");
+    failed = append_quoted(statement, QUERY_SIZE, location);
+    snprintf(coordinates, sizeof(coordinates), ", %.6f, %.6f)", latitude, longitude);
+    strcat(statement, coordinates);
+  } else {
+    strcpy(statement, "DELETE FROM theaters WHERE location = ");
+    failed = append_quoted(statement, QUERY_SIZE, location);
+  }
+  change->theaters++;
+
+  if (change->connection != NULL && !change->failed &&
+      (failed || mysql_query(change->connection, statement))) {
+    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(change->connection));
+    change->failed = 1;
+  }
+}
+
+// Counts the showtimes added and removed by a batch of changes in the facet
+// index, so that it always agrees with what was published
+void count_changes(struct change_batch* batch) {
+  char  values[SNAPSHOT_COLUMNS][FEED_VALUE_SIZE];
+  char* pointers[SNAPSHOT_COLUMNS] = { values[0], values[1], values[2], values[3] };
+  int   i;
+
+  for (i = 0; i < batch->count; i++)
+    if (row_values(batch->changes[i].row, values) == 0)
+      add_facet_count(facets, pointers, batch->changes[i].op == CHANGE_ADD ? 1 : -1);
+}
+
+/******************************************************************************
+
+Reloads the data files after they changed.  Only the differences from the data
+last loaded are applied: to MySQL in a single transaction, so queries see
+either all of them or none, or, when serving from a snapshot, by writing a new
+snapshot and mapping it in place of the old one.  The indexes are then rebuilt
+and swapped in, the data version goes up, and the showtimes actually added
+and removed are published to the change feed under it and counted in the
+facet index, as commit_ingest() does.  If
+anything fails, e.g., because a file was only partly written, the server keeps
+what it had.
+
+*******************************************************************************/
+void reload_data() {
+  struct data_change       change;
+  struct dataset*          loaded;
+  struct snapshot_builder* builder;
+  struct snapshot*         mapped = NULL;
+  struct title_index*      new_titles;
+  struct geo_index*        new_theaters;
+
+  if ((loaded = load_dataset(data_files, 2)) == NULL) {
+    fprintf(stderr, "Server: Keeping data version %ld\n", data_version);
+    return;
+  }
+
+  memset(&change, 0, sizeof(change));
+  if (snapshot == NULL) {
+    if ((change.connection = connect_database(0)) == NULL ||
+	mysql_query(change.connection, "START TRANSACTION")) {
+      if (change.connection != NULL)
+	mysql_close(change.connection);
+      free_dataset(loaded);
+      fprintf(stderr, "Server: Keeping data version %ld\n", data_version);
+      return;
+    }
+  }
+
+  if (diff_datasets(dataset, loaded, apply_row_change, apply_theater_change, &change) == 0) {
+    if (change.connection != NULL)
+      mysql_close(change.connection);
+    free_dataset(loaded);
+    return;
+  }
+
+  if (snapshot == NULL) {
+    if (change.failed || mysql_query(change.connection, "COMMIT")) {
+      mysql_query(change.connection, "ROLLBACK");
+      mysql_close(change.connection);
+      free(change.batch.changes);
+      free_dataset(loaded);
+      fprintf(stderr, "Server: Keeping data version %ld\n", data_version);
+      return;
+    }
+    new_titles = load_title_index(change.connection);
+    new_theaters = load_geo_index(change.connection);
+    mysql_close(change.connection);
+  } else {
+    builder = dataset_builder(loaded);
+    if (write_snapshot(builder, snapshot_file) < 0 ||
+	(mapped = open_snapshot(snapshot_file)) == NULL) {
+      free_snapshot_builder(builder);
+      free(change.batch.changes);
+      free_dataset(loaded);
+      fprintf(stderr, "Server: Keeping data version %ld\n", data_version);
+      return;
+    }
+    free_snapshot_builder(builder);
+    close_snapshot(snapshot);
+    snapshot = mapped;
+    new_titles = snapshot_title_index(snapshot);
+    new_theaters = snapshot_geo_index(snapshot);
+  }
+
+  data_version = publish_changes(feed, change.batch.changes, change.batch.count, data_version + 1);
+  count_changes(&change.batch);
+  free(change.batch.changes);
+
+  free_title_index(titles);
+  free_geo_index(theaters);
+  free_dataset(dataset);
+  titles = new_titles;
+  theaters = new_theaters;
+  dataset = loaded;
+
+  fprintf(stdout, "Server: Data version %ld: %d showtimes added, %d removed, %d theater changes\n",
+	  data_version, change.inserted, change.removed, change.theaters);
+}
+
+/******************************************************************************
+
+Commits every showtime in the ingest queue in a single transaction and tells
+the writers waiting for it how it went.  The showtimes actually inserted are
+published to the change feed under a new data version and counted in the facet
+index, and the title index is rebuilt if any of them is for a new title, so
+title searches find it; counts of showtimes for known titles are left as they
+were.  The data files are not
+touched, so a later reload only applies what changed in the files.
+
+*******************************************************************************/
+void commit_ingest() {
+  static struct showtime showtimes[INGEST_QUEUE_SIZE];
+  struct change_batch    batch;
+  struct timespec        start;
+  struct timespec        end;
+  double                 elapsed;
+  char*                  values[SNAPSHOT_COLUMNS];
+  long                   group;
+  int                    count;
+  int                    inserted = 0;
+  int                    new_titles = 0;
+  int                    failed;
+  int                    result;
+  int                    i;
+  int                    j;
+
+  if ((count = take_showtimes(ingest, showtimes, &group)) == 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(&batch, 0, sizeof(batch));
+
+  if (ingest_connection == NULL)
+    ingest_connection = connect_database(0);
+  failed = ingest_connection == NULL || mysql_query(ingest_connection, "START TRANSACTION");
+  for (i = 0; i < count && !failed; i++) {
+    for (j = 0; j < SNAPSHOT_COLUMNS; j++)
+      values[j] = showtimes[i].values[j];
+    if ((result = insert_showtime(ingest_connection, values)) < 0)
+      failed = 1;
+    else if (result > 0) {
+      feed_row_change(&batch, values, 1);
+      inserted++;
+    }
+  }
+  if (!failed && mysql_query(ingest_connection, "COMMIT"))
+    failed = 1;
+
+  if (failed && ingest_connection != NULL) {
+    fprintf(stderr, "Server: Ingest commit failed: %s\n", mysql_error(ingest_connection));
+    mysql_query(ingest_connection, "ROLLBACK");
+    mysql_close(ingest_connection);
+    ingest_connection = NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  finish_group(ingest, group, failed, inserted, count - inserted, elapsed);
+  if (failed) {
+    free(batch.changes);
+    return;
+  }
+
+  if (batch.count > 0) {
+    data_version = publish_changes(feed, batch.changes, batch.count, data_version + 1);
+    count_changes(&batch);
+    for (i = 0; i < count && !new_titles; i++)
+      new_titles = find_title(titles, showtimes[i].values[COLUMN_NAME]) < 0;
+  }
+  free(batch.changes);
+  if (new_titles) {
+    free_title_index(titles);
+    titles = load_title_index(ingest_connection);
+  }
+
+  fprintf(stdout, "Server: Committed %d showtimes (%d new) in %.2f ms, data version %ld\n",
+	  count, inserted, elapsed, data_version);
+}
+
+/******************************************************************************
+
+Waits for the next connection on 'sockfd' or 'unixfd', and returns the one
+that has it, reloading the data files whenever 'watchfd' reports they were
+written.  A burst of writes only causes one reload,
+RELOAD_DELAY milliseconds after the last of them.  A 'watchfd' of -1 means the
+files are not watched, and a 'unixfd' of -1 that there is no Unix domain
+socket.  Batches queued by writers are committed 'commit_window'
+milliseconds after the first of them arrives, or as soon as half the queue is
+full.
+
+*******************************************************************************/
+int wait_for_connection(int sockfd, int unixfd, int watchfd) {
+  static struct timespec changed;
+  static struct timespec queued;
+  static int             pending = 0;
+  static int             ingesting = 0;
+  struct pollfd          fds[4];
+  struct timespec        now;
+  long                   waited;
+  int                    timeout;
+
+  fds[0].fd = sockfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = watchfd;
+  fds[1].events = POLLIN;
+  fds[2].fd = ingest->wakeup[0];
+  fds[2].events = POLLIN;
+  fds[3].fd = unixfd;
+  fds[3].events = POLLIN;
+
+  while (1) {
+    timeout = -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pending) {
+      waited = (now.tv_sec - changed.tv_sec) * 1000 + (now.tv_nsec - changed.tv_nsec) / 1000000;
+      if (waited >= RELOAD_DELAY) {
+	reload_data();
+	pending = 0;
+	fflush(stdout);
+      } else
+	timeout = RELOAD_DELAY - waited;
+    }
+    if (ingesting) {
+      waited = (now.tv_sec - queued.tv_sec) * 1000 + (now.tv_nsec - queued.tv_nsec) / 1000000;
+      if (waited >= commit_window || ingest_pending(ingest) >= INGEST_QUEUE_SIZE / 2) {
+	commit_ingest();
+	ingesting = 0;
+	fflush(stdout);
+      } else if (timeout < 0 || commit_window - waited < timeout)
+	timeout = commit_window - waited;
+    }
+    if (stats_requested) {
+      stats_requested = 0;
+      print_ingest_stats(ingest, stdout);
+      print_replay_stats(stdout);
+    }
+
+    if (poll(fds, 4, timeout) < 0) {
+      if (errno != EINTR)
+	return sockfd;
+      continue;
+    }
+
+    if ((fds[1].revents & POLLIN) && files_changed(watchfd, data_files, 2)) {
+      clock_gettime(CLOCK_MONOTONIC, &changed);
+      pending = 1;
+    }
+    if ((fds[2].revents & POLLIN) && ingest_pending(ingest) > 0 && !ingesting) {
+      clock_gettime(CLOCK_MONOTONIC, &queued);
+      ingesting = 1;
+    }
+    if (fds[0].revents & POLLIN)
+      return sockfd;
+    if (fds[3].revents & POLLIN)
+      return unixfd;
+  }
+}
+
+/******************************************************************************
+
+Makes MySQL itself stop a SELECT once 'deadline_ms' milliseconds have passed,
+using the MAX_EXECUTION_TIME optimizer hint, so a query nobody will wait for
+any longer does not keep running and holding on to the database.
+
+*******************************************************************************/
+void apply_deadline(char* query, size_t size, long deadline_ms) {
+  char hinted[QUERY_SIZE];
+
+  if (strncasecmp(query, "SELECT ", 7) != 0)
+    return;
+
+  if (snprintf(hinted, sizeof(hinted), "SELECT /*+ MAX_EXECUTION_TIME(%ld) */ %s",
+	       deadline_ms, query + 7) < (int)size)
+    strcpy(query, hinted);
+}
+
+// True if the last statement failed because it ran out of time
+int timed_out(MYSQL* connection) {
+  switch (mysql_errno(connection)) {
+  case ER_QUERY_TIMEOUT:
+  case ER_QUERY_INTERRUPTED:
+  case CR_SERVER_LOST:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/******************************************************************************
+
+Answers a batch of queries from the Tier 1 server (see batch-tools.h), given
+the request after "BATCH ".  The queries are run one after the other, from the
+snapshot where it can answer them and otherwise on one MySQL connection for
+the whole batch, each with its own deadline.  Every result is followed by
+"RESULT <id> <status>" and the batch by "DONE".
+
+*******************************************************************************/
+void answer_batch(char* request, long deadline_ms) {
+  MYSQL*     connection = NULL;
+  MYSQL_RES* result;
+  MYSQL_ROW  row;
+  char       query[QUERY_SIZE];
+  char       reply[BUFFER_SIZE];
+  char*      line;
+  char*      next;
+  char*      status;
+  long       query_deadline;
+  long       rows;
+  int        partial;
+  int        count = atoi(request);
+  int        id;
+
+  line = strchr(request, '\n');
+  for (id = 0; id < count && line != NULL; id++, line = next) {
+    line++;
+    if ((next = strchr(line, '\n')) != NULL)
+      *next = '\0';
+    query_deadline = strtol(line, &line, 10);
+    if (*line == ' ')
+      line++;
+    partial = expand_filters(line, query, QUERY_SIZE);
+
+    if (snapshot != NULL && (rows = query_snapshot(snapshot, query, send_snapshot_row, &results)) >= 0)
+      status = rows == 0 ? "NO RESULTS" : "DONE";
+    else if (connection == NULL && (connection = connect_database(deadline_ms)) == NULL)
+      status = "FAILED";
+    else {
+      if (query_deadline > 0)
+	apply_deadline(query, QUERY_SIZE, query_deadline);
+      if (mysql_query(connection, query) || (result = mysql_store_result(connection)) == NULL)
+	status = timed_out(connection) ? "TIMEOUT" : "FAILED";
+      else {
+	for (rows = 0; (row = mysql_fetch_row(result)) != NULL; rows++)
+	  send_result_row(&results, row);
+	mysql_free_result(result);
+	status = rows == 0 ? "NO RESULTS" : "DONE";
+      }
+    }
+    if (partial && (strcmp(status, "DONE") == 0 || strcmp(status, "NO RESULTS") == 0))
+      status = "PARTIAL";
+
+    snprintf(reply, BUFFER_SIZE, BATCH_RESULT_PREFIX "%d %s", id, status);
+    if (send_result_text(&results, reply) < 0)
+      break;
+  }
+
+  send_result_text(&results, "DONE");
+  finish_results(&results);
+  printf("Server: Answered a batch of %d queries in %ld bytes\n", id, results.bytes);
+  if (connection != NULL)
+    mysql_close(connection);
+}
+
+// Counts one showtime found in the snapshot
+void count_snapshot_row(void* context, char** values) {
+  add_facet_count((struct facet_index*)context, values, 1);
+}
+
+/******************************************************************************
+
+Answers a count (see facet-tools.h), given the request after "COUNT ", from
+the facet index.  A search the index can not answer, i.e., one for a time, has
+its showtimes counted instead, from the snapshot or MySQL, though still only
+the counts are sent.
+
+*******************************************************************************/
+void answer_count(char* request, long deadline_ms) {
+  struct facet_index*  counts = create_facet_index();
+  struct facet_index*  found;
+  struct facet_group** sorted;
+  MYSQL*               connection;
+  MYSQL_RES*           result;
+  MYSQL_ROW            row;
+  char                 query[QUERY_SIZE];
+  char                 reply[FACET_ROW_SIZE];
+  char*                search;
+  char*                status = NULL;
+  int                  grouping = -1;
+  int                  partial = 0;
+  int                  i;
+
+  if ((search = strchr(request, ' ')) != NULL) {
+    *search++ = '\0';
+    grouping = parse_grouping(request);
+  }
+  if (grouping >= 0) {
+    partial = expand_filters(search, query, QUERY_SIZE);
+    printf("Server: Counting by %s: %s\n", request, query);
+    if (count_facets(facets, query, grouping, counts) < 0) {
+      found = create_facet_index();
+      if (snapshot != NULL && query_snapshot(snapshot, query, count_snapshot_row, found) >= 0)
+	;
+      else if ((connection = connect_database(deadline_ms)) == NULL)
+	status = "NO RESULTS";
+      else {
+	if (deadline_ms > 0)
+	  apply_deadline(query, QUERY_SIZE, deadline_ms);
+	if (mysql_query(connection, query) || (result = mysql_store_result(connection)) == NULL)
+	  status = timed_out(connection) ? "TIMEOUT" : "NO RESULTS";
+	else {
+	  while ((row = mysql_fetch_row(result)) != NULL)
+	    add_facet_count(found, row, 1);
+	  mysql_free_result(result);
+	}
+	mysql_close(connection);
+      }
+      count_facets(found, "SELECT * FROM movie_times", grouping, counts);
+      free_facet_index(found);
+    }
+  }
+
+  sorted = sort_facets(counts);
+  for (i = 0; status == NULL && sorted[i] != NULL; i++) {
+    format_facet_row(reply, sizeof(reply), sorted[i]);
+    send_result_text(&results, reply);
+  }
+  if (status == NULL)
+    status = partial ? "PARTIAL" : i > 0 ? "DONE" : "NO RESULTS";
+  send_result_text(&results, status);
+  finish_results(&results);
+  printf("Server: Answered %d counts in %ld bytes\n", i, results.bytes);
+  free(sorted);
+  free_facet_index(counts);
+}
 
 int main(int argc, char **argv) {
   struct sockaddr_in addr;
   unsigned int       len = sizeof(addr);
   unsigned int       sockfd;
   unsigned int       port;
+  char*              unix_path = NULL;
+  int                unixfd = -1;
+  int                listener;
+  int                plain_local = 0;
   SSL_CTX*           ssl_ctx;
   SSL*               ssl;
   int                client;
   char         reply[BUFFER_SIZE] = "";
   char               client_addr[INET_ADDRSTRLEN];
   pid_t              pid;
-  char               buffer[BUFFER_SIZE];
+  char               buffer[REQUEST_SIZE];
+  char               query[QUERY_SIZE];
   long rows;
+  size_t row_len;
+  int partial;
   MYSQL* connection;
   MYSQL_ROW row;
   MYSQL_RES* result;
+  long deadline_ms;
+  int watchfd;
+  int c;
+  struct sigaction stats_action;
 
   // Do not create zombie processes
   signal(SIGCHLD, SIG_IGN);
   init_openssl();
+
+  while((c = getopt(argc, argv, "a:k:nT:u:w:")) != -1)
+    switch(c)
+      {
+      case 'k':
+    if (read_ingest_key(optarg, ingest_key, sizeof(ingest_key)) < 0)
+      return EXIT_FAILURE;
+    break;
+      case 'a':
+    if (strcmp(optarg, "commit") == 0)
+      durability = DURABLE_COMMIT;
+    else if (strcmp(optarg, "queue") == 0)
+      durability = DURABLE_QUEUE;
+    else {
+      fprintf(stderr, "Server: Unknown durability '%s' (use commit or queue)\n", optarg);
+      return EXIT_FAILURE;
+    }
+    break;
+      case 'w':
+    commit_window = atoi(optarg);
+    break;
+      case 'u':
+    unix_path = optarg;
+    break;
+      case 'n':
+    plain_local = 1;
+    break;
+      case 'T':
+    if ((tls_profile = parse_tls_profile(optarg)) < 0) {
+      fprintf(stderr, "Server: Unknown TLS profile '%s' (use default or fast)\n", optarg);
+      return EXIT_FAILURE;
+    }
+    break;
+      default:
+    argc = 0;
+      }
     
   // Port can be specified on the command line. If it's not, use the default port
-  switch(argc)
+  switch(argc - optind)
     {
-    case 1:
+    case 0:
       port = DEFAULT_PORT;
       break;
+    case 1:
+      port = atoi(argv[optind]);
+      break;
     case 2:
-      port = atoi(argv[1]);
+      port = atoi(argv[optind]);
+      snapshot_file = argv[optind + 1];
+      if ((snapshot = open_snapshot(snapshot_file)) == NULL)
+	return EXIT_FAILURE;
       break;
     default:
-      fprintf(stderr, "Usage: ssl-server-tier2 <port> (optional)\n");
+      fprintf(stderr, "Usage: ssl-server-tier2 -k <ingest key file> (optional) -a <commit|queue> (optional) -w <commit window ms> (optional) -u <unix socket path> (optional) -n (no TLS on the unix socket) (optional) -T <default|fast> (optional) <port> (optional) <snapshot> (optional)\n");
       return EXIT_FAILURE;
     }
   //**********************************************************************
 
+  // Set up the database and the title index once, before serving anyone.  A
+  // snapshot already holds everything, so MySQL is left as it is
+  if (snapshot != NULL) {
+    titles = snapshot_title_index(snapshot);
+    theaters = snapshot_geo_index(snapshot);
+    facets = snapshot_facet_index(snapshot);
+    dataset = snapshot_dataset(snapshot);
+  } else {
+    if ((connection = connect_database(0)) == NULL || load_database(connection) < 0)
+      return EXIT_FAILURE;
+    titles = load_title_index(connection);
+    theaters = load_geo_index(connection);
+    facets = load_facet_index(connection);
+    mysql_close(connection);
+    dataset = load_dataset(data_files, 2);
+  }
+
+  // Versions start from the time the server started, so that they keep
+  // increasing across restarts and a subscriber can tell it missed changes
+  data_version = time(NULL);
+  feed = create_change_log(data_version);
+  ingest = create_ingest_queue();
+
+  // Installed without SA_RESTART so that the signal interrupts poll()
+  stats_action.sa_handler = request_stats;
+  sigemptyset(&stats_action.sa_mask);
+  stats_action.sa_flags = 0;
+  sigaction(SIGUSR1, &stats_action, NULL);
+
+  // Changes to the data files are only applied if there is something to
+  // compare them with
+  watchfd = dataset != NULL ? watch_files(data_files, 2) : -1;
+
 
 
   // This will create a network socket and return a socket descriptor, which is
@@ -91,35 +1284,58 @@ int main(int argc, char **argv) {
   // we have to specify which TCP/UDP port on which we are communicating as an
   // argument to our user-defined create_socket() function.
   sockfd = create_socket(port);
+  if (unix_path != NULL)
+    unixfd = create_unix_socket(unix_path);
+
+  // The fast profile's context, and its ticket keys, are shared by all children
+  if (tls_profile == TLS_PROFILE_FAST)
+    fast_server_context();
   
   // Wait for incoming connections and handle them as the arrive
   while(true) {
     // Once an incoming connection arrives, accept it.  If this is successful,
     // we now have a connection between client and server and can communicate
     // using the socket descriptor
-    client = accept(sockfd, (struct sockaddr*)&addr, &len);
+    listener = wait_for_connection(sockfd, unixfd, watchfd);
+    len = sizeof(addr);
+    client = accept(listener, (struct sockaddr*)&addr, &len);
     if (client < 0) {
       fprintf(stderr, "Server: Unable to accept connection: %s\n", strerror(errno));
       return EXIT_FAILURE;
     }
     
-    // This will be a concurrent, rather than an iterative, server
+    // This will be a concurrent, rather than an iterative, server.  Flush
+    // first so that buffered output is not duplicated in the child.
+    fflush(stdout);
     pid = fork();
     
     if (pid == 0) {
-      // Display the IPv4 network address of the connected client
-      inet_ntop(AF_INET, (struct in_addr*)&addr.sin_addr, client_addr, INET_ADDRSTRLEN);
-      fprintf(stdout, "Server: Established TCP connection with client (%s) on port %u\n", client_addr, port);
+      if (listener == unixfd) {
+	// Only processes of this server's own user may use the Unix socket
+	strcpy(client_addr, "local");
+	if (check_peer(client) < 0)
+	  exit(EXIT_FAILURE);
+	fprintf(stdout, "Server: Established Unix socket connection with client (%s)\n", client_addr);
+      } else {
+	// Display the IPv4 network address of the connected client
+	inet_ntop(AF_INET, (struct in_addr*)&addr.sin_addr, client_addr, INET_ADDRSTRLEN);
+	fprintf(stdout, "Server: Established TCP connection with client (%s) on port %u\n", client_addr, port);
+      }
       
       // Create a new SSL object to bind to the socket descriptor
-      ssl = create_ssl_socket(client);
+      if (listener == unixfd && plain_local)
+	ssl = create_plain_socket(client);
+      else
+	ssl = create_ssl_socket(client);
+      set_socket_timeout(client, REQUEST_TIMEOUT);
       
       // SSL_accept() executes the SSL/TLS handshake. Because network sockets are
       // blocking by default, this function will block as well until the handshake
-      // is complete.
-      if (SSL_accept(ssl) <= 0) {
+      // is complete.  A plain session has no handshake to do.
+      if (peer_accept(ssl) <= 0) {
     fprintf(stderr, "Server: Could not establish secure connection:\n");
     ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
       }
       else
     fprintf(stdout, "Server: Established SSL/TLS connection with client (%s)\n", client_addr);
@@ -127,71 +1343,134 @@ int main(int argc, char **argv) {
 
       // Receive response back from other server.  Then it gets passed to the client
 
-      // Create Database
-      // Initialize the MySQL connection object
-      if ((connection = mysql_init(NULL)) == NULL) {
-        fprintf(stderr, "Could not initialize mysql: %s\n", mysql_error(connection));
-        return EXIT_FAILURE;
+      bzero(buffer, REQUEST_SIZE);
+      peer_read(ssl, buffer, REQUEST_SIZE - 1);
+
+      // The Tier 1 server says how long it will wait for the answer; nothing
+      // here may take longer than that
+      deadline_ms = strip_deadline(buffer);
+      if (deadline_ms > 0)
+    set_socket_timeout(client, deadline_ms);
+
+      // Results are sent as labelled text unless compact batches were asked for
+      start_results(&results, ssl, strip_encoding(buffer));
+
+      // The data version tells whether the data changed since it was last asked
+      if (strcmp(buffer, "VERSION") == 0) {
+    snprintf(reply, BUFFER_SIZE, "VERSION %ld", data_version);
+    peer_write(ssl, reply, strlen(reply)+1);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
       }
 
-  // Connect to mysql on 'localhost' and provide login credentials
+      // A subscription stays open, streaming changes, until the subscriber
+      // goes away
+      if (strncmp(buffer, "SUBSCRIBE ", strlen("SUBSCRIBE ")) == 0) {
+    fprintf(stdout, "Server: Client (%s) subscribed to changes\n", client_addr);
+    fflush(stdout);
+    serve_subscription(feed, ssl, atol(buffer + strlen("SUBSCRIBE ")));
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
 
-  if (mysql_real_connect(connection, "localhost", "user", "password",
-          NULL, 0, NULL, 0) == NULL) {
-      fprintf(stderr, "Could not connect to MySQL database: %s\n",
-          mysql_error(connection));
-      mysql_close(connection);
-      return EXIT_FAILURE;
-  }
-  // create database
-  if (mysql_query(connection, "CREATE DATABASE IF NOT EXISTS movies")) {
-    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
-    mysql_close(connection);
-    return EXIT_FAILURE;
-  }
-  if (mysql_query(connection, "USE movies")) {
-    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
-    mysql_close(connection);
-    return EXIT_FAILURE;
-  }
-  if (mysql_query(connection, "CREATE TABLE IF NOT EXISTS movie_times(name VARCHAR(30) NOT NULL, location VARCHAR(30) NOT NULL, date VARCHAR(30) NOT NULL, time VARCHAR(30) NOT NULL )")) {
-    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
-    mysql_close(connection);
-    return EXIT_FAILURE;
-  }
-  if (mysql_query(connection, "ALTER TABLE movie_times ADD UNIQUE INDEX(name, location, date, time)")) {
-    fprintf(stderr, "MySQL query failed: %s\n", mysql_error(connection));
-    mysql_close(connection);
-    return EXIT_FAILURE;
-  }
-        
-    //read file to populate database
-    char buf [BUF_SIZE];
-    buffer[strlen(buffer)-1] = '\0';
-    FILE *fptr;
-    fptr = fopen("sqldata.txt","r");
-    if (fptr == NULL) {
-        fprintf(stderr, "File operations error: %s\n", strerror(errno));
-        sprintf(buffer, "%d", errno);
+      // Writers stay connected, sending batch after batch.  Showtimes written
+      // to MySQL would not show in searches answered from a snapshot, so
+      // ingest needs the server to run without one
+      if (strncmp(buffer, INGEST_PREFIX, strlen(INGEST_PREFIX)) == 0) {
+    // A request sent as early data could be a replay, so nothing is changed
+    // before the client has finished the handshake
+    if (confirm_handshake(ssl) < 0) {
+      fprintf(stderr, "Server: Client (%s) did not finish the handshake\n", client_addr);
+      exit(EXIT_FAILURE);
+    }
+    if (ingest_key[0] == '\0' || snapshot != NULL)
+      peer_write(ssl, "UNSUPPORTED", 12);
+    else if (!check_ingest_key(ingest_key, buffer + strlen(INGEST_PREFIX))) {
+      fprintf(stderr, "Server: Client (%s) gave a wrong ingest key\n", client_addr);
+      peer_write(ssl, "DENIED", 7);
     } else {
-        int fs = fread(buf, strlen(buf)+1,2048, fptr);
+      fprintf(stdout, "Server: Client (%s) started ingesting\n", client_addr);
+      fflush(stdout);
+      serve_ingest(ingest, ssl, durability);
     }
-    fclose(fptr);
-        
-  if (mysql_query(connection, buf)) {
-    fprintf(stderr, "MySQL query failed***: %s\n", mysql_error(connection));
-      fprintf(stderr, "MySQL query failed***: %s\n", buf);
-    mysql_close(connection);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      // Title completion is answered from the title index alone
+      if (strncmp(buffer, "COMPLETE ", strlen("COMPLETE ")) == 0) {
+    answer_completion(ssl, buffer);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      // Queries batched by the Tier 1 server are answered in one session
+      if (strncmp(buffer, BATCH_PREFIX, strlen(BATCH_PREFIX)) == 0) {
+    answer_batch(buffer + strlen(BATCH_PREFIX), deadline_ms);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      // Counts are answered from the facet index, without listing showtimes
+      if (strncmp(buffer, COUNT_PREFIX, strlen(COUNT_PREFIX)) == 0) {
+    answer_count(buffer + strlen(COUNT_PREFIX), deadline_ms);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      // Title and distance searches are resolved using the in-memory indexes
+      partial = expand_filters(buffer, query, QUERY_SIZE);
+
+      // With a snapshot, this server is up as long as it can answer from it
+      if (snapshot != NULL && strcmp(buffer, "PING") == 0) {
+    peer_write(ssl, "PONG", 5);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      if (snapshot != NULL && (rows = query_snapshot(snapshot, query, send_snapshot_row, &results)) >= 0) {
+    send_result_text(&results, partial ? "PARTIAL" : rows == 0 ? "NO RESULTS" : "DONE");
+    printf("Server: Answered query from the snapshot in %ld bytes: %s\n", results.bytes, query);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
+      }
+
+      if ((connection = connect_database(deadline_ms)) == NULL)
     return EXIT_FAILURE;
+
+  // Health checks from the Tier 1 server only need to know that this server
+  // is up and can reach its database
+  if (strcmp(buffer, "PING") == 0) {
+    if (mysql_ping(connection) == 0)
+      peer_write(ssl, "PONG", 5);
+    mysql_close(connection);
+    SSL_free(ssl);
+    close(client);
+    exit(EXIT_SUCCESS);
   }
 
-  SSL_read(ssl, buffer, BUFFER_SIZE);
+  if (deadline_ms > 0)
+    apply_deadline(query, QUERY_SIZE, deadline_ms);
+  printf("Server: Running query: %s\n", query);
 
-  
-  if (mysql_query(connection, buffer)) {
+  if (mysql_query(connection, query)) {
+    if (timed_out(connection)) {
+      fprintf(stderr, "Server: Query stopped at its deadline: %s\n", mysql_error(connection));
+      peer_write(ssl, "TIMEOUT", 8);
+      mysql_close(connection);
+      return EXIT_FAILURE;
+    }
        bzero(reply, BUFFER_SIZE);
     strcat(reply, "No movies found");
-    SSL_write(ssl, reply, strlen(reply)+1);
+    peer_write(ssl, reply, strlen(reply)+1);
     mysql_close(connection);
     return EXIT_FAILURE;
   }
@@ -201,6 +1480,8 @@ int main(int argc, char **argv) {
   
   if ((result = mysql_store_result(connection)) == NULL) {
     fprintf(stderr, "%s\n", mysql_error(connection));
+    if (timed_out(connection))
+      peer_write(ssl, "TIMEOUT", 8);
     mysql_close(connection);
     return EXIT_FAILURE;
   }
@@ -209,24 +1490,18 @@ int main(int argc, char **argv) {
  fprintf(stdout, "Server: Sending message to client (%s)\n%s", client_addr, reply);
   bzero(reply, BUFFER_SIZE);
   while (row = mysql_fetch_row(result)) {
-    strcat(reply, "Name: ");
-    strcat(reply, row[0]);
-    strcat(reply, " ");
-    strcat(reply, "Location: ");
-    strcat(reply, row[1]);
-    strcat(reply, " ");
-    strcat(reply, "Date: ");
-    strcat(reply, row[2]);
-    strcat(reply, " ");
-    strcat(reply, "Time: ");
-    strcat(reply, row[3]);
-    strcat(reply, " ");
-    strcat(reply, "\n");
+    // Compact results go out in batches, and are not logged row by row
+    if (results.encoding & ENCODING_COMPACT) {
+      send_result_row(&results, row);
+      continue;
+    }
+
+    // MySQL already knows the length of every value
+    row_len = format_row(reply, BUFFER_SIZE, row, mysql_fetch_lengths(result));
 
     printf("%s", reply);
 
-     SSL_write(ssl, reply, strlen(reply)+1);
-      bzero(reply, BUFFER_SIZE);
+     peer_write(ssl, reply, row_len+1);
   }
 
   
@@ -236,13 +1511,15 @@ int main(int argc, char **argv) {
     rows = 0;
 }
 
-if (rows == 0) {
-  strcat(reply, "NO RESULTS");
+if (partial) {
+  strcpy(reply, "PARTIAL");
+} else if (rows == 0) {
+  strcpy(reply, "NO RESULTS");
 } else {
-  strcat(reply, "DONE");
+  strcpy(reply, "DONE");
 }
 
-  SSL_write(ssl, reply, strlen(reply)+1);
+  send_result_text(&results, reply);
   bzero(reply, BUFFER_SIZE);
 
 
@@ -261,7 +1538,9 @@ if (rows == 0) {
       
       SSL_free(ssl);
       close(client);
+      exit(EXIT_SUCCESS);
     } // Child process code ends here. Parent just resumes listening
+    close(client);
   }
   
   // Tear down and clean up server data structures before terminating
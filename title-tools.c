@@ -0,0 +1,309 @@
+/******************************************************************************
+
+PROGRAM:  title-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the in-memory movie title index of the Tier 2
+          server.  See title-tools.h for an overview.
+
+******************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "title-tools.h"
+
+struct title_index* create_title_index() {
+  struct title_index* index;
+
+  index = calloc(1, sizeof(struct title_index));
+  if (index == NULL) {
+    fprintf(stderr, "Server: Unable to allocate title index\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return index;
+}
+
+// Lookups ignore case, as MySQL does when comparing names
+static void title_key(char* name, char* key) {
+  int i;
+
+  for (i = 0; name[i] != '\0' && i < MAX_TITLE_LENGTH - 1; i++)
+    key[i] = tolower((unsigned char)name[i]);
+  key[i] = '\0';
+}
+
+/******************************************************************************
+
+Adds a title with its number of showtimes.  Titles may be added in any order;
+build_title_index() must be called once all of them have been added.
+
+*******************************************************************************/
+void add_title(struct title_index* index, char* name, long showtimes) {
+  struct title* title;
+
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? index->capacity * 2 : 64;
+    index->titles = realloc(index->titles, index->capacity * sizeof(struct title));
+    if (index->titles == NULL) {
+      fprintf(stderr, "Server: Unable to grow title index\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  title = &index->titles[index->count++];
+  strncpy(title->name, name, MAX_TITLE_LENGTH - 1);
+  title->name[MAX_TITLE_LENGTH - 1] = '\0';
+  title_key(title->name, title->key);
+  title->showtimes = showtimes;
+}
+
+/******************************************************************************
+
+Splits 'key' into its distinct trigrams, padded with two spaces in front and
+one behind so that the first letters of a title carry more weight, e.g.,
+"star" gives "  s", " st", "sta", "tar" and "ar ".  Returns the number of
+trigrams stored in 'trigrams', which must have room for MAX_TITLE_LENGTH + 2.
+
+*******************************************************************************/
+static int title_trigrams(char* key, unsigned int* trigrams) {
+  char         padded[MAX_TITLE_LENGTH + 4];
+  unsigned int trigram;
+  int          count = 0;
+  int          i;
+  int          j;
+
+  snprintf(padded, sizeof(padded), "  %s ", key);
+  for (i = 0; padded[i + 2] != '\0'; i++) {
+    trigram = ((unsigned char)padded[i] << 16) | ((unsigned char)padded[i + 1] << 8) |
+      (unsigned char)padded[i + 2];
+    for (j = 0; j < count && trigrams[j] != trigram; j++)
+      ;
+    if (j == count)
+      trigrams[count++] = trigram;
+  }
+
+  return count;
+}
+
+// Finds the postings list of a trigram, or the free bucket where it belongs
+static struct trigram_postings* find_postings(struct title_index* index, unsigned int trigram) {
+  unsigned int bucket = (trigram * 2654435761u) & (TRIGRAM_BUCKETS - 1);
+  int          probes;
+
+  for (probes = 0; probes < TRIGRAM_BUCKETS; probes++) {
+    if (index->trigrams[bucket].trigram == trigram || index->trigrams[bucket].trigram == 0)
+      return &index->trigrams[bucket];
+    bucket = (bucket + 1) & (TRIGRAM_BUCKETS - 1);
+  }
+
+  return NULL;
+}
+
+static int compare_titles(const void* a, const void* b) {
+  return strcmp(((struct title*)a)->key, ((struct title*)b)->key);
+}
+
+/******************************************************************************
+
+Sorts the titles for prefix lookups and fills the trigram postings lists.  Each
+postings list holds the position of every title containing that trigram once,
+in increasing order.
+
+*******************************************************************************/
+void build_title_index(struct title_index* index) {
+  struct trigram_postings* postings;
+  unsigned int             trigrams[MAX_TITLE_LENGTH + 2];
+  int                      count;
+  int                      i;
+  int                      j;
+
+  qsort(index->titles, index->count, sizeof(struct title), compare_titles);
+
+  for (i = 0; i < index->count; i++) {
+    count = title_trigrams(index->titles[i].key, trigrams);
+    index->titles[i].trigrams = count;
+    for (j = 0; j < count; j++) {
+      postings = find_postings(index, trigrams[j]);
+      if (postings == NULL) {
+	fprintf(stderr, "Server: Trigram table full, fuzzy search will miss titles\n");
+	return;
+      }
+      postings->trigram = trigrams[j];
+      if (postings->count == postings->capacity) {
+	postings->capacity = postings->capacity ? postings->capacity * 2 : 4;
+	postings->titles = realloc(postings->titles, postings->capacity * sizeof(int));
+	if (postings->titles == NULL) {
+	  fprintf(stderr, "Server: Unable to grow trigram postings\n");
+	  exit(EXIT_FAILURE);
+	}
+      }
+      postings->titles[postings->count++] = i;
+    }
+  }
+
+  fprintf(stdout, "Server: Indexed %d movie titles\n", index->count);
+}
+
+void free_title_index(struct title_index* index) {
+  int i;
+
+  for (i = 0; i < TRIGRAM_BUCKETS; i++)
+    free(index->trigrams[i].titles);
+  free(index->titles);
+  free(index);
+}
+
+// Returns the position of the title named 'name', ignoring case, or -1
+int find_title(struct title_index* index, char* name) {
+  char key[MAX_TITLE_LENGTH];
+  int  low = 0;
+  int  high = index->count;
+  int  middle;
+
+  title_key(name, key);
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (strcmp(index->titles[middle].key, key) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low < index->count && strcmp(index->titles[low].key, key) == 0 ? low : -1;
+}
+
+/******************************************************************************
+
+Keeps the 'k' best candidates seen so far in 'matches', ordered best first by
+'score' and then by number of showtimes.  Returns the new number of matches.
+
+*******************************************************************************/
+static int rank_match(struct title_index* index, int* matches, double* scores, int count,
+		      int k, int candidate, double score) {
+  int i;
+
+  for (i = count; i > 0; i--) {
+    if (scores[i - 1] > score || (scores[i - 1] == score &&
+	index->titles[matches[i - 1]].showtimes >= index->titles[candidate].showtimes))
+      break;
+    if (i < k) {
+      matches[i] = matches[i - 1];
+      scores[i] = scores[i - 1];
+    }
+  }
+  if (i < k) {
+    matches[i] = candidate;
+    scores[i] = score;
+  }
+
+  return count < k ? count + 1 : k;
+}
+
+static int compare_positions(const void* a, const void* b) {
+  return *(int*)a - *(int*)b;
+}
+
+/******************************************************************************
+
+Stores in 'matches' the positions of up to 'k' titles starting with 'prefix',
+preferring the titles with the most showtimes, and returns how many were found.
+The matches are returned in title order.
+
+*******************************************************************************/
+int prefix_titles(struct title_index* index, char* prefix, int k, int* matches) {
+  char   key[MAX_TITLE_LENGTH];
+  double scores[MAX_TITLE_MATCHES];
+  size_t len;
+  int    low = 0;
+  int    high = index->count;
+  int    middle;
+  int    count = 0;
+  int    i;
+
+  if (k > MAX_TITLE_MATCHES)
+    k = MAX_TITLE_MATCHES;
+  title_key(prefix, key);
+  len = strlen(key);
+
+  // Binary search for the first title not sorting before the prefix; all the
+  // titles with this prefix follow it contiguously
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (strcmp(index->titles[middle].key, key) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (i = low; i < index->count && strncmp(index->titles[i].key, key, len) == 0; i++)
+    count = rank_match(index, matches, scores, count, k, i, 1.0);
+
+  qsort(matches, count, sizeof(int), compare_positions);
+
+  return count;
+}
+
+/******************************************************************************
+
+Stores in 'matches' the positions of up to 'k' titles similar to 'text' and
+returns how many were found.  Similarity is the number of trigrams a title
+shares with the text divided by the number of distinct trigrams in either
+(Jaccard similarity); titles below FUZZY_THRESHOLD are not considered.  Only
+titles sharing at least one trigram are ever looked at, so the cost depends on
+the postings lists touched rather than on the number of titles.  The matches
+are returned in title order.
+
+*******************************************************************************/
+int fuzzy_titles(struct title_index* index, char* text, int k, int* matches) {
+  struct trigram_postings* postings;
+  unsigned int             text_trigrams[MAX_TITLE_LENGTH + 2];
+  char                     key[MAX_TITLE_LENGTH];
+  double                   scores[MAX_TITLE_MATCHES];
+  double                   score;
+  int*                     shared;
+  int*                     touched;
+  int                      touched_count = 0;
+  int                      text_count;
+  int                      title;
+  int                      count = 0;
+  int                      i;
+  int                      j;
+
+  if (k > MAX_TITLE_MATCHES)
+    k = MAX_TITLE_MATCHES;
+  title_key(text, key);
+  text_count = title_trigrams(key, text_trigrams);
+
+  shared = calloc(index->count + 1, sizeof(int));
+  touched = malloc((index->count + 1) * sizeof(int));
+  if (shared == NULL || touched == NULL) {
+    free(shared);
+    free(touched);
+    return 0;
+  }
+
+  for (i = 0; i < text_count; i++) {
+    postings = find_postings(index, text_trigrams[i]);
+    if (postings != NULL && postings->trigram == text_trigrams[i])
+      for (j = 0; j < postings->count; j++)
+	if (shared[postings->titles[j]]++ == 0)
+	  touched[touched_count++] = postings->titles[j];
+  }
+
+  for (i = 0; i < touched_count; i++) {
+    title = touched[i];
+    score = (double)shared[title] / (text_count + index->titles[title].trigrams - shared[title]);
+    if (score >= FUZZY_THRESHOLD)
+      count = rank_match(index, matches, scores, count, k, title, score);
+  }
+  free(shared);
+  free(touched);
+
+  qsort(matches, count, sizeof(int), compare_positions);
+
+  return count;
+}
@@ -0,0 +1,65 @@
+/******************************************************************************
+
+PROGRAM:  title-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for the in-memory
+          movie title index kept by the Tier 2 server.  The index answers two
+          kinds of lookups without touching MySQL:
+
+          - prefix lookups, from an array of lowercased titles kept in sorted
+            order, in which all titles sharing a prefix form one contiguous
+            range found by binary search, and
+          - fuzzy lookups, from trigram postings lists: every title is split
+            into overlapping three letter sequences, and titles sharing many
+            trigrams with the search text are considered similar, so small
+            typos still find the right movie.
+
+          Matches are ranked by the number of showtimes of each title.
+
+******************************************************************************/
+
+#ifndef _TITLETOOLS_H_
+#define _TITLETOOLS_H_
+
+#define MAX_TITLE_LENGTH   64
+#define MAX_TITLE_MATCHES  64      // Largest k for a single lookup
+#define TRIGRAM_BUCKETS    16384   // Must be a power of two
+#define FUZZY_THRESHOLD    0.3     // Minimum trigram similarity for a match
+
+struct title {
+  char  name[MAX_TITLE_LENGTH];    // As stored in movie_times
+  char  key[MAX_TITLE_LENGTH];     // Lowercased, used for lookups
+  long  showtimes;
+  int   trigrams;                  // Number of distinct trigrams in 'key'
+};
+
+struct trigram_postings {
+  unsigned int trigram;            // Three bytes packed, 0 if the bucket is free
+  int          count;
+  int          capacity;
+  int*         titles;
+};
+
+struct title_index {
+  int                      count;
+  int                      capacity;
+  struct title*            titles;           // Sorted by 'key' once built
+  struct trigram_postings  trigrams[TRIGRAM_BUCKETS];
+};
+
+struct title_index* create_title_index();
+
+void add_title(struct title_index* index, char* name, long showtimes);
+
+void build_title_index(struct title_index* index);
+
+void free_title_index(struct title_index* index);
+
+int find_title(struct title_index* index, char* name);
+
+int prefix_titles(struct title_index* index, char* prefix, int k, int* matches);
+
+int fuzzy_titles(struct title_index* index, char* text, int k, int* matches);
+
+#endif
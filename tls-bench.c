@@ -0,0 +1,242 @@
+/******************************************************************************
+
+PROGRAM:  tls-bench.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This program measures what setting up a TLS session costs under each
+          TLS profile (see tls-tools.h):
+
+          tls-bench [-n <requests>]
+
+          For the default profile, and for the fast profile with full
+          handshakes, with resumed sessions and with resumed sessions sending
+          their request as 0-RTT early data, a child process accepts
+          connections over the loopback interface the way the servers do, one
+          connection and handshake per request, and answers a small request.
+          The parent connects and sends the requests the way the Tier 1
+          server does.  The mean latency of a request and the processor time
+          each side spent on it are printed for each, with how many sessions
+          were resumed and how many requests went as early data.  The server
+          needs cert.pem and key.pem, and ec-cert.pem and ec-key.pem for the
+          fast profile, which is skipped without them, so run it where the
+          servers run.
+
+******************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+#include "client-tools.h"
+#include "server-tools.h"
+#include "local-tools.h"
+#include "tls-tools.h"
+
+#define DEFAULT_REQUESTS 200
+#define REQUEST          "PING"
+#define REPLY            "PONG"
+#define MESSAGE_SIZE     64
+
+struct bench_profile {
+  char* name;
+  int   profile;
+  int   resume;
+  int   early;
+};
+
+struct bench_profile profiles[] = {
+  { "default, RSA",  TLS_PROFILE_DEFAULT, 0, 0 },
+  { "fast, full",    TLS_PROFILE_FAST,    0, 0 },
+  { "fast, resumed", TLS_PROFILE_FAST,    1, 0 },
+  { "fast, 0-RTT",   TLS_PROFILE_FAST,    1, 1 },
+};
+
+double cpu_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+double wall_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// Answers 'requests' requests on 'listener', then reports the processor time
+// spent through 'report', as the child end of a run
+void serve_requests(int listener, int requests, int report) {
+  char   request[MESSAGE_SIZE];
+  double start = cpu_ms();
+  double spent;
+  SSL*   ssl;
+  int    client;
+  int    i;
+
+  for (i = 0; i < requests; i++) {
+    if ((client = accept(listener, NULL, NULL)) < 0) {
+      fprintf(stderr, "Bench: Unable to accept a connection: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    ssl = create_ssl_socket(client);
+    if (peer_accept(ssl) <= 0) {
+      fprintf(stderr, "Bench: Could not accept the SSL session\n");
+      exit(EXIT_FAILURE);
+    }
+
+    bzero(request, sizeof(request));
+    if (peer_read(ssl, request, sizeof(request) - 1) <= 0 || strcmp(request, REQUEST) != 0 ||
+	peer_write(ssl, REPLY, strlen(REPLY)+1) <= 0) {
+      fprintf(stderr, "Bench: The request was not answered\n");
+      exit(EXIT_FAILURE);
+    }
+
+    SSL_free(ssl);
+    close(client);
+  }
+
+  spent = cpu_ms() - start;
+  write(report, &spent, sizeof(spent));
+  exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+
+Sends 'requests' requests under one profile and prints the mean latency and
+processor time of the client and server per request.  Returns -1 if a request
+failed.
+
+*******************************************************************************/
+int run_profile(struct bench_profile* profile, int requests) {
+  static struct session_slot slot;
+  struct sockaddr_in         addr;
+  socklen_t                  len = sizeof(addr);
+  char                       reply[MESSAGE_SIZE];
+  double                     server_ms = 0;
+  double                     client_ms;
+  double                     latency_ms;
+  double                     start;
+  long                       resumed = 0;
+  long                       early = 0;
+  SSL*                       ssl;
+  int                        listener;
+  int                        sockfd;
+  int                        report[2];
+  int                        result;
+  int                        i;
+  pid_t                      pid;
+
+  // The server's context is made before it forks, as the servers do
+  tls_profile = profile->profile;
+  if (tls_profile == TLS_PROFILE_FAST)
+    fast_server_context();
+  memset(&slot, 0, sizeof(slot));
+
+  // Port 0 lets the system pick a free port, read back with getsockname()
+  listener = create_socket(0);
+  getsockname(listener, (struct sockaddr*)&addr, &len);
+
+  if (pipe(report) < 0) {
+    fprintf(stderr, "Bench: Unable to create a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  fflush(stdout);
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Bench: Unable to fork: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pid == 0) {
+    close(report[0]);
+    serve_requests(listener, requests, report[1]);
+  }
+  close(report[1]);
+  close(listener);
+
+  start = wall_ms();
+  client_ms = cpu_ms();
+  for (i = 0; i < requests; i++) {
+    if ((sockfd = try_client_socket("localhost", ntohs(addr.sin_port), 0)) < 0)
+      return -1;
+    ssl = create_client_ssl_socket(sockfd);
+    if (profile->resume)
+      use_session_slot(ssl, &slot);
+
+    // Without early data the handshake is finished before the request goes
+    result = profile->early ? peer_connect(ssl) : SSL_connect(ssl);
+    bzero(reply, sizeof(reply));
+    if (result != 1 || peer_write(ssl, REQUEST, strlen(REQUEST)+1) <= 0 ||
+	peer_read(ssl, reply, sizeof(reply) - 1) <= 0 || strcmp(reply, REPLY) != 0) {
+      fprintf(stderr, "Bench: The request failed under %s\n", profile->name);
+      return -1;
+    }
+    resumed += SSL_session_reused(ssl);
+    early += SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED;
+
+    SSL_free(ssl);
+    close(sockfd);
+  }
+  latency_ms = wall_ms() - start;
+  client_ms = cpu_ms() - client_ms;
+
+  if (read(report[0], &server_ms, sizeof(server_ms)) != sizeof(server_ms)) {
+    fprintf(stderr, "Bench: The server under %s failed\n", profile->name);
+    return -1;
+  }
+  close(report[0]);
+  waitpid(pid, NULL, 0);
+
+  printf("%-14s %8ld %8ld %12.3f %12.3f %12.3f\n", profile->name, resumed, early,
+	 latency_ms / requests, client_ms / requests, server_ms / requests);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int requests = DEFAULT_REQUESTS;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+
+  if (argc - optind != 0 || requests <= 0) {
+    fprintf(stderr, "Usage: tls-bench [-n <requests>]\n");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  init_openssl();
+
+  printf("%-14s %8s %8s %12s %12s %12s\n", "profile", "resumed", "0-RTT", "latency ms",
+	 "client ms", "server ms");
+  for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+    if (profiles[i].profile == TLS_PROFILE_FAST && missing_fast_file() != NULL) {
+      printf("%-14s skipped, %s can not be read\n", profiles[i].name, missing_fast_file());
+      continue;
+    }
+    if (run_profile(&profiles[i], requests) < 0)
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
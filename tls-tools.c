@@ -0,0 +1,479 @@
+/******************************************************************************
+
+PROGRAM:  tls-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the fast TLS profile: the shared contexts,
+          session resumption and 0-RTT early data with replay protection.
+          See tls-tools.h for an overview.
+
+******************************************************************************/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "tls-tools.h"
+
+// What is kept with the SSL object of a fast profile session
+struct early_state {
+  struct session_slot* slot;      // Where a client saves new tickets
+  int                  deferred;  // Client: handshake waits for the first write
+  int                  pending;   // Server: handshake not finished after early data
+  int                  len;       // Server: early data received ...
+  int                  pos;       // ... and how much of it was read
+  unsigned char        data[EARLY_DATA_SIZE];
+};
+
+int tls_profile = TLS_PROFILE_DEFAULT;
+
+static struct replay_table* replays = NULL;
+static int                  early_index = -1;
+
+// Returns the TLS profile named 'name', or -1 if there is no such profile
+int parse_tls_profile(char* name) {
+  if (strcmp(name, "default") == 0)
+    return TLS_PROFILE_DEFAULT;
+  if (strcmp(name, "fast") == 0)
+    return TLS_PROFILE_FAST;
+
+  return -1;
+}
+
+static void free_early_state(void* parent, void* state, CRYPTO_EX_DATA* data, int index,
+			     long argl, void* argp) {
+  free(state);
+}
+
+static struct early_state* early_state(SSL* ssl) {
+  return early_index < 0 ? NULL : SSL_get_ex_data(ssl, early_index);
+}
+
+// Returns the early data state of 'ssl', creating it if needed
+static struct early_state* new_early_state(SSL* ssl) {
+  struct early_state* state;
+
+  if (early_index < 0)
+    early_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_early_state);
+  if ((state = early_state(ssl)) != NULL)
+    return state;
+
+  if (early_index < 0 || (state = calloc(1, sizeof(struct early_state))) == NULL) {
+    fprintf(stderr, "Unable to allocate the early data state\n");
+    exit(EXIT_FAILURE);
+  }
+  SSL_set_ex_data(ssl, early_index, state);
+
+  return state;
+}
+
+static void lock_replays() {
+  if (pthread_mutex_lock(&replays->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&replays->lock);
+}
+
+/******************************************************************************
+
+Records the use of the ticket nonce 'nonce' for early data.  Returns 1 if it
+was not used before, and 0 if it was, or if the table has no room to remember
+it; either way the early data must then be refused.  The nonce is random, so
+its first bytes pick the slot, and a few slots after it are searched.
+
+*******************************************************************************/
+static int claim_nonce(const unsigned char* nonce) {
+  unsigned int hash;
+  time_t       now = time(NULL);
+  int          slot;
+  int          free_slot = -1;
+  int          i;
+
+  memcpy(&hash, nonce, sizeof(hash));
+
+  lock_replays();
+  for (i = 0; i < 16; i++) {
+    slot = (hash + i) % REPLAY_SLOTS;
+    if (replays->slots[slot].expires <= now) {
+      if (free_slot < 0)
+	free_slot = slot;
+    } else if (memcmp(replays->slots[slot].nonce, nonce, TICKET_NONCE_SIZE) == 0) {
+      replays->rejected++;
+      pthread_mutex_unlock(&replays->lock);
+      return 0;
+    }
+  }
+
+  if (free_slot >= 0) {
+    memcpy(replays->slots[free_slot].nonce, nonce, TICKET_NONCE_SIZE);
+    replays->slots[free_slot].expires = now + TICKET_LIFETIME;
+    replays->accepted++;
+  } else
+    replays->rejected++;
+  pthread_mutex_unlock(&replays->lock);
+
+  return free_slot >= 0;
+}
+
+// Gives every new ticket a random nonce, checked when it brings early data
+static int add_ticket_nonce(SSL* ssl, void* arg) {
+  unsigned char nonce[TICKET_NONCE_SIZE];
+
+  if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+    return 0;
+
+  return SSL_SESSION_set1_ticket_appdata(SSL_get_session(ssl), nonce, sizeof(nonce));
+}
+
+// Resumes the sessions of tickets that decrypt, and does a full handshake
+// (with a new ticket) for the rest, e.g., ones from before a restart
+static SSL_TICKET_RETURN check_ticket(SSL* ssl, SSL_SESSION* session, const unsigned char* keyname,
+				      size_t keyname_length, SSL_TICKET_STATUS status, void* arg) {
+  switch (status) {
+  case SSL_TICKET_SUCCESS:
+    return SSL_TICKET_RETURN_USE;
+  case SSL_TICKET_SUCCESS_RENEW:
+    return SSL_TICKET_RETURN_USE_RENEW;
+  case SSL_TICKET_NONE:
+  case SSL_TICKET_EMPTY:
+  case SSL_TICKET_NO_DECRYPT:
+    return SSL_TICKET_RETURN_IGNORE_RENEW;
+  default:
+    return SSL_TICKET_RETURN_ABORT;
+  }
+}
+
+// Accepts early data only with a ticket whose nonce was never used for it
+static int allow_early_data(SSL* ssl, void* arg) {
+  SSL_SESSION* session = SSL_get_session(ssl);
+  void*        nonce;
+  size_t       len;
+
+  if (session == NULL || SSL_SESSION_get0_ticket_appdata(session, &nonce, &len) != 1 ||
+      len != TICKET_NONCE_SIZE)
+    return 0;
+
+  return claim_nonce(nonce);
+}
+
+// Returns the first file a server needs for the fast profile that it can not
+// read, or NULL if it can read them all
+char* missing_fast_file() {
+  if (access(FAST_CERTIFICATE_FILE, R_OK) < 0)
+    return FAST_CERTIFICATE_FILE;
+  if (access(FAST_KEY_FILE, R_OK) < 0)
+    return FAST_KEY_FILE;
+
+  return NULL;
+}
+
+/******************************************************************************
+
+Returns the context every fast profile session of a server is made from,
+creating it on the first call.  Call it before the server forks, so all of its
+children share the certificate, the keys that encrypt session tickets, and the
+table of ticket nonces already used for early data.  OpenSSL's own replay
+protection keeps used tickets in a cache of one process, which a forking
+server can not share, so it is turned off in favor of that table.
+
+*******************************************************************************/
+SSL_CTX* fast_server_context() {
+  static SSL_CTX*     ssl_ctx = NULL;
+  pthread_mutexattr_t mutex_attr;
+  char*               missing;
+
+  if (ssl_ctx != NULL)
+    return ssl_ctx;
+
+  if ((missing = missing_fast_file()) != NULL) {
+    fprintf(stderr, "Server: Unable to read %s, which the fast TLS profile needs: %s\n",
+	    missing, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  replays = mmap(NULL, sizeof(struct replay_table), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (replays == MAP_FAILED) {
+    fprintf(stderr, "Server: Unable to map replay table: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(replays, 0, sizeof(struct replay_table));
+
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&replays->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  ssl_ctx = SSL_CTX_new(TLS_server_method());
+  if (ssl_ctx == NULL ||
+      SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_3_VERSION) != 1 ||
+      SSL_CTX_set_ciphersuites(ssl_ctx, FAST_CIPHERSUITES) != 1 ||
+      SSL_CTX_set1_groups_list(ssl_ctx, FAST_GROUPS) != 1) {
+    fprintf(stderr, "Server: Unable to create the fast TLS context\n");
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  // The server's order wins, except that a client preferring ChaCha20 gets it
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA |
+		      SSL_OP_NO_ANTI_REPLAY);
+
+  if (SSL_CTX_use_certificate_file(ssl_ctx, FAST_CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0 ||
+      SSL_CTX_use_PrivateKey_file(ssl_ctx, FAST_KEY_FILE, SSL_FILETYPE_PEM) <= 0 ||
+      SSL_CTX_check_private_key(ssl_ctx) != 1) {
+    fprintf(stderr, "Server: Unable to load %s and %s\n", FAST_CERTIFICATE_FILE, FAST_KEY_FILE);
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  // Tickets carry the whole session, so no server side cache is needed
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_timeout(ssl_ctx, TICKET_LIFETIME);
+  SSL_CTX_set_max_early_data(ssl_ctx, EARLY_DATA_SIZE);
+  SSL_CTX_set_recv_max_early_data(ssl_ctx, EARLY_DATA_SIZE);
+  SSL_CTX_set_session_ticket_cb(ssl_ctx, add_ticket_nonce, check_ticket, NULL);
+  SSL_CTX_set_allow_early_data_cb(ssl_ctx, allow_early_data, NULL);
+
+  return ssl_ctx;
+}
+
+// Keeps a new ticket from the server in the slot of its backend, if any
+static int save_session(SSL* ssl, SSL_SESSION* session) {
+  struct early_state*  state = early_state(ssl);
+  struct session_slot* slot;
+  unsigned char*       p;
+  int                  len;
+
+  if (state == NULL || (slot = state->slot) == NULL || !SSL_SESSION_is_resumable(session))
+    return 0;
+
+  len = i2d_SSL_SESSION(session, NULL);
+  if (len <= 0 || len > SESSION_SIZE || __sync_lock_test_and_set(&slot->lock, 1))
+    return 0;
+  p = slot->data;
+  slot->len = i2d_SSL_SESSION(session, &p);
+  __sync_lock_release(&slot->lock);
+
+  return 0;
+}
+
+/******************************************************************************
+
+Returns the context every fast profile session of a client is made from,
+creating it on the first call.  ChaCha20-Poly1305 is preferred over AES-GCM on
+processors without AES instructions, where it is several times faster.  The
+sessions of new tickets are not cached here but handed to save_session().
+
+*******************************************************************************/
+SSL_CTX* fast_client_context() {
+  static SSL_CTX* ssl_ctx = NULL;
+  char*           ciphersuites = FAST_CIPHERSUITES;
+
+  if (ssl_ctx != NULL)
+    return ssl_ctx;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("aes"))
+    ciphersuites = FAST_CIPHERSUITES_SOFT;
+#endif
+
+  ssl_ctx = SSL_CTX_new(TLS_client_method());
+  if (ssl_ctx == NULL ||
+      SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_3_VERSION) != 1 ||
+      SSL_CTX_set_ciphersuites(ssl_ctx, ciphersuites) != 1 ||
+      SSL_CTX_set1_groups_list(ssl_ctx, FAST_GROUPS) != 1) {
+    fprintf(stderr, "Unable to create the fast TLS context\n");
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, save_session);
+
+  return ssl_ctx;
+}
+
+/******************************************************************************
+
+Resumes the session kept in 'slot', if there is one, when the client session
+'ssl' connects, and keeps the tickets the server sends there for the next
+connection.  The slot is shared memory, and simply skipped while another
+process is using it.
+
+*******************************************************************************/
+void use_session_slot(SSL* ssl, struct session_slot* slot) {
+  struct early_state*  state = new_early_state(ssl);
+  const unsigned char* p = slot->data;
+  SSL_SESSION*         session;
+
+  state->slot = slot;
+  if (slot->len <= 0 || __sync_lock_test_and_set(&slot->lock, 1))
+    return;
+  session = d2i_SSL_SESSION(NULL, &p, slot->len);
+  __sync_lock_release(&slot->lock);
+
+  if (session == NULL)
+    return;
+  if (SSL_SESSION_is_resumable(session))
+    SSL_set_session(ssl, session);
+  SSL_SESSION_free(session);
+}
+
+/******************************************************************************
+
+Called by peer_connect().  If the client session 'ssl' resumes a session that
+allows early data, the handshake is put off until the first write, which sends
+it as early data, and 1 is returned.  Otherwise returns 0 and the handshake is
+done right away.
+
+*******************************************************************************/
+int defer_handshake(SSL* ssl) {
+  struct early_state* state = early_state(ssl);
+  SSL_SESSION*        session = SSL_get_session(ssl);
+
+  if (state == NULL || session == NULL || SSL_SESSION_get_max_early_data(session) == 0)
+    return 0;
+  state->deferred = 1;
+
+  return 1;
+}
+
+/******************************************************************************
+
+Called by peer_accept().  If the server allows early data, reads any the
+client sent, keeping it for peer_read(), and returns 1 as soon as some has
+arrived, before the handshake is finished.  Otherwise, or if there is none,
+completes the handshake as SSL_accept() does and returns its result.
+
+*******************************************************************************/
+int accept_early(SSL* ssl) {
+  struct early_state* state;
+  size_t              nbytes;
+  int                 result;
+
+  if (SSL_get_max_early_data(ssl) == 0)
+    return SSL_accept(ssl);
+
+  state = new_early_state(ssl);
+  while (1) {
+    result = SSL_read_early_data(ssl, state->data + state->len, EARLY_DATA_SIZE - state->len,
+				 &nbytes);
+    if (result == SSL_READ_EARLY_DATA_ERROR)
+      return -1;
+    state->len += nbytes;
+    if (result == SSL_READ_EARLY_DATA_FINISH)
+      return SSL_accept(ssl);
+    if (state->len > 0) {
+      state->pending = 1;
+      return 1;
+    }
+  }
+}
+
+/******************************************************************************
+
+Finishes the handshake of a server session that accepted early data, reading
+whatever early data is left first.  Returns 0 once the client has proved it
+holds the keys of the session, and so the request is not a replay, or -1 if
+the handshake failed.  Sessions without early data return 0 right away.
+
+*******************************************************************************/
+int confirm_handshake(SSL* ssl) {
+  struct early_state* state = early_state(ssl);
+  size_t              nbytes;
+  int                 result;
+
+  if (state == NULL || !state->pending)
+    return 0;
+
+  do {
+    if (state->len == EARLY_DATA_SIZE)
+      return -1;
+    result = SSL_read_early_data(ssl, state->data + state->len, EARLY_DATA_SIZE - state->len,
+				 &nbytes);
+    if (result == SSL_READ_EARLY_DATA_ERROR)
+      return -1;
+    state->len += nbytes;
+  } while (result != SSL_READ_EARLY_DATA_FINISH);
+
+  state->pending = 0;
+
+  return SSL_accept(ssl) == 1 ? 0 : -1;
+}
+
+/******************************************************************************
+
+Called by peer_read().  Returns up to 'size' bytes of early data not read yet.
+Once it is all read, finishes the handshake and returns 0, meaning the caller
+reads from the session as usual, or -1 if the handshake failed.
+
+*******************************************************************************/
+int read_early(SSL* ssl, void* buffer, int size) {
+  struct early_state* state = early_state(ssl);
+
+  if (state == NULL)
+    return 0;
+
+  if (state->pos == state->len && confirm_handshake(ssl) < 0)
+    return -1;
+  if (state->pos < state->len) {
+    if (size > state->len - state->pos)
+      size = state->len - state->pos;
+    memcpy(buffer, state->data + state->pos, size);
+    state->pos += size;
+    return size;
+  }
+
+  return 0;
+}
+
+/******************************************************************************
+
+Called by peer_write().  The first write of a client whose handshake was put
+off is sent as early data and the handshake then finished; if the server
+refused the early data, e.g., as a replay, it is sent again as usual.  A
+server that accepted early data finishes its handshake before its first
+write.  Returns the number of bytes written, -1 if that failed, or 0 if the
+caller still has to write them.
+
+*******************************************************************************/
+int write_early(SSL* ssl, const void* buffer, int size) {
+  struct early_state* state = early_state(ssl);
+  size_t              nbytes;
+
+  if (state == NULL)
+    return 0;
+
+  if (state->deferred) {
+    state->deferred = 0;
+    if ((uint32_t)size <= SSL_SESSION_get_max_early_data(SSL_get_session(ssl)) &&
+	SSL_write_early_data(ssl, buffer, size, &nbytes) != 1)
+      return -1;
+    if (SSL_connect(ssl) != 1)
+      return -1;
+    if (SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED)
+      return size;
+    return SSL_write(ssl, buffer, size) > 0 ? size : -1;
+  }
+
+  return confirm_handshake(ssl) < 0 ? -1 : 0;
+}
+
+// Prints how often early data was accepted and refused as a replay
+void print_replay_stats(FILE* out) {
+  if (replays == NULL)
+    return;
+
+  lock_replays();
+  fprintf(out, "Early data: %ld accepted, %ld refused\n", replays->accepted, replays->rejected);
+  pthread_mutex_unlock(&replays->lock);
+}
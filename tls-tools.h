@@ -0,0 +1,103 @@
+/******************************************************************************
+
+PROGRAM:  tls-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for the "fast" TLS
+          profile, which the servers use when started with "-T fast".  By
+          default every connection negotiates whatever TLS version both ends
+          support, with an RSA certificate, and a server loads its
+          certificate and key again for every connection.  The fast profile
+          instead
+
+          - allows TLS 1.3 only, with AES-GCM preferred and ChaCha20-Poly1305
+            chosen for clients that list it first, i.e., ones without AES
+            instructions, and X25519 or P-256 key exchange;
+          - uses an ECDSA P-256 certificate, ec-cert.pem and ec-key.pem,
+            whose signatures are far cheaper to make than RSA's;
+          - loads them once, into one context made before the server forks,
+            so every child shares it and the keys of its session tickets;
+          - lets the Tier 1 server resume its sessions with Tier 2 servers,
+            keeping the last ticket of each backend in shared memory, and
+            send its request as 0-RTT early data along with the ClientHello.
+
+          Early data can be replayed by anyone who captured it, so a ticket
+          is only accepted for early data once: each ticket carries a random
+          nonce, and the nonces already used are kept in a table shared by
+          all children of the server.  OpenSSL also refuses early data sent
+          with a ticket older than its lifetime or whose age does not match.
+          Everything the Tier 1 server sends Tier 2 only reads data; a server
+          must still call confirm_handshake() before acting on a request that
+          changes anything, which waits for the client to finish the
+          handshake and so can not be done by a replay.
+
+          The peer_ functions of local-tools.h do the early data handling, so
+          the rest of the code reads and writes sessions as before.
+
+******************************************************************************/
+
+#ifndef _TLSTOOLS_H_
+#define _TLSTOOLS_H_
+
+#include <time.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#define TLS_PROFILE_DEFAULT    0
+#define TLS_PROFILE_FAST       1
+#define FAST_CERTIFICATE_FILE  "ec-cert.pem"
+#define FAST_KEY_FILE          "ec-key.pem"
+#define FAST_CIPHERSUITES      "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384"
+#define FAST_CIPHERSUITES_SOFT "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define FAST_GROUPS            "X25519:P-256"
+#define TICKET_LIFETIME        600        // Seconds a session ticket may be resumed
+#define TICKET_NONCE_SIZE      16
+#define EARLY_DATA_SIZE        16384      // Largest request sent as early data
+#define REPLAY_SLOTS           16384      // Nonces of tickets used for early data
+#define SESSION_SIZE           4096       // Largest serialized session kept for a backend
+
+// The used nonces, in shared memory; a slot is free again once it expires
+struct replay_table {
+  pthread_mutex_t lock;
+  long            rejected;               // Early data refused as a replay
+  long            accepted;
+  struct {
+    unsigned char nonce[TICKET_NONCE_SIZE];
+    time_t        expires;
+  } slots[REPLAY_SLOTS];
+};
+
+// A resumable session, serialized, in shared memory with its backend
+struct session_slot {
+  int           lock;
+  int           len;
+  unsigned char data[SESSION_SIZE];
+};
+
+extern int tls_profile;
+
+int parse_tls_profile(char* name);
+
+char* missing_fast_file();
+
+SSL_CTX* fast_server_context();
+
+SSL_CTX* fast_client_context();
+
+void use_session_slot(SSL* ssl, struct session_slot* slot);
+
+int defer_handshake(SSL* ssl);
+
+int accept_early(SSL* ssl);
+
+int confirm_handshake(SSL* ssl);
+
+int read_early(SSL* ssl, void* buffer, int size);
+
+int write_early(SSL* ssl, const void* buffer, int size);
+
+void print_replay_stats(FILE* out);
+
+#endif
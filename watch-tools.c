@@ -0,0 +1,165 @@
+/******************************************************************************
+
+PROGRAM:  watch-tools.c
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This file implements the Tier 1 side of the change feed.  See
+          watch-tools.h for an overview.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+
+#include "watch-tools.h"
+#include "local-tools.h"
+
+struct change_batch {
+  int            count;
+  int            capacity;
+  struct change* changes;
+};
+
+// A flight is affected if any change could belong to its result
+static int batch_affects(char* key, void* context) {
+  struct change_batch* batch = context;
+  int                  i;
+
+  for (i = 0; i < batch->count; i++)
+    if (match_filter(key, batch->changes[i].row) != 0)
+      return 1;
+
+  return 0;
+}
+
+static void add_to_batch(struct change_batch* batch, struct change* change) {
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+    batch->changes = realloc(batch->changes, batch->capacity * sizeof(struct change));
+    if (batch->changes == NULL) {
+      fprintf(stderr, "Server: Unable to grow change batch\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  batch->changes[batch->count++] = *change;
+}
+
+/******************************************************************************
+
+Forks the subscriber process of a shard.  Changes are only published to the
+log once the VERSION message closing their version arrives, so a session lost
+halfway through a version publishes nothing of it, and the version is asked
+for again on reconnecting.  A RESYNC from Tier 2 is passed on as is, and closes
+every running flight.  The subscriber exits when the Tier 1 server that
+started it goes away.
+
+*******************************************************************************/
+pid_t start_feed_subscriber(struct backend_pool* pool, int shard, struct change_log* log,
+			    struct flight_table* flights) {
+  struct change_batch batch;
+  struct change       change;
+  struct backend*     backend;
+  char                buffer[FEED_ROW_SIZE + 32];
+  long                since = 0;
+  pid_t               pid;
+  pid_t               parent = getpid();
+  int                 sockfd;
+  int                 nbytes;
+  SSL*                ssl;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid != 0)
+    return pid;
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&batch, 0, sizeof(batch));
+
+  while (getppid() == parent) {
+    // Missing three heartbeats in a row means the session is gone
+    ssl = connect_backend(pool, &backend, &sockfd, 3 * FEED_HEARTBEAT);
+    if (ssl == NULL) {
+      usleep(FEED_RETRY * 1000);
+      continue;
+    }
+    // A subscription is not a request in progress, so it does not count
+    // against the backend when balancing
+    cancel_backend(backend);
+
+    snprintf(buffer, sizeof(buffer), "SUBSCRIBE %ld", since);
+    if (peer_write(ssl, buffer, strlen(buffer)+1) > 0) {
+      fprintf(stdout, "Server: Shard %d subscribed to changes from %s:%u\n", shard,
+	      backend->host, backend->port);
+      fflush(stdout);
+    }
+
+    batch.count = 0;
+    while ((nbytes = peer_read(ssl, buffer, sizeof(buffer) - 1)) > 0) {
+      buffer[nbytes] = '\0';
+      switch (parse_feed_message(buffer, &change)) {
+      case FEED_CHANGE:
+	add_to_batch(&batch, &change);
+	break;
+      case FEED_VERSION:
+	if (batch.count > 0) {
+	  invalidate_flights(flights, batch_affects, &batch);
+	  publish_changes(log, batch.changes, batch.count, 0);
+	  batch.count = 0;
+	}
+	since = change.version;
+	break;
+      case FEED_RESYNC:
+	invalidate_flights(flights, NULL, NULL);
+	publish_changes(log, &change, 1, 0);
+	batch.count = 0;
+	since = change.version;
+	break;
+      default:
+	fprintf(stderr, "Server: Unexpected message on the change feed of shard %d\n", shard);
+	break;
+      }
+    }
+
+    fprintf(stderr, "Server: Shard %d lost its change feed from %s:%u\n", shard,
+	    backend->host, backend->port);
+    SSL_free(ssl);
+    close(sockfd);
+    usleep(FEED_RETRY * 1000);
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+
+Runs in the child serving a watching client, once its results were sent:
+forwards each change from 'position' on that matches the client's query, and a
+VERSION message every FEED_HEARTBEAT milliseconds without one.  Returns when the
+client goes away, or after telling it to RESYNC, i.e., to search again.
+
+*******************************************************************************/
+void serve_watch(struct change_log* log, SSL* ssl, char* query, long position) {
+  struct change change;
+  char          message[FEED_ROW_SIZE + 32];
+  int           result;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  while (1) {
+    result = next_change(log, &position, &change, FEED_HEARTBEAT);
+    if (result == 0)
+      snprintf(message, sizeof(message), "VERSION %ld", change.version);
+    else if (change.op == CHANGE_RESYNC || match_filter(query, change.row) == 1)
+      format_change(&change, message, sizeof(message));
+    else
+      continue;
+
+    if (SSL_write(ssl, message, strlen(message)+1) <= 0 ||
+	(result == 1 && change.op == CHANGE_RESYNC))
+      return;
+  }
+}
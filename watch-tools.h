@@ -0,0 +1,38 @@
+/******************************************************************************
+
+PROGRAM:  watch-tools.h
+AUTHOR:   Omar Castorena
+COURSE:   CS469 - Distributed Systems (Regis University)
+SYNOPSIS: This header file provides function signatures for the Tier 1 side of
+          the change feed (see feed-tools.h).  For every shard, a subscriber
+          process keeps a TLS session open to one of the shard's Tier 2
+          servers and copies each version of changes it receives into the
+          Tier 1 server's own change log, after closing the coalesced flights
+          the changes affect to new joiners.  If the session is lost, the
+          subscriber reconnects, possibly to another server of the shard, and
+          asks for the changes made since the last version it saw.
+
+          Clients that send "WATCH <search>" get the search's results as
+          usual, then stay connected and are sent the changes to the log that
+          match their search.
+
+******************************************************************************/
+
+#ifndef _WATCHTOOLS_H_
+#define _WATCHTOOLS_H_
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#include "backend-tools.h"
+#include "coalesce-tools.h"
+#include "feed-tools.h"
+
+#define WATCH_PREFIX   "WATCH "
+
+pid_t start_feed_subscriber(struct backend_pool* pool, int shard, struct change_log* log,
+			    struct flight_table* flights);
+
+void serve_watch(struct change_log* log, SSL* ssl, char* query, long position);
+
+#endif